@@ -0,0 +1,88 @@
+// The page memory budget against the mock server: many chapters of large pages, a small
+// max_inflight_bytes, and the most memory held at once must stay within it.
+//
+//   make check
+//   ./bin/cml_check_budget ./bin/cml_mock_server
+//
+// 6 chapters x 30 pages of about 500 KB (up to 750 KB), 8 fetch workers, for budgets of 2, 4 and
+// 8 MiB, with CBZ output (which keeps pages in memory until the chapter ends and spills the
+// older ones) and with RAW output. Every run must write every page, hold at most its budget and
+// have waited for memory at least once, so the budget was what held downloads back. Prints one line
+// per failed expectation and exits non-zero if there was any.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <curl/curl.h>
+
+#include "harness.h"
+
+#define CHAPTERS 6
+#define PAGES 30
+#define STR_(x) #x
+#define STR(x) STR_(x)
+
+static int failures;
+
+static void expect(bool ok, const char *run, const char *what) {
+  if (ok) return;
+  fprintf(stderr, "cml_check_budget: %s: expected %s\n", run, what);
+  failures++;
+}
+
+int main(int argc, char **argv) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s <cml_mock_server>\n", argv[0]);
+    return 2;
+  }
+  if (curl_global_init(CURL_GLOBAL_DEFAULT) != 0) return 1;
+  const char *args[] = {"--chapters", STR(CHAPTERS), "--pages", STR(PAGES), "--page-size", "500000", NULL};
+  unsigned port = 0;
+  pid_t server = bench_server_start(argv[1], args, &port);
+  if (server < 0) {
+    fprintf(stderr, "cml_check_budget: cannot start %s\n", argv[1]);
+    return 1;
+  }
+  char base[64];
+  snprintf(base, sizeof(base), "http://127.0.0.1:%u", port);
+
+  static const size_t budgets_mib[] = {2, 4, 8};
+  static const cml_output_format formats[] = {CML_OUTPUT_CBZ, CML_OUTPUT_RAW};
+  for (size_t f = 0; f < sizeof(formats) / sizeof(formats[0]); f++) {
+    for (size_t b = 0; b < sizeof(budgets_mib) / sizeof(budgets_mib[0]); b++) {
+      char run[32];
+      snprintf(run, sizeof(run), "%s %zu MiB", formats[f] == CML_OUTPUT_CBZ ? "cbz" : "raw", budgets_mib[b]);
+      char dir[] = "/tmp/cml-check-XXXXXX";
+      if (!mkdtemp(dir)) {
+        expect(false, run, "a temporary directory");
+        continue;
+      }
+      size_t budget = budgets_mib[b] << 20;
+      cml_config cfg = {.out_dir = dir,
+                        .output = formats[f],
+                        .out_fd = -1,
+                        .api_base = base,
+                        .fetch_workers = 8,
+                        .max_inflight_bytes = budget};
+      bench_run r;
+      bool ran = bench_run_title(&cfg, &r);
+      bench_rm_rf(dir);
+      expect(ran, run, "the run to happen");
+      if (!ran) continue;
+      expect(r.status == CML_OK, run, "the run to succeed");
+      expect(r.stats.write.pages == CHAPTERS * PAGES, run, "every page to be written");
+      expect(r.stats.inflight_bytes_peak > 0, run, "the peak to be measured");
+      expect(r.stats.inflight_bytes_peak <= budget, run, "the peak to stay within the budget");
+      expect(r.stats.budget_stalls > 0, run, "downloads to wait for memory");
+      printf("%s: peak %.2f MiB, %llu stalls, %.2f s\n", run, (double)r.stats.inflight_bytes_peak / (1 << 20),
+             (unsigned long long)r.stats.budget_stalls, (double)r.wall_ns / 1e9);
+    }
+  }
+
+  bench_server_stop(server);
+  curl_global_cleanup();
+  printf("cml_check_budget: %s\n", failures ? "FAILED" : "ok");
+  return failures ? 1 : 0;
+}
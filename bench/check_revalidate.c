@@ -0,0 +1,148 @@
+// Metadata revalidation against the mock server: three runs on one handle, RAW output.
+//
+//   make check
+//   ./bin/cml_check_revalidate ./bin/cml_mock_server
+//
+// The server changes each title detail and manga viewer every second request for it
+// (--vary-every 2), so on one handle
+//   run 1 downloads and parses every metadata response,
+//   run 2 sends the kept validators back and gets only 304s: every result must come from what run 1
+//         kept, with nothing parsed, and the pages written must be the same as run 1's,
+//   run 3 finds every object changed: each must be downloaded and parsed again, with no 304s.
+// The output directory is emptied between runs so that every chapter needs its viewer. Prints one
+// line per failed expectation and exits non-zero if there was any.
+
+#include <dirent.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <curl/curl.h>
+
+#include "harness.h"
+
+#define CHAPTERS 3
+#define PAGES 4
+#define STR_(x) #x
+#define STR(x) STR_(x)
+
+static int failures;
+
+static void expect(bool ok, int run, const char *what) {
+  if (ok) return;
+  fprintf(stderr, "cml_check_revalidate: run %d: expected %s\n", run, what);
+  failures++;
+}
+
+static uint64_t fnv(uint64_t h, const void *p, size_t n) {
+  const uint8_t *b = (const uint8_t *)p;
+  for (size_t i = 0; i < n; i++) h = (h ^ b[i]) * 0x100000001b3ull;
+  return h;
+}
+
+// Order-independent digest of the names and contents of every file under path.
+static uint64_t tree_digest(const char *path, const char *rel) {
+  DIR *d = opendir(path);
+  if (!d) return 0;
+  uint64_t sum = 0;
+  struct dirent *e;
+  while ((e = readdir(d)) != NULL) {
+    if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) continue;
+    char full[1024];
+    char name[1024];
+    snprintf(full, sizeof(full), "%s/%s", path, e->d_name);
+    snprintf(name, sizeof(name), "%s/%s", rel, e->d_name);
+    struct stat st;
+    if (stat(full, &st) != 0) continue;
+    if (S_ISDIR(st.st_mode)) {
+      sum += tree_digest(full, name);
+      continue;
+    }
+    uint64_t h = fnv(0xcbf29ce484222325ull, name, strlen(name));
+    FILE *f = fopen(full, "rb");
+    char chunk[8192];
+    size_t n;
+    while (f && (n = fread(chunk, 1, sizeof(chunk), f)) > 0) h = fnv(h, chunk, n);
+    if (f) fclose(f);
+    sum += h;
+  }
+  closedir(d);
+  return sum;
+}
+
+int main(int argc, char **argv) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s <cml_mock_server>\n", argv[0]);
+    return 2;
+  }
+  if (curl_global_init(CURL_GLOBAL_DEFAULT) != 0) return 1;
+  const char *args[] = {"--chapters",  STR(CHAPTERS), "--pages", STR(PAGES),
+                        "--page-size", "4000", "--vary-every", "2", NULL};
+  unsigned port = 0;
+  pid_t server = bench_server_start(argv[1], args, &port);
+  if (server < 0) {
+    fprintf(stderr, "cml_check_revalidate: cannot start %s\n", argv[1]);
+    return 1;
+  }
+  char base[64];
+  snprintf(base, sizeof(base), "http://127.0.0.1:%u", port);
+  char dir[] = "/tmp/cml-check-XXXXXX";
+  if (!mkdtemp(dir)) {
+    bench_server_stop(server);
+    return 1;
+  }
+  cml_config cfg = {.out_dir = dir, .output = CML_OUTPUT_RAW, .out_fd = -1, .api_base = base};
+  cml *h = cml_create(&cfg);
+  if (!h || cml_add_title_id(h, BENCH_TITLE_ID) != CML_OK) {
+    fprintf(stderr, "cml_check_revalidate: cannot create a handle\n");
+    cml_destroy(h);
+    bench_server_stop(server);
+    bench_rm_rf(dir);
+    return 1;
+  }
+
+  const uint64_t objects = 1 + CHAPTERS;  // the title detail and one viewer per chapter
+  uint64_t first_digest = 0;
+  uint64_t not_modified_before = 0;
+  for (int run = 1; run <= 3; run++) {
+    cml_status st = cml_run(h);
+    cml_stats s;
+    cml_get_stats(h, &s);
+    uint64_t digest = tree_digest(dir, "");
+    uint64_t not_modified = 0;
+    expect(bench_server_stat(base, "not_modified", &not_modified), run, "the server's counters");
+    uint64_t answered_304 = not_modified - not_modified_before;
+    not_modified_before = not_modified;
+
+    expect(st == CML_OK, run, "the run to succeed");
+    expect(s.write.pages == CHAPTERS * PAGES, run, "every page to be written");
+    expect(s.metadata.requests == objects, run, "one response per metadata object");
+    if (run == 1) {
+      first_digest = digest;
+      expect(s.metadata.revalidated == 0 && answered_304 == 0, run, "no 304s on a new handle");
+      expect(s.work.decode_ns > 0, run, "the responses to be parsed");
+    } else if (run == 2) {
+      expect(s.metadata.revalidated == objects && answered_304 == objects, run, "every object revalidated by a 304");
+      expect(s.work.decode_ns == 0, run, "nothing parsed: results come from what run 1 kept");
+      expect(s.metadata.bytes_saved > 0, run, "the kept bodies to count as saved");
+    } else {
+      expect(s.metadata.revalidated == 0 && answered_304 == 0, run, "no 304s once every object changed");
+      expect(s.work.decode_ns > 0, run, "the changed responses to be parsed again");
+    }
+    expect(digest == first_digest, run, "the same output as run 1");
+    printf("run %d: %llu metadata responses, %llu revalidated, %.3f ms decoding\n", run,
+           (unsigned long long)s.metadata.requests, (unsigned long long)s.metadata.revalidated,
+           (double)s.work.decode_ns / 1e6);
+    if (!bench_rm_rf(dir) || mkdir(dir, 0700) != 0) expect(false, run, "the output directory to be emptied");
+  }
+
+  cml_destroy(h);
+  bench_server_stop(server);
+  bench_rm_rf(dir);
+  curl_global_cleanup();
+  printf("cml_check_revalidate: %s\n", failures ? "FAILED" : "ok");
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,190 @@
+// CML_OUTPUT_S3 against the mock server's S3 stand-in: objects appear only when their upload
+// succeeded, and a failed chapter leaves neither an object nor an open upload behind.
+//
+//   make check
+//   ./bin/cml_check_s3 ./bin/cml_mock_server
+//
+// Three servers, part size 5 MiB:
+//   multipart  3 chapters of about 8 MB each, the second Complete answering 200 with an <Error> body
+//              (--s3-fail-complete 2). Run 1 must fail with chapter 1 stored, chapter 2's upload
+//              aborted and no object for it. Run 2 must skip chapter 1 on its HEAD and store the rest;
+//              every object must then be a ZIP with one entry per page.
+//   page fault 1 chapter whose last page answers 404 after at least one part went up. The run must
+//              fail, with that upload aborted and no object.
+//   put        2 chapters smaller than a part, stored with one PutObject each and no multipart upload.
+// Every request must carry a valid signature. Prints one line per failed expectation and exits
+// non-zero if there was any.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <curl/curl.h>
+
+#include "harness.h"
+
+#define PART_SIZE (5u * 1024 * 1024)
+
+static int failures;
+
+static void expect(bool ok, const char *phase, const char *what) {
+  if (ok) return;
+  fprintf(stderr, "cml_check_s3: %s: expected %s\n", phase, what);
+  failures++;
+}
+
+typedef struct {
+  pid_t pid;
+  char base[64];
+  char endpoint[80];
+} server;
+
+static bool server_start(server *s, const char *path, const char *const *args) {
+  unsigned port = 0;
+  s->pid = bench_server_start(path, args, &port);
+  snprintf(s->base, sizeof(s->base), "http://127.0.0.1:%u", port);
+  snprintf(s->endpoint, sizeof(s->endpoint), "%s/s3", s->base);
+  if (s->pid < 0) fprintf(stderr, "cml_check_s3: cannot start %s\n", path);
+  return s->pid >= 0;
+}
+
+static uint64_t stat_of(const server *s, const char *phase, const char *key) {
+  uint64_t v = 0;
+  if (!bench_server_stat(s->base, key, &v)) expect(false, phase, "the server's counters");
+  return v;
+}
+
+// Runs the title once on a new handle that uploads to s, with pages fetched by workers threads.
+static cml_status run_s3(const server *s, uint32_t workers) {
+  const cml_s3_config s3 = {.endpoint = s->endpoint,
+                            .region = "us-east-1",
+                            .bucket = "comics",
+                            .access_key = "mock-access",
+                            .secret_key = "mock-secret",
+                            .key_prefix = "check/",
+                            .part_size = PART_SIZE};
+  cml_config cfg = {.output = CML_OUTPUT_S3,
+                    .out_fd = -1,
+                    .api_base = s->base,
+                    .s3 = &s3,
+                    .fetch_workers = workers,
+                    .fixed_concurrency = workers != 0};
+  cml *h = cml_create(&cfg);
+  cml_status st = CML_ERR_INVALID;
+  if (h && cml_add_title_id(h, BENCH_TITLE_ID) == CML_OK) st = cml_run(h);
+  cml_destroy(h);
+  return st;
+}
+
+// Checks that every stored object is a ZIP with pages entries; returns how many there are.
+static uint64_t objects_are_zips(const server *s, const char *phase, long pages) {
+  char list[8192];
+  uint64_t n = 0;
+  if (!bench_server_get(s->base, "/s3-objects", list, sizeof(list))) {
+    expect(false, phase, "the object list");
+    return 0;
+  }
+  char *save = NULL;
+  for (char *line = strtok_r(list, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+    unsigned long long bytes = 0;
+    long entries = 0;
+    int key = 0;
+    if (sscanf(line, "%llu %ld %n", &bytes, &entries, &key) != 2) continue;
+    if (entries != pages) {
+      fprintf(stderr, "cml_check_s3: %s: %s has %ld entries\n", phase, line + key, entries);
+      failures++;
+    }
+    expect(strncmp(line + key, "comics/check/", 13) == 0, phase, "objects named after the bucket and the prefix");
+    n++;
+  }
+  return n;
+}
+
+static void check_multipart(const char *mock) {
+  const char *phase = "multipart";
+  const char *args[] = {"--chapters", "3", "--pages", "8", "--page-size", "1000000", "--s3-fail-complete", "2", NULL};
+  server s;
+  if (!server_start(&s, mock, args)) {
+    failures++;
+    return;
+  }
+  cml_status st = run_s3(&s, 0);
+  expect(st != CML_OK, phase, "run 1 to fail");
+  expect(stat_of(&s, phase, "s3_completed") == 1, phase, "run 1 to complete chapter 1 only");
+  expect(stat_of(&s, phase, "s3_objects") == stat_of(&s, phase, "s3_completed"), phase,
+         "an object for each completed upload and none for the failed one");
+  expect(stat_of(&s, phase, "s3_uploads") == 0, phase, "no open upload after run 1");
+  expect(stat_of(&s, phase, "s3_aborted") == 1, phase, "the failed upload to be aborted");
+  printf("multipart run 1: %s, %llu objects, %llu parts, %llu aborted\n", cml_status_string(st),
+         (unsigned long long)stat_of(&s, phase, "s3_objects"), (unsigned long long)stat_of(&s, phase, "s3_parts"),
+         (unsigned long long)stat_of(&s, phase, "s3_aborted"));
+
+  uint64_t images = stat_of(&s, phase, "images");
+  st = run_s3(&s, 0);
+  uint64_t fetched = stat_of(&s, phase, "images") - images;
+  expect(st == CML_OK, phase, "run 2 to succeed");
+  expect(fetched == 2 * 8, phase, "run 2 to fetch chapters 2 and 3 only");
+  expect(stat_of(&s, phase, "s3_objects") == 3, phase, "an object per chapter after run 2");
+  expect(stat_of(&s, phase, "s3_uploads") == 0, phase, "no open upload after run 2");
+  expect(objects_are_zips(&s, phase, 8) == 3, phase, "three listed objects");
+  expect(stat_of(&s, phase, "s3_bad_signatures") == 0, phase, "every request to be signed correctly");
+  printf("multipart run 2: %s, %llu pages fetched, %llu objects\n", cml_status_string(st),
+         (unsigned long long)fetched, (unsigned long long)stat_of(&s, phase, "s3_objects"));
+  bench_server_stop(s.pid);
+}
+
+static void check_page_fault(const char *mock) {
+  const char *phase = "page fault";
+  const char *args[] = {"--chapters", "1", "--pages", "8", "--page-size", "1000000",
+                        "--fault", "status code=404 from=8 every=1000000 count=1", NULL};
+  server s;
+  if (!server_start(&s, mock, args)) {
+    failures++;
+    return;
+  }
+  cml_status st = run_s3(&s, 1);
+  expect(st != CML_OK, phase, "the run to fail");
+  expect(stat_of(&s, phase, "s3_parts") >= 1, phase, "a part uploaded before the failure");
+  expect(stat_of(&s, phase, "s3_objects") == 0, phase, "no object");
+  expect(stat_of(&s, phase, "s3_uploads") == 0, phase, "no open upload");
+  expect(stat_of(&s, phase, "s3_aborted") == 1, phase, "the upload to be aborted");
+  expect(stat_of(&s, phase, "s3_bad_signatures") == 0, phase, "every request to be signed correctly");
+  printf("page fault: %s, %llu parts, %llu aborted, %llu objects\n", cml_status_string(st),
+         (unsigned long long)stat_of(&s, phase, "s3_parts"), (unsigned long long)stat_of(&s, phase, "s3_aborted"),
+         (unsigned long long)stat_of(&s, phase, "s3_objects"));
+  bench_server_stop(s.pid);
+}
+
+static void check_put(const char *mock) {
+  const char *phase = "put";
+  const char *args[] = {"--chapters", "2", "--pages", "3", "--page-size", "20000", NULL};
+  server s;
+  if (!server_start(&s, mock, args)) {
+    failures++;
+    return;
+  }
+  cml_status st = run_s3(&s, 0);
+  expect(st == CML_OK, phase, "the run to succeed");
+  expect(stat_of(&s, phase, "s3_puts") == 2, phase, "one PutObject per chapter");
+  expect(stat_of(&s, phase, "s3_created") == 0, phase, "no multipart upload");
+  expect(objects_are_zips(&s, phase, 3) == 2, phase, "two listed objects");
+  expect(stat_of(&s, phase, "s3_bad_signatures") == 0, phase, "every request to be signed correctly");
+  printf("put: %s, %llu objects\n", cml_status_string(st), (unsigned long long)stat_of(&s, phase, "s3_objects"));
+  bench_server_stop(s.pid);
+}
+
+int main(int argc, char **argv) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s <cml_mock_server>\n", argv[0]);
+    return 2;
+  }
+  if (curl_global_init(CURL_GLOBAL_DEFAULT) != 0) return 1;
+  check_multipart(argv[1]);
+  check_page_fault(argv[1]);
+  check_put(argv[1]);
+  curl_global_cleanup();
+  printf("cml_check_s3: %s\n", failures ? "FAILED" : "ok");
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,215 @@
+// Resilience under network faults: cml_run against the mock server with the faults of each scenario
+// of a scenario file injected into page requests, RAW output.
+//
+//   make bench-faults
+//   ./bin/cml_bench_faults ./bin/cml_mock_server bench/faults.scenarios [--scenario NAME] [--workers N]
+//                          [--hedge PERCENTILE] [--chapters N] [--pages N] [--page-size BYTES]
+//
+// Every scenario gets a fresh server (so its counters and fault rules start from zero) and a fresh
+// output directory, removed afterwards. Reported per scenario, as JSON on stdout: whether the run
+// completed, its wall time, the page requests the server answered and the page bytes it sent, the
+// bytes wasted beyond one clean download of the title, the client's retry, resume, timeout and
+// hedge counters, and the median and 99th percentile time of a page request. The scenario file
+// format is described in bench/faults.scenarios.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <curl/curl.h>
+
+#include "harness.h"
+
+#define MAX_SCENARIOS 32
+#define MAX_RULES 16
+
+typedef struct {
+  char name[64];
+  char *rules[MAX_RULES];
+  size_t rules_len;
+} scenario;
+
+typedef struct {
+  const char *only;  // run just this scenario
+  uint32_t workers;
+  uint32_t hedge;
+  uint32_t chapters;
+  uint32_t pages;
+  uint32_t page_size;
+} options;
+
+static void trim(char *s) {
+  char *h = strchr(s, '#');
+  if (h) *h = '\0';
+  size_t n = strlen(s);
+  while (n > 0 && (s[n - 1] == ' ' || s[n - 1] == '\t' || s[n - 1] == '\r' || s[n - 1] == '\n')) s[--n] = '\0';
+  size_t lead = strspn(s, " \t");
+  memmove(s, s + lead, n - lead + 1);
+}
+
+static size_t load_scenarios(const char *path, scenario *out) {
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    fprintf(stderr, "cml_bench_faults: cannot open %s\n", path);
+    return 0;
+  }
+  char line[512];
+  size_t n = 0;
+  unsigned lineno = 0;
+  bool bad = false;
+  while (!bad && fgets(line, sizeof(line), f)) {
+    lineno++;
+    trim(line);
+    size_t len = strlen(line);
+    if (len == 0) continue;
+    if (line[0] == '[' && line[len - 1] == ']' && len > 2 && len - 2 < sizeof(out->name) && n < MAX_SCENARIOS) {
+      memset(&out[n], 0, sizeof(out[n]));
+      memcpy(out[n].name, line + 1, len - 2);
+      n++;
+    } else if (n > 0 && line[0] != '[' && out[n - 1].rules_len < MAX_RULES) {
+      char *rule = strdup(line);
+      bad = !rule;
+      if (rule) out[n - 1].rules[out[n - 1].rules_len++] = rule;
+    } else {
+      fprintf(stderr, "cml_bench_faults: %s:%u: unexpected \"%s\"\n", path, lineno, line);
+      bad = true;
+    }
+  }
+  fclose(f);
+  if (bad) {
+    for (size_t i = 0; i < n; i++)
+      for (size_t r = 0; r < out[i].rules_len; r++) free(out[i].rules[r]);
+    return 0;
+  }
+  return n;
+}
+
+static int run_scenario(const char *server_path, const scenario *sc, const options *o, bool last) {
+  char v[3][16];
+  snprintf(v[0], sizeof(v[0]), "%u", o->chapters);
+  snprintf(v[1], sizeof(v[1]), "%u", o->pages);
+  snprintf(v[2], sizeof(v[2]), "%u", o->page_size);
+  const char *args[6 + 2 * MAX_RULES + 1] = {"--chapters", v[0], "--pages", v[1], "--page-size", v[2]};
+  size_t n = 6;
+  for (size_t i = 0; i < sc->rules_len; i++) {
+    args[n++] = "--fault";
+    args[n++] = sc->rules[i];
+  }
+  args[n] = NULL;
+
+  unsigned port = 0;
+  pid_t server = bench_server_start(server_path, args, &port);
+  if (server < 0) {
+    fprintf(stderr, "cml_bench_faults: cannot start %s for scenario %s\n", server_path, sc->name);
+    return 0;
+  }
+  char base[64];
+  snprintf(base, sizeof(base), "http://127.0.0.1:%u", port);
+  char dir[] = "/tmp/cml-bench-XXXXXX";
+  bench_run r;
+  bool made = mkdtemp(dir) != NULL;
+  int ok = made;
+  cml_config cfg = {.out_dir = dir,
+                    .output = CML_OUTPUT_RAW,
+                    .out_fd = -1,
+                    .fetch_workers = o->workers,
+                    .hedge_percentile = o->hedge,
+                    .api_base = base};
+  ok = ok && bench_run_title(&cfg, &r);
+  uint64_t images = 0;
+  uint64_t sent = 0;
+  uint64_t title = 0;
+  uint64_t faults = 0;
+  ok = ok && bench_server_stat(base, "images", &images) && bench_server_stat(base, "image_bytes", &sent) &&
+       bench_server_stat(base, "title_bytes", &title) && bench_server_stat(base, "faults", &faults);
+  bench_server_stop(server);
+  if (made && !bench_rm_rf(dir)) fprintf(stderr, "cml_bench_faults: cannot remove %s\n", dir);
+  if (!ok) {
+    fprintf(stderr, "cml_bench_faults: scenario %s could not be run\n", sc->name);
+    return 0;
+  }
+
+  // Bytes beyond one clean download; a run that did not complete wasted everything it received.
+  uint64_t wasted = r.status == CML_OK ? (sent > title ? sent - title : 0) : sent;
+  const cml_stats *s = &r.stats;
+  printf("    \"%s\": {\"ok\": %s, \"status\": \"%s\", \"wall_s\": %.3f, \"pages\": %llu, "
+         "\"page_requests\": %llu, \"faults\": %llu, \"bytes_sent\": %llu, \"wasted_bytes\": %llu, "
+         "\"wasted_pct\": %.1f, \"retries\": %llu, \"retry_after\": %llu, \"gave_up\": %llu, \"resumed\": %llu, "
+         "\"resumed_bytes\": %llu, \"first_byte_timeouts\": %llu, \"stalls\": %llu, \"slow_aborts\": %llu, "
+         "\"hedges\": %llu, \"hedges_won\": %llu, \"page_p50_ms\": %.1f, \"page_p99_ms\": %.1f}%s\n",
+         sc->name, r.status == CML_OK ? "true" : "false", cml_status_string((cml_status)r.status),
+         (double)r.wall_ns / 1e9, (unsigned long long)s->write.pages, (unsigned long long)images,
+         (unsigned long long)faults, (unsigned long long)sent, (unsigned long long)wasted,
+         title ? 100.0 * (double)wasted / (double)title : 0.0, (unsigned long long)s->retry.retries,
+         (unsigned long long)s->retry.retry_after, (unsigned long long)s->retry.gave_up,
+         (unsigned long long)s->retry.resumed, (unsigned long long)s->retry.resumed_bytes,
+         (unsigned long long)s->timeouts.first_byte_timeouts, (unsigned long long)s->timeouts.stalls,
+         (unsigned long long)s->timeouts.slow_aborts, (unsigned long long)s->hedge.hedges,
+         (unsigned long long)s->hedge.won, (double)cml_histogram_percentile(&s->http.pages.total, 50.0) / 1000.0,
+         (double)cml_histogram_percentile(&s->http.pages.total, 99.0) / 1000.0, last ? "" : ",");
+  fflush(stdout);
+  return 1;
+}
+
+int main(int argc, char **argv) {
+  options o = {.chapters = 4, .pages = 20, .page_size = 200000};
+  int bad = argc < 3;
+  for (int i = 3; i < argc && !bad; i += 2) {
+    const char *a = argv[i];
+    bad = i + 1 >= argc;
+    if (bad) break;
+    if (strcmp(a, "--scenario") == 0) {
+      o.only = argv[i + 1];
+      continue;
+    }
+    uint32_t v = 0;
+    bad = !bench_parse_u32(argv[i + 1], &v);
+    if (bad) break;
+    if (strcmp(a, "--workers") == 0) o.workers = v;
+    else if (strcmp(a, "--hedge") == 0 && v < 100) o.hedge = v;
+    else if (strcmp(a, "--chapters") == 0 && v > 0) o.chapters = v;
+    else if (strcmp(a, "--pages") == 0 && v > 0) o.pages = v;
+    else if (strcmp(a, "--page-size") == 0 && v >= 16) o.page_size = v;
+    else bad = 1;
+  }
+  if (bad) {
+    fprintf(stderr,
+            "usage: %s <cml_mock_server> <scenario file> [--scenario NAME] [--workers N] [--hedge PERCENTILE] "
+            "[--chapters N] [--pages N] [--page-size BYTES]\n",
+            argv[0]);
+    return 2;
+  }
+
+  static scenario scenarios[MAX_SCENARIOS];
+  size_t n = load_scenarios(argv[2], scenarios);
+  size_t chosen = n;
+  if (o.only) {
+    for (chosen = 0; chosen < n && strcmp(scenarios[chosen].name, o.only) != 0; chosen++) {
+    }
+    if (chosen == n) {
+      fprintf(stderr, "cml_bench_faults: no scenario %s in %s\n", o.only, argv[2]);
+      return 2;
+    }
+  }
+  if (n == 0) return 1;
+  if (curl_global_init(CURL_GLOBAL_DEFAULT) != 0) return 1;
+
+  printf("{\n  \"workers\": %u,\n  \"hedge_percentile\": %u,\n", o.workers, o.hedge);
+  printf("  \"title\": {\"chapters\": %u, \"pages\": %u, \"page_size\": %u},\n", o.chapters, o.pages, o.page_size);
+  printf("  \"scenarios\": {\n");
+  fflush(stdout);
+  int ok = 1;
+  for (size_t i = 0; i < n && ok; i++) {
+    if (o.only && i != chosen) continue;
+    ok = run_scenario(argv[1], &scenarios[i], &o, o.only || i + 1 == n);
+  }
+  printf("  }\n}\n");
+
+  for (size_t i = 0; i < n; i++)
+    for (size_t r = 0; r < scenarios[i].rules_len; r++) free(scenarios[i].rules[r]);
+  curl_global_cleanup();
+  return ok ? 0 : 1;
+}
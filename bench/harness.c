@@ -0,0 +1,177 @@
+#include "harness.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <curl/curl.h>
+
+#define MAX_SERVER_ARGS 64
+
+uint64_t bench_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+int bench_parse_u32(const char *s, uint32_t *out) {
+  char *end = NULL;
+  unsigned long v = strtoul(s, &end, 10);
+  if (!end || end == s || *end || v > 0xffffffffUL) return 0;
+  *out = (uint32_t)v;
+  return 1;
+}
+
+int bench_rm_rf(const char *path) {
+  struct stat st;
+  if (lstat(path, &st) != 0) return errno == ENOENT;
+  if (S_ISDIR(st.st_mode)) {
+    DIR *d = opendir(path);
+    if (!d) return 0;
+    struct dirent *e;
+    int ok = 1;
+    while (ok && (e = readdir(d)) != NULL) {
+      if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) continue;
+      size_t n = strlen(path) + strlen(e->d_name) + 2;
+      char *child = (char *)malloc(n);
+      if (!child) ok = 0;
+      if (child) {
+        snprintf(child, n, "%s/%s", path, e->d_name);
+        ok = bench_rm_rf(child);
+        free(child);
+      }
+    }
+    closedir(d);
+    return ok && rmdir(path) == 0;
+  }
+  return unlink(path) == 0;
+}
+
+pid_t bench_server_start(const char *path, const char *const *args, unsigned *port) {
+  const char *argv[MAX_SERVER_ARGS + 4] = {path, "--port", "0"};
+  size_t n = 3;
+  for (; args && args[n - 3] && n < MAX_SERVER_ARGS + 3; n++) argv[n] = args[n - 3];
+  argv[n] = NULL;
+  int fds[2];
+  if (pipe(fds) != 0) return -1;
+  pid_t pid = fork();
+  if (pid == 0) {
+    dup2(fds[1], STDOUT_FILENO);
+    close(fds[0]);
+    close(fds[1]);
+    execv(path, (char *const *)argv);
+    _exit(127);
+  }
+  close(fds[1]);
+  FILE *f = fdopen(fds[0], "r");
+  int ok = pid > 0 && f && fscanf(f, "port %u", port) == 1;
+  if (f) fclose(f);
+  else close(fds[0]);
+  if (!ok && pid > 0) bench_server_stop(pid);
+  return ok ? pid : -1;
+}
+
+void bench_server_stop(pid_t pid) {
+  kill(pid, SIGTERM);
+  waitpid(pid, NULL, 0);
+}
+
+typedef struct {
+  char *data;
+  size_t cap;
+  size_t len;
+} collect_buf;
+
+static size_t collect(char *data, size_t size, size_t nmemb, void *user) {
+  collect_buf *out = (collect_buf *)user;
+  size_t n = size * nmemb;
+  size_t room = out->cap - 1 - out->len;
+  memcpy(out->data + out->len, data, n < room ? n : room);
+  out->len += n < room ? n : room;
+  out->data[out->len] = '\0';
+  return n;
+}
+
+int bench_server_get(const char *base, const char *path, char *out, size_t cap) {
+  char url[256];
+  snprintf(url, sizeof(url), "%s%s", base, path);
+  collect_buf b = {.data = out, .cap = cap};
+  out[0] = '\0';
+  CURL *c = curl_easy_init();
+  if (!c) return 0;
+  curl_easy_setopt(c, CURLOPT_URL, url);
+  curl_easy_setopt(c, CURLOPT_WRITEFUNCTION, collect);
+  curl_easy_setopt(c, CURLOPT_WRITEDATA, &b);
+  curl_easy_setopt(c, CURLOPT_FAILONERROR, 1L);
+  CURLcode rc = curl_easy_perform(c);
+  curl_easy_cleanup(c);
+  return rc == CURLE_OK;
+}
+
+int bench_server_stat(const char *base, const char *key, uint64_t *out) {
+  char body[2048];
+  char field[64];
+  snprintf(field, sizeof(field), "\"%s\": ", key);
+  const char *p = bench_server_get(base, "/stats", body, sizeof(body)) ? strstr(body, field) : NULL;
+  if (!p) return 0;
+  *out = strtoull(p + strlen(field), NULL, 10);
+  return 1;
+}
+
+static double tv_s(struct timeval tv) { return (double)tv.tv_sec + (double)tv.tv_usec / 1e6; }
+
+// Runs in the forked child: one whole download, reported through fd.
+static void run_child(int fd, const cml_config *cfg) {
+  bench_run r;
+  memset(&r, 0, sizeof(r));
+  r.status = CML_ERR_INVALID;
+  cml *h = cml_create(cfg);
+  uint64_t t0 = bench_now_ns();
+  if (h) {
+    r.status = cml_add_title_id(h, BENCH_TITLE_ID);
+    if (r.status == CML_OK) r.status = cml_run(h);
+    cml_get_stats(h, &r.stats);
+  }
+  r.wall_ns = bench_now_ns() - t0;
+  cml_destroy(h);
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  r.user_s = tv_s(ru.ru_utime);
+  r.sys_s = tv_s(ru.ru_stime);
+  r.peak_rss_kb = ru.ru_maxrss;
+  ssize_t w = write(fd, &r, sizeof(r));
+  _exit(w == (ssize_t)sizeof(r) ? 0 : 1);
+}
+
+int bench_run_title(const cml_config *cfg, bench_run *out) {
+  memset(out, 0, sizeof(*out));
+  out->status = CML_ERR_INVALID;
+  int fds[2];
+  if (pipe(fds) != 0) return 0;
+  pid_t pid = fork();
+  if (pid == 0) {
+    close(fds[0]);
+    run_child(fds[1], cfg);
+  }
+  close(fds[1]);
+  size_t got = 0;
+  while (pid > 0 && got < sizeof(*out)) {
+    ssize_t r = read(fds[0], (char *)out + got, sizeof(*out) - got);
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) break;
+    got += (size_t)r;
+  }
+  int ok = got == sizeof(*out);
+  close(fds[0]);
+  int wstatus = 0;
+  if (pid > 0) ok = waitpid(pid, &wstatus, 0) == pid && WIFEXITED(wstatus) && WEXITSTATUS(wstatus) == 0 && ok;
+  return ok;
+}
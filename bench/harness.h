@@ -0,0 +1,39 @@
+#pragma once
+
+// Helpers shared by the end-to-end benchmarks: the mock server as a child process, and whole
+// downloads run in forked children so that their CPU time and peak RSS are their own.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "cml/cml.h"
+
+#define BENCH_TITLE_ID 100
+
+// What a forked run reports back.
+typedef struct {
+  int status;  // cml_status of cml_run
+  cml_stats stats;
+  uint64_t wall_ns;
+  double user_s;
+  double sys_s;
+  long peak_rss_kb;
+} bench_run;
+
+uint64_t bench_now_ns(void);
+int bench_parse_u32(const char *s, uint32_t *out);
+int bench_rm_rf(const char *path);
+
+// Starts the mock server at path with args (NULL-terminated, "--port 0" is added) and reads the port
+// it listens on; returns its pid, or -1.
+pid_t bench_server_start(const char *path, const char *const *args, unsigned *port);
+void bench_server_stop(pid_t pid);
+// GETs path from the server at base ("http://127.0.0.1:<port>") into out, cut to cap - 1 bytes.
+int bench_server_get(const char *base, const char *path, char *out, size_t cap);
+// Counter key of the server's /stats at base.
+int bench_server_stat(const char *base, const char *key, uint64_t *out);
+
+// Downloads BENCH_TITLE_ID with cfg in a forked child. The run failed to happen (rather than
+// cml_run failing, which out->status tells) when this returns 0.
+int bench_run_title(const cml_config *cfg, bench_run *out);
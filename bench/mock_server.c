@@ -0,0 +1,990 @@
+// Local stand-in for the MANGA Plus API, for benchmarks and checks.
+//
+//   ./bin/cml_mock_server [--port N] [--chapters N] [--pages N] [--page-size BYTES] [--latency-ms MS]
+//                         [--vary-every N] [--s3-fail-complete N] [--fault SPEC]...
+//
+// Serves one title (any title id) with --chapters chapters of --pages pages each. /api/title_detailV3
+// and /api/manga_viewer answer with protobuf built the way the real API lays it out, and every page
+// under /img/ is a pseudo-random JPEG-framed body, XOR-encrypted with the key the viewer announces.
+// Page sizes vary deterministically between half and one and a half times --page-size. /stats
+// reports request and byte counters as JSON. With --port 0 (the default) the kernel picks the port;
+// either way the first line on stdout is "port <n>".
+//
+// Title details carry an ETag and manga viewers a Last-Modified; a request that sends the current
+// one back (If-None-Match, If-Modified-Since) gets a 304. With --vary-every N each of them changes
+// every N requests for it: the body gains a new version number in a field clients ignore, with new
+// validators. Without it they never change.
+//
+// Pages honour "Range: bytes=N-" (and If-Range against their ETag) so that resumption can be
+// exercised. Each --fault SPEC adds a rule for page requests, "<kind> [from=F] [every=N] [count=K]
+// [opts]": the rule hits page requests n >= F (counted from 1, across all connections) with
+// (n - F) % N < K, and the first rule that hits wins. from defaults to 1, every to 1 and count to
+// every, so a bare kind hits all of them.
+//
+//   reset                        close the connection with a RST before answering
+//   truncate at=P                send P% of the body, then close
+//   status code=C retry_after=S  answer C with an empty body (and Retry-After: S when S > 0)
+//   delay ms=M                   wait M ms before the response head (slow first byte)
+//   stall at=P ms=M              send P% of the body, pause M ms, send the rest
+//   pace bps=R                   send the body in 4 KiB chunks at R bytes per second
+//
+// Under /s3/ it is an S3-compatible object store for CML_OUTPUT_S3 (endpoint http://127.0.0.1:<port>/s3,
+// any bucket and region, access key MOCK_S3_ACCESS_KEY, secret MOCK_S3_SECRET_KEY). Every request must
+// carry a valid SigV4 signature over host, x-amz-content-sha256 and x-amz-date, and a payload hash
+// that matches its body; others get a 403. It answers HEAD, GET and PUT (PutObject) on objects, and
+// CreateMultipartUpload, UploadPart (with an ETag), CompleteMultipartUpload and
+// AbortMultipartUpload. An object only exists once its PutObject or Complete succeeded. With
+// --s3-fail-complete N the N-th Complete answers 200 with an <Error> body, as S3 may, and leaves the
+// upload open. /s3-objects lists the stored objects, one "<bytes> <zip entries> <key>" line each
+// (entries -1 when the object is not a ZIP), and /stats counts the S3 requests.
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cml_internal.h"
+
+#define TITLE_ID 100
+#define FIRST_CHAPTER_ID 1001
+#define KEY_HEX "a1b2c3d4e5f60718293a4b5c6d7e8f90"
+#define REQ_MAX 16384
+#define MAX_FAULTS 16
+#define BODY_MAX (64u * 1024 * 1024)
+#define MAX_S3_OBJECTS 256
+#define MAX_S3_UPLOADS 64
+#define MAX_S3_PARTS 256
+#define MOCK_S3_ACCESS_KEY "mock-access"
+#define MOCK_S3_SECRET_KEY "mock-secret"
+
+typedef struct {
+  uint32_t chapters;
+  uint32_t pages;
+  uint32_t page_size;
+  uint32_t latency_ms;
+  uint32_t vary_every;  // 0: metadata never changes
+  uint32_t s3_fail_complete;  // this CompleteMultipartUpload (1-based) answers an error; 0: none
+  uint16_t port;
+} options;
+
+typedef enum { FAULT_RESET, FAULT_TRUNCATE, FAULT_STATUS, FAULT_DELAY, FAULT_STALL, FAULT_PACE } fault_kind;
+
+typedef struct {
+  fault_kind kind;
+  uint32_t from;
+  uint32_t every;
+  uint32_t count;
+  uint32_t at;  // percent of the body, for truncate and stall
+  uint32_t ms;
+  uint32_t code;
+  uint32_t retry_after;
+  uint32_t bps;
+} fault;
+
+static options opt = {.chapters = 10, .pages = 20, .page_size = 300000};
+static uint8_t key[16];
+static fault faults[MAX_FAULTS];
+static size_t faults_len;
+
+static atomic_uint_fast64_t stat_requests;
+static atomic_uint_fast64_t stat_metadata;
+static atomic_uint_fast64_t stat_images;
+static atomic_uint_fast64_t stat_image_bytes;
+static atomic_uint_fast64_t stat_faults;
+static atomic_uint_fast64_t stat_ranges;
+static atomic_uint_fast64_t stat_not_modified;
+// Requests seen per metadata object: the title detail, then each chapter's viewer.
+static atomic_uint_fast64_t *meta_seen;
+
+// Growable byte buffer for building responses.
+typedef struct {
+  uint8_t *data;
+  size_t len;
+  size_t cap;
+} buf;
+
+static void put(buf *b, const void *p, size_t n) {
+  if (n == 0) return;
+  if (b->len + n > b->cap) {
+    size_t cap = b->cap ? b->cap : 256;
+    while (cap < b->len + n) cap *= 2;
+    uint8_t *d = (uint8_t *)realloc(b->data, cap);
+    if (!d) abort();
+    b->data = d;
+    b->cap = cap;
+  }
+  memcpy(b->data + b->len, p, n);
+  b->len += n;
+}
+
+static void put_varint(buf *b, uint64_t v) {
+  uint8_t tmp[10];
+  size_t n = 0;
+  do {
+    tmp[n] = (uint8_t)(v & 0x7f);
+    v >>= 7;
+    if (v) tmp[n] |= 0x80;
+    n++;
+  } while (v);
+  put(b, tmp, n);
+}
+
+static void pb_varint(buf *b, uint32_t field, uint64_t v) {
+  put_varint(b, (uint64_t)field << 3);
+  put_varint(b, v);
+}
+
+static void pb_bytes(buf *b, uint32_t field, const void *p, size_t n) {
+  put_varint(b, ((uint64_t)field << 3) | 2);
+  put_varint(b, n);
+  put(b, p, n);
+}
+
+static void pb_str(buf *b, uint32_t field, const char *s) { pb_bytes(b, field, s, strlen(s)); }
+
+// Wraps inner as field of b and frees it.
+static void pb_msg(buf *b, uint32_t field, buf *inner) {
+  pb_bytes(b, field, inner->data, inner->len);
+  free(inner->data);
+  memset(inner, 0, sizeof(*inner));
+}
+
+static void chapter_msg(buf *b, uint32_t field, uint32_t chapter_id) {
+  uint32_t n = chapter_id - FIRST_CHAPTER_ID + 1;
+  char name[16];
+  char sub[32];
+  snprintf(name, sizeof(name), "#%03u", n);
+  snprintf(sub, sizeof(sub), "Chapter %u", n);
+  buf c = {0};
+  pb_varint(&c, 2, chapter_id);
+  pb_str(&c, 3, name);
+  pb_str(&c, 4, sub);
+  pb_msg(b, field, &c);
+}
+
+// Response.success(1).title_detail_view(8): title(1) and one chapter group(28).
+static void title_detail(buf *out) {
+  buf title = {0};
+  pb_varint(&title, 1, TITLE_ID);
+  pb_str(&title, 2, "Bench Title");
+  pb_str(&title, 3, "Bench Author");
+  buf group = {0};
+  for (uint32_t i = 0; i < opt.chapters; i++) chapter_msg(&group, 2, FIRST_CHAPTER_ID + i);
+  buf view = {0};
+  pb_msg(&view, 1, &title);
+  pb_msg(&view, 28, &group);
+  buf success = {0};
+  pb_msg(&success, 8, &view);
+  pb_msg(out, 1, &success);
+}
+
+// Response.success(1).manga_viewer(10): pages, then the chapter list and the chapter's own fields.
+static void manga_viewer(buf *out, uint32_t chapter_id) {
+  buf viewer = {0};
+  char url[128];
+  for (uint32_t p = 0; p < opt.pages; p++) {
+    snprintf(url, sizeof(url), "http://127.0.0.1:%u/img/%u/%u.jpg", opt.port, chapter_id, p);
+    buf mp = {0};
+    pb_str(&mp, 1, url);
+    pb_varint(&mp, 4, 0);
+    pb_str(&mp, 5, KEY_HEX);
+    buf page = {0};
+    pb_msg(&page, 1, &mp);
+    pb_msg(&viewer, 1, &page);
+  }
+  buf last = {0};
+  chapter_msg(&last, 1, chapter_id);
+  if (chapter_id + 1 < FIRST_CHAPTER_ID + opt.chapters) chapter_msg(&last, 2, chapter_id + 1);
+  buf page = {0};
+  pb_msg(&page, 3, &last);
+  pb_msg(&viewer, 1, &page);
+  pb_varint(&viewer, 2, chapter_id);
+  for (uint32_t i = 0; i < opt.chapters; i++) chapter_msg(&viewer, 3, FIRST_CHAPTER_ID + i);
+  char name[16];
+  snprintf(name, sizeof(name), "#%03u", chapter_id - FIRST_CHAPTER_ID + 1);
+  pb_str(&viewer, 6, name);
+  pb_varint(&viewer, 9, TITLE_ID);
+  buf success = {0};
+  pb_msg(&success, 10, &viewer);
+  pb_msg(out, 1, &success);
+}
+
+static uint64_t mix64(uint64_t x) {
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdull;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ull;
+  x ^= x >> 33;
+  return x;
+}
+
+static size_t page_len(uint32_t chapter_id, uint32_t page) {
+  uint64_t r = mix64(((uint64_t)chapter_id << 32) | page);
+  return opt.page_size / 2 + (size_t)(r % ((uint64_t)opt.page_size + 1));
+}
+
+// Size of every page of the title, i.e. what one clean download transfers.
+static uint64_t title_bytes(void) {
+  uint64_t n = 0;
+  for (uint32_t c = 0; c < opt.chapters; c++)
+    for (uint32_t p = 0; p < opt.pages; p++) n += page_len(FIRST_CHAPTER_ID + c, p);
+  return n;
+}
+
+// JPEG start and end markers around pseudo-random bytes, encrypted as the CDN does.
+static void page_body(buf *out, uint32_t chapter_id, uint32_t page) {
+  size_t n = page_len(chapter_id, page);
+  if (out->cap < n) {
+    out->data = (uint8_t *)realloc(out->data, n);
+    if (!out->data) abort();
+    out->cap = n;
+  }
+  uint64_t s = mix64(((uint64_t)page << 32) | chapter_id) | 1;
+  for (size_t i = 0; i < n; i += 8) {
+    s ^= s << 13;
+    s ^= s >> 7;
+    s ^= s << 17;
+    size_t k = n - i < 8 ? n - i : 8;
+    memcpy(out->data + i, &s, k);
+  }
+  static const uint8_t soi[4] = {0xff, 0xd8, 0xff, 0xe0};
+  memcpy(out->data, soi, n < 4 ? n : 4);
+  if (n >= 6) {
+    out->data[n - 2] = 0xff;
+    out->data[n - 1] = 0xd9;
+  }
+  for (size_t i = 0; i < n; i++) out->data[i] ^= key[i % sizeof(key)];
+  out->len = n;
+}
+
+// Bytes of p written to fd before an error.
+static size_t send_some(int fd, const void *p, size_t n) {
+  const uint8_t *b = (const uint8_t *)p;
+  size_t done = 0;
+  while (done < n) {
+    ssize_t w = send(fd, b + done, n - done, MSG_NOSIGNAL);
+    if (w < 0 && errno == EINTR) continue;
+    if (w <= 0) break;
+    done += (size_t)w;
+  }
+  return done;
+}
+
+static int send_all(int fd, const void *p, size_t n) { return send_some(fd, p, n) == n; }
+
+static int send_head(int fd, int code, const char *type, size_t len, const char *extra) {
+  const char *reason = code == 200   ? "OK"
+                       : code == 204 ? "No Content"
+                       : code == 206 ? "Partial Content"
+                       : code == 304 ? "Not Modified"
+                       : code == 400 ? "Bad Request"
+                       : code == 403 ? "Forbidden"
+                       : code == 404 ? "Not Found"
+                       : code == 429 ? "Too Many Requests"
+                                     : "Error";
+  char head[512];
+  int n = snprintf(head, sizeof(head), "HTTP/1.1 %d %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\n%s\r\n", code,
+                   reason, type, len, extra ? extra : "");
+  return n > 0 && (size_t)n < sizeof(head) && send_all(fd, head, (size_t)n);
+}
+
+static int respond(int fd, int code, const char *type, const buf *body) {
+  size_t len = body ? body->len : 0;
+  return send_head(fd, code, type, len, NULL) && (len == 0 || send_all(fd, body->data, len));
+}
+
+static uint32_t query_u32(const char *query, const char *name) {
+  size_t k = strlen(name);
+  for (const char *p = query; p && *p; p = strchr(p, '&'), p = p ? p + 1 : NULL) {
+    if (strncmp(p, name, k) == 0 && p[k] == '=') return (uint32_t)strtoul(p + k + 1, NULL, 10);
+  }
+  return 0;
+}
+
+// The value of request header name (lowercase, with the colon) in req, up to the line end.
+static const char *header_get(const char *req, const char *name, size_t *len) {
+  size_t k = strlen(name);
+  for (const char *p = strstr(req, "\r\n"); p && p[2] != '\r'; p = strstr(p + 2, "\r\n")) {
+    if (strncasecmp(p + 2, name, k) != 0) continue;
+    const char *v = p + 2 + k;
+    while (*v == ' ') v++;
+    const char *e = strstr(v, "\r\n");
+    *len = e ? (size_t)(e - v) : strlen(v);
+    return v;
+  }
+  return NULL;
+}
+
+static void sleep_ms(uint32_t ms) {
+  struct timespec ts = {.tv_sec = ms / 1000, .tv_nsec = (long)(ms % 1000) * 1000000L};
+  while (nanosleep(&ts, &ts) == -1 && errno == EINTR) {
+  }
+}
+
+// The first rule that applies to the n-th page request (1-based), or NULL.
+static const fault *fault_for(uint64_t n) {
+  for (size_t i = 0; i < faults_len; i++)
+    if (n >= faults[i].from && (n - faults[i].from) % faults[i].every < faults[i].count) return &faults[i];
+  return NULL;
+}
+
+// Sends data[0..n) as a page body, the way f (if any) says; counts what went out. 0 when the
+// connection has to close.
+static int send_page_body(int fd, const uint8_t *data, size_t n, const fault *f) {
+  size_t cut = f && (f->kind == FAULT_TRUNCATE || f->kind == FAULT_STALL) ? n * f->at / 100 : n;
+  size_t sent = 0;
+  if (f && f->kind == FAULT_PACE) {
+    // Chunks of 4 KiB, each after the time it takes at the given rate.
+    while (sent < n) {
+      size_t k = n - sent < 4096 ? n - sent : 4096;
+      sleep_ms((uint32_t)(k * 1000 / f->bps));
+      size_t w = send_some(fd, data + sent, k);
+      sent += w;
+      if (w < k) break;
+    }
+  } else {
+    sent = send_some(fd, data, cut);
+    if (sent == cut && cut < n && f->kind == FAULT_STALL) {
+      sleep_ms(f->ms);
+      sent += send_some(fd, data + cut, n - cut);
+    }
+  }
+  atomic_fetch_add(&stat_image_bytes, sent);
+  return sent == n;
+}
+
+// A page, with Range support (bytes=N- only, checked against If-Range) and the faults configured.
+static int serve_page(int fd, const char *req, uint32_t chapter_id, uint32_t page, buf *body) {
+  uint64_t n = atomic_fetch_add(&stat_images, 1) + 1;
+  const fault *f = fault_for(n);
+  if (f) atomic_fetch_add(&stat_faults, 1);
+  if (opt.latency_ms) sleep_ms(opt.latency_ms);
+  if (f && f->kind == FAULT_RESET) {
+    // Closing with a zero linger time sends a RST instead of a FIN.
+    struct linger lg = {.l_onoff = 1, .l_linger = 0};
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    return 0;
+  }
+  char extra[160];
+  if (f && f->kind == FAULT_STATUS) {
+    snprintf(extra, sizeof(extra), "Retry-After: %u\r\n", f->retry_after);
+    return send_head(fd, (int)f->code, "text/plain", 0, f->retry_after ? extra : NULL);
+  }
+  if (f && f->kind == FAULT_DELAY) sleep_ms(f->ms);
+
+  page_body(body, chapter_id, page);
+  char etag[32];
+  snprintf(etag, sizeof(etag), "\"c%up%u\"", chapter_id, page);
+  size_t start = 0;
+  size_t len = 0;
+  const char *range = header_get(req, "range:", &len);
+  const char *if_range = header_get(req, "if-range:", &len);
+  bool same = !if_range || (len == strlen(etag) && memcmp(if_range, etag, len) == 0);
+  unsigned long long first = 0;
+  if (range && same && sscanf(range, "bytes=%llu-", &first) == 1 && first < body->len) start = (size_t)first;
+  if (start) {
+    snprintf(extra, sizeof(extra), "Accept-Ranges: bytes\r\nETag: %s\r\nContent-Range: bytes %zu-%zu/%zu\r\n", etag,
+             start, body->len - 1, body->len);
+    atomic_fetch_add(&stat_ranges, 1);
+  } else {
+    snprintf(extra, sizeof(extra), "Accept-Ranges: bytes\r\nETag: %s\r\n", etag);
+  }
+  return send_head(fd, start ? 206 : 200, "image/jpeg", body->len - start, extra) &&
+         send_page_body(fd, body->data + start, body->len - start, f);
+}
+
+// Version of metadata object slot for this request to it (see --vary-every).
+static uint32_t meta_version(size_t slot) {
+  uint64_t n = atomic_fetch_add(&meta_seen[slot], 1) + 1;
+  return opt.vary_every ? (uint32_t)((n - 1) / opt.vary_every) : 0;
+}
+
+// A title detail (chapter_id 0) or manga viewer with its validator; 304 when the request already has
+// the current one.
+static int serve_metadata(int fd, const char *req, uint32_t chapter_id, buf *body) {
+  atomic_fetch_add(&stat_metadata, 1);
+  uint32_t version = meta_version(chapter_id ? 1 + chapter_id - FIRST_CHAPTER_ID : 0);
+  char value[64];
+  char extra[96];
+  const char *sent = NULL;
+  size_t len = 0;
+  if (!chapter_id) {
+    snprintf(value, sizeof(value), "\"t%uv%u\"", TITLE_ID, version);
+    snprintf(extra, sizeof(extra), "ETag: %s\r\n", value);
+    sent = header_get(req, "if-none-match:", &len);
+  } else {
+    time_t t = (time_t)1700000000 + (time_t)version * 86400 + (time_t)chapter_id;
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    strftime(value, sizeof(value), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    snprintf(extra, sizeof(extra), "Last-Modified: %s\r\n", value);
+    sent = header_get(req, "if-modified-since:", &len);
+  }
+  if (sent && len == strlen(value) && memcmp(sent, value, len) == 0) {
+    atomic_fetch_add(&stat_not_modified, 1);
+    return send_head(fd, 304, "application/octet-stream", 0, extra);
+  }
+  if (chapter_id) manga_viewer(body, chapter_id);
+  else title_detail(body);
+  if (opt.vary_every) pb_varint(body, 15, version);  // not a Response field: parsers skip it
+  return send_head(fd, 200, "application/octet-stream", body->len, extra) && send_all(fd, body->data, body->len);
+}
+
+// S3 stand-in (see the top). Objects and open uploads live in fixed tables under s3_mu; keys are
+// "<bucket>/<key>" as they appear in the request path.
+typedef struct {
+  char *key;
+  buf data;
+} s3_object;
+
+typedef struct {
+  uint32_t id;
+  char *key;
+  uint32_t parts;  // highest part number received
+  buf part[MAX_S3_PARTS];
+  char etag[MAX_S3_PARTS][40];
+} s3_upload;
+
+static pthread_mutex_t s3_mu = PTHREAD_MUTEX_INITIALIZER;
+static s3_object s3_objects[MAX_S3_OBJECTS];
+static s3_upload *s3_uploads[MAX_S3_UPLOADS];
+static uint32_t s3_next_upload = 1;
+static uint32_t s3_completes;
+
+static atomic_uint_fast64_t stat_s3_created;
+static atomic_uint_fast64_t stat_s3_parts;
+static atomic_uint_fast64_t stat_s3_completed;
+static atomic_uint_fast64_t stat_s3_aborted;
+static atomic_uint_fast64_t stat_s3_puts;
+static atomic_uint_fast64_t stat_s3_bad_signatures;
+
+// Callers hold s3_mu.
+static s3_object *s3_object_find(const char *key) {
+  for (size_t i = 0; i < MAX_S3_OBJECTS; i++)
+    if (s3_objects[i].key && strcmp(s3_objects[i].key, key) == 0) return &s3_objects[i];
+  return NULL;
+}
+
+// Stores data as key, replacing what was there; takes data over. 0 when the table is full.
+static int s3_object_store(const char *key, buf *data) {
+  s3_object *o = s3_object_find(key);
+  for (size_t i = 0; !o && i < MAX_S3_OBJECTS; i++)
+    if (!s3_objects[i].key) o = &s3_objects[i];
+  if (!o) return 0;
+  if (!o->key) o->key = strdup(key);
+  if (!o->key) abort();
+  free(o->data.data);
+  o->data = *data;
+  memset(data, 0, sizeof(*data));
+  return 1;
+}
+
+static s3_upload **s3_upload_find(const char *key, uint32_t id) {
+  for (size_t i = 0; i < MAX_S3_UPLOADS; i++)
+    if (s3_uploads[i] && s3_uploads[i]->id == id && strcmp(s3_uploads[i]->key, key) == 0) return &s3_uploads[i];
+  return NULL;
+}
+
+static void s3_upload_free(s3_upload **slot) {
+  s3_upload *u = *slot;
+  for (uint32_t i = 0; i < u->parts; i++) free(u->part[i].data);
+  free(u->key);
+  free(u);
+  *slot = NULL;
+}
+
+// Entries in the end of central directory record of a ZIP, or -1.
+static long zip_entries(const buf *b) {
+  if (b->len < 22) return -1;
+  for (size_t i = b->len - 22;; i--) {
+    const uint8_t *p = b->data + i;
+    if (p[0] == 0x50 && p[1] == 0x4b && p[2] == 0x05 && p[3] == 0x06) return (long)(p[10] | p[11] << 8);
+    if (i == 0 || b->len - i > 22 + 65535) return -1;
+  }
+}
+
+// Copies header name's value into out; 0 when it is missing or too long.
+static int header_copy(const char *req, const char *name, char *out, size_t cap) {
+  size_t len = 0;
+  const char *v = header_get(req, name, &len);
+  if (!v || len >= cap) return 0;
+  memcpy(out, v, len);
+  out[len] = '\0';
+  return 1;
+}
+
+static int cmp_str(const void *a, const void *b) { return strcmp(*(const char *const *)a, *(const char *const *)b); }
+
+// query with its parameters sorted and every name given an '=', as SigV4 wants it.
+static void s3_canonical_query(const char *query, char *out, size_t cap) {
+  char tmp[1024];
+  char *params[32];
+  size_t n = 0;
+  snprintf(tmp, sizeof(tmp), "%s", query ? query : "");
+  char *save = NULL;
+  for (char *p = strtok_r(tmp, "&", &save); p && n < 32; p = strtok_r(NULL, "&", &save)) params[n++] = p;
+  qsort(params, n, sizeof(params[0]), cmp_str);
+  size_t off = 0;
+  out[0] = '\0';
+  for (size_t i = 0; i < n && off < cap; i++)
+    off += (size_t)snprintf(out + off, cap - off, "%s%s%s", i ? "&" : "", params[i], strchr(params[i], '=') ? "" : "=");
+}
+
+// Checks the request's SigV4 Authorization header (host, x-amz-content-sha256 and x-amz-date signed)
+// and that the payload hash matches the body.
+static int s3_signature_ok(const char *method, const char *req, const char *path, const char *query,
+                           const buf *in) {
+  char auth[512];
+  char host[256];
+  char date[32];
+  char hash[72];
+  if (!header_copy(req, "authorization:", auth, sizeof(auth)) || !header_copy(req, "host:", host, sizeof(host)) ||
+      !header_copy(req, "x-amz-date:", date, sizeof(date)) ||
+      !header_copy(req, "x-amz-content-sha256:", hash, sizeof(hash)))
+    return 0;
+  char body_hash[65];
+  cml_sha256_hex(in->data ? in->data : (const uint8_t *)"", in->len, body_hash);
+  if (strcmp(hash, body_hash) != 0) return 0;
+
+  static const char prefix[] = "AWS4-HMAC-SHA256 Credential=" MOCK_S3_ACCESS_KEY "/";
+  if (strncmp(auth, prefix, sizeof(prefix) - 1) != 0) return 0;
+  char scope[128];
+  char region[64];
+  char day[16];
+  const char *s = auth + sizeof(prefix) - 1;
+  size_t scope_len = strcspn(s, ",");
+  if (scope_len >= sizeof(scope)) return 0;
+  memcpy(scope, s, scope_len);
+  scope[scope_len] = '\0';
+  if (sscanf(scope, "%15[^/]/%63[^/]/s3/aws4_request", day, region) != 2) return 0;
+  if (!strstr(s, ", SignedHeaders=host;x-amz-content-sha256;x-amz-date, ")) return 0;
+  const char *sig = strstr(s, "Signature=");
+  if (!sig) return 0;
+  sig += 10;
+
+  char cquery[1024];
+  s3_canonical_query(query, cquery, sizeof(cquery));
+  char canonical[4096];
+  snprintf(canonical, sizeof(canonical),
+           "%s\n%s\n%s\nhost:%s\nx-amz-content-sha256:%s\nx-amz-date:%s\n\nhost;x-amz-content-sha256;x-amz-date\n%s",
+           method, path, cquery, host, hash, date, hash);
+  char canonical_hash[65];
+  cml_sha256_hex(canonical, strlen(canonical), canonical_hash);
+  char to_sign[256];
+  snprintf(to_sign, sizeof(to_sign), "AWS4-HMAC-SHA256\n%s\n%s\n%s", date, scope, canonical_hash);
+  uint8_t k[32];
+  static const char secret[] = "AWS4" MOCK_S3_SECRET_KEY;
+  cml_hmac_sha256(secret, sizeof(secret) - 1, day, strlen(day), k);
+  cml_hmac_sha256(k, 32, region, strlen(region), k);
+  cml_hmac_sha256(k, 32, "s3", 2, k);
+  cml_hmac_sha256(k, 32, "aws4_request", 12, k);
+  uint8_t mac[32];
+  cml_hmac_sha256(k, 32, to_sign, strlen(to_sign), mac);
+  char expect[65];
+  for (size_t i = 0; i < 32; i++) snprintf(expect + 2 * i, 3, "%02x", mac[i]);
+  return strlen(sig) == 64 && memcmp(sig, expect, 64) == 0;
+}
+
+static int s3_error(int fd, int code, const char *what, buf *body) {
+  body->len = 0;
+  char xml[192];
+  int n = snprintf(xml, sizeof(xml), "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<Error><Code>%s</Code></Error>",
+                   what);
+  put(body, xml, (size_t)n);
+  return respond(fd, code, "application/xml", body);
+}
+
+static int s3_xml(int fd, const char *xml, buf *body) {
+  body->len = 0;
+  put(body, xml, strlen(xml));
+  return respond(fd, 200, "application/xml", body);
+}
+
+// A part's ETag: quoted, like S3's, and derived from its bytes.
+static void s3_etag(const buf *b, char out[40]) {
+  char hex[65];
+  cml_sha256_hex(b->data ? b->data : (const uint8_t *)"", b->len, hex);
+  snprintf(out, 40, "\"%.32s\"", hex);
+}
+
+// Assembles u from the parts listed in a CompleteMultipartUpload body, which must name parts 1..n in
+// order with the ETags they were given. Callers hold s3_mu.
+static int s3_assemble(const s3_upload *u, const buf *in, buf *out) {
+  char *xml = strndup(in->data ? (const char *)in->data : "", in->len);
+  if (!xml) abort();
+  uint32_t n = 0;
+  int ok = 1;
+  for (const char *p = strstr(xml, "<Part>"); ok && p; p = strstr(p + 6, "<Part>")) {
+    unsigned number = 0;
+    const char *e = strstr(p, "<ETag>");
+    const char *z = e ? strstr(e, "</ETag>") : NULL;
+    size_t len = z ? (size_t)(z - e - 6) : 0;
+    ok = sscanf(p, "<Part><PartNumber>%u</PartNumber>", &number) == 1 && number == n + 1 && number <= u->parts && z &&
+         len == strlen(u->etag[n]) && memcmp(e + 6, u->etag[n], len) == 0;
+    if (ok) put(out, u->part[n].data, u->part[n].len);
+    n++;
+  }
+  free(xml);
+  return ok && n > 0 && n == u->parts;
+}
+
+static int serve_s3(int fd, const char *method, const char *req, const char *path, const char *query,
+                    const buf *in, buf *body) {
+  if (!s3_signature_ok(method, req, path, query, in)) {
+    atomic_fetch_add(&stat_s3_bad_signatures, 1);
+    return s3_error(fd, 403, "SignatureDoesNotMatch", body);
+  }
+  const char *key = path + 4;  // after "/s3/"
+  if (!strchr(key, '/')) return s3_error(fd, 400, "InvalidRequest", body);
+  bool create = query && (strcmp(query, "uploads") == 0 || strcmp(query, "uploads=") == 0);
+  uint32_t id = query_u32(query, "uploadId");
+  uint32_t part_no = query_u32(query, "partNumber");
+  char extra[96];
+  int ok = 0;
+  pthread_mutex_lock(&s3_mu);
+  s3_object *o = s3_object_find(key);
+  s3_upload **slot = id ? s3_upload_find(key, id) : NULL;
+  if (strcmp(method, "HEAD") == 0) {
+    ok = send_head(fd, o ? 200 : 404, "application/octet-stream", o ? o->data.len : 0, NULL);
+  } else if (strcmp(method, "GET") == 0) {
+    ok = o ? respond(fd, 200, "application/octet-stream", &o->data) : s3_error(fd, 404, "NoSuchKey", body);
+  } else if (strcmp(method, "POST") == 0 && create) {
+    size_t i = 0;
+    while (i < MAX_S3_UPLOADS && s3_uploads[i]) i++;
+    s3_upload *u = i < MAX_S3_UPLOADS ? (s3_upload *)calloc(1, sizeof(*u)) : NULL;
+    if (u && (u->key = strdup(key)) != NULL) {
+      u->id = s3_next_upload++;
+      s3_uploads[i] = u;
+      atomic_fetch_add(&stat_s3_created, 1);
+      char xml[128];
+      snprintf(xml, sizeof(xml),
+               "<InitiateMultipartUploadResult><UploadId>%u</UploadId></InitiateMultipartUploadResult>", u->id);
+      ok = s3_xml(fd, xml, body);
+    } else {
+      free(u);
+      ok = s3_error(fd, 503, "SlowDown", body);
+    }
+  } else if (strcmp(method, "PUT") == 0 && id) {
+    s3_upload *u = slot ? *slot : NULL;
+    if (!u) {
+      ok = s3_error(fd, 404, "NoSuchUpload", body);
+    } else if (part_no == 0 || part_no > MAX_S3_PARTS) {
+      ok = s3_error(fd, 400, "InvalidArgument", body);
+    } else {
+      buf *p = &u->part[part_no - 1];
+      p->len = 0;
+      put(p, in->data ? in->data : (const uint8_t *)"", in->len);
+      s3_etag(p, u->etag[part_no - 1]);
+      if (part_no > u->parts) u->parts = part_no;
+      atomic_fetch_add(&stat_s3_parts, 1);
+      snprintf(extra, sizeof(extra), "ETag: %s\r\n", u->etag[part_no - 1]);
+      ok = send_head(fd, 200, "text/plain", 0, extra);
+    }
+  } else if (strcmp(method, "PUT") == 0) {
+    buf data = {0};
+    put(&data, in->data ? in->data : (const uint8_t *)"", in->len);
+    char etag[40];
+    s3_etag(&data, etag);
+    if (s3_object_store(key, &data)) {
+      atomic_fetch_add(&stat_s3_puts, 1);
+      snprintf(extra, sizeof(extra), "ETag: %s\r\n", etag);
+      ok = send_head(fd, 200, "text/plain", 0, extra);
+    } else {
+      free(data.data);
+      ok = s3_error(fd, 507, "InsufficientStorage", body);
+    }
+  } else if (strcmp(method, "POST") == 0 && id) {
+    buf data = {0};
+    if (!slot) {
+      ok = s3_error(fd, 404, "NoSuchUpload", body);
+    } else if (++s3_completes == opt.s3_fail_complete) {
+      // S3 can fail a Complete after it has sent its 200; the upload stays open.
+      ok = s3_error(fd, 200, "InternalError", body);
+    } else if (!s3_assemble(*slot, in, &data)) {
+      ok = s3_error(fd, 400, "InvalidPart", body);
+    } else if (!s3_object_store(key, &data)) {
+      ok = s3_error(fd, 507, "InsufficientStorage", body);
+    } else {
+      s3_upload_free(slot);
+      atomic_fetch_add(&stat_s3_completed, 1);
+      ok = s3_xml(fd, "<CompleteMultipartUploadResult></CompleteMultipartUploadResult>", body);
+    }
+    free(data.data);
+  } else if (strcmp(method, "DELETE") == 0 && id) {
+    if (slot) {
+      s3_upload_free(slot);
+      atomic_fetch_add(&stat_s3_aborted, 1);
+      ok = send_head(fd, 204, "text/plain", 0, NULL);
+    } else {
+      ok = s3_error(fd, 404, "NoSuchUpload", body);
+    }
+  } else {
+    ok = s3_error(fd, 405, "MethodNotAllowed", body);
+  }
+  pthread_mutex_unlock(&s3_mu);
+  return ok;
+}
+
+// Counts of stored objects and open uploads.
+static void s3_counts(uint64_t *objects, uint64_t *uploads) {
+  *objects = 0;
+  *uploads = 0;
+  pthread_mutex_lock(&s3_mu);
+  for (size_t i = 0; i < MAX_S3_OBJECTS; i++) *objects += s3_objects[i].key != NULL;
+  for (size_t i = 0; i < MAX_S3_UPLOADS; i++) *uploads += s3_uploads[i] != NULL;
+  pthread_mutex_unlock(&s3_mu);
+}
+
+// /s3-objects: "<bytes> <zip entries> <key>" per stored object.
+static void s3_list(buf *body) {
+  pthread_mutex_lock(&s3_mu);
+  for (size_t i = 0; i < MAX_S3_OBJECTS; i++) {
+    if (!s3_objects[i].key) continue;
+    char line[2200];
+    int n = snprintf(line, sizeof(line), "%zu %ld %s\n", s3_objects[i].data.len, zip_entries(&s3_objects[i].data),
+                     s3_objects[i].key);
+    put(body, line, n > 0 && (size_t)n < sizeof(line) ? (size_t)n : 0);
+  }
+  pthread_mutex_unlock(&s3_mu);
+}
+
+// Answers one request, with its body in, for path (with its query); 0 when the connection has to close.
+static int handle(int fd, const char *method, const char *req, char *path, const buf *in, buf *body) {
+  atomic_fetch_add(&stat_requests, 1);
+  char *query = strchr(path, '?');
+  if (query) *query++ = '\0';
+  body->len = 0;
+  uint32_t chapter_id = 0;
+  uint32_t page = 0;
+  if (strncmp(path, "/s3/", 4) == 0) return serve_s3(fd, method, req, path, query, in, body);
+  if (strcmp(method, "GET") != 0) return respond(fd, 404, "text/plain", NULL);
+  if (strcmp(path, "/stats") == 0) {
+    uint64_t objects = 0;
+    uint64_t uploads = 0;
+    s3_counts(&objects, &uploads);
+    char json[768];
+    int n = snprintf(
+        json, sizeof(json),
+        "{\"requests\": %llu, \"metadata\": %llu, \"not_modified\": %llu, \"images\": %llu, "
+        "\"image_bytes\": %llu, \"title_bytes\": %llu, \"faults\": %llu, \"ranges\": %llu, \"s3_objects\": %llu, "
+        "\"s3_uploads\": %llu, \"s3_created\": %llu, \"s3_parts\": %llu, \"s3_completed\": %llu, "
+        "\"s3_aborted\": %llu, \"s3_puts\": %llu, \"s3_bad_signatures\": %llu}\n",
+        (unsigned long long)atomic_load(&stat_requests), (unsigned long long)atomic_load(&stat_metadata),
+        (unsigned long long)atomic_load(&stat_not_modified), (unsigned long long)atomic_load(&stat_images),
+        (unsigned long long)atomic_load(&stat_image_bytes), (unsigned long long)title_bytes(),
+        (unsigned long long)atomic_load(&stat_faults), (unsigned long long)atomic_load(&stat_ranges),
+        (unsigned long long)objects, (unsigned long long)uploads, (unsigned long long)atomic_load(&stat_s3_created),
+        (unsigned long long)atomic_load(&stat_s3_parts), (unsigned long long)atomic_load(&stat_s3_completed),
+        (unsigned long long)atomic_load(&stat_s3_aborted), (unsigned long long)atomic_load(&stat_s3_puts),
+        (unsigned long long)atomic_load(&stat_s3_bad_signatures));
+    put(body, json, (size_t)n);
+    return respond(fd, 200, "application/json", body);
+  }
+  if (strcmp(path, "/s3-objects") == 0) {
+    s3_list(body);
+    return respond(fd, 200, "text/plain", body);
+  }
+  if (strcmp(path, "/api/title_detailV3") == 0) return serve_metadata(fd, req, 0, body);
+  if (strcmp(path, "/api/manga_viewer") == 0) {
+    chapter_id = query_u32(query, "chapter_id");
+    if (chapter_id < FIRST_CHAPTER_ID || chapter_id >= FIRST_CHAPTER_ID + opt.chapters)
+      return respond(fd, 404, "text/plain", NULL);
+    return serve_metadata(fd, req, chapter_id, body);
+  }
+  if (sscanf(path, "/img/%u/%u.jpg", &chapter_id, &page) == 2 && chapter_id >= FIRST_CHAPTER_ID &&
+      chapter_id < FIRST_CHAPTER_ID + opt.chapters && page < opt.pages)
+    return serve_page(fd, req, chapter_id, page, body);
+  return respond(fd, 404, "text/plain", NULL);
+}
+
+// One keep-alive connection: requests are read up to the blank line, then their Content-Length
+// bytes of body, and answered in order.
+static void *conn_main(void *arg) {
+  int fd = (int)(intptr_t)arg;
+  char *req = (char *)malloc(REQ_MAX + 1);
+  buf body = {0};
+  buf in = {0};
+  size_t have = 0;
+  if (req) req[0] = '\0';
+  while (req) {
+    char *end = NULL;
+    while (!(end = strstr(req, "\r\n\r\n"))) {
+      if (have == REQ_MAX) goto done;
+      ssize_t r = recv(fd, req + have, REQ_MAX - have, 0);
+      if (r < 0 && errno == EINTR) continue;
+      if (r <= 0) goto done;
+      have += (size_t)r;
+      req[have] = '\0';
+    }
+    char method[8];
+    char path[2048];
+    if (sscanf(req, "%7s %2047s", method, path) != 2) goto done;
+    size_t len = 0;
+    const char *conn = header_get(req, "connection:", &len);
+    bool keep = !(conn && len >= 5 && strncasecmp(conn, "close", 5) == 0);
+    const char *cl = header_get(req, "content-length:", &len);
+    unsigned long long want = cl ? strtoull(cl, NULL, 10) : 0;
+    if (want > BODY_MAX) goto done;
+    end[2] = '\0';  // the headers end here for header_get
+    size_t used = (size_t)(end + 4 - req);
+    size_t take = have - used < want ? have - used : (size_t)want;
+    in.len = 0;
+    put(&in, req + used, take);
+    used += take;
+    while (in.len < want) {
+      if (in.cap < want) {
+        in.data = (uint8_t *)realloc(in.data, (size_t)want);
+        if (!in.data) abort();
+        in.cap = (size_t)want;
+      }
+      ssize_t r = recv(fd, in.data + in.len, (size_t)want - in.len, 0);
+      if (r < 0 && errno == EINTR) continue;
+      if (r <= 0) goto done;
+      in.len += (size_t)r;
+    }
+    bool ok = handle(fd, method, req, path, &in, &body);
+    memmove(req, req + used, have - used + 1);
+    have -= used;
+    if (!ok || !keep) break;
+  }
+done:
+  free(in.data);
+  free(body.data);
+  free(req);
+  close(fd);
+  return NULL;
+}
+
+static int parse_u32(const char *s, uint32_t *out) {
+  char *end = NULL;
+  unsigned long v = strtoul(s, &end, 10);
+  if (!end || end == s || *end || v > 0xffffffffUL) return 0;
+  *out = (uint32_t)v;
+  return 1;
+}
+
+// "<kind> [name=value]..." as documented at the top.
+static int parse_fault(const char *spec, fault *f) {
+  static const char *const kinds[] = {"reset", "truncate", "status", "delay", "stall", "pace"};
+  char tmp[256];
+  snprintf(tmp, sizeof(tmp), "%s", spec);
+  char *save = NULL;
+  char *tok = strtok_r(tmp, " ", &save);
+  size_t k = 0;
+  while (tok && k < sizeof(kinds) / sizeof(kinds[0]) && strcmp(tok, kinds[k]) != 0) k++;
+  if (!tok || k == sizeof(kinds) / sizeof(kinds[0])) return 0;
+  memset(f, 0, sizeof(*f));
+  f->kind = (fault_kind)k;
+  f->from = 1;
+  f->every = 1;
+  f->at = 50;
+  f->code = 503;
+  f->bps = 65536;
+  bool has_count = false;
+  while ((tok = strtok_r(NULL, " ", &save)) != NULL) {
+    char *eq = strchr(tok, '=');
+    uint32_t v = 0;
+    if (!eq || !parse_u32(eq + 1, &v)) return 0;
+    *eq = '\0';
+    if (strcmp(tok, "from") == 0 && v > 0) {
+      f->from = v;
+    } else if (strcmp(tok, "every") == 0 && v > 0) {
+      f->every = v;
+    } else if (strcmp(tok, "count") == 0) {
+      f->count = v;
+      has_count = true;
+    } else if (strcmp(tok, "at") == 0 && v <= 100) {
+      f->at = v;
+    } else if (strcmp(tok, "ms") == 0) {
+      f->ms = v;
+    } else if (strcmp(tok, "code") == 0 && v >= 100 && v <= 599) {
+      f->code = v;
+    } else if (strcmp(tok, "retry_after") == 0) {
+      f->retry_after = v;
+    } else if (strcmp(tok, "bps") == 0 && v > 0) {
+      f->bps = v;
+    } else {
+      return 0;
+    }
+  }
+  if (!has_count) f->count = f->every;
+  return 1;
+}
+
+int main(int argc, char **argv) {
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--fault") == 0 && i + 1 < argc) {
+      if (faults_len == MAX_FAULTS || !parse_fault(argv[++i], &faults[faults_len])) {
+        fprintf(stderr, "%s: invalid fault \"%s\"\n", argv[0], argv[i]);
+        return 2;
+      }
+      faults_len++;
+      continue;
+    }
+    uint32_t v = 0;
+    if (i + 1 >= argc || !parse_u32(argv[i + 1], &v)) {
+      fprintf(stderr,
+              "usage: %s [--port N] [--chapters N] [--pages N] [--page-size BYTES] [--latency-ms MS] "
+              "[--vary-every N] [--s3-fail-complete N] [--fault SPEC]...\n",
+              argv[0]);
+      return 2;
+    }
+    const char *a = argv[i++];
+    if (strcmp(a, "--port") == 0 && v <= 65535) opt.port = (uint16_t)v;
+    else if (strcmp(a, "--chapters") == 0 && v > 0) opt.chapters = v;
+    else if (strcmp(a, "--pages") == 0 && v > 0) opt.pages = v;
+    else if (strcmp(a, "--page-size") == 0 && v >= 16) opt.page_size = v;
+    else if (strcmp(a, "--latency-ms") == 0) opt.latency_ms = v;
+    else if (strcmp(a, "--vary-every") == 0) opt.vary_every = v;
+    else if (strcmp(a, "--s3-fail-complete") == 0) opt.s3_fail_complete = v;
+    else {
+      fprintf(stderr, "%s: invalid option %s\n", argv[0], a);
+      return 2;
+    }
+  }
+  for (size_t i = 0; i < sizeof(key); i++) sscanf(KEY_HEX + 2 * i, "%2hhx", &key[i]);
+  meta_seen = (atomic_uint_fast64_t *)calloc((size_t)opt.chapters + 1, sizeof(*meta_seen));
+  if (!meta_seen) return 1;
+
+  int ls = socket(AF_INET, SOCK_STREAM, 0);
+  int one = 1;
+  setsockopt(ls, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(opt.port)};
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t alen = sizeof(addr);
+  if (ls < 0 || bind(ls, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(ls, 128) != 0 ||
+      getsockname(ls, (struct sockaddr *)&addr, &alen) != 0) {
+    perror("cml_mock_server");
+    return 1;
+  }
+  opt.port = ntohs(addr.sin_port);
+  printf("port %u\n", opt.port);
+  fflush(stdout);
+
+  for (;;) {
+    int fd = accept(ls, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      perror("cml_mock_server: accept");
+      return 1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    pthread_t t;
+    if (pthread_create(&t, NULL, conn_main, (void *)(intptr_t)fd) != 0) {
+      close(fd);
+      continue;
+    }
+    pthread_detach(t);
+  }
+}
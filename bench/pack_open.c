@@ -0,0 +1,110 @@
+// Open-to-first-page latency: CBZ (libzip, central directory parse) vs. chapter pack (mmap).
+//
+//   make bench
+//   ./bin/cml_bench_pack "<chapter>.cbz" "<chapter>.cmlpack" [iterations]
+//
+// Both files should hold the same chapter, e.g. from `cml --cbz --pack`. Each iteration opens the
+// file, reads every byte of the first page and closes it again; the page cache is warm after the
+// first round, so this measures per-open CPU cost rather than disk latency.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <zip.h>
+
+#include "cml/cml.h"
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+// Sum of the page bytes, so neither reader can skip touching the data.
+static uint64_t checksum(const uint8_t *p, size_t n) {
+  uint64_t s = 0;
+  for (size_t i = 0; i < n; i++) s += p[i];
+  return s;
+}
+
+static int cbz_first_page(const char *path, uint64_t *sum) {
+  int err = 0;
+  zip_t *z = zip_open(path, ZIP_RDONLY, &err);
+  if (!z) return 0;
+  zip_stat_t zs;
+  int ok = 0;
+  if (zip_get_num_entries(z, 0) > 0 && zip_stat_index(z, 0, 0, &zs) == 0 && (zs.valid & ZIP_STAT_SIZE)) {
+    uint8_t *buf = (uint8_t *)malloc(zs.size ? (size_t)zs.size : 1);
+    zip_file_t *f = buf ? zip_fopen_index(z, 0, 0) : NULL;
+    if (f) {
+      ok = zip_fread(f, buf, zs.size) == (zip_int64_t)zs.size;
+      zip_fclose(f);
+      if (ok) *sum += checksum(buf, (size_t)zs.size);
+    }
+    free(buf);
+  }
+  zip_discard(z);
+  return ok;
+}
+
+static int pack_first_page(const char *path, uint64_t *sum) {
+  cml_pack *p = NULL;
+  if (cml_pack_open(path, &p) != CML_OK) return 0;
+  cml_pack_page page;
+  int ok = cml_pack_page_count(p) > 0 && cml_pack_page_get(p, 0, &page) == CML_OK;
+  if (ok) *sum += checksum(page.data, page.len);
+  cml_pack_close(p);
+  return ok;
+}
+
+static int run(const char *name, const char *path, int (*fn)(const char *, uint64_t *), size_t iters, int last) {
+  uint64_t *ns = (uint64_t *)malloc(iters * sizeof(uint64_t));
+  if (!ns) return 0;
+  uint64_t sum = 0;
+  for (size_t i = 0; i < iters; i++) {
+    uint64_t t0 = now_ns();
+    if (!fn(path, &sum)) {
+      fprintf(stderr, "cml_bench_pack: cannot read first page of %s\n", path);
+      free(ns);
+      return 0;
+    }
+    ns[i] = now_ns() - t0;
+  }
+  qsort(ns, iters, sizeof(uint64_t), cmp_u64);
+  printf("  \"%s\": {\"iterations\": %zu, \"p50_us\": %.2f, \"p90_us\": %.2f, \"min_us\": %.2f, \"checksum\": %llu}%s\n",
+         name, iters, (double)ns[iters / 2] / 1000.0, (double)ns[iters * 9 / 10] / 1000.0, (double)ns[0] / 1000.0,
+         (unsigned long long)sum, last ? "" : ",");
+  free(ns);
+  return 1;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 3 || argc > 4) {
+    fprintf(stderr, "usage: %s <chapter.cbz> <chapter.cmlpack> [iterations]\n", argv[0]);
+    return 2;
+  }
+  size_t iters = 1000;
+  if (argc == 4) {
+    long v = strtol(argv[3], NULL, 10);
+    if (v <= 0) {
+      fprintf(stderr, "cml_bench_pack: invalid iterations\n");
+      return 2;
+    }
+    iters = (size_t)v;
+  }
+
+  printf("{\n");
+  if (!run("cbz", argv[1], cbz_first_page, iters, 0)) return 1;
+  if (!run("pack", argv[2], pack_first_page, iters, 1)) return 1;
+  printf("}\n");
+  return 0;
+}
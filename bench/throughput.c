@@ -0,0 +1,136 @@
+// End-to-end throughput: cml_run against the local mock server, from the first request to files on
+// disk, for CBZ and RAW output.
+//
+//   make bench
+//   ./bin/cml_bench_throughput ./bin/cml_mock_server [--runs N] [--workers N] [--chapters N] [--pages N]
+//                              [--page-size BYTES] [--latency-ms MS]
+//
+// The server runs as a child process with the given title shape. Every run forks, so that its CPU
+// time and peak RSS are its own; it downloads the whole title into a fresh directory that is removed
+// afterwards. The run with the median wall time of each format is reported, as JSON on stdout:
+// pages/s and MB/s (10^6 bytes of encrypted page bodies, as counted by the server), user and system
+// CPU seconds, and peak RSS in KiB (the highest of the format's runs).
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <curl/curl.h>
+
+#include "harness.h"
+
+#define MAX_RUNS 99
+
+typedef struct {
+  uint32_t runs;
+  uint32_t workers;
+  // The title the server serves.
+  uint32_t chapters;
+  uint32_t pages;
+  uint32_t page_size;
+  uint32_t latency_ms;
+} options;
+
+typedef struct {
+  bench_run r;
+  uint64_t bytes;
+} run_sample;
+
+static pid_t server_start(const char *path, const options *o, unsigned *port) {
+  char v[4][16];
+  snprintf(v[0], sizeof(v[0]), "%u", o->chapters);
+  snprintf(v[1], sizeof(v[1]), "%u", o->pages);
+  snprintf(v[2], sizeof(v[2]), "%u", o->page_size);
+  snprintf(v[3], sizeof(v[3]), "%u", o->latency_ms);
+  const char *args[] = {"--chapters", v[0], "--pages", v[1], "--page-size", v[2], "--latency-ms", v[3], NULL};
+  return bench_server_start(path, args, port);
+}
+
+static int run_once(const char *base, const options *o, cml_output_format format, run_sample *out) {
+  memset(out, 0, sizeof(*out));
+  out->r.status = CML_ERR_INVALID;
+  char dir[] = "/tmp/cml-bench-XXXXXX";
+  if (!mkdtemp(dir)) return 0;
+  cml_config cfg = {.out_dir = dir, .output = format, .out_fd = -1, .fetch_workers = o->workers, .api_base = base};
+  uint64_t before = 0;
+  uint64_t after = 0;
+  int ok = bench_server_stat(base, "image_bytes", &before) && bench_run_title(&cfg, &out->r);
+  ok = ok && out->r.status == CML_OK && bench_server_stat(base, "image_bytes", &after);
+  out->bytes = after - before;
+  if (!bench_rm_rf(dir)) fprintf(stderr, "cml_bench_throughput: cannot remove %s\n", dir);
+  if (out->r.status != CML_OK)
+    fprintf(stderr, "cml_bench_throughput: run failed: %s\n", cml_status_string((cml_status)out->r.status));
+  return ok;
+}
+
+static int cmp_wall(const void *a, const void *b) {
+  uint64_t x = ((const run_sample *)a)->r.wall_ns;
+  uint64_t y = ((const run_sample *)b)->r.wall_ns;
+  return x < y ? -1 : x > y;
+}
+
+static int bench_format(const char *name, cml_output_format format, const char *base, const options *o, int last) {
+  run_sample samples[MAX_RUNS];
+  long peak = 0;
+  for (uint32_t i = 0; i < o->runs; i++) {
+    if (!run_once(base, o, format, &samples[i])) return 0;
+    if (samples[i].r.peak_rss_kb > peak) peak = samples[i].r.peak_rss_kb;
+  }
+  qsort(samples, o->runs, sizeof(samples[0]), cmp_wall);
+  const run_sample *m = &samples[o->runs / 2];
+  double wall_s = (double)m->r.wall_ns / 1e9;
+  uint64_t pages = m->r.stats.write.pages;
+  printf("  \"%s\": {\"pages\": %llu, \"bytes\": %llu, \"wall_s\": %.3f, \"pages_per_s\": %.1f, \"mb_per_s\": %.1f, "
+         "\"cpu_user_s\": %.3f, \"cpu_sys_s\": %.3f, \"peak_rss_kb\": %ld}%s\n",
+         name, (unsigned long long)pages, (unsigned long long)m->bytes, wall_s, (double)pages / wall_s,
+         (double)m->bytes / 1e6 / wall_s, m->r.user_s, m->r.sys_s, peak, last ? "" : ",");
+  return 1;
+}
+
+int main(int argc, char **argv) {
+  options o = {.runs = 3, .chapters = 10, .pages = 20, .page_size = 300000};
+  int bad = argc < 2;
+  for (int i = 2; i < argc && !bad; i += 2) {
+    uint32_t v = 0;
+    bad = i + 1 >= argc || !bench_parse_u32(argv[i + 1], &v);
+    if (bad) break;
+    const char *a = argv[i];
+    if (strcmp(a, "--runs") == 0 && v >= 1 && v <= MAX_RUNS) o.runs = v;
+    else if (strcmp(a, "--workers") == 0) o.workers = v;
+    else if (strcmp(a, "--chapters") == 0 && v > 0) o.chapters = v;
+    else if (strcmp(a, "--pages") == 0 && v > 0) o.pages = v;
+    else if (strcmp(a, "--page-size") == 0 && v >= 16) o.page_size = v;
+    else if (strcmp(a, "--latency-ms") == 0) o.latency_ms = v;
+    else bad = 1;
+  }
+  if (bad) {
+    fprintf(stderr,
+            "usage: %s <cml_mock_server> [--runs N] [--workers N] [--chapters N] [--pages N] [--page-size BYTES] "
+            "[--latency-ms MS]\n",
+            argv[0]);
+    return 2;
+  }
+
+  if (curl_global_init(CURL_GLOBAL_DEFAULT) != 0) return 1;
+  unsigned port = 0;
+  pid_t server = server_start(argv[1], &o, &port);
+  if (server < 0) {
+    fprintf(stderr, "cml_bench_throughput: cannot start %s\n", argv[1]);
+    return 1;
+  }
+  char base[64];
+  snprintf(base, sizeof(base), "http://127.0.0.1:%u", port);
+
+  printf("{\n  \"runs\": %u,\n  \"workers\": %u,\n", o.runs, o.workers);
+  printf("  \"title\": {\"chapters\": %u, \"pages\": %u, \"page_size\": %u, \"latency_ms\": %u},\n", o.chapters,
+         o.pages, o.page_size, o.latency_ms);
+  fflush(stdout);
+  int ok = bench_format("cbz", CML_OUTPUT_CBZ, base, &o, 0) && bench_format("raw", CML_OUTPUT_RAW, base, &o, 1);
+  printf("}\n");
+
+  bench_server_stop(server);
+  curl_global_cleanup();
+  return ok ? 0 : 1;
+}
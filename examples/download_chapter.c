@@ -19,6 +19,7 @@ int main(void) {
   cml_config cfg = {
       .out_dir = "cml_downloads",
       .output = CML_OUTPUT_CBZ,
+      .out_fd = -1,
       .quality = CML_QUALITY_SUPER_HIGH,
       .split = false,
       .min_chapter = 0,
@@ -27,6 +27,12 @@ typedef enum {
 typedef enum {
   CML_OUTPUT_CBZ = 0,
   CML_OUTPUT_RAW = 1,
+  CML_OUTPUT_TITLE_ARCHIVE = 2,  // one append-only <title>.zip per title
+  // POSIX tar streamed to out_fd; nothing is written to out_dir. Pages are streamed as they arrive, so
+  // a chapter is whole only if an empty <title>/<chapter>/.complete entry follows its pages.
+  CML_OUTPUT_TAR = 3,
+  CML_OUTPUT_PACK = 4,           // one indexed <chapter>.cmlpack per chapter (see cml_pack_open)
+  CML_OUTPUT_S3 = 5,             // CBZ uploaded to S3-compatible storage (cml_config.s3); nothing touches disk
 } cml_output_format;
 
 typedef enum {
@@ -56,13 +62,105 @@ typedef struct {
   uint32_t chapter_total;   // optional, 0 when unknown
   uint32_t done;
   uint32_t total;  // 0 when unknown
+  uint32_t concurrency;  // page downloads currently allowed in flight ("images" stage; 0 otherwise)
 } cml_progress_event;
 
 typedef void (*cml_progress_fn)(void *user, const cml_progress_event *ev);
 
+// Output sinks receive decrypted pages directly. The built-in outputs are sinks too; setting
+// cml_config.sink replaces them, and the library then does no filesystem I/O of its own.
 typedef struct {
-  const char *out_dir;  // directory; created as needed
+  uint32_t title_id;
+  const char *title_name;     // optional
+  const char *title_author;   // optional
+  uint32_t chapter_id;
+  const char *chapter_name;   // optional, e.g. "#012"
+  const char *chapter_title;  // optional
+  const char *title_dir;      // sanitized names used by the built-in outputs
+  const char *chapter_dir;
+} cml_sink_chapter;
+
+typedef struct {
+  const char *filename;  // e.g. "<chapter prefix> - p003 <suffix>.jpg"
+  bool is_range;         // double page spanning start..stop
+  uint32_t start;
+  uint32_t stop;
+  const uint8_t *data;  // NULL for page_exists
+  size_t len;
+  const char *stored_path;  // the page's object in cfg.store_dir, when a store is configured
+} cml_sink_page;
+
+// All pointers passed to callbacks are valid only during the call.
+typedef struct {
+  void *user;
+  // Called before any page of a chapter; *chapter_state is passed to the other chapter callbacks.
+  cml_status (*chapter_begin)(void *user, const cml_sink_chapter *ch, void **chapter_state);
+  // Optional: nonzero when the page is already stored, so it is not downloaded.
+  int (*page_exists)(void *user, void *chapter_state, const cml_sink_page *page);
+  cml_status (*page)(void *user, void *chapter_state, const cml_sink_page *page);
+  // Always called once chapter_begin succeeded; success is false when the chapter was aborted.
+  cml_status (*chapter_end)(void *user, void *chapter_state, bool success);
+  // Optional: nonzero when the whole chapter is already stored. Called before the chapter's viewer
+  // is fetched, so a yes avoids all requests for it.
+  int (*chapter_exists)(void *user, const cml_sink_chapter *ch);
+  // Optional: called when cml_run finishes.
+  cml_status (*run_end)(void *user);
+} cml_sink;
+
+// Object storage target for CML_OUTPUT_S3. Requests are path-style (<endpoint>/<bucket>/<key>) and
+// signed with AWS Signature Version 4. Objects are named <key_prefix><title>/<chapter>.cbz.
+typedef struct {
+  const char *endpoint;  // e.g. "https://s3.eu-central-1.amazonaws.com" or "http://127.0.0.1:9000"
+  const char *region;    // signing region, e.g. "us-east-1"
+  const char *bucket;
+  const char *access_key;
+  const char *secret_key;
+  const char *key_prefix;  // optional
+  size_t part_size;        // multipart part size in bytes; 0 means 8 MiB (minimum 5 MiB)
+} cml_s3_config;
+
+// Retry policy for every HTTP request. A failed attempt (transport error, 429 or 5xx) is retried
+// after a delay drawn uniformly from [0, min(max_delay, base_delay * 2^(attempt-1))] ("full
+// jitter"), or after the server's Retry-After when that is longer. Per host, a circuit breaker
+// opens after breaker_failures consecutive failures (429s excepted: those lower the host's request
+// rate instead, see max_requests_per_sec): requests to that host are refused without
+// being sent (each refusal uses up an attempt) until breaker_cooldown_ms has passed, then a single
+// request probes the host while the others wait, and its success closes the breaker again.
+typedef struct {
+  uint32_t max_attempts;         // 0 means 4
+  uint32_t base_delay_ms;        // 0 means 250
+  uint32_t max_delay_ms;         // 0 means 8000
+  bool no_jitter;                // wait the full exponential delay instead
+  bool ignore_retry_after;       // do not wait for a server's Retry-After
+  uint32_t breaker_failures;     // 0 means 5
+  uint32_t breaker_cooldown_ms;  // 0 means 10000
+} cml_retry_policy;
+
+typedef enum {
+  CML_TRANSPORT_LIVE = 0,    // requests go to the network
+  CML_TRANSPORT_RECORD = 1,  // requests go to the network and every final response is saved in dir
+  CML_TRANSPORT_REPLAY = 2,  // requests are answered from dir; nothing goes to the network
+} cml_transport_mode;
+
+// Where GET requests are answered (see README "Record and replay"). Uploads (CML_OUTPUT_S3) always
+// go to the network.
+typedef struct {
+  cml_transport_mode mode;
+  const char *dir;         // recordings; required for RECORD and REPLAY, created by RECORD
+  uint32_t latency_ms;     // REPLAY: wait before each response, as for a round trip
+  uint64_t bytes_per_sec;  // REPLAY: rate each response body is delivered at; 0 means at once
+} cml_transport_config;
+
+typedef struct {
+  const char *out_dir;  // directory; created as needed (unused for CML_OUTPUT_TAR)
   cml_output_format output;
+  // Optional: several outputs written from one download (each format at most once); when
+  // outputs_len > 0 this list is used instead of output.
+  const cml_output_format *outputs;
+  size_t outputs_len;
+  // Destination of CML_OUTPUT_TAR (e.g. STDOUT_FILENO or a pipe); set it explicitly, since 0 (stdin,
+  // and what a zero-initialized config holds) is rejected.
+  int out_fd;
   cml_quality quality;
   bool split;
 
@@ -76,6 +174,44 @@ typedef struct {
   cml_log_fn log_fn;
   cml_progress_fn progress_fn;
   void *user;
+
+  const cml_sink *sink;  // optional; replaces the built-in output when set (copied by cml_create)
+
+  // Optional content-addressed page store shared across runs and output directories. Pages are
+  // stored once by content; RAW output hardlinks into it, and pages it already holds for a chapter
+  // are not downloaded again.
+  const char *store_dir;
+
+  const cml_s3_config *s3;  // required for CML_OUTPUT_S3; strings must outlive the handle
+
+  // Page pipeline: fetch_workers threads download pages, one thread decrypts them and the thread
+  // calling cml_run writes them, in page order. How many downloads run at once adapts between 1 and
+  // fetch_workers (see README "Pipeline") unless fixed_concurrency is set. max_inflight_bytes bounds
+  // the memory held for pages (HTTP bodies, decrypted pages, pages an output keeps until the chapter
+  // ends, upload buffers) and metadata; no new page download starts while it is exhausted (one page
+  // is always allowed).
+  uint32_t fetch_workers;     // 0 means 8
+  bool fixed_concurrency;     // always allow fetch_workers downloads in flight
+  size_t max_inflight_bytes;  // 0 means 64 MiB
+
+  cml_retry_policy retry;  // all zero: the defaults above
+
+  // Per-host limits shared by every request (0 means unlimited). Whatever the limits, a 429 lowers
+  // the host's request rate below what it was sending, and the rate climbs back slowly after that.
+  uint32_t max_requests_per_sec;
+  uint64_t max_bytes_per_sec;  // response and upload bodies
+
+  // Hedged page downloads: a page still outstanding after this percentile of recent page download
+  // times is requested a second time and the first copy to complete is used (see README "Hedging").
+  // 0 disables hedging.
+  uint32_t hedge_percentile;     // e.g. 95
+  uint32_t hedge_max_extra_pct;  // bytes the losing copies may add, in percent of page bytes; 0 means 5
+
+  const char *api_base;  // optional; NULL means https://jumpg-webapi.tokyo-cdn.com
+  cml_transport_config transport;  // all zero: live
+
+  // Optional: each cml_run writes a Chrome trace-event JSON of its timing here (see README "Tracing").
+  const char *trace_path;
 } cml_config;
 
 typedef struct cml cml;
@@ -97,6 +233,168 @@ cml_status cml_run(cml *h);
 // Utilities
 const char *cml_status_string(cml_status st);
 
+// Page store counters for the last cml_run (all zero without cfg.store_dir).
+typedef struct {
+  uint64_t pages;          // pages passed through the store
+  uint64_t pages_deduped;  // of those, pages whose content was already stored
+  uint64_t pages_reused;   // of those, pages served from the store instead of downloaded
+  uint64_t bytes;          // bytes of all pages
+  uint64_t bytes_saved;    // bytes of deduplicated pages (not written again)
+} cml_store_stats;
+
+cml_status cml_get_store_stats(const cml *h, cml_store_stats *out);
+
+// One stage of the page pipeline (fetch, decrypt, write). A stage whose utilization is near 1 while
+// the queue in front of it stays deep is the bottleneck.
+typedef struct {
+  uint32_t threads;        // threads serving the stage
+  uint64_t pages;          // pages that went through the stage
+  uint64_t busy_ns;        // time spent working, summed over the stage's threads
+  double utilization;      // busy_ns / (wall_ns * threads)
+  double queue_depth_avg;  // pages waiting for the stage, sampled at every hand-off
+  uint32_t queue_depth_max;
+} cml_stage_stats;
+
+// HTTP retries and circuit breaker activity.
+typedef struct {
+  uint64_t requests;          // attempts sent
+  uint64_t retries;           // attempts that repeated an earlier failed one
+  uint64_t retry_after;       // delays taken from a server's Retry-After
+  uint64_t backoff_ns;        // total delay scheduled between attempts
+  uint64_t gave_up;           // requests that failed on their last attempt
+  uint64_t breaker_opened;    // times a host's breaker opened
+  uint64_t breaker_rejected;  // attempts refused while a host's breaker was open
+  uint64_t resumed;           // page retries that continued a cut-off body with a Range request
+  uint64_t resumed_bytes;     // bytes those retries did not download again
+} cml_retry_stats;
+
+// Rate limiting.
+typedef struct {
+  uint64_t throttled;             // times a request waited for its host's rate limit
+  uint64_t wait_ns;               // total delay scheduled for that
+  uint64_t cuts;                  // times a 429 lowered a host's request rate
+  double min_requests_per_sec;    // lowest rate a 429 cut to (0 without cuts)
+} cml_rate_stats;
+
+// Adaptive page download concurrency.
+typedef struct {
+  uint32_t window;        // downloads allowed in flight when the run ended
+  uint32_t window_min;
+  uint32_t window_max;
+  uint64_t increases;     // times the window grew by a whole download
+  uint64_t error_cuts;    // halvings after a 429, 5xx or transport error
+  uint64_t latency_cuts;  // halvings after the time to first byte rose
+  uint64_t waits;         // downloads that waited for a free slot
+} cml_concurrency_stats;
+
+// Transfers abandoned early by the adaptive timeouts.
+typedef struct {
+  uint64_t first_byte_timeouts;  // no response within the host's first-byte budget
+  uint64_t stalls;               // no bytes moved for 3 s
+  uint64_t slow_aborts;          // far slower than the host's usual transfer rate
+  uint64_t saved_ns;             // time first-byte timeouts and stalls saved over the former fixed 60 s timeout
+} cml_timeout_stats;
+
+// Hedged page downloads.
+typedef struct {
+  uint64_t hedges;        // second copies requested
+  uint64_t won;           // of those, copies that completed first
+  uint64_t declined;      // slow pages not hedged (extra bandwidth cap, window, rate limit or memory)
+  uint64_t wasted_bytes;  // bytes received by the copies that lost
+  uint64_t delay_ns;      // how long a page could be outstanding before it was hedged, at the end of the run
+} cml_hedge_stats;
+
+// Metadata requests (title details and manga viewers).
+typedef struct {
+  uint64_t requests;     // metadata responses received
+  uint64_t revalidated;  // of those, 304 answers to conditional requests, served from the kept result
+  uint64_t bytes_saved;  // body bytes the 304 answers did not download
+} cml_metadata_stats;
+
+// Latency histogram in microseconds with log-linear buckets, as in HdrHistogram: values below 16 us
+// have a bucket each, and every power of two above that is split into 16 buckets, so a value is
+// known to within 1/16 of itself. Values from 2^28 us (about 4.5 minutes) share the last bucket.
+#define CML_HIST_BUCKETS 400
+
+typedef struct {
+  uint64_t count;
+  uint64_t sum_us;
+  uint64_t min_us;
+  uint64_t max_us;
+  uint64_t buckets[CML_HIST_BUCKETS];
+} cml_histogram;
+
+// The value below which pct percent (0-100) of the recorded values fall, in microseconds: the upper
+// bound of the bucket it lands in, capped at max_us. 0 for an empty histogram.
+uint64_t cml_histogram_percentile(const cml_histogram *h, double pct);
+
+// HTTP attempts of one kind, timed by curl. dns, connect and tls are recorded for attempts that
+// opened a connection (tls only over https); ttfb and total for every attempt that got a response.
+// Replayed responses (cml_config.transport) count as requests with ttfb and total but no connection.
+typedef struct {
+  uint64_t requests;          // attempts sent; a hedged attempt counts once
+  uint64_t transport_errors;  // of those, attempts that got no complete response
+  uint64_t bytes_received;    // response body bytes
+  uint64_t bytes_sent;        // request body bytes
+  uint64_t connections;       // connections opened
+  uint64_t reused;            // attempts sent on a connection that was already open
+  cml_histogram dns;
+  cml_histogram connect;
+  cml_histogram tls;
+  cml_histogram ttfb;
+  cml_histogram total;
+} cml_http_class_stats;
+
+typedef struct {
+  cml_http_class_stats metadata;  // title details and manga viewers
+  cml_http_class_stats pages;     // page images
+  cml_http_class_stats uploads;   // CML_OUTPUT_S3 requests
+} cml_http_stats;
+
+// Time spent processing responses, summed over threads.
+typedef struct {
+  uint64_t decode_ns;   // decoding metadata responses
+  uint64_t decrypt_ns;  // decrypting pages
+  uint64_t export_ns;   // outputs: starting and finishing chapters, writing pages and ending the run
+} cml_work_stats;
+
+// Counters for the last cml_run.
+typedef struct {
+  uint64_t wall_ns;  // time spent in chapter pipelines
+  cml_stage_stats fetch;
+  cml_stage_stats decrypt;
+  cml_stage_stats write;
+  uint64_t inflight_bytes_peak;  // most memory held against max_inflight_bytes at once
+  uint64_t budget_stalls;        // page downloads that had to wait for memory to be released
+  cml_retry_stats retry;
+  cml_rate_stats rate;
+  cml_concurrency_stats concurrency;
+  cml_timeout_stats timeouts;
+  cml_hedge_stats hedge;
+  cml_metadata_stats metadata;
+  cml_http_stats http;
+  cml_work_stats work;
+} cml_stats;
+
+cml_status cml_get_stats(const cml *h, cml_stats *out);
+
+// Chapter packs (CML_OUTPUT_PACK) are read through a read-only mapping: opening checks the header
+// only, and page data points into the mapping (valid until cml_pack_close).
+typedef struct cml_pack cml_pack;
+
+typedef struct {
+  const char *filename;  // NUL-terminated
+  const uint8_t *data;
+  size_t len;
+  uint32_t start;
+  uint32_t stop;
+} cml_pack_page;
+
+cml_status cml_pack_open(const char *path, cml_pack **out);
+size_t cml_pack_page_count(const cml_pack *p);
+cml_status cml_pack_page_get(const cml_pack *p, size_t index, cml_pack_page *out);
+void cml_pack_close(cml_pack *p);
+
 #ifdef __cplusplus
 }  // extern "C"
 #endif
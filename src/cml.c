@@ -41,7 +41,9 @@ void cml_log(cml *h, cml_log_level level, const char *fmt, ...) {
   va_end(ap);
 
   cml_log_event ev = {.level = level, .message = buf};
+  pthread_mutex_lock(&h->log_mu);
   h->cfg.log_fn(h->cfg.user, &ev);
+  pthread_mutex_unlock(&h->log_mu);
 }
 
 void cml_progress(cml *h, const cml_progress_event *ev) {
@@ -63,9 +65,53 @@ static const char *quality_str(cml_quality q) {
   }
 }
 
+static const cml_sink *builtin_sink(cml_output_format output) {
+  switch (output) {
+    case CML_OUTPUT_CBZ:
+      return &cml_cbz_sink;
+    case CML_OUTPUT_RAW:
+      return &cml_raw_sink;
+    case CML_OUTPUT_TITLE_ARCHIVE:
+      return &cml_title_sink;
+    case CML_OUTPUT_TAR:
+      return &cml_tar_sink;
+    case CML_OUTPUT_PACK:
+      return &cml_pack_sink;
+    case CML_OUTPUT_S3:
+      return &cml_s3_sink;
+    default:
+      return NULL;
+  }
+}
+
+static int output_valid(const cml_config *cfg, cml_output_format output) {
+  if (!builtin_sink(output)) return 0;
+  // 0 is what a zero-initialized config holds; a tar stream to stdin is never what was meant.
+  if (output == CML_OUTPUT_TAR) return cfg->out_fd > 0;
+  if (output == CML_OUTPUT_S3) {
+    const cml_s3_config *s3 = cfg->s3;
+    return s3 && s3->endpoint && *s3->endpoint && s3->region && *s3->region && s3->bucket && *s3->bucket &&
+           s3->access_key && s3->secret_key && (s3->part_size == 0 || s3->part_size >= CML_S3_MIN_PART);
+  }
+  return cfg->out_dir && *cfg->out_dir;
+}
+
 static int cfg_valid(const cml_config *cfg) {
   if (!cfg) return 0;
-  if (!cfg->out_dir || !*cfg->out_dir) return 0;
+  if (cfg->store_dir && !*cfg->store_dir) return 0;
+  if (cfg->api_base && !*cfg->api_base) return 0;
+  if (cfg->trace_path && !*cfg->trace_path) return 0;
+  if (cfg->transport.mode > CML_TRANSPORT_REPLAY) return 0;
+  if (cfg->transport.mode != CML_TRANSPORT_LIVE && (!cfg->transport.dir || !*cfg->transport.dir)) return 0;
+  if (cfg->sink) return cfg->sink->chapter_begin && cfg->sink->page && cfg->sink->chapter_end;
+  if (cfg->outputs_len == 0) return output_valid(cfg, cfg->output);
+  if (!cfg->outputs || cfg->outputs_len > CML_MAX_SINKS) return 0;
+  for (size_t i = 0; i < cfg->outputs_len; i++) {
+    if (!output_valid(cfg, cfg->outputs[i])) return 0;
+    // Built-in sinks keep per-format state on the handle, so each may appear only once.
+    for (size_t j = 0; j < i; j++)
+      if (cfg->outputs[j] == cfg->outputs[i]) return 0;
+  }
   return 1;
 }
 
@@ -81,10 +127,73 @@ cml *cml_create(const cml_config *cfg) {
   cml *h = (cml *)calloc(1, sizeof(*h));
   if (!h) return NULL;
   h->cfg = *cfg;
+  if (cfg->sink) {
+    h->sinks[0] = *cfg->sink;
+    h->sinks_len = 1;
+  } else {
+    size_t n = cfg->outputs_len ? cfg->outputs_len : 1;
+    for (size_t i = 0; i < n; i++) {
+      h->outputs[i] = cfg->outputs_len ? cfg->outputs[i] : cfg->output;
+      h->sinks[i] = *builtin_sink(h->outputs[i]);
+      h->sinks[i].user = h;
+    }
+    h->sinks_len = n;
+  }
+  // Point at the handle's copy so the caller's array need not outlive cml_create().
+  h->cfg.outputs = cfg->outputs_len ? h->outputs : NULL;
 
+  if (pthread_mutex_init(&h->log_mu, NULL) != 0) {
+    free(h);
+    return NULL;
+  }
+  if (cml_bufpool_init(h) != CML_OK) {
+    pthread_mutex_destroy(&h->log_mu);
+    free(h);
+    return NULL;
+  }
+  if (cml_retry_init(h) != CML_OK) {
+    cml_bufpool_free(h);
+    pthread_mutex_destroy(&h->log_mu);
+    free(h);
+    return NULL;
+  }
+  if (cml_rate_init(h) != CML_OK) {
+    cml_retry_free(h);
+    cml_bufpool_free(h);
+    pthread_mutex_destroy(&h->log_mu);
+    free(h);
+    return NULL;
+  }
+  if (cml_window_init(h) != CML_OK) {
+    cml_rate_free(h);
+    cml_retry_free(h);
+    cml_bufpool_free(h);
+    pthread_mutex_destroy(&h->log_mu);
+    free(h);
+    return NULL;
+  }
+  if (cml_timeout_init(h) != CML_OK) {
+    cml_window_free(h);
+    cml_rate_free(h);
+    cml_retry_free(h);
+    cml_bufpool_free(h);
+    pthread_mutex_destroy(&h->log_mu);
+    free(h);
+    return NULL;
+  }
+  if (cml_hedge_init(h) != CML_OK) {
+    cml_timeout_free(h);
+    cml_window_free(h);
+    cml_rate_free(h);
+    cml_retry_free(h);
+    cml_bufpool_free(h);
+    pthread_mutex_destroy(&h->log_mu);
+    free(h);
+    return NULL;
+  }
   h->curl = curl_easy_init();
   if (!h->curl) {
-    free(h);
+    cml_destroy(h);
     return NULL;
   }
 
@@ -92,9 +201,13 @@ cml *cml_create(const cml_config *cfg) {
     cml_destroy(h);
     return NULL;
   }
+  if (cml_transport_init(h) != CML_OK) {
+    cml_destroy(h);
+    return NULL;
+  }
 
-  cml_log(h, CML_LOG_DEBUG, "quality=%s split=%d output=%d", quality_str(h->cfg.quality), (int)h->cfg.split,
-          (int)h->cfg.output);
+  cml_log(h, CML_LOG_DEBUG, "quality=%s split=%d output=%d outputs=%zu", quality_str(h->cfg.quality),
+          (int)h->cfg.split, (int)h->cfg.output, h->sinks_len);
   return h;
 }
 
@@ -103,6 +216,17 @@ void cml_destroy(cml *h) {
   if (h->curl) curl_easy_cleanup(h->curl);
   cml_u32_free(&h->chapter_ids);
   cml_u32_free(&h->title_ids);
+  cml_export_raw_reset_index(h);
+  cml_export_title_close(h);
+  cml_strset_free(&h->store_dirs);
+  cml_api_cache_free(h);
+  cml_bufpool_free(h);
+  cml_retry_free(h);
+  cml_rate_free(h);
+  cml_window_free(h);
+  cml_timeout_free(h);
+  cml_hedge_free(h);
+  pthread_mutex_destroy(&h->log_mu);
   free(h);
 }
 
@@ -131,6 +255,10 @@ cml_status cml_run(cml *h) {
   if (h->chapter_ids.len == 0 && h->title_ids.len == 0) return CML_ERR_INVALID;
   if (cml_u32_sort_dedupe(&h->chapter_ids) != 0) return CML_ERR_OOM;
   if (cml_u32_sort_dedupe(&h->title_ids) != 0) return CML_ERR_OOM;
-  return cml_loader_run(h);
+  cml_status st = cml_trace_start(h);
+  if (st != CML_OK) return st;
+  st = cml_loader_run(h);
+  cml_status trace_st = cml_trace_finish(h);
+  return st != CML_OK ? st : trace_st;
 }
 
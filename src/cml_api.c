@@ -6,6 +6,15 @@
 
 static const char *API_BASE = "https://jumpg-webapi.tokyo-cdn.com";
 
+// cfg.api_base when set, without trailing slashes.
+static const char *api_base(const cml *h, size_t *len) {
+  const char *base = h->cfg.api_base ? h->cfg.api_base : API_BASE;
+  size_t n = strlen(base);
+  while (n > 0 && base[n - 1] == '/') n--;
+  *len = n;
+  return base;
+}
+
 static const char *quality_param(cml_quality q) {
   switch (q) {
     case CML_QUALITY_SUPER_HIGH:
@@ -19,12 +28,119 @@ static const char *quality_param(cml_quality q) {
   }
 }
 
-static cml_status api_get(cml *h, const char *path_and_query, cml_bytes *out) {
-  size_t n = strlen(API_BASE) + strlen(path_and_query) + 1;
+// Metadata responses that carry a validator are kept with their parsed result. The next request for
+// the same URL (endpoint, id and parameters) sends If-None-Match / If-Modified-Since, and a 304 is
+// answered with a copy of the kept result: no body is downloaded and nothing is decoded.
+
+static void entry_clear(cml_api_entry *e) {
+  free(e->url);
+  free(e->etag);
+  free(e->last_modified);
+  cml_proto_free_manga_viewer(&e->viewer);
+  cml_proto_free_title_detail(&e->detail);
+  memset(e, 0, sizeof(*e));
+}
+
+static cml_api_entry *entry_find(cml_api_cache *c, const char *url) {
+  for (size_t i = 0; i < CML_API_CACHE_MAX; i++)
+    if (c->items[i].url && strcmp(c->items[i].url, url) == 0) return &c->items[i];
+  return NULL;
+}
+
+// A free slot, or the least recently used entry, cleared.
+static cml_api_entry *entry_slot(cml_api_cache *c) {
+  cml_api_entry *victim = &c->items[0];
+  for (size_t i = 0; i < CML_API_CACHE_MAX; i++) {
+    if (!c->items[i].url) return &c->items[i];
+    if (c->items[i].used < victim->used) victim = &c->items[i];
+  }
+  entry_clear(victim);
+  return victim;
+}
+
+static cml_status result_copy(bool is_viewer, const cml_api_entry *e, void *out) {
+  return is_viewer ? cml_proto_copy_manga_viewer(&e->viewer, (cml_manga_viewer *)out)
+                   : cml_proto_copy_title_detail(&e->detail, (cml_title_detail *)out);
+}
+
+// Keeps a copy of a freshly parsed result under its validators; a response without any replaces
+// what was kept for the URL with nothing.
+static void remember(cml *h, const char *url, const cml_http_resp *resp, bool is_viewer, const void *parsed,
+                     cml_api_entry *old) {
+  if (old) entry_clear(old);
+  if (!resp->etag && !resp->last_modified) return;
+  cml_api_entry *e = entry_slot(&h->api);
+  e->is_viewer = is_viewer;
+  cml_status st = is_viewer ? cml_proto_copy_manga_viewer((const cml_manga_viewer *)parsed, &e->viewer)
+                            : cml_proto_copy_title_detail((const cml_title_detail *)parsed, &e->detail);
+  e->url = strdup(url);
+  e->etag = resp->etag ? strdup(resp->etag) : NULL;
+  e->last_modified = resp->last_modified ? strdup(resp->last_modified) : NULL;
+  if (st != CML_OK || !e->url || (resp->etag && !e->etag) || (resp->last_modified && !e->last_modified)) {
+    entry_clear(e);
+    return;
+  }
+  e->used = ++h->api.clock;
+}
+
+// Fetches and parses one metadata object into out (a cml_manga_viewer or cml_title_detail, by
+// is_viewer). Its body size is charged to the memory budget and recorded in out->mem.
+static cml_status api_get(cml *h, const char *path_and_query, bool is_viewer, void *out) {
+  size_t base_len = 0;
+  const char *base = api_base(h, &base_len);
+  size_t n = base_len + strlen(path_and_query) + 1;
   char *url = (char *)malloc(n);
   if (!url) return CML_ERR_OOM;
-  snprintf(url, n, "%s%s", API_BASE, path_and_query);
-  cml_status st = cml_http_get(h, url, out);
+  snprintf(url, n, "%.*s%s", (int)base_len, base, path_and_query);
+
+  cml_api_entry *e = entry_find(&h->api, url);
+  if (e && e->is_viewer != is_viewer) {
+    entry_clear(e);
+    e = NULL;
+  }
+  struct curl_slist *headers = NULL;
+  char line[320];
+  if (e && e->etag) {
+    snprintf(line, sizeof(line), "If-None-Match: %s", e->etag);
+    headers = curl_slist_append(headers, line);
+  }
+  if (e && e->last_modified) {
+    snprintf(line, sizeof(line), "If-Modified-Since: %s", e->last_modified);
+    struct curl_slist *more = curl_slist_append(headers, line);
+    if (more) headers = more;
+  }
+  cml_http_req req = {.method = "GET", .url = url, .headers = headers, .conditional = headers != NULL};
+  cml_http_resp resp = {0};
+  cml_status st = cml_http_send(h, &req, &resp);
+  curl_slist_free_all(headers);
+
+  if (st == CML_OK && resp.code == 304 && req.conditional) {
+    st = result_copy(is_viewer, e, out);
+    if (st == CML_OK) {
+      size_t mem = is_viewer ? e->viewer.mem : e->detail.mem;
+      cml_mem_charge(h, mem);
+      e->used = ++h->api.clock;
+      h->api.stats.requests++;
+      h->api.stats.revalidated++;
+      h->api.stats.bytes_saved += mem;
+    }
+  } else if (st == CML_OK) {
+    // The body is charged while it is parsed; the parsed message keeps a charge of the same size.
+    cml_mem_charge(h, resp.body.len);
+    uint64_t t0 = cml_now_ns();
+    st = is_viewer ? cml_proto_parse_manga_viewer(resp.body.data, resp.body.len, (cml_manga_viewer *)out)
+                   : cml_proto_parse_title_detail(resp.body.data, resp.body.len, (cml_title_detail *)out);
+    h->work.decode_ns += cml_now_ns() - t0;
+    if (st == CML_OK) {
+      if (is_viewer) ((cml_manga_viewer *)out)->mem = resp.body.len;
+      else ((cml_title_detail *)out)->mem = resp.body.len;
+      h->api.stats.requests++;
+      remember(h, url, &resp, is_viewer, out, e);
+    } else {
+      cml_mem_release(h, resp.body.len);
+    }
+  }
+  cml_http_resp_free(&resp);
   free(url);
   return st;
 }
@@ -34,12 +150,9 @@ cml_status cml_api_get_manga_viewer(cml *h, uint32_t chapter_id, cml_manga_viewe
   char query[256];
   snprintf(query, sizeof(query), "/api/manga_viewer?chapter_id=%u&split=%s&img_quality=%s", chapter_id,
            h->cfg.split ? "yes" : "no", quality_param(h->cfg.quality));
-
-  cml_bytes resp = {0};
-  cml_status st = api_get(h, query, &resp);
-  if (st != CML_OK) return st;
-  st = cml_proto_parse_manga_viewer(resp.data, resp.len, out);
-  cml_bytes_free(&resp);
+  uint64_t t0 = cml_trace_begin(h);
+  cml_status st = api_get(h, query, true, out);
+  cml_trace_end(h, t0, "api", "cml_api_get_manga_viewer", "chapter_id", chapter_id);
   return st;
 }
 
@@ -47,11 +160,12 @@ cml_status cml_api_get_title_detail(cml *h, uint32_t title_id, cml_title_detail
   if (!h || !out || title_id == 0) return CML_ERR_INVALID;
   char query[128];
   snprintf(query, sizeof(query), "/api/title_detailV3?title_id=%u", title_id);
-  cml_bytes resp = {0};
-  cml_status st = api_get(h, query, &resp);
-  if (st != CML_OK) return st;
-  st = cml_proto_parse_title_detail(resp.data, resp.len, out);
-  cml_bytes_free(&resp);
+  uint64_t t0 = cml_trace_begin(h);
+  cml_status st = api_get(h, query, false, out);
+  cml_trace_end(h, t0, "api", "cml_api_get_title_detail", "title_id", title_id);
   return st;
 }
 
+void cml_api_cache_free(cml *h) {
+  for (size_t i = 0; i < CML_API_CACHE_MAX; i++) entry_clear(&h->api.items[i]);
+}
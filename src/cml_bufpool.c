@@ -0,0 +1,300 @@
+#include "cml_internal.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Page buffers are sized from Content-Length when the server sends it, otherwise from a running
+// estimate of the page size, so receiving a page normally costs one allocation (none once the pool
+// is warm) and no regrowth copies. Fetch workers allocate and the writer releases, so the free list
+// and counters sit behind a mutex; the lock is never held across malloc or realloc.
+//
+// The pool also keeps the memory budget: every page buffer it hands out or keeps is charged while it
+// exists, and so is anything a sink or the loader charges explicitly. Downloads are admitted on an
+// estimate of their size; a page body larger than that waits for room when its buffer is allocated
+// (cml_buf_get_page), or gives way when none comes, so the estimate being wrong does not push memory
+// past the budget.
+
+#define BUF_ROUND 4096
+#define BUF_DEFAULT (256u * 1024)
+// Longest a page body waits for room. It runs out when the writer's next page sits in the fetch queue
+// (after a retry) behind downloads that all wait; they then give way to it instead of overshooting.
+#define ROOM_WAIT_NS (500ull * 1000000ull)
+
+static size_t round_up(size_t n) { return (n + BUF_ROUND - 1) & ~(size_t)(BUF_ROUND - 1); }
+
+static void charge_locked(cml_bufpool *p, size_t n) {
+  p->held += n;
+  if (p->held > p->held_peak) p->held_peak = p->held;
+}
+
+static void release_locked(cml_bufpool *p, size_t n) {
+  p->held = p->held > n ? p->held - n : 0;
+  pthread_cond_broadcast(&p->room);
+}
+
+static size_t estimate_locked(const cml_bufpool *p) {
+  // A new buffer gets the typical page plus headroom; a recycled one may be as large as any page.
+  size_t n = p->typical ? p->typical + p->typical / 4 : 0;
+  if (p->largest > n) n = p->largest;
+  return n ? round_up(n) : 0;
+}
+
+// Whether a body of cap bytes for page fits now. Other pages leave room for the writer's next one,
+// which never waits, unless the budget cannot hold two pages at all.
+static bool fits_locked(const cml_bufpool *p, size_t page, size_t cap) {
+  if (p->next_page == SIZE_MAX || page == p->next_page) return true;
+  size_t next = estimate_locked(p);
+  if (cap + next > p->limit) next = 0;
+  return p->held + cap + next <= p->limit;
+}
+
+// page: the position of the page whose body this is, or NULL when the buffer never waits for room.
+static cml_status buf_get(cml *h, size_t want, const size_t *page, cml_bytes *out) {
+  if (!h || !out) return CML_ERR_INVALID;
+  memset(out, 0, sizeof(*out));
+  cml_bufpool *p = &h->bufs;
+  pthread_mutex_lock(&p->mu);
+  if (want == 0) want = p->typical ? p->typical : BUF_DEFAULT;
+
+  size_t cap = 0;
+  uint64_t deadline = page ? cml_now_ns() + ROOM_WAIT_NS : 0;
+  for (;;) {
+    // Best fit, so small pages do not pin the largest buffers.
+    size_t best = p->free_len;
+    for (size_t i = 0; i < p->free_len; i++) {
+      if (p->free[i].cap < want) continue;
+      if (best == p->free_len || p->free[i].cap < p->free[best].cap) best = i;
+    }
+    if (best < p->free_len) {
+      *out = p->free[best];
+      p->free_bytes -= out->cap;
+      p->free[best] = p->free[--p->free_len];
+      out->len = 0;
+      p->stats.reused++;
+      pthread_mutex_unlock(&p->mu);
+      return CML_OK;
+    }
+
+    // Leave headroom over the typical page so the buffer fits most later pages too.
+    cap = want;
+    if (cap < p->typical + p->typical / 4) cap = p->typical + p->typical / 4;
+    cap = round_up(cap);
+    if (p->free_len && p->held + cap > p->limit) {
+      // None of the idle buffers is large enough: they make room instead.
+      uint8_t *drop[CML_BUF_POOL_SLOTS];
+      size_t dropped = 0;
+      while (p->free_len && p->held + cap > p->limit) {
+        cml_bytes b = p->free[--p->free_len];
+        p->free_bytes -= b.cap;
+        p->held = p->held > b.cap ? p->held - b.cap : 0;
+        drop[dropped++] = b.data;
+      }
+      pthread_mutex_unlock(&p->mu);
+      for (size_t i = 0; i < dropped; i++) free(drop[i]);
+      pthread_mutex_lock(&p->mu);
+      continue;
+    }
+    if (!page || fits_locked(p, *page, cap)) break;
+    uint64_t now = cml_now_ns();
+    if (now >= deadline) {
+      pthread_mutex_unlock(&p->mu);
+      return CML_OK;
+    }
+    struct timespec until;
+    clock_gettime(CLOCK_MONOTONIC, &until);
+    uint64_t ns = (uint64_t)until.tv_nsec + (deadline - now);
+    until.tv_sec += (time_t)(ns / 1000000000ull);
+    until.tv_nsec = (long)(ns % 1000000000ull);
+    pthread_cond_timedwait(&p->room, &p->mu, &until);
+  }
+  p->stats.allocs++;
+  charge_locked(p, cap);
+  pthread_mutex_unlock(&p->mu);
+  out->data = (uint8_t *)malloc(cap);
+  if (!out->data) {
+    cml_mem_release(h, cap);
+    return CML_ERR_OOM;
+  }
+  out->cap = cap;
+  return CML_OK;
+}
+
+cml_status cml_buf_get(cml *h, size_t want, cml_bytes *out) { return buf_get(h, want, NULL, out); }
+
+cml_status cml_buf_get_page(cml *h, size_t want, size_t page, cml_bytes *out) { return buf_get(h, want, &page, out); }
+
+cml_status cml_buf_grow(cml *h, cml_bytes *b, size_t need) {
+  if (!h || !b) return CML_ERR_INVALID;
+  if (need <= b->cap) return CML_OK;
+  size_t next = b->cap * 2;
+  if (next < need) next = need;
+  next = round_up(next);
+  uint8_t *p = (uint8_t *)realloc(b->data, next);
+  if (!p) return CML_ERR_OOM;
+  pthread_mutex_lock(&h->bufs.mu);
+  charge_locked(&h->bufs, next - b->cap);
+  b->data = p;
+  b->cap = next;
+  h->bufs.stats.allocs++;
+  h->bufs.stats.bytes_copied += b->len;
+  pthread_mutex_unlock(&h->bufs.mu);
+  return CML_OK;
+}
+
+void cml_buf_put(cml *h, cml_bytes *b) {
+  if (!b || !b->data) return;
+  cml_bufpool *p = h ? &h->bufs : NULL;
+  bool kept = false;
+  if (p) {
+    pthread_mutex_lock(&p->mu);
+    // A pooled buffer stays charged: it is still memory, and cml_mem_reserve frees it when needed.
+    // Nothing is kept while the budget is overdrawn.
+    if (b->cap && p->free_len < CML_BUF_POOL_SLOTS && p->free_bytes + b->cap <= CML_BUF_POOL_MAX_BYTES &&
+        p->held + p->reserved <= p->limit) {
+      p->free[p->free_len++] = (cml_bytes){.data = b->data, .len = 0, .cap = b->cap};
+      p->free_bytes += b->cap;
+      kept = true;
+      pthread_cond_broadcast(&p->room);
+    } else {
+      release_locked(p, b->cap);
+    }
+    pthread_mutex_unlock(&p->mu);
+  }
+  if (!kept) free(b->data);
+  memset(b, 0, sizeof(*b));
+}
+
+void cml_buf_note_copy(cml *h, size_t n) {
+  if (!h) return;
+  pthread_mutex_lock(&h->bufs.mu);
+  h->bufs.stats.bytes_copied += n;
+  pthread_mutex_unlock(&h->bufs.mu);
+}
+
+void cml_buf_note_page(cml *h, size_t len) {
+  if (!h) return;
+  cml_bufpool *p = &h->bufs;
+  pthread_mutex_lock(&p->mu);
+  p->typical = p->typical ? (p->typical * 7 + len) / 8 : len;
+  if (len > p->largest) p->largest = len;
+  p->stats.pages++;
+  p->stats.bytes += len;
+  pthread_mutex_unlock(&p->mu);
+}
+
+size_t cml_buf_estimate(cml *h) {
+  pthread_mutex_lock(&h->bufs.mu);
+  size_t n = estimate_locked(&h->bufs);
+  pthread_mutex_unlock(&h->bufs.mu);
+  return n;
+}
+
+int cml_page_take(cml *h, const cml_sink_page *page, cml_bytes *out) {
+  if (!h || !page || !out) return 0;
+  cml_bytes *o = h->bufs.offered;
+  if (!o || !o->data || o->data != page->data) return 0;
+  *out = *o;
+  memset(o, 0, sizeof(*o));
+  return 1;
+}
+
+size_t cml_mem_limit(cml *h) { return h->bufs.limit; }
+
+void cml_mem_charge(cml *h, size_t n) {
+  if (!h || n == 0) return;
+  pthread_mutex_lock(&h->bufs.mu);
+  charge_locked(&h->bufs, n);
+  pthread_mutex_unlock(&h->bufs.mu);
+}
+
+void cml_mem_release(cml *h, size_t n) {
+  if (!h || n == 0) return;
+  pthread_mutex_lock(&h->bufs.mu);
+  release_locked(&h->bufs, n);
+  pthread_mutex_unlock(&h->bufs.mu);
+}
+
+bool cml_mem_reserve(cml *h, size_t n, bool force) {
+  cml_bufpool *p = &h->bufs;
+  uint8_t *drop[CML_BUF_POOL_SLOTS];
+  size_t dropped = 0;
+  pthread_mutex_lock(&p->mu);
+  // Pending downloads take idle buffers first, so those count once: the memory needed is what is in
+  // use plus the larger of the idle buffers and the downloads. Idle buffers beyond that are freed.
+  size_t in_use = p->held - p->free_bytes;
+  size_t want = p->reserved + n;
+  bool fits = in_use + (p->free_bytes > want ? p->free_bytes : want) <= p->limit;
+  while (!fits && p->free_bytes > want) {
+    cml_bytes b = p->free[--p->free_len];
+    p->free_bytes -= b.cap;
+    release_locked(p, b.cap);
+    drop[dropped++] = b.data;
+    fits = in_use + (p->free_bytes > want ? p->free_bytes : want) <= p->limit;
+  }
+  if (fits || force) p->reserved += n;
+  pthread_mutex_unlock(&p->mu);
+  for (size_t i = 0; i < dropped; i++) free(drop[i]);
+  return fits || force;
+}
+
+bool cml_mem_tight(cml *h) {
+  cml_bufpool *p = &h->bufs;
+  pthread_mutex_lock(&p->mu);
+  bool tight = p->held - p->free_bytes + estimate_locked(p) > p->limit;
+  pthread_mutex_unlock(&p->mu);
+  return tight;
+}
+
+void cml_mem_note_stall(cml *h) {
+  pthread_mutex_lock(&h->bufs.mu);
+  h->bufs.stalls++;
+  pthread_mutex_unlock(&h->bufs.mu);
+}
+
+void cml_mem_next_page(cml *h, size_t page) {
+  pthread_mutex_lock(&h->bufs.mu);
+  h->bufs.next_page = page;
+  pthread_cond_broadcast(&h->bufs.room);
+  pthread_mutex_unlock(&h->bufs.mu);
+}
+
+void cml_mem_unreserve(cml *h, size_t n) {
+  pthread_mutex_lock(&h->bufs.mu);
+  h->bufs.reserved = h->bufs.reserved > n ? h->bufs.reserved - n : 0;
+  pthread_mutex_unlock(&h->bufs.mu);
+}
+
+void cml_mem_reset(cml *h) {
+  pthread_mutex_lock(&h->bufs.mu);
+  h->bufs.held_peak = h->bufs.held;
+  h->bufs.stalls = 0;
+  pthread_mutex_unlock(&h->bufs.mu);
+}
+
+cml_status cml_bufpool_init(cml *h) {
+  h->bufs.limit = h->cfg.max_inflight_bytes ? h->cfg.max_inflight_bytes : CML_DEFAULT_INFLIGHT_BYTES;
+  h->bufs.next_page = SIZE_MAX;
+  if (pthread_mutex_init(&h->bufs.mu, NULL) != 0) return CML_ERR_OOM;
+  pthread_condattr_t attr;
+  bool ok = pthread_condattr_init(&attr) == 0;
+  if (ok) {
+    ok = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC) == 0 && pthread_cond_init(&h->bufs.room, &attr) == 0;
+    pthread_condattr_destroy(&attr);
+  }
+  if (!ok) {
+    pthread_mutex_destroy(&h->bufs.mu);
+    return CML_ERR_OOM;
+  }
+  return CML_OK;
+}
+
+void cml_bufpool_free(cml *h) {
+  if (!h) return;
+  cml_bufpool *p = &h->bufs;
+  for (size_t i = 0; i < p->free_len; i++) free(p->free[i].data);
+  p->free_len = 0;
+  p->free_bytes = 0;
+  pthread_cond_destroy(&p->room);
+  pthread_mutex_destroy(&p->mu);
+}
@@ -1,4 +1,5 @@
 #include <getopt.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -15,16 +16,18 @@ typedef struct {
   int printed_any_title;
   int chapter_line_active;
 
-  const char *title;
-  const char *author;
+  // Copies: progress event strings are only valid during the callback.
+  char *title;
+  char *author;
   uint32_t title_done;
   uint32_t title_total;
-  const char *chapter_no;
-  const char *chapter_title;
+  char *chapter_no;
+  char *chapter_title;
   uint32_t chapter_done;
   uint32_t chapter_total;
   uint32_t pages_done;
   uint32_t pages_total;
+  uint32_t concurrency;  // page downloads the library currently allows in flight
 
   uint32_t chapters_done_total;
   uint64_t pages_done_total;
@@ -36,6 +39,19 @@ static int str_eq(const char *a, const char *b) {
   return strcmp(a, b) == 0;
 }
 
+static void ui_keep(char **slot, const char *s) {
+  if (str_eq(*slot, s)) return;
+  free(*slot);
+  *slot = s ? strdup(s) : NULL;
+}
+
+static void ui_free(cli_ui *ui) {
+  free(ui->title);
+  free(ui->author);
+  free(ui->chapter_no);
+  free(ui->chapter_title);
+}
+
 static int ui_color_enabled(void) {
   const char *no = getenv("NO_COLOR");
   return !(no && *no);
@@ -127,6 +143,7 @@ static void ui_render_chapter_progress(cli_ui *ui, uint32_t done, uint32_t total
   } else {
     fprintf(stderr, " %s—%s %s%s%u pages%s", c_dim(ui), c_rst(ui), c_bold(ui), c_grn(ui), done, c_rst(ui));
   }
+  if (ui->concurrency) fprintf(stderr, " %s(%u parallel)%s", c_dim(ui), ui->concurrency, c_rst(ui));
   fflush(stderr);
   ui->chapter_line_active = 1;
 }
@@ -139,8 +156,14 @@ static void print_help(FILE *out) {
       "\n"
       "Options:\n"
       "  --version                       Show version and exit.\n"
-      "  -o, --out <directory>           Output directory  [default: cml_downloads]\n"
+      "  -o, --out <directory>           Output directory, or - to stream a tar to stdout (no other format)\n"
+      "                                  [default: cml_downloads]\n"
       "  -r, --raw                       Write raw images instead of CBZ\n"
+      "      --title-archive             Append chapters to one .zip archive per title\n"
+      "      --pack                      Write one indexed .cmlpack file per chapter\n"
+      "      --s3                        Upload one CBZ per chapter to S3-compatible storage\n"
+      "      --cbz                       Write CBZ archives (combine with -r/--title-archive/--pack/--s3\n"
+      "                                  to produce several formats from one download)\n"
       "  -q, --quality <super_high|high|low>\n"
       "                                  Image quality  [default: super_high]\n"
       "  -s, --split                     Request server-side split for combined images\n"
@@ -151,10 +174,19 @@ static void print_help(FILE *out) {
       "  -l, --last                      Download only the last chapter for each title\n"
       "      --chapter-title             Include chapter titles in filenames\n"
       "      --chapter-subdir            Save raw images in a per-chapter subdirectory\n"
+      "      --store <directory>         Keep pages in a content-addressed store shared across runs\n"
+      "      --api-base <url>            API server  [default: https://jumpg-webapi.tokyo-cdn.com]\n"
+      "      --record <directory>        Save every response in a directory, for --replay\n"
+      "      --replay <directory>        Answer requests from a --record directory instead of the network\n"
+      "      --stats                     Print request, latency and timing statistics at the end\n"
+      "      --trace <file>              Write a Chrome trace of the run's timing (open it in Perfetto)\n"
       "  -h, --help                      Show this message and exit.\n"
       "\n"
       "Environment:\n"
-      "  CML_OUT_DIR, CML_RAW, CML_QUALITY\n",
+      "  CML_OUT_DIR, CML_RAW, CML_QUALITY, CML_STORE_DIR, CML_API_BASE\n"
+      "  CML_REPLAY_LATENCY_MS, CML_REPLAY_RATE (bytes per second)  (for --replay)\n"
+      "  CML_S3_ENDPOINT, CML_S3_REGION, CML_S3_BUCKET, CML_S3_PREFIX, CML_S3_PART_SIZE (MiB),\n"
+      "  AWS_ACCESS_KEY_ID, AWS_SECRET_ACCESS_KEY  (for --s3)\n",
       out);
 }
 
@@ -193,6 +225,58 @@ static int env_bool(const char *key, int fallback) {
   return fallback;
 }
 
+static const char *env_str(const char *key) {
+  const char *v = getenv(key);
+  return (v && *v) ? v : NULL;
+}
+
+// --s3 takes its target and credentials from the environment, never from argv.
+static int s3_from_env(cml_s3_config *out) {
+  out->endpoint = env_str("CML_S3_ENDPOINT");
+  out->region = env_str("CML_S3_REGION");
+  if (!out->region) out->region = "us-east-1";
+  out->bucket = env_str("CML_S3_BUCKET");
+  out->access_key = env_str("AWS_ACCESS_KEY_ID");
+  out->secret_key = env_str("AWS_SECRET_ACCESS_KEY");
+  out->key_prefix = env_str("CML_S3_PREFIX");
+  out->part_size = 0;
+  if (!out->endpoint || !out->bucket || !out->access_key || !out->secret_key) {
+    fprintf(stderr, "cml: --s3 needs CML_S3_ENDPOINT, CML_S3_BUCKET, AWS_ACCESS_KEY_ID and AWS_SECRET_ACCESS_KEY\n");
+    return 0;
+  }
+  const char *part = env_str("CML_S3_PART_SIZE");
+  if (part) {
+    char *end = NULL;
+    unsigned long long mib = strtoull(part, &end, 10);
+    if (!end || *end != '\0' || mib < 5 || mib > 5120) {
+      fprintf(stderr, "cml: invalid $CML_S3_PART_SIZE (expected MiB between 5 and 5120)\n");
+      return 0;
+    }
+    out->part_size = (size_t)mib * 1024 * 1024;
+  }
+  return 1;
+}
+
+// --replay takes its simulated network from the environment.
+static int replay_from_env(cml_transport_config *out) {
+  const char *latency = env_str("CML_REPLAY_LATENCY_MS");
+  if (latency && !parse_u32(latency, &out->latency_ms)) {
+    fprintf(stderr, "cml: invalid $CML_REPLAY_LATENCY_MS\n");
+    return 0;
+  }
+  const char *rate = env_str("CML_REPLAY_RATE");
+  if (rate) {
+    char *end = NULL;
+    unsigned long long v = strtoull(rate, &end, 10);
+    if (!end || end == rate || *end != '\0') {
+      fprintf(stderr, "cml: invalid $CML_REPLAY_RATE (expected bytes per second)\n");
+      return 0;
+    }
+    out->bytes_per_sec = (uint64_t)v;
+  }
+  return 1;
+}
+
 static void default_progress(void *user, const cml_progress_event *ev) {
   cli_ui *ui = (cli_ui *)user;
   if (!ui || !ev || !ev->stage) return;
@@ -200,12 +284,12 @@ static void default_progress(void *user, const cml_progress_event *ev) {
   if (!str_eq(ev->stage, "images")) return;
 
   if (!str_eq(ui->title, ev->title_name) || !str_eq(ui->author, ev->title_author)) {
-    ui->title = ev->title_name;
-    ui->author = ev->title_author;
+    ui_keep(&ui->title, ev->title_name);
+    ui_keep(&ui->author, ev->title_author);
     ui->title_done = ev->title_done;
     ui->title_total = ev->title_total;
-    ui->chapter_no = NULL;
-    ui->chapter_title = NULL;
+    ui_keep(&ui->chapter_no, NULL);
+    ui_keep(&ui->chapter_title, NULL);
     ui->chapter_done = 0;
     ui->chapter_total = 0;
     ui->pages_done = 0;
@@ -217,8 +301,8 @@ static void default_progress(void *user, const cml_progress_event *ev) {
   const char *ch_title = (ev->chapter_title && ev->chapter_title[0]) ? ev->chapter_title : ev->chapter_name;
   if (!str_eq(ui->chapter_no, ch_no) || !str_eq(ui->chapter_title, ch_title) || ui->pages_total != ev->total ||
       ui->chapter_done != ev->chapter_done || ui->chapter_total != ev->chapter_total) {
-    ui->chapter_no = ch_no;
-    ui->chapter_title = ch_title;
+    ui_keep(&ui->chapter_no, ch_no);
+    ui_keep(&ui->chapter_title, ch_title);
     ui->chapter_done = ev->chapter_done;
     ui->chapter_total = ev->chapter_total;
     ui->pages_done = 0;
@@ -226,6 +310,7 @@ static void default_progress(void *user, const cml_progress_event *ev) {
   }
 
   ui->pages_done = ev->done;
+  ui->concurrency = ev->concurrency;
   if (ev->total && ev->done == ev->total) {
     ui->chapters_done_total += 1;
     ui->pages_done_total += (uint64_t)ev->total;
@@ -265,6 +350,65 @@ static int u32_list_push(u32_list *l, uint32_t v) {
   return 1;
 }
 
+static size_t format_add(cml_output_format *formats, size_t len, cml_output_format f) {
+  for (size_t i = 0; i < len; i++)
+    if (formats[i] == f) return len;
+  formats[len] = f;
+  return len + 1;
+}
+
+// " name p50/p99 ms" of a latency histogram; nothing when it is empty.
+static void print_latency(const char *name, const cml_histogram *hist) {
+  if (!hist->count) return;
+  fprintf(stderr, "  %s %.1f/%.1f ms", name, (double)cml_histogram_percentile(hist, 50.0) / 1000.0,
+          (double)cml_histogram_percentile(hist, 99.0) / 1000.0);
+}
+
+static void print_http_class(const cli_ui *ui, const char *name, const cml_http_class_stats *cs) {
+  if (!cs->requests) return;
+  fprintf(stderr,
+          "  %-9s %llu requests, %llu failed, %.2f MiB in, %.2f MiB out, %llu connections opened, %llu reused\n", name,
+          (unsigned long long)cs->requests, (unsigned long long)cs->transport_errors,
+          (double)cs->bytes_received / (1024.0 * 1024.0), (double)cs->bytes_sent / (1024.0 * 1024.0),
+          (unsigned long long)cs->connections, (unsigned long long)cs->reused);
+  fprintf(stderr, "%s           p50/p99:", c_dim(ui));
+  print_latency("dns", &cs->dns);
+  print_latency("connect", &cs->connect);
+  print_latency("tls", &cs->tls);
+  print_latency("first byte", &cs->ttfb);
+  print_latency("total", &cs->total);
+  fprintf(stderr, "%s\n", c_rst(ui));
+}
+
+// --stats: what the run did on the network and where its time went.
+static void print_stats(const cli_ui *ui, const cml *h) {
+  cml_stats ps;
+  if (cml_get_stats(h, &ps) != CML_OK) return;
+  cml_store_stats ss;
+  if (cml_get_store_stats(h, &ss) != CML_OK) memset(&ss, 0, sizeof(ss));
+  fprintf(stderr, "%sStatistics:%s\n", c_bold(ui), c_rst(ui));
+  print_http_class(ui, "metadata", &ps.http.metadata);
+  print_http_class(ui, "pages", &ps.http.pages);
+  print_http_class(ui, "uploads", &ps.http.uploads);
+  fprintf(stderr, "  %-9s %llu metadata responses unchanged, %llu pages from the store\n", "cache",
+          (unsigned long long)ps.metadata.revalidated, (unsigned long long)ss.pages_reused);
+  if (ss.pages) {
+    fprintf(stderr, "  %-9s %llu of %llu pages deduplicated (%.1f%%), %.1f MiB saved\n", "store",
+            (unsigned long long)ss.pages_deduped, (unsigned long long)ss.pages,
+            100.0 * (double)ss.pages_deduped / (double)ss.pages, (double)ss.bytes_saved / (1024.0 * 1024.0));
+  }
+  if (ps.fetch.pages) {
+    const cml_concurrency_stats *cs = &ps.concurrency;
+    fprintf(stderr, "  %-9s %u in parallel at the end (range %u-%u), halved %llu times\n", "downloads", cs->window,
+            cs->window_min, cs->window_max, (unsigned long long)(cs->error_cuts + cs->latency_cuts));
+  }
+  fprintf(stderr, "  %-9s %llu retries, %llu pages resumed, %llu hedged, %llu gave up\n", "retries",
+          (unsigned long long)ps.retry.retries, (unsigned long long)ps.retry.resumed,
+          (unsigned long long)ps.hedge.hedges, (unsigned long long)ps.retry.gave_up);
+  fprintf(stderr, "  %-9s decode %.1f ms, decrypt %.1f ms, export %.1f ms\n", "time",
+          (double)ps.work.decode_ns / 1e6, (double)ps.work.decrypt_ns / 1e6, (double)ps.work.export_ns / 1e6);
+}
+
 static void u32_list_free(u32_list *l) {
   free(l->items);
   l->items = NULL;
@@ -276,6 +420,8 @@ int main(int argc, char **argv) {
   const char *out_dir = getenv("CML_OUT_DIR");
   if (!out_dir || !*out_dir) out_dir = "cml_downloads";
   cml_output_format output = env_bool("CML_RAW", 0) ? CML_OUTPUT_RAW : CML_OUTPUT_CBZ;
+  const char *store_dir = getenv("CML_STORE_DIR");
+  if (store_dir && !*store_dir) store_dir = NULL;
   cml_quality quality = CML_QUALITY_SUPER_HIGH;
   const char *qenv = getenv("CML_QUALITY");
   if (qenv && *qenv) {
@@ -308,6 +454,7 @@ int main(int argc, char **argv) {
   cml_config cfg = {
       .out_dir = out_dir,
       .output = output,
+      .out_fd = -1,
       .quality = quality,
       .split = false,
       .min_chapter = 0,
@@ -318,15 +465,46 @@ int main(int argc, char **argv) {
       .log_fn = NULL,
       .progress_fn = default_progress,
       .user = &ui,
+      .store_dir = store_dir,
+      .api_base = env_str("CML_API_BASE"),
   };
 
   u32_list chapter_ids = {0};
   u32_list title_ids = {0};
 
-  enum { OPT_CHAPTER_TITLE = 1000, OPT_CHAPTER_SUBDIR = 1001 };
+  // Formats picked with -r/--title-archive/--pack/--s3/--cbz; several of them share one download.
+  cml_output_format formats[5];
+  cml_s3_config s3 = {0};
+  size_t formats_len = 0;
+  bool show_stats = false;
+
+  enum {
+    OPT_CHAPTER_TITLE = 1000,
+    OPT_CHAPTER_SUBDIR = 1001,
+    OPT_TITLE_ARCHIVE = 1002,
+    OPT_CBZ = 1003,
+    OPT_PACK = 1004,
+    OPT_STORE = 1005,
+    OPT_S3 = 1006,
+    OPT_API_BASE = 1007,
+    OPT_RECORD = 1008,
+    OPT_REPLAY = 1009,
+    OPT_STATS = 1010,
+    OPT_TRACE = 1011,
+  };
   static struct option longopts[] = {
       {"out", required_argument, NULL, 'o'},
       {"raw", no_argument, NULL, 'r'},
+      {"title-archive", no_argument, NULL, OPT_TITLE_ARCHIVE},
+      {"cbz", no_argument, NULL, OPT_CBZ},
+      {"pack", no_argument, NULL, OPT_PACK},
+      {"s3", no_argument, NULL, OPT_S3},
+      {"store", required_argument, NULL, OPT_STORE},
+      {"api-base", required_argument, NULL, OPT_API_BASE},
+      {"record", required_argument, NULL, OPT_RECORD},
+      {"replay", required_argument, NULL, OPT_REPLAY},
+      {"stats", no_argument, NULL, OPT_STATS},
+      {"trace", required_argument, NULL, OPT_TRACE},
       {"quality", required_argument, NULL, 'q'},
       {"split", no_argument, NULL, 's'},
       {"chapter", required_argument, NULL, 'c'},
@@ -348,7 +526,42 @@ int main(int argc, char **argv) {
         cfg.out_dir = optarg;
         break;
       case 'r':
-        cfg.output = CML_OUTPUT_RAW;
+        formats_len = format_add(formats, formats_len, CML_OUTPUT_RAW);
+        break;
+      case OPT_TITLE_ARCHIVE:
+        formats_len = format_add(formats, formats_len, CML_OUTPUT_TITLE_ARCHIVE);
+        break;
+      case OPT_CBZ:
+        formats_len = format_add(formats, formats_len, CML_OUTPUT_CBZ);
+        break;
+      case OPT_PACK:
+        formats_len = format_add(formats, formats_len, CML_OUTPUT_PACK);
+        break;
+      case OPT_S3:
+        if (!cfg.s3 && !s3_from_env(&s3)) {
+          u32_list_free(&chapter_ids);
+          u32_list_free(&title_ids);
+          return 1;
+        }
+        cfg.s3 = &s3;
+        formats_len = format_add(formats, formats_len, CML_OUTPUT_S3);
+        break;
+      case OPT_STORE:
+        cfg.store_dir = optarg;
+        break;
+      case OPT_API_BASE:
+        cfg.api_base = optarg;
+        break;
+      case OPT_RECORD:
+      case OPT_REPLAY:
+        cfg.transport.mode = opt == OPT_RECORD ? CML_TRANSPORT_RECORD : CML_TRANSPORT_REPLAY;
+        cfg.transport.dir = optarg;
+        break;
+      case OPT_STATS:
+        show_stats = true;
+        break;
+      case OPT_TRACE:
+        cfg.trace_path = optarg;
         break;
       case 'q':
         if (!parse_quality(optarg, &cfg.quality)) {
@@ -429,6 +642,40 @@ int main(int argc, char **argv) {
     }
   }
 
+  if (cfg.transport.mode == CML_TRANSPORT_REPLAY && !replay_from_env(&cfg.transport)) {
+    u32_list_free(&chapter_ids);
+    u32_list_free(&title_ids);
+    return 1;
+  }
+
+  if (formats_len == 1) {
+    cfg.output = formats[0];
+  } else if (formats_len > 1) {
+    cfg.outputs = formats;
+    cfg.outputs_len = formats_len;
+  }
+
+  if (strcmp(cfg.out_dir, "-") == 0) {
+    if (formats_len > 0) {
+      fprintf(stderr, "cml: -o - streams a tar and cannot be combined with -r/--cbz/--title-archive/--pack/--s3\n");
+      u32_list_free(&chapter_ids);
+      u32_list_free(&title_ids);
+      return 1;
+    }
+    if (isatty(STDOUT_FILENO)) {
+      fprintf(stderr, "cml: refusing to write a tar stream to a terminal\n");
+      u32_list_free(&chapter_ids);
+      u32_list_free(&title_ids);
+      return 1;
+    }
+    cfg.output = CML_OUTPUT_TAR;
+    cfg.outputs = NULL;
+    cfg.outputs_len = 0;
+    cfg.out_fd = STDOUT_FILENO;
+    // A closed pipe should surface as an io error, not kill the process.
+    signal(SIGPIPE, SIG_IGN);
+  }
+
   cml *h = cml_create(&cfg);
   if (!h) {
     fprintf(stderr, "cml: failed to initialize\n");
@@ -487,6 +734,8 @@ int main(int argc, char **argv) {
   } else {
     fprintf(stderr, "%s%s%s %s%s\n", c_bold(&ui), c_red(&ui), ui_mark_err(&ui), cml_status_string(st), c_rst(&ui));
   }
+  if (show_stats) print_stats(&ui, h);
   cml_destroy(h);
+  ui_free(&ui);
   return (st == CML_OK) ? 0 : 1;
 }
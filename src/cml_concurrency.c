@@ -0,0 +1,124 @@
+#include "cml_internal.h"
+
+#include <string.h>
+
+// Adaptive page download concurrency. The fetch workers are the ceiling; the window says how many of
+// them may have a request in flight. Every healthy answer grows the window by 1/window (about one
+// slot per window's worth of answers); a 429, a 5xx, a transport error or a time to first byte well
+// above the best seen halves it. Only requests started after the last cut can cut again, so one bad
+// round trip halves the window once.
+
+#define INITIAL_WINDOW 4
+#define LATENCY_FACTOR 2.0         // smoothed time to first byte over the best one that counts as queueing
+#define LATENCY_SLACK_NS 5000000.0 // plus this much, so sub-millisecond jitter on fast links is ignored
+
+static void note_window(cml_window_state *w) {
+  uint32_t cur = (uint32_t)w->window;
+  if (cur < w->stats.window_min) w->stats.window_min = cur;
+  if (cur > w->stats.window_max) w->stats.window_max = cur;
+}
+
+uint64_t cml_window_enter(cml *h) {
+  cml_window_state *w = &h->window;
+  pthread_mutex_lock(&w->mu);
+  if (w->inflight >= (uint32_t)w->window) {
+    w->stats.waits++;
+    while (w->inflight >= (uint32_t)w->window) pthread_cond_wait(&w->cv, &w->mu);
+  }
+  w->inflight++;
+  pthread_mutex_unlock(&w->mu);
+  return cml_now_ns();
+}
+
+void cml_window_leave(cml *h, uint64_t start_ns, bool congested, uint64_t ttfb_ns) {
+  cml_window_state *w = &h->window;
+  pthread_mutex_lock(&w->mu);
+  w->inflight--;
+  if (!w->fixed) {
+    bool slow = false;
+    if (!congested && ttfb_ns) {
+      if (w->min_ttfb_ns == 0 || ttfb_ns < w->min_ttfb_ns) w->min_ttfb_ns = ttfb_ns;
+      w->srtt_ns = w->srtt_ns > 0 ? (w->srtt_ns * 7 + (double)ttfb_ns) / 8 : (double)ttfb_ns;
+      slow = w->srtt_ns > (double)w->min_ttfb_ns * LATENCY_FACTOR + LATENCY_SLACK_NS;
+    }
+    if ((congested || slow) && start_ns > w->cut_ns) {
+      if (w->window >= 2.0) {
+        if (congested) w->stats.error_cuts++;
+        else w->stats.latency_cuts++;
+      }
+      w->window = w->window / 2 >= 1.0 ? w->window / 2 : 1.0;
+      w->cut_ns = cml_now_ns();
+      w->srtt_ns = 0;  // judge the new window on its own round trips
+    } else if (!congested && !slow && w->window < (double)w->max) {
+      uint32_t before = (uint32_t)w->window;
+      w->window += 1.0 / w->window;
+      if (w->window > (double)w->max) w->window = (double)w->max;
+      if ((uint32_t)w->window > before) w->stats.increases++;
+    }
+    note_window(w);
+  }
+  pthread_cond_broadcast(&w->cv);
+  pthread_mutex_unlock(&w->mu);
+}
+
+// A hedge may take one slot beyond the window: the page it duplicates is the one holding things up,
+// and a window cut down to a single download would otherwise never let it be hedged.
+bool cml_window_try_enter(cml *h) {
+  cml_window_state *w = &h->window;
+  pthread_mutex_lock(&w->mu);
+  bool ok = w->inflight <= (uint32_t)w->window;
+  if (ok) w->inflight++;
+  pthread_mutex_unlock(&w->mu);
+  return ok;
+}
+
+void cml_window_release(cml *h) {
+  cml_window_state *w = &h->window;
+  pthread_mutex_lock(&w->mu);
+  w->inflight--;
+  pthread_cond_broadcast(&w->cv);
+  pthread_mutex_unlock(&w->mu);
+}
+
+uint32_t cml_window_current(cml *h) {
+  pthread_mutex_lock(&h->window.mu);
+  uint32_t cur = (uint32_t)h->window.window;
+  pthread_mutex_unlock(&h->window.mu);
+  return cur;
+}
+
+cml_status cml_window_init(cml *h) {
+  cml_window_state *w = &h->window;
+  w->fixed = h->cfg.fixed_concurrency;
+  w->max = h->cfg.fetch_workers ? h->cfg.fetch_workers : CML_DEFAULT_FETCH_WORKERS;
+  w->window = w->fixed || w->max < INITIAL_WINDOW ? (double)w->max : INITIAL_WINDOW;
+  if (pthread_mutex_init(&w->mu, NULL) != 0) return CML_ERR_OOM;
+  if (pthread_cond_init(&w->cv, NULL) != 0) {
+    pthread_mutex_destroy(&w->mu);
+    return CML_ERR_OOM;
+  }
+  return CML_OK;
+}
+
+void cml_window_free(cml *h) {
+  pthread_cond_destroy(&h->window.cv);
+  pthread_mutex_destroy(&h->window.mu);
+}
+
+// The window carries over from run to run; the latency baseline and the counters start afresh.
+void cml_window_reset_stats(cml *h) {
+  cml_window_state *w = &h->window;
+  pthread_mutex_lock(&w->mu);
+  memset(&w->stats, 0, sizeof(w->stats));
+  w->stats.window_min = w->stats.window_max = (uint32_t)w->window;
+  w->min_ttfb_ns = 0;
+  w->srtt_ns = 0;
+  pthread_mutex_unlock(&w->mu);
+}
+
+void cml_window_get_stats(cml *h, cml_concurrency_stats *out) {
+  pthread_mutex_lock(&h->window.mu);
+  *out = h->window.stats;
+  out->window = (uint32_t)h->window.window;
+  pthread_mutex_unlock(&h->window.mu);
+}
@@ -26,132 +26,322 @@ static char *path_with_ext(const char *path, const char *ext_with_dot) {
   return out;
 }
 
-static cml_status exporter_common(cml *h, const cml_title *title, const cml_chapter *chapter, const cml_chapter *next,
-                                  cml_exporter *e) {
-  char *title_dir = NULL;
-  char *prefix = NULL;
-  char *suffix = NULL;
-  char *chapter_dir = NULL;
-  cml_status st =
-      cml_build_names(title, chapter, next, h->cfg.include_chapter_title, &title_dir, &prefix, &suffix, &chapter_dir);
-  if (st != CML_OK) return st;
+typedef struct {
+  char *name;     // page filename inside the chapter directory
+  cml_bytes buf;  // page buffer read by the zip source; released after zip_close/zip_discard
+  zip_int64_t index;
+  bool spilled;  // moved to the spool directory; the zip entry reads the file instead
+} cbz_page;
 
-  e->title_dir_name = title_dir;
-  e->chapter_prefix = prefix;
-  e->chapter_suffix = suffix;
-  e->chapter_dir_name = chapter_dir;
+typedef struct {
+  cml *h;
+  char *chapter_dir;
+  char *cbz_path;  // <out>/<title>/<chapter>.cbz
+  zip_t *zip;
+  bool skip_all;
 
-  e->title_dir_path = path_join2(h->cfg.out_dir, e->title_dir_name);
-  if (!e->title_dir_path) return CML_ERR_OOM;
-  st = cml_mkdir_p(e->title_dir_path);
-  return st;
-}
-
-cml_status cml_export_cbz_init(cml *h, const cml_title *title, const cml_chapter *chapter, const cml_chapter *next,
-                               cml_exporter *e) {
-  cml_status st = exporter_common(h, title, chapter, next, e);
-  if (st != CML_OK) return st;
+  // Checkpointing: pages added this run, and pages spooled by an earlier failed run.
+  cbz_page *pending;
+  size_t pending_len;
+  size_t pending_cap;
+  char *spool_dir;  // <chapter>.cbz.spool
+  cml_strset spool;
 
-  char *noext = path_join2(e->title_dir_path, e->chapter_dir_name);
-  if (!noext) return CML_ERR_OOM;
+  // libzip reads every page at zip_close, so a long chapter would hold all of them in memory. Past
+  // half the memory budget, or when the writer's next page might not fit, the oldest pages are
+  // written to the spool and read back from there.
+  size_t held;
+  size_t spill_next;
+  bool spool_made;
+} cbz_chapter;
 
-  char *final = path_with_ext(noext, ".cbz");
-  char *tmp = path_with_ext(noext, ".cbz.part");
+static char *cbz_path_for(const cml *h, const cml_sink_chapter *ch) {
+  char *title_dir = path_join2(h->cfg.out_dir, ch->title_dir);
+  char *noext = title_dir ? path_join2(title_dir, ch->chapter_dir) : NULL;
+  char *final = noext ? path_with_ext(noext, ".cbz") : NULL;
   free(noext);
-  if (!final || !tmp) {
-    free(final);
-    free(tmp);
-    return CML_ERR_OOM;
+  free(title_dir);
+  return final;
+}
+
+static void cbz_chapter_free(cbz_chapter *c) {
+  if (!c) return;
+  for (size_t i = 0; i < c->pending_len; i++) {
+    free(c->pending[i].name);
+    cml_buf_put(c->h, &c->pending[i].buf);
   }
-  e->cbz_path = final;
+  free(c->pending);
+  free(c->chapter_dir);
+  free(c->cbz_path);
+  free(c->spool_dir);
+  cml_strset_free(&c->spool);
+  free(c);
+}
 
-  if (cml_exists(e->cbz_path)) {
-    free(tmp);
-    e->skip_all = true;
+static cml_status cbz_open(cml *h, const cml_sink_chapter *ch, cbz_chapter *c) {
+  c->chapter_dir = strdup(ch->chapter_dir);
+  c->cbz_path = cbz_path_for(h, ch);
+  if (!c->chapter_dir || !c->cbz_path) return CML_ERR_OOM;
+  char *title_dir = path_join2(h->cfg.out_dir, ch->title_dir);
+  if (!title_dir) return CML_ERR_OOM;
+  cml_status st = cml_mkdir_p(title_dir);
+  free(title_dir);
+  if (st != CML_OK) return st;
+
+  if (cml_exists(c->cbz_path)) {
+    c->skip_all = true;
     return CML_OK;
   }
 
-  int zerr = 0;
-  e->zip = zip_open(tmp, ZIP_CREATE | ZIP_TRUNCATE, &zerr);
-  if (!e->zip) {
-    free(tmp);
-    return CML_ERR_ZIP;
-  }
+  // Pages spooled by an earlier failed attempt are reused instead of downloaded again.
+  c->spool_dir = path_with_ext(c->cbz_path, ".spool");
+  if (!c->spool_dir) return CML_ERR_OOM;
+  size_t stale = 0;
+  st = cml_dir_scan(c->spool_dir, &c->spool, &stale);
+  if (st != CML_OK) return st;
+  if (c->spool.len) cml_log(h, CML_LOG_INFO, "resuming %s: %zu page(s) spooled", c->chapter_dir, c->spool.len);
 
+  char *tmp = path_with_ext(c->cbz_path, ".part");
+  if (!tmp) return CML_ERR_OOM;
+  int zerr = 0;
+  c->zip = zip_open(tmp, ZIP_CREATE | ZIP_TRUNCATE, &zerr);
   free(tmp);
+  if (!c->zip) return CML_ERR_ZIP;
   return CML_OK;
 }
 
-cml_status cml_export_cbz_add(cml_exporter *e, const uint8_t *data, size_t len, int is_range, uint32_t start,
-                              uint32_t stop) {
-  if (!e || !e->zip || !data) return CML_ERR_INVALID;
-  char *filename = NULL;
-  cml_status st = cml_format_page_filename(e->chapter_prefix, e->chapter_suffix, is_range, start, stop, "jpg", &filename);
+static cml_status cbz_chapter_begin(void *user, const cml_sink_chapter *ch, void **state) {
+  cml *h = (cml *)user;
+  cbz_chapter *c = (cbz_chapter *)calloc(1, sizeof(*c));
+  if (!c) return CML_ERR_OOM;
+  c->h = h;
+  cml_status st = cbz_open(h, ch, c);
+  if (st != CML_OK) {
+    cbz_chapter_free(c);
+    return st;
+  }
+  *state = c;
+  return CML_OK;
+}
+
+static int cbz_chapter_exists(void *user, const cml_sink_chapter *ch) {
+  // A finished .cbz only ever appears via rename, so its presence means the chapter is done.
+  char *path = cbz_path_for((cml *)user, ch);
+  int exists = path ? cml_exists(path) : 0;
+  free(path);
+  return exists;
+}
+
+static int cbz_page_exists(void *user, void *state, const cml_sink_page *page) {
+  (void)user;
+  cbz_chapter *c = (cbz_chapter *)state;
+  return c->skip_all || cml_strset_has(&c->spool, page->filename);
+}
+
+static cml_status spill_page(cbz_chapter *c, cbz_page *pg) {
+  if (!c->spool_made) {
+    cml_status st = cml_mkdir_p(c->spool_dir);
+    if (st != CML_OK) return st;
+    c->spool_made = true;
+  }
+  char *path = path_join2(c->spool_dir, pg->name);
+  if (!path) return CML_ERR_OOM;
+  cml_status st = cml_write_file_atomic(path, pg->buf.data, pg->buf.len);
+  zip_source_t *src = st == CML_OK ? zip_source_file(c->zip, path, 0, -1) : NULL;
+  free(path);
   if (st != CML_OK) return st;
+  if (!src || zip_file_replace(c->zip, (zip_uint64_t)pg->index, src, 0) < 0) {
+    if (src) zip_source_free(src);
+    return CML_ERR_ZIP;
+  }
+  c->held -= pg->buf.cap;
+  cml_buf_put(c->h, &pg->buf);
+  pg->spilled = true;
+  return CML_OK;
+}
 
-  char *internal = path_join2(e->chapter_dir_name, filename);
-  free(filename);
-  if (!internal) return CML_ERR_OOM;
+static cml_status spill_to_budget(cbz_chapter *c) {
+  size_t keep = cml_mem_limit(c->h) / 2;
+  cml_status st = CML_OK;
+  while (st == CML_OK && c->spill_next < c->pending_len && (c->held > keep || (c->held && cml_mem_tight(c->h))))
+    st = spill_page(c, &c->pending[c->spill_next++]);
+  return st;
+}
 
-  uint8_t *copy = (uint8_t *)malloc(len);
-  if (!copy) {
+static cml_status cbz_page_add(void *user, void *state, const cml_sink_page *page) {
+  cml *h = (cml *)user;
+  cbz_chapter *c = (cbz_chapter *)state;
+  if (c->skip_all) return CML_OK;
+  if (!c->zip) return CML_ERR_INVALID;
+
+  // The pending list keeps the page for checkpointing and holds its buffer until zip_close.
+  if (c->pending_len == c->pending_cap) {
+    size_t next = c->pending_cap ? (c->pending_cap * 2) : 32;
+    void *p = realloc(c->pending, next * sizeof(cbz_page));
+    if (!p) return CML_ERR_OOM;
+    c->pending = (cbz_page *)p;
+    c->pending_cap = next;
+  }
+  char *internal = path_join2(c->chapter_dir, page->filename);
+  char *name = strdup(page->filename);
+  if (!internal || !name) {
     free(internal);
+    free(name);
     return CML_ERR_OOM;
   }
-  memcpy(copy, data, len);
 
-  zip_source_t *src = zip_source_buffer(e->zip, copy, len, 1 /* freep */);
-  if (!src) {
-    free(copy);
-    free(internal);
+  // libzip reads the data at zip_close, so the buffer is taken over rather than copied when possible.
+  cml_bytes buf = {0};
+  if (!cml_page_take(h, page, &buf)) {
+    cml_status st = cml_buf_get(h, page->len, &buf);
+    if (st != CML_OK) {
+      free(internal);
+      free(name);
+      return st;
+    }
+    memcpy(buf.data, page->data, page->len);
+    buf.len = page->len;
+    cml_buf_note_copy(h, page->len);
+  }
+
+  zip_source_t *src = zip_source_buffer(c->zip, buf.data, page->len, 0);
+  zip_int64_t index = src ? zip_file_add(c->zip, internal, src, ZIP_FL_ENC_UTF_8) : -1;
+  free(internal);
+  if (index < 0) {
+    if (src) zip_source_free(src);
+    cml_buf_put(h, &buf);
+    free(name);
     return CML_ERR_ZIP;
   }
+  c->pending[c->pending_len++] = (cbz_page){.name = name, .buf = buf, .index = index};
+  c->held += buf.cap;
+  return spill_to_budget(c);
+}
 
-  if (zip_file_add(e->zip, internal, src, ZIP_FL_ENC_UTF_8) < 0) {
-    zip_source_free(src);
+static cml_status cbz_add_spooled(cbz_chapter *c) {
+  for (size_t i = 0; i < c->spool.cap; i++) {
+    const char *name = c->spool.slots[i];
+    if (!name) continue;
+    char *path = path_join2(c->spool_dir, name);
+    char *internal = path_join2(c->chapter_dir, name);
+    if (!path || !internal) {
+      free(path);
+      free(internal);
+      return CML_ERR_OOM;
+    }
+    zip_source_t *src = zip_source_file(c->zip, path, 0, -1);
+    free(path);
+    if (!src) {
+      free(internal);
+      return CML_ERR_ZIP;
+    }
+    if (zip_file_add(c->zip, internal, src, ZIP_FL_ENC_UTF_8) < 0) {
+      zip_source_free(src);
+      free(internal);
+      return CML_ERR_ZIP;
+    }
     free(internal);
-    return CML_ERR_ZIP;
   }
-  free(internal);
   return CML_OK;
 }
 
+static void spool_unlink(cbz_chapter *c, const char *name) {
+  char *path = path_join2(c->spool_dir, name);
+  if (!path) return;
+  unlink(path);
+  free(path);
+}
+
+static void spool_remove(cbz_chapter *c) {
+  if (!c->spool_dir || (c->spool.len == 0 && c->spill_next == 0)) return;
+  for (size_t i = 0; i < c->spool.cap; i++) {
+    if (c->spool.slots[i]) spool_unlink(c, c->spool.slots[i]);
+  }
+  for (size_t i = 0; i < c->spill_next; i++) spool_unlink(c, c->pending[i].name);
+  rmdir(c->spool_dir);
+}
+
+// Writes the pages this attempt managed to download next to the archive so the next run only
+// fetches what is still missing. It runs when the failure is reported, so a process that is killed
+// or crashes loses the pages still in memory; only pages spilled earlier are on disk.
+static void spool_pending(cbz_chapter *c) {
+  if (!c->spool_dir || c->pending_len == 0) return;
+  if (cml_mkdir_p(c->spool_dir) != CML_OK) return;
+  for (size_t i = 0; i < c->pending_len; i++) {
+    if (c->pending[i].spilled) continue;
+    char *path = path_join2(c->spool_dir, c->pending[i].name);
+    if (!path) return;
+    cml_status st = cml_write_file_atomic(path, c->pending[i].buf.data, c->pending[i].buf.len);
+    free(path);
+    if (st != CML_OK) return;
+  }
+}
+
+static void cbz_abort(cbz_chapter *c) {
+  if (c->zip) {
+    spool_pending(c);
+    zip_discard(c->zip);
+    c->zip = NULL;
+  }
+  if (c->cbz_path) {
+    char *part = path_with_ext(c->cbz_path, ".part");
+    if (!part) return;
+    unlink(part);
+    free(part);
+  }
+}
+
 // Finalize: close zip and rename .part -> .cbz
-static cml_status cbz_finalize(cml_exporter *e) {
-  if (!e || !e->zip || !e->cbz_path) return CML_ERR_INVALID;
-  const char *dst = e->cbz_path;
-  size_t n = strlen(dst) + 6;
-  char *src = (char *)malloc(n);
+static cml_status cbz_finalize(cbz_chapter *c) {
+  if (!c->zip || !c->cbz_path) return CML_ERR_INVALID;
+  char *src = path_with_ext(c->cbz_path, ".part");
   if (!src) return CML_ERR_OOM;
-  snprintf(src, n, "%s.part", dst);
 
-  if (zip_close(e->zip) != 0) {
-    e->zip = NULL;
+  cml_status st = cbz_add_spooled(c);
+  if (st != CML_OK) {
+    cbz_abort(c);
+    free(src);
+    return st;
+  }
+
+  // A failed zip_close (e.g. a full disk) leaves the handle open: checkpoint the pages and discard it.
+  if (zip_close(c->zip) != 0) {
+    cbz_abort(c);
     free(src);
     return CML_ERR_ZIP;
   }
-  e->zip = NULL;
-  cml_status st = cml_rename_overwrite(src, dst);
+  c->zip = NULL;
+  st = cml_rename_overwrite(src, c->cbz_path);
   if (st != CML_OK) unlink(src);
   free(src);
+  if (st == CML_OK) spool_remove(c);
   return st;
 }
 
-// Called by the shared exporter close path.
-cml_status cml_export_cbz_finalize(cml_exporter *e) { return cbz_finalize(e); }
-
-void cml_export_cbz_abort(cml_exporter *e) {
-  if (!e) return;
-  if (e->zip) {
-    zip_discard(e->zip);
-    e->zip = NULL;
-  }
-  if (e->cbz_path) {
-    size_t n = strlen(e->cbz_path) + 6;
-    char *part = (char *)malloc(n);
-    if (!part) return;
-    snprintf(part, n, "%s.part", e->cbz_path);
-    unlink(part);
-    free(part);
+static cml_status cbz_chapter_end(void *user, void *state, bool success) {
+  cml *h = (cml *)user;
+  cbz_chapter *c = (cbz_chapter *)state;
+  if (!c) return CML_OK;
+  cml_status st = CML_OK;
+  if (!c->skip_all) {
+    if (success) {
+      uint64_t t0 = cml_trace_begin(h);
+      st = cbz_finalize(c);
+      cml_trace_end(h, t0, "export", "cbz_finalize", NULL, 0);
+    } else {
+      cbz_abort(c);
+    }
   }
+  cbz_chapter_free(c);
+  return st;
 }
+
+const cml_sink cml_cbz_sink = {
+    .user = NULL,
+    .chapter_begin = cbz_chapter_begin,
+    .page_exists = cbz_page_exists,
+    .page = cbz_page_add,
+    .chapter_end = cbz_chapter_end,
+    .chapter_exists = cbz_chapter_exists,
+    .run_end = NULL,
+};
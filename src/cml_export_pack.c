@@ -0,0 +1,250 @@
+#include "cml_internal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Chapter packs: <out>/<title>/<chapter>.cmlpack, written to a .part file and renamed on success
+// like CBZ. Payloads are appended at CML_PACK_ALIGN boundaries as pages arrive; the page table and
+// names follow the last payload, and the header (first block) is written last.
+
+static char *path_join2(const char *a, const char *b) {
+  if (!a || !b) return NULL;
+  size_t alen = strlen(a);
+  size_t blen = strlen(b);
+  int need = (alen > 0 && a[alen - 1] != '/');
+  size_t n = alen + (need ? 1 : 0) + blen + 1;
+  char *out = (char *)malloc(n);
+  if (!out) return NULL;
+  snprintf(out, n, need ? "%s/%s" : "%s%s", a, b);
+  return out;
+}
+
+static char *path_with_ext(const char *path, const char *ext_with_dot) {
+  if (!path || !ext_with_dot) return NULL;
+  size_t n = strlen(path) + strlen(ext_with_dot) + 1;
+  char *out = (char *)malloc(n);
+  if (!out) return NULL;
+  snprintf(out, n, "%s%s", path, ext_with_dot);
+  return out;
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+  p[0] = (uint8_t)v;
+  p[1] = (uint8_t)(v >> 8);
+  p[2] = (uint8_t)(v >> 16);
+  p[3] = (uint8_t)(v >> 24);
+}
+
+static void put64(uint8_t *p, uint64_t v) {
+  put32(p, (uint32_t)v);
+  put32(p + 4, (uint32_t)(v >> 32));
+}
+
+static cml_status pwrite_all(int fd, const uint8_t *data, size_t len, uint64_t off) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t w = pwrite(fd, data + done, len - done, (off_t)(off + done));
+    if (w < 0) {
+      if (errno == EINTR) continue;
+      return CML_ERR_IO;
+    }
+    done += (size_t)w;
+  }
+  return CML_OK;
+}
+
+typedef struct {
+  uint64_t offset;
+  uint64_t len;
+  uint32_t start;
+  uint32_t stop;
+  uint32_t name_offset;
+  uint32_t name_len;
+} pack_entry;
+
+typedef struct {
+  char *pack_path;  // <out>/<title>/<chapter>.cmlpack
+  char *part_path;
+  int fd;
+  bool skip_all;
+  uint64_t end;  // end of the last payload
+
+  pack_entry *entries;
+  size_t len;
+  size_t cap;
+  char *names;  // NUL-terminated page filenames, back to back
+  size_t names_len;
+  size_t names_cap;
+} pack_chapter;
+
+static char *pack_path_for(const cml *h, const cml_sink_chapter *ch) {
+  char *title_dir = path_join2(h->cfg.out_dir, ch->title_dir);
+  char *noext = title_dir ? path_join2(title_dir, ch->chapter_dir) : NULL;
+  char *final = noext ? path_with_ext(noext, ".cmlpack") : NULL;
+  free(noext);
+  free(title_dir);
+  return final;
+}
+
+static void pack_chapter_free(pack_chapter *c) {
+  if (!c) return;
+  if (c->fd >= 0) close(c->fd);
+  free(c->pack_path);
+  free(c->part_path);
+  free(c->entries);
+  free(c->names);
+  free(c);
+}
+
+static cml_status pack_chapter_begin(void *user, const cml_sink_chapter *ch, void **state) {
+  cml *h = (cml *)user;
+  pack_chapter *c = (pack_chapter *)calloc(1, sizeof(*c));
+  if (!c) return CML_ERR_OOM;
+  c->fd = -1;
+  c->end = CML_PACK_ALIGN;  // the header owns the first block
+
+  cml_status st = CML_ERR_OOM;
+  char *title_dir = path_join2(h->cfg.out_dir, ch->title_dir);
+  c->pack_path = pack_path_for(h, ch);
+  c->part_path = c->pack_path ? path_with_ext(c->pack_path, ".part") : NULL;
+  if (!title_dir || !c->part_path) goto fail;
+  st = cml_mkdir_p(title_dir);
+  if (st != CML_OK) goto fail;
+
+  if (cml_exists(c->pack_path)) {
+    c->skip_all = true;
+  } else {
+    c->fd = open(c->part_path, O_CREAT | O_TRUNC | O_RDWR, 0644);
+    if (c->fd < 0) {
+      st = CML_ERR_IO;
+      goto fail;
+    }
+  }
+  free(title_dir);
+  *state = c;
+  return CML_OK;
+
+fail:
+  free(title_dir);
+  pack_chapter_free(c);
+  return st;
+}
+
+static int pack_chapter_exists(void *user, const cml_sink_chapter *ch) {
+  char *path = pack_path_for((cml *)user, ch);
+  int exists = path ? cml_exists(path) : 0;
+  free(path);
+  return exists;
+}
+
+static int pack_page_exists(void *user, void *state, const cml_sink_page *page) {
+  (void)user;
+  (void)page;
+  return ((pack_chapter *)state)->skip_all;
+}
+
+static cml_status pack_page(void *user, void *state, const cml_sink_page *page) {
+  (void)user;
+  pack_chapter *c = (pack_chapter *)state;
+  if (c->skip_all) return CML_OK;
+
+  size_t name_len = strlen(page->filename);
+  if (c->names_len + name_len + 1 > UINT32_MAX) return CML_ERR_INVALID;
+  if (c->len == c->cap) {
+    size_t next = c->cap ? (c->cap * 2) : 32;
+    void *p = realloc(c->entries, next * sizeof(pack_entry));
+    if (!p) return CML_ERR_OOM;
+    c->entries = (pack_entry *)p;
+    c->cap = next;
+  }
+  if (c->names_len + name_len + 1 > c->names_cap) {
+    size_t next = c->names_cap ? c->names_cap : 1024;
+    while (next < c->names_len + name_len + 1) next *= 2;
+    char *p = (char *)realloc(c->names, next);
+    if (!p) return CML_ERR_OOM;
+    c->names = p;
+    c->names_cap = next;
+  }
+
+  // The gap up to the aligned offset stays a hole, so padding costs no writes.
+  uint64_t off = (c->end + CML_PACK_ALIGN - 1) & ~(uint64_t)(CML_PACK_ALIGN - 1);
+  cml_status st = pwrite_all(c->fd, page->data, page->len, off);
+  if (st != CML_OK) return st;
+  c->end = off + page->len;
+
+  memcpy(c->names + c->names_len, page->filename, name_len + 1);
+  c->entries[c->len++] = (pack_entry){.offset = off,
+                                      .len = page->len,
+                                      .start = page->start,
+                                      .stop = page->stop,
+                                      .name_offset = (uint32_t)c->names_len,
+                                      .name_len = (uint32_t)name_len};
+  c->names_len += name_len + 1;
+  return CML_OK;
+}
+
+static cml_status pack_finalize(pack_chapter *c) {
+  uint64_t table_off = (c->end + 7) & ~(uint64_t)7;
+  size_t table_len = c->len * CML_PACK_ENTRY_SIZE;
+  uint8_t *table = (uint8_t *)calloc(1, table_len + c->names_len + 1);
+  if (!table) return CML_ERR_OOM;
+  for (size_t i = 0; i < c->len; i++) {
+    uint8_t *p = table + i * CML_PACK_ENTRY_SIZE;
+    put64(p, c->entries[i].offset);
+    put64(p + 8, c->entries[i].len);
+    put32(p + 16, c->entries[i].start);
+    put32(p + 20, c->entries[i].stop);
+    put32(p + 24, c->entries[i].name_offset);
+    put32(p + 28, c->entries[i].name_len);
+  }
+  if (c->names_len) memcpy(table + table_len, c->names, c->names_len);
+  cml_status st = pwrite_all(c->fd, table, table_len + c->names_len, table_off);
+  free(table);
+  if (st != CML_OK) return st;
+
+  uint8_t hdr[CML_PACK_HEADER_SIZE] = {0};
+  uint64_t names_off = table_off + table_len;
+  memcpy(hdr, CML_PACK_MAGIC, 8);
+  put32(hdr + 8, CML_PACK_VERSION);
+  put32(hdr + 12, (uint32_t)c->len);
+  put64(hdr + 16, table_off);
+  put64(hdr + 24, names_off);
+  put64(hdr + 32, c->names_len);
+  put64(hdr + 40, names_off + c->names_len);
+  st = pwrite_all(c->fd, hdr, sizeof(hdr), 0);
+  // An empty names blob writes nothing, so set the size explicitly.
+  if (st == CML_OK && ftruncate(c->fd, (off_t)(names_off + c->names_len)) != 0) st = CML_ERR_IO;
+  if (st == CML_OK && fsync(c->fd) != 0) st = CML_ERR_IO;
+  if (close(c->fd) != 0 && st == CML_OK) st = CML_ERR_IO;
+  c->fd = -1;
+  if (st == CML_OK) st = cml_rename_overwrite(c->part_path, c->pack_path);
+  return st;
+}
+
+static cml_status pack_chapter_end(void *user, void *state, bool success) {
+  (void)user;
+  pack_chapter *c = (pack_chapter *)state;
+  if (!c) return CML_OK;
+  cml_status st = CML_OK;
+  if (!c->skip_all) {
+    if (success && c->len > UINT32_MAX) st = CML_ERR_INVALID;
+    if (success && st == CML_OK) st = pack_finalize(c);
+    if (!success || st != CML_OK) unlink(c->part_path);
+  }
+  pack_chapter_free(c);
+  return st;
+}
+
+const cml_sink cml_pack_sink = {
+    .user = NULL,
+    .chapter_begin = pack_chapter_begin,
+    .page_exists = pack_page_exists,
+    .page = pack_page,
+    .chapter_end = pack_chapter_end,
+    .chapter_exists = pack_chapter_exists,
+    .run_end = NULL,
+};
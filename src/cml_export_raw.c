@@ -16,120 +16,94 @@ static char *path_join2(const char *a, const char *b) {
   return out;
 }
 
-static cml_status exporter_common(cml *h, const cml_title *title, const cml_chapter *chapter, const cml_chapter *next,
-                                  cml_exporter *e) {
-  char *title_dir = NULL;
-  char *prefix = NULL;
-  char *suffix = NULL;
-  char *chapter_dir = NULL;
-  cml_status st =
-      cml_build_names(title, chapter, next, h->cfg.include_chapter_title, &title_dir, &prefix, &suffix, &chapter_dir);
-  if (st != CML_OK) return st;
+typedef struct {
+  char *dir;  // where images go: <out>/<title>[/<chapter>]
+} raw_chapter;
 
-  e->title_dir_name = title_dir;
-  e->chapter_prefix = prefix;
-  e->chapter_suffix = suffix;
-  e->chapter_dir_name = chapter_dir;
-
-  e->title_dir_path = path_join2(h->cfg.out_dir, e->title_dir_name);
-  if (!e->title_dir_path) return CML_ERR_OOM;
-  st = cml_mkdir_p(e->title_dir_path);
-  return st;
+void cml_export_raw_reset_index(cml *h) {
+  if (!h) return;
+  free(h->raw_index_dir);
+  h->raw_index_dir = NULL;
+  cml_strset_free(&h->raw_index);
 }
 
-static cml_status exporter_raw_init(cml *h, const cml_title *title, const cml_chapter *chapter, const cml_chapter *next,
-                                    cml_exporter *e) {
-  cml_status st = exporter_common(h, title, chapter, next, e);
-  if (st != CML_OK) return st;
-  if (h->cfg.chapter_subdir) {
-    e->raw_dir_path = path_join2(e->title_dir_path, e->chapter_dir_name);
-  } else {
-    e->raw_dir_path = strdup(e->title_dir_path);
+// Lists dir once and keeps the result on the handle, so consecutive chapters writing into the same
+// title directory answer skip checks from memory instead of one stat() per page.
+static cml_status raw_index_load(cml *h, const char *dir) {
+  if (h->raw_index_dir && strcmp(h->raw_index_dir, dir) == 0) return CML_OK;
+  cml_export_raw_reset_index(h);
+  h->raw_index_dir = strdup(dir);
+  if (!h->raw_index_dir) return CML_ERR_OOM;
+  size_t stale = 0;
+  cml_status st = cml_dir_scan(dir, &h->raw_index, &stale);
+  if (st != CML_OK) {
+    cml_export_raw_reset_index(h);
+    return st;
   }
-  if (!e->raw_dir_path) return CML_ERR_OOM;
-  return cml_mkdir_p(e->raw_dir_path);
+  if (stale) cml_log(h, CML_LOG_DEBUG, "removed %zu stale temp file(s) in %s", stale, dir);
+  return CML_OK;
 }
 
-cml_status cml_exporter_open(cml *h, const cml_title *title, const cml_chapter *chapter, const cml_chapter *next_chapter,
-                             cml_exporter **out) {
-  if (!h || !title || !chapter || !out) return CML_ERR_INVALID;
-  *out = NULL;
-  cml_exporter *e = (cml_exporter *)calloc(1, sizeof(*e));
-  if (!e) return CML_ERR_OOM;
-  e->fmt = h->cfg.output;
-
-  cml_status st = CML_OK;
-  if (e->fmt == CML_OUTPUT_RAW) {
-    st = exporter_raw_init(h, title, chapter, next_chapter, e);
+static cml_status raw_chapter_begin(void *user, const cml_sink_chapter *ch, void **state) {
+  cml *h = (cml *)user;
+  raw_chapter *c = (raw_chapter *)calloc(1, sizeof(*c));
+  if (!c) return CML_ERR_OOM;
+  char *title_dir = path_join2(h->cfg.out_dir, ch->title_dir);
+  if (title_dir && h->cfg.chapter_subdir) {
+    c->dir = path_join2(title_dir, ch->chapter_dir);
+    free(title_dir);
   } else {
-    extern cml_status cml_export_cbz_init(cml *h, const cml_title *title, const cml_chapter *chapter,
-                                          const cml_chapter *next, cml_exporter *e);
-    st = cml_export_cbz_init(h, title, chapter, next_chapter, e);
+    c->dir = title_dir;
   }
-
+  cml_status st = c->dir ? cml_mkdir_p(c->dir) : CML_ERR_OOM;
+  if (st == CML_OK) st = raw_index_load(h, c->dir);
   if (st != CML_OK) {
-    cml_exporter_close_destroy(e, false);
+    free(c->dir);
+    free(c);
     return st;
   }
-  *out = e;
+  *state = c;
   return CML_OK;
 }
 
-void cml_exporter_close_destroy(cml_exporter *e, bool success) {
-  if (!e) return;
-  if (e->zip && e->fmt == CML_OUTPUT_CBZ) {
-    extern cml_status cml_export_cbz_finalize(cml_exporter *e);
-    extern void cml_export_cbz_abort(cml_exporter *e);
-    if (success) {
-      (void)cml_export_cbz_finalize(e);
-    } else {
-      cml_export_cbz_abort(e);
-    }
-  } else if (e->zip) {
-    zip_close(e->zip);
-  }
-  e->zip = NULL;
-  free(e->title_dir_name);
-  free(e->chapter_dir_name);
-  free(e->chapter_prefix);
-  free(e->chapter_suffix);
-  free(e->title_dir_path);
-  free(e->raw_dir_path);
-  free(e->cbz_path);
-  free(e);
+static int raw_page_exists(void *user, void *state, const cml_sink_page *page) {
+  (void)state;
+  cml *h = (cml *)user;
+  return cml_strset_has(&h->raw_index, page->filename);
 }
 
-int cml_exporter_skip_image(cml_exporter *e, int is_range, uint32_t start, uint32_t stop) {
-  if (!e) return 1;
-  if (e->skip_all) return 1;
-  if (e->fmt == CML_OUTPUT_CBZ) return 0;
-  char *filename = NULL;
-  if (cml_format_page_filename(e->chapter_prefix, e->chapter_suffix, is_range, start, stop, "jpg", &filename) != CML_OK)
-    return 0;
-  char *path = path_join2(e->raw_dir_path, filename);
-  free(filename);
-  if (!path) return 0;
-  int exists = cml_exists(path);
-  free(path);
-  return exists;
-}
-
-cml_status cml_exporter_add_image(cml_exporter *e, const uint8_t *data, size_t len, int is_range, uint32_t start,
-                                  uint32_t stop) {
-  if (!e || !data) return CML_ERR_INVALID;
-  if (e->skip_all) return CML_OK;
-  if (e->fmt == CML_OUTPUT_CBZ) {
-    extern cml_status cml_export_cbz_add(cml_exporter *e, const uint8_t *data, size_t len, int is_range, uint32_t start,
-                                         uint32_t stop);
-    return cml_export_cbz_add(e, data, len, is_range, start, stop);
-  }
-  char *filename = NULL;
-  cml_status st = cml_format_page_filename(e->chapter_prefix, e->chapter_suffix, is_range, start, stop, "jpg", &filename);
-  if (st != CML_OK) return st;
-  char *path = path_join2(e->raw_dir_path, filename);
-  free(filename);
+static cml_status raw_page(void *user, void *state, const cml_sink_page *page) {
+  cml *h = (cml *)user;
+  raw_chapter *c = (raw_chapter *)state;
+  char *path = path_join2(c->dir, page->filename);
   if (!path) return CML_ERR_OOM;
-  st = cml_write_file_atomic(path, data, len);
+  cml_status st = CML_ERR_IO;
+  // Link to the store's copy so the same page costs no extra space; copy when linking is impossible.
+  if (page->stored_path) st = cml_link_file_atomic(page->stored_path, path);
+  if (st != CML_OK) st = cml_write_file_atomic(path, page->data, page->len);
   free(path);
+  if (st == CML_OK && cml_strset_add(&h->raw_index, page->filename) != 0) st = CML_ERR_OOM;
   return st;
 }
+
+static cml_status raw_chapter_end(void *user, void *state, bool success) {
+  (void)user;
+  (void)success;
+  raw_chapter *c = (raw_chapter *)state;
+  if (!c) return CML_OK;
+  free(c->dir);
+  free(c);
+  return CML_OK;
+}
+
+// RAW output has no per-chapter completion marker: the page count is only known from the viewer,
+// so there is no chapter_exists.
+const cml_sink cml_raw_sink = {
+    .user = NULL,
+    .chapter_begin = raw_chapter_begin,
+    .page_exists = raw_page_exists,
+    .page = raw_page,
+    .chapter_end = raw_chapter_end,
+    .chapter_exists = NULL,
+    .run_end = NULL,
+};
@@ -0,0 +1,483 @@
+#include "cml_internal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Streams each chapter as a CBZ (stored ZIP) to S3-compatible storage. Pages are framed as ZIP
+// entries into a part buffer; every full part_size bytes go out as one UploadPart, so memory stays
+// at about one part plus one page. The object only appears once CompleteMultipartUpload succeeds
+// (or the single PutObject for chapters smaller than one part); a failed chapter aborts its upload.
+
+typedef struct {
+  cml *h;
+  char *key_enc;  // URI-encoded object key
+  char *chapter_dir;  // entry names are <chapter_dir>/<page>, as in the CBZ sink
+  bool skip_all;
+  size_t part_size;
+
+  uint8_t *buf;  // bytes of the archive not uploaded yet
+  size_t len;
+  size_t cap;
+  uint64_t offset;  // archive offset of the next entry
+
+  cml_zip_entry *entries;
+  size_t entries_len;
+  size_t entries_cap;
+
+  char *upload_id;  // set once the multipart upload exists
+  char **etags;
+  size_t parts;
+  size_t parts_cap;
+} s3_chapter;
+
+static int unreserved(unsigned char ch) {
+  return (ch >= 'A' && ch <= 'Z') || (ch >= 'a' && ch <= 'z') || (ch >= '0' && ch <= '9') || ch == '-' || ch == '_' ||
+         ch == '.' || ch == '~';
+}
+
+// SigV4 URI encoding; '/' is kept for object keys.
+static char *uri_encode(const char *s, bool keep_slash) {
+  size_t n = strlen(s);
+  char *out = (char *)malloc(n * 3 + 1);
+  if (!out) return NULL;
+  char *p = out;
+  for (const unsigned char *q = (const unsigned char *)s; *q; q++) {
+    if (unreserved(*q) || (keep_slash && *q == '/')) {
+      *p++ = (char)*q;
+    } else {
+      snprintf(p, 4, "%%%02X", *q);
+      p += 3;
+    }
+  }
+  *p = '\0';
+  return out;
+}
+
+static void hex32(const uint8_t d[32], char out[65]) {
+  for (int i = 0; i < 32; i++) snprintf(out + i * 2, 3, "%02x", d[i]);
+}
+
+cml_status cml_sigv4_sign(const char *secret_key, const char *region, const char *amz_date, const char *canonical,
+                          char out[65]) {
+  char date[9];
+  snprintf(date, sizeof(date), "%.8s", amz_date);
+  char canonical_hash[65];
+  cml_sha256_hex(canonical, strlen(canonical), canonical_hash);
+  char to_sign[320];
+  snprintf(to_sign, sizeof(to_sign), "AWS4-HMAC-SHA256\n%s\n%s/%s/s3/aws4_request\n%s", amz_date, date, region,
+           canonical_hash);
+
+  // kSigning = HMAC(HMAC(HMAC(HMAC("AWS4" + secret, date), region), "s3"), "aws4_request")
+  size_t secret_len = strlen(secret_key) + 4;
+  char *secret = (char *)malloc(secret_len + 1);
+  if (!secret) return CML_ERR_OOM;
+  snprintf(secret, secret_len + 1, "AWS4%s", secret_key);
+  uint8_t k[32];
+  cml_hmac_sha256(secret, secret_len, date, strlen(date), k);
+  cml_hmac_sha256(k, 32, region, strlen(region), k);
+  cml_hmac_sha256(k, 32, "s3", 2, k);
+  cml_hmac_sha256(k, 32, "aws4_request", 12, k);
+  uint8_t sig[32];
+  cml_hmac_sha256(k, 32, to_sign, strlen(to_sign), sig);
+  memset(secret, 0, secret_len);
+  free(secret);
+  hex32(sig, out);
+  return CML_OK;
+}
+
+cml_status cml_s3_sign(const cml_s3_signed *r, const char *region, const char *secret_key, char out[65]) {
+  size_t n = strlen(r->method) + strlen(r->uri) + strlen(r->query) + r->host_len + 2 * strlen(r->payload_hash) +
+             strlen(r->amz_date) + 128;
+  char *canonical = (char *)malloc(n);
+  if (!canonical) return CML_ERR_OOM;
+  snprintf(canonical, n,
+           "%s\n%s\n%s\nhost:%.*s\nx-amz-content-sha256:%s\nx-amz-date:%s\n\nhost;x-amz-content-sha256;x-amz-date\n%s",
+           r->method, r->uri, r->query, (int)r->host_len, r->host, r->payload_hash, r->amz_date, r->payload_hash);
+  cml_status st = cml_sigv4_sign(secret_key, region, r->amz_date, canonical, out);
+  free(canonical);
+  return st;
+}
+
+// Sends a signed request for the chapter's object. query must already be in canonical form.
+static cml_status s3_send(s3_chapter *c, const char *method, const char *query, const char *content_type,
+                          const uint8_t *body, size_t body_len, bool quiet_404, cml_http_resp *resp) {
+  const cml_s3_config *s3 = c->h->cfg.s3;
+  const char *authority = strstr(s3->endpoint, "://");
+  authority = authority ? authority + 3 : s3->endpoint;
+  size_t host_len = strcspn(authority, "/");
+  const char *base_path = authority + host_len;
+  size_t base_len = strlen(base_path);
+  while (base_len > 0 && base_path[base_len - 1] == '/') base_len--;
+
+  char payload_hash[65];
+  cml_sha256_hex(body ? (const void *)body : "", body ? body_len : 0, payload_hash);
+  char amz_date[17];
+  char date[9];
+  time_t now = time(NULL);
+  struct tm tm;
+  gmtime_r(&now, &tm);
+  strftime(amz_date, sizeof(amz_date), "%Y%m%dT%H%M%SZ", &tm);
+  strftime(date, sizeof(date), "%Y%m%d", &tm);
+
+  char *bucket = uri_encode(s3->bucket, false);
+  size_t n = base_len + (bucket ? strlen(bucket) : 0) + strlen(c->key_enc) + 3;
+  char *uri = bucket ? (char *)malloc(n) : NULL;
+  size_t url_len = strlen(s3->endpoint) + n + strlen(query) + 2;
+  char *url = uri ? (char *)malloc(url_len) : NULL;
+  if (!url) {
+    free(bucket);
+    free(uri);
+    return CML_ERR_OOM;
+  }
+  snprintf(uri, n, "%.*s/%s/%s", (int)base_len, base_path, bucket, c->key_enc);
+  snprintf(url, url_len, "%.*s%s%s%s", (int)(authority + host_len - s3->endpoint), s3->endpoint, uri, *query ? "?" : "",
+           query);
+
+  char scope[128];
+  snprintf(scope, sizeof(scope), "%s/%s/s3/aws4_request", date, s3->region);
+  const cml_s3_signed sr = {.method = method,
+                            .uri = uri,
+                            .query = query,
+                            .host = authority,
+                            .host_len = host_len,
+                            .payload_hash = payload_hash,
+                            .amz_date = amz_date};
+  char sig_hex[65];
+  if (cml_s3_sign(&sr, s3->region, s3->secret_key, sig_hex) != CML_OK) {
+    free(bucket);
+    free(uri);
+    free(url);
+    return CML_ERR_OOM;
+  }
+
+  char h_auth[512];
+  char h_date[64];
+  char h_hash[96];
+  char h_type[128];
+  snprintf(h_auth, sizeof(h_auth),
+           "Authorization: AWS4-HMAC-SHA256 Credential=%s/%s, SignedHeaders=host;x-amz-content-sha256;x-amz-date, "
+           "Signature=%s",
+           s3->access_key, scope, sig_hex);
+  snprintf(h_date, sizeof(h_date), "x-amz-date: %s", amz_date);
+  snprintf(h_hash, sizeof(h_hash), "x-amz-content-sha256: %s", payload_hash);
+  snprintf(h_type, sizeof(h_type), "Content-Type:%s%s", content_type ? " " : "", content_type ? content_type : "");
+  struct curl_slist *headers = NULL;
+  struct curl_slist *next = NULL;
+  const char *lines[] = {h_auth, h_date, h_hash, h_type, "Expect:"};
+  for (size_t i = 0; i < sizeof(lines) / sizeof(lines[0]); i++) {
+    next = curl_slist_append(headers, lines[i]);
+    if (!next) break;
+    headers = next;
+  }
+
+  cml_status st = CML_ERR_OOM;
+  if (next) {
+    cml_http_req req = {.method = method,
+                        .url = url,
+                        .headers = headers,
+                        .body = body,
+                        .body_len = body_len,
+                        .quiet_404 = quiet_404};
+    st = cml_http_send(c->h, &req, resp);
+  }
+  curl_slist_free_all(headers);
+  free(bucket);
+  free(uri);
+  free(url);
+  return st;
+}
+
+static int body_has(const cml_bytes *b, const char *needle) {
+  if (!b->data) return 0;
+  char *text = strndup((const char *)b->data, b->len);
+  int found = text && strstr(text, needle) != NULL;
+  free(text);
+  return found;
+}
+
+static char *xml_value(const cml_bytes *b, const char *tag) {
+  char open[64];
+  char close[64];
+  snprintf(open, sizeof(open), "<%s>", tag);
+  snprintf(close, sizeof(close), "</%s>", tag);
+  if (!b->data) return NULL;
+  char *text = strndup((const char *)b->data, b->len);
+  if (!text) return NULL;
+  char *a = strstr(text, open);
+  char *z = a ? strstr(a, close) : NULL;
+  char *out = z ? strndup(a + strlen(open), (size_t)(z - a - (ptrdiff_t)strlen(open))) : NULL;
+  free(text);
+  return out;
+}
+
+static cml_status upload_create(s3_chapter *c) {
+  cml_http_resp resp = {0};
+  cml_status st = s3_send(c, "POST", "uploads=", "application/vnd.comicbook+zip", NULL, 0, false, &resp);
+  if (st == CML_OK) {
+    c->upload_id = xml_value(&resp.body, "UploadId");
+    if (!c->upload_id) st = CML_ERR_PROTO;
+  }
+  cml_http_resp_free(&resp);
+  return st;
+}
+
+static char *part_query(const s3_chapter *c, size_t part_no) {
+  char *id = uri_encode(c->upload_id, false);
+  if (!id) return NULL;
+  size_t n = strlen(id) + 48;
+  char *q = (char *)malloc(n);
+  if (q) {
+    if (part_no)
+      snprintf(q, n, "partNumber=%zu&uploadId=%s", part_no, id);
+    else
+      snprintf(q, n, "uploadId=%s", id);
+  }
+  free(id);
+  return q;
+}
+
+static cml_status upload_part(s3_chapter *c, const uint8_t *data, size_t len) {
+  cml_status st = c->upload_id ? CML_OK : upload_create(c);
+  if (st != CML_OK) return st;
+  if (c->parts == c->parts_cap) {
+    size_t next = c->parts_cap ? (c->parts_cap * 2) : 16;
+    void *p = realloc(c->etags, next * sizeof(char *));
+    if (!p) return CML_ERR_OOM;
+    c->etags = (char **)p;
+    c->parts_cap = next;
+  }
+  char *q = part_query(c, c->parts + 1);
+  if (!q) return CML_ERR_OOM;
+  cml_http_resp resp = {0};
+  st = s3_send(c, "PUT", q, NULL, data, len, false, &resp);
+  free(q);
+  if (st == CML_OK && !resp.etag) st = CML_ERR_PROTO;
+  if (st == CML_OK) {
+    c->etags[c->parts++] = resp.etag;
+    resp.etag = NULL;
+  }
+  cml_http_resp_free(&resp);
+  return st;
+}
+
+static cml_status upload_complete(s3_chapter *c) {
+  size_t n = 128;
+  for (size_t i = 0; i < c->parts; i++) n += strlen(c->etags[i]) + 80;
+  char *xml = (char *)malloc(n);
+  char *q = xml ? part_query(c, 0) : NULL;
+  if (!q) {
+    free(xml);
+    return CML_ERR_OOM;
+  }
+  size_t off = (size_t)snprintf(xml, n, "<CompleteMultipartUpload>");
+  for (size_t i = 0; i < c->parts; i++)
+    off += (size_t)snprintf(xml + off, n - off, "<Part><PartNumber>%zu</PartNumber><ETag>%s</ETag></Part>", i + 1,
+                            c->etags[i]);
+  off += (size_t)snprintf(xml + off, n - off, "</CompleteMultipartUpload>");
+  cml_http_resp resp = {0};
+  cml_status st = s3_send(c, "POST", q, "application/xml", (const uint8_t *)xml, off, false, &resp);
+  // CompleteMultipartUpload can fail after answering 200; the error is in the body.
+  if (st == CML_OK && body_has(&resp.body, "<Error>")) st = CML_ERR_HTTP;
+  cml_http_resp_free(&resp);
+  free(q);
+  free(xml);
+  return st;
+}
+
+static void upload_abort(s3_chapter *c) {
+  if (!c->upload_id) return;
+  char *q = part_query(c, 0);
+  if (!q) return;
+  cml_http_resp resp = {0};
+  if (s3_send(c, "DELETE", q, NULL, NULL, 0, false, &resp) != CML_OK)
+    cml_log(c->h, CML_LOG_WARN, "could not abort multipart upload %s", c->upload_id);
+  cml_http_resp_free(&resp);
+  free(q);
+}
+
+static cml_status buf_append(s3_chapter *c, const uint8_t *data, size_t len) {
+  if (c->len + len > c->cap) {
+    size_t next = c->cap ? c->cap : 65536;
+    while (next < c->len + len) next *= 2;
+    uint8_t *p = (uint8_t *)realloc(c->buf, next);
+    if (!p) return CML_ERR_OOM;
+    // The part buffer counts against the memory budget like the pages it is built from.
+    cml_mem_charge(c->h, next - c->cap);
+    c->buf = p;
+    c->cap = next;
+  }
+  memcpy(c->buf + c->len, data, len);
+  c->len += len;
+  return CML_OK;
+}
+
+// Uploads whole parts and keeps the remainder buffered.
+static cml_status flush_parts(s3_chapter *c) {
+  size_t off = 0;
+  cml_status st = CML_OK;
+  while (st == CML_OK && c->len - off >= c->part_size) {
+    st = upload_part(c, c->buf + off, c->part_size);
+    if (st == CML_OK) off += c->part_size;
+  }
+  if (off) {
+    memmove(c->buf, c->buf + off, c->len - off);
+    c->len -= off;
+  }
+  return st;
+}
+
+static void s3_chapter_free(s3_chapter *c) {
+  if (!c) return;
+  for (size_t i = 0; i < c->entries_len; i++) free(c->entries[i].name);
+  for (size_t i = 0; i < c->parts; i++) free(c->etags[i]);
+  free(c->entries);
+  free(c->etags);
+  free(c->upload_id);
+  cml_mem_release(c->h, c->cap);
+  free(c->buf);
+  free(c->key_enc);
+  free(c->chapter_dir);
+  free(c);
+}
+
+static char *object_key(const cml *h, const cml_sink_chapter *ch) {
+  const char *prefix = h->cfg.s3->key_prefix ? h->cfg.s3->key_prefix : "";
+  size_t n = strlen(prefix) + strlen(ch->title_dir) + strlen(ch->chapter_dir) + 8;
+  char *key = (char *)malloc(n);
+  if (!key) return NULL;
+  snprintf(key, n, "%s%s/%s.cbz", prefix, ch->title_dir, ch->chapter_dir);
+  char *enc = uri_encode(key, true);
+  free(key);
+  return enc;
+}
+
+static cml_status object_exists(s3_chapter *c, int *out) {
+  cml_http_resp resp = {0};
+  cml_status st = s3_send(c, "HEAD", "", NULL, NULL, 0, true, &resp);
+  *out = (st == CML_OK);
+  if (st == CML_ERR_HTTP && resp.code == 404) st = CML_OK;
+  cml_http_resp_free(&resp);
+  return st;
+}
+
+static cml_status s3_chapter_begin(void *user, const cml_sink_chapter *ch, void **state) {
+  cml *h = (cml *)user;
+  s3_chapter *c = (s3_chapter *)calloc(1, sizeof(*c));
+  if (!c) return CML_ERR_OOM;
+  c->h = h;
+  c->part_size = h->cfg.s3->part_size ? h->cfg.s3->part_size : CML_S3_DEFAULT_PART;
+  c->key_enc = object_key(h, ch);
+  c->chapter_dir = strdup(ch->chapter_dir);
+  if (!c->key_enc || !c->chapter_dir) {
+    s3_chapter_free(c);
+    return CML_ERR_OOM;
+  }
+  int exists = 0;
+  cml_status st = object_exists(c, &exists);
+  if (st != CML_OK) {
+    s3_chapter_free(c);
+    return st;
+  }
+  c->skip_all = exists != 0;
+  *state = c;
+  return CML_OK;
+}
+
+static int s3_chapter_exists(void *user, const cml_sink_chapter *ch) {
+  s3_chapter c = {.h = (cml *)user};
+  c.key_enc = object_key(c.h, ch);
+  int exists = 0;
+  if (c.key_enc && object_exists(&c, &exists) != CML_OK) exists = 0;
+  free(c.key_enc);
+  return exists;
+}
+
+static int s3_page_exists(void *user, void *state, const cml_sink_page *page) {
+  (void)user;
+  (void)page;
+  return ((s3_chapter *)state)->skip_all;
+}
+
+static cml_status s3_page(void *user, void *state, const cml_sink_page *page) {
+  (void)user;
+  s3_chapter *c = (s3_chapter *)state;
+  if (c->skip_all) return CML_OK;
+  if ((uint64_t)page->len >= 0xffffffffu) return CML_ERR_INVALID;
+
+  if (c->entries_len == c->entries_cap) {
+    size_t next = c->entries_cap ? (c->entries_cap * 2) : 32;
+    void *p = realloc(c->entries, next * sizeof(cml_zip_entry));
+    if (!p) return CML_ERR_OOM;
+    c->entries = (cml_zip_entry *)p;
+    c->entries_cap = next;
+  }
+  cml_zip_entry *e = &c->entries[c->entries_len];
+  memset(e, 0, sizeof(*e));
+  size_t name_len = strlen(c->chapter_dir) + strlen(page->filename) + 2;
+  e->name = (char *)malloc(name_len);
+  if (!e->name) return CML_ERR_OOM;
+  snprintf(e->name, name_len, "%s/%s", c->chapter_dir, page->filename);
+  e->offset = c->offset;
+  e->size = page->len;
+  e->crc = page->len ? cml_crc32(page->data, page->len) : 0;
+  cml_zip_dos_now(&e->dos_time, &e->dos_date);
+  c->entries_len++;
+
+  uint8_t *hdr = (uint8_t *)malloc(30 + strlen(e->name));
+  if (!hdr) return CML_ERR_OOM;
+  size_t hdr_len = cml_zip_local_header(hdr, e);
+  cml_status st = buf_append(c, hdr, hdr_len);
+  free(hdr);
+  if (st == CML_OK) st = buf_append(c, page->data, page->len);
+  if (st != CML_OK) return st;
+  cml_buf_note_copy(c->h, page->len);
+  c->offset += hdr_len + page->len;
+  return flush_parts(c);
+}
+
+static cml_status s3_finalize(s3_chapter *c) {
+  uint8_t *cd = NULL;
+  size_t cd_len = 0;
+  cml_status st = cml_zip_central_dir(c->entries, c->entries_len, c->offset, &cd, &cd_len);
+  if (st != CML_OK) return st;
+  st = buf_append(c, cd, cd_len);
+  free(cd);
+  if (st != CML_OK) return st;
+
+  if (!c->upload_id) {
+    // Smaller than one part: a single PutObject is just as atomic.
+    cml_http_resp resp = {0};
+    st = s3_send(c, "PUT", "", "application/vnd.comicbook+zip", c->buf, c->len, false, &resp);
+    cml_http_resp_free(&resp);
+    return st;
+  }
+  st = flush_parts(c);
+  if (st == CML_OK && c->len) st = upload_part(c, c->buf, c->len);
+  if (st == CML_OK) st = upload_complete(c);
+  return st;
+}
+
+static cml_status s3_chapter_end(void *user, void *state, bool success) {
+  (void)user;
+  s3_chapter *c = (s3_chapter *)state;
+  if (!c) return CML_OK;
+  cml_status st = CML_OK;
+  if (!c->skip_all) {
+    if (success) st = s3_finalize(c);
+    if (!success || st != CML_OK) upload_abort(c);
+  }
+  s3_chapter_free(c);
+  return st;
+}
+
+const cml_sink cml_s3_sink = {
+    .user = NULL,
+    .chapter_begin = s3_chapter_begin,
+    .page_exists = s3_page_exists,
+    .page = s3_page,
+    .chapter_end = s3_chapter_end,
+    .chapter_exists = s3_chapter_exists,
+    .run_end = NULL,
+};
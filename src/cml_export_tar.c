@@ -0,0 +1,221 @@
+#include "cml_internal.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+// Streams pages as a POSIX (ustar/pax) tar to cfg.out_fd. Nothing is written to the filesystem;
+// paths are <title>/<chapter>/<page>.jpg. Paths that do not fit the ustar name/prefix fields get a
+// pax extended header. A chapter's pages are written as they arrive, so an empty
+// <title>/<chapter>/.complete after them is what tells a reader the chapter is whole.
+
+#define TAR_BLOCK 512
+#define TAR_COMPLETE ".complete"
+
+static const uint8_t zero_block[TAR_BLOCK];
+
+static cml_status writev_all(int fd, struct iovec *iov, int iovcnt) {
+  while (iovcnt > 0) {
+    ssize_t w = writev(fd, iov, iovcnt);
+    if (w < 0) {
+      if (errno == EINTR) continue;
+      return CML_ERR_IO;
+    }
+    size_t left = (size_t)w;
+    while (iovcnt > 0 && left >= iov->iov_len) {
+      left -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (uint8_t *)iov->iov_base + left;
+      iov->iov_len -= left;
+    }
+  }
+  return CML_OK;
+}
+
+static void put_octal(char *field, size_t width, uint64_t v) {
+  // width - 1 digits followed by NUL, zero padded
+  field[width - 1] = '\0';
+  for (size_t i = width - 1; i > 0; i--) {
+    field[i - 1] = (char)('0' + (v & 7));
+    v >>= 3;
+  }
+}
+
+static void header_init(uint8_t *h, const char *name, const char *prefix, uint64_t size, char type, int64_t mtime) {
+  memset(h, 0, TAR_BLOCK);
+  char *b = (char *)h;
+  if (name) memcpy(b, name, strlen(name));
+  put_octal(b + 100, 8, type == '5' ? 0755 : 0644);
+  put_octal(b + 108, 8, 0);
+  put_octal(b + 116, 8, 0);
+  put_octal(b + 124, 12, size);
+  put_octal(b + 136, 12, (uint64_t)(mtime > 0 ? mtime : 0));
+  b[156] = type;
+  memcpy(b + 257, "ustar", 6);
+  memcpy(b + 263, "00", 2);
+  if (prefix) memcpy(b + 345, prefix, strlen(prefix));
+
+  memset(b + 148, ' ', 8);
+  unsigned sum = 0;
+  for (size_t i = 0; i < TAR_BLOCK; i++) sum += h[i];
+  put_octal(b + 148, 7, sum);
+  b[155] = ' ';
+}
+
+// Splits path into ustar prefix (<= 155) and name (<= 100) at a '/'. Returns 0 if it cannot.
+static int split_ustar(const char *path, char *prefix, char *name) {
+  size_t n = strlen(path);
+  if (n <= 100) {
+    prefix[0] = '\0';
+    memcpy(name, path, n + 1);
+    return 1;
+  }
+  for (size_t i = n; i > 0; i--) {
+    if (path[i - 1] != '/') continue;
+    size_t plen = i - 1;
+    size_t nlen = n - i;
+    if (nlen == 0 || nlen > 100) return 0;
+    if (plen > 155) continue;
+    memcpy(prefix, path, plen);
+    prefix[plen] = '\0';
+    memcpy(name, path + i, nlen + 1);
+    return 1;
+  }
+  return 0;
+}
+
+// "<len> path=<path>\n" where <len> counts the whole record including its own digits.
+static char *pax_path_record(const char *path, size_t *out_len) {
+  size_t body = strlen(" path=") + strlen(path) + 1;
+  size_t len = body + 1;
+  for (;;) {
+    char digits[32];
+    int d = snprintf(digits, sizeof(digits), "%zu", len);
+    if (body + (size_t)d == len) break;
+    len = body + (size_t)d;
+  }
+  char *rec = (char *)malloc(len + 1);
+  if (!rec) return NULL;
+  snprintf(rec, len + 1, "%zu path=%s\n", len, path);
+  *out_len = len;
+  return rec;
+}
+
+static cml_status tar_write_entry(int fd, const char *path, const uint8_t *data, size_t len, int64_t mtime) {
+  uint8_t pax_hdr[TAR_BLOCK];
+  uint8_t hdr[TAR_BLOCK];
+  char prefix[156];
+  char name[101];
+  char *pax = NULL;
+  size_t pax_len = 0;
+
+  if (!split_ustar(path, prefix, name)) {
+    pax = pax_path_record(path, &pax_len);
+    if (!pax) return CML_ERR_OOM;
+    header_init(pax_hdr, "PaxHeader", NULL, pax_len, 'x', mtime);
+    // Readers use the pax path; the ustar name is only a truncated fallback.
+    snprintf(name, sizeof(name), "%.100s", path);
+    prefix[0] = '\0';
+  }
+  header_init(hdr, name, prefix, len, '0', mtime);
+
+  struct iovec iov[6];
+  int n = 0;
+  if (pax) {
+    iov[n++] = (struct iovec){.iov_base = pax_hdr, .iov_len = TAR_BLOCK};
+    iov[n++] = (struct iovec){.iov_base = pax, .iov_len = pax_len};
+    if (pax_len % TAR_BLOCK)
+      iov[n++] = (struct iovec){.iov_base = (void *)zero_block, .iov_len = TAR_BLOCK - pax_len % TAR_BLOCK};
+  }
+  iov[n++] = (struct iovec){.iov_base = hdr, .iov_len = TAR_BLOCK};
+  if (len) iov[n++] = (struct iovec){.iov_base = (void *)data, .iov_len = len};
+  if (len % TAR_BLOCK) iov[n++] = (struct iovec){.iov_base = (void *)zero_block, .iov_len = TAR_BLOCK - len % TAR_BLOCK};
+  cml_status st = writev_all(fd, iov, n);
+  free(pax);
+  return st;
+}
+
+typedef struct {
+  char *dir;  // <title>/<chapter>
+} tar_chapter;
+
+static cml_status tar_chapter_begin(void *user, const cml_sink_chapter *ch, void **state) {
+  cml *h = (cml *)user;
+  if (h->cfg.out_fd <= 0) return CML_ERR_INVALID;
+  tar_chapter *c = (tar_chapter *)calloc(1, sizeof(*c));
+  if (!c) return CML_ERR_OOM;
+  size_t n = strlen(ch->title_dir) + strlen(ch->chapter_dir) + 2;
+  c->dir = (char *)malloc(n);
+  if (!c->dir) {
+    free(c);
+    return CML_ERR_OOM;
+  }
+  snprintf(c->dir, n, "%s/%s", ch->title_dir, ch->chapter_dir);
+  if (!h->tar_started) {
+    h->tar_started = true;
+    h->tar_mtime = (int64_t)time(NULL);
+  }
+  *state = c;
+  return CML_OK;
+}
+
+static cml_status tar_page(void *user, void *state, const cml_sink_page *page) {
+  cml *h = (cml *)user;
+  tar_chapter *c = (tar_chapter *)state;
+  size_t n = strlen(c->dir) + strlen(page->filename) + 2;
+  char *path = (char *)malloc(n);
+  if (!path) return CML_ERR_OOM;
+  snprintf(path, n, "%s/%s", c->dir, page->filename);
+  cml_status st = tar_write_entry(h->cfg.out_fd, path, page->data, page->len, h->tar_mtime);
+  free(path);
+  return st;
+}
+
+static cml_status tar_chapter_end(void *user, void *state, bool success) {
+  cml *h = (cml *)user;
+  tar_chapter *c = (tar_chapter *)state;
+  if (!c) return CML_OK;
+  cml_status st = CML_OK;
+  if (success) {
+    size_t n = strlen(c->dir) + sizeof(TAR_COMPLETE) + 1;
+    char *path = (char *)malloc(n);
+    if (path) {
+      snprintf(path, n, "%s/%s", c->dir, TAR_COMPLETE);
+      st = tar_write_entry(h->cfg.out_fd, path, NULL, 0, h->tar_mtime);
+    } else {
+      st = CML_ERR_OOM;
+    }
+    free(path);
+  }
+  free(c->dir);
+  free(c);
+  return st;
+}
+
+// Terminates the archive with two zero blocks once the run is over.
+static cml_status tar_run_end(void *user) {
+  cml *h = (cml *)user;
+  if (!h->tar_started) return CML_OK;
+  h->tar_started = false;
+  struct iovec iov[2] = {{.iov_base = (void *)zero_block, .iov_len = TAR_BLOCK},
+                         {.iov_base = (void *)zero_block, .iov_len = TAR_BLOCK}};
+  return writev_all(h->cfg.out_fd, iov, 2);
+}
+
+// A stream cannot be inspected, so nothing is ever skipped.
+const cml_sink cml_tar_sink = {
+    .user = NULL,
+    .chapter_begin = tar_chapter_begin,
+    .page_exists = NULL,
+    .page = tar_page,
+    .chapter_end = tar_chapter_end,
+    .chapter_exists = NULL,
+    .run_end = tar_run_end,
+};
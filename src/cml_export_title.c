@@ -0,0 +1,187 @@
+#include "cml_internal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Title archives: every chapter of a title is appended to <out>/<title>.zip. A chapter is only
+// visible once its "<chapter>/" directory entry has been committed with the central directory.
+
+static char *path_join2(const char *a, const char *b) {
+  if (!a || !b) return NULL;
+  size_t alen = strlen(a);
+  size_t blen = strlen(b);
+  int need = (alen > 0 && a[alen - 1] != '/');
+  size_t n = alen + (need ? 1 : 0) + blen + 1;
+  char *out = (char *)malloc(n);
+  if (!out) return NULL;
+  snprintf(out, n, need ? "%s/%s" : "%s%s", a, b);
+  return out;
+}
+
+static char *path_with_ext(const char *path, const char *ext_with_dot) {
+  if (!path || !ext_with_dot) return NULL;
+  size_t n = strlen(path) + strlen(ext_with_dot) + 1;
+  char *out = (char *)malloc(n);
+  if (!out) return NULL;
+  snprintf(out, n, "%s%s", path, ext_with_dot);
+  return out;
+}
+
+typedef struct {
+  cml_zipw *archive;  // h->archive
+  char *chapter_dir;
+  bool skip_all;
+} title_chapter;
+
+void cml_export_title_close(cml *h) {
+  if (!h || !h->archive_path) return;
+  cml_zipw_close(&h->archive);
+  free(h->archive_path);
+  h->archive_path = NULL;
+}
+
+static char *archive_path(const cml *h, const char *title_dir) {
+  char *noext = path_join2(h->cfg.out_dir, title_dir);
+  char *path = noext ? path_with_ext(noext, ".zip") : NULL;
+  free(noext);
+  return path;
+}
+
+// Opens the title's archive for appending, creating it or recovering it as needed.
+static cml_status archive_get(cml *h, const char *title_dir, cml_zipw **out) {
+  *out = NULL;
+  char *path = archive_path(h, title_dir);
+  if (!path) return CML_ERR_OOM;
+  if (h->archive_path && strcmp(h->archive_path, path) == 0 && !h->archive.read_only) {
+    free(path);
+    *out = &h->archive;
+    return CML_OK;
+  }
+  cml_export_title_close(h);
+  cml_status st = cml_mkdir_p(h->cfg.out_dir);
+  if (st == CML_OK) st = cml_zipw_open(path, &h->archive);
+  if (st != CML_OK) {
+    cml_log(h, CML_LOG_ERROR, "cannot open title archive %s: %s", path, cml_status_string(st));
+    free(path);
+    return st;
+  }
+  cml_log(h, CML_LOG_DEBUG, "title archive %s: %zu entries", path, h->archive.len);
+  h->archive_path = path;
+  *out = &h->archive;
+  return CML_OK;
+}
+
+static char *chapter_marker(const char *chapter_dir) { return path_with_ext(chapter_dir, "/"); }
+
+static cml_status title_chapter_begin(void *user, const cml_sink_chapter *ch, void **state) {
+  cml *h = (cml *)user;
+  title_chapter *c = (title_chapter *)calloc(1, sizeof(*c));
+  if (!c) return CML_ERR_OOM;
+  c->chapter_dir = strdup(ch->chapter_dir);
+  char *marker = c->chapter_dir ? chapter_marker(c->chapter_dir) : NULL;
+  cml_status st = marker ? archive_get(h, ch->title_dir, &c->archive) : CML_ERR_OOM;
+  if (st != CML_OK) {
+    free(marker);
+    free(c->chapter_dir);
+    free(c);
+    return st;
+  }
+  c->skip_all = cml_zipw_has(c->archive, marker);
+  free(marker);
+  *state = c;
+  return CML_OK;
+}
+
+// Only looks, so it never writes: a title without an archive, or whose archive has no usable
+// central directory, has nothing exported yet, and recovering it is left to title_chapter_begin. An
+// archive open for appending stays open; a read-only one is kept for the title's other chapters.
+static int title_chapter_exists(void *user, const cml_sink_chapter *ch) {
+  cml *h = (cml *)user;
+  char *marker = chapter_marker(ch->chapter_dir);
+  char *path = marker ? archive_path(h, ch->title_dir) : NULL;
+  int done = 0;
+  if (path && h->archive_path && strcmp(h->archive_path, path) == 0) {
+    done = cml_zipw_has(&h->archive, marker);
+  } else if (path) {
+    cml_zipw z;
+    if (cml_zipw_open_read(path, &z) == CML_OK) {
+      done = cml_zipw_has(&z, marker);
+      if (!h->archive_path || h->archive.read_only) {
+        cml_export_title_close(h);
+        h->archive = z;
+        h->archive_path = path;
+        path = NULL;
+      } else {
+        cml_zipw_close(&z);
+      }
+    }
+  }
+  free(path);
+  free(marker);
+  return done;
+}
+
+static int title_page_exists(void *user, void *state, const cml_sink_page *page) {
+  (void)user;
+  title_chapter *c = (title_chapter *)state;
+  if (c->skip_all) return 1;
+  char *name = path_join2(c->chapter_dir, page->filename);
+  if (!name) return 0;
+  int exists = cml_zipw_has(c->archive, name);
+  free(name);
+  return exists;
+}
+
+static cml_status title_page(void *user, void *state, const cml_sink_page *page) {
+  (void)user;
+  title_chapter *c = (title_chapter *)state;
+  if (c->skip_all) return CML_OK;
+  char *name = path_join2(c->chapter_dir, page->filename);
+  if (!name) return CML_ERR_OOM;
+  cml_status st = cml_zipw_add(c->archive, name, page->data, page->len);
+  free(name);
+  return st;
+}
+
+static cml_status title_finalize(title_chapter *c) {
+  char *marker = chapter_marker(c->chapter_dir);
+  if (!marker) return CML_ERR_OOM;
+  cml_status st = cml_zipw_add(c->archive, marker, NULL, 0);
+  free(marker);
+  if (st == CML_OK) st = cml_zipw_commit(c->archive);
+  if (st != CML_OK) (void)cml_zipw_rollback(c->archive);
+  return st;
+}
+
+static cml_status title_chapter_end(void *user, void *state, bool success) {
+  (void)user;
+  title_chapter *c = (title_chapter *)state;
+  if (!c) return CML_OK;
+  cml_status st = CML_OK;
+  if (!c->skip_all) {
+    if (success) {
+      st = title_finalize(c);
+    } else {
+      (void)cml_zipw_rollback(c->archive);
+    }
+  }
+  free(c->chapter_dir);
+  free(c);
+  return st;
+}
+
+static cml_status title_run_end(void *user) {
+  cml_export_title_close((cml *)user);
+  return CML_OK;
+}
+
+const cml_sink cml_title_sink = {
+    .user = NULL,
+    .chapter_begin = title_chapter_begin,
+    .page_exists = title_page_exists,
+    .page = title_page,
+    .chapter_end = title_chapter_end,
+    .chapter_exists = title_chapter_exists,
+    .run_end = title_run_end,
+};
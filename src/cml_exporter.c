@@ -0,0 +1,232 @@
+#include "cml_internal.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Drives the active sinks (h->sinks) for one chapter: builds the output names once and hands every
+// downloaded page to each sink that still needs it. Built-in outputs are sinks too (cml_export_*.c).
+
+static void sink_chapter_fill(const cml_title *title, const cml_chapter *chapter, const char *title_dir,
+                              const char *chapter_dir, cml_sink_chapter *out) {
+  memset(out, 0, sizeof(*out));
+  out->title_id = title->title_id;
+  out->title_name = title->name;
+  out->title_author = title->author;
+  out->chapter_id = chapter->chapter_id;
+  out->chapter_name = chapter->name;
+  out->chapter_title = chapter->sub_title;
+  out->title_dir = title_dir;
+  out->chapter_dir = chapter_dir;
+}
+
+static void exporter_free(cml_exporter *e) {
+  free(e->title_dir_name);
+  free(e->chapter_dir_name);
+  free(e->chapter_prefix);
+  free(e->chapter_suffix);
+  cml_store_refs_free(&e->refs);
+  free(e);
+}
+
+cml_status cml_exporter_open(cml *h, const cml_title *title, const cml_chapter *chapter, const cml_chapter *next_chapter,
+                             cml_exporter **out) {
+  if (!h || !title || !chapter || !out) return CML_ERR_INVALID;
+  *out = NULL;
+  cml_exporter *e = (cml_exporter *)calloc(1, sizeof(*e));
+  if (!e) return CML_ERR_OOM;
+  e->h = h;
+  e->sinks = h->sinks;
+
+  cml_status st = cml_build_names(title, chapter, next_chapter, h->cfg.include_chapter_title, &e->title_dir_name,
+                                  &e->chapter_prefix, &e->chapter_suffix, &e->chapter_dir_name);
+  if (st == CML_OK && h->cfg.store_dir)
+    st = cml_store_refs_load(h, e->title_dir_name, e->chapter_dir_name, &e->refs);
+  if (st != CML_OK) {
+    exporter_free(e);
+    return st;
+  }
+
+  cml_sink_chapter ch;
+  sink_chapter_fill(title, chapter, e->title_dir_name, e->chapter_dir_name, &ch);
+  for (size_t i = 0; i < h->sinks_len; i++) {
+    st = e->sinks[i].chapter_begin(e->sinks[i].user, &ch, &e->state[i]);
+    if (st != CML_OK) {
+      // Sinks already begun see an aborted chapter.
+      (void)cml_exporter_close_destroy(e, false);
+      return st;
+    }
+    e->sinks_len = i + 1;
+  }
+  *out = e;
+  return CML_OK;
+}
+
+cml_status cml_exporter_close_destroy(cml_exporter *e, bool success) {
+  if (!e) return CML_OK;
+  // Saved for failed chapters too: their stored pages are reused by the next attempt.
+  if (e->refs.path && cml_store_refs_save(&e->refs) != CML_OK)
+    cml_log(e->h, CML_LOG_WARN, "cannot save page store refs %s", e->refs.path);
+  cml_status st = CML_OK;
+  for (size_t i = 0; i < e->sinks_len; i++) {
+    cml_status end_st = e->sinks[i].chapter_end(e->sinks[i].user, e->state[i], success);
+    if (st == CML_OK) st = end_st;
+  }
+  exporter_free(e);
+  return st;
+}
+
+cml_status cml_exporter_end_run(cml *h) {
+  if (!h) return CML_ERR_INVALID;
+  cml_status st = CML_OK;
+  for (size_t i = 0; i < h->sinks_len; i++) {
+    if (!h->sinks[i].run_end) continue;
+    cml_status end_st = h->sinks[i].run_end(h->sinks[i].user);
+    if (st == CML_OK) st = end_st;
+  }
+  return st;
+}
+
+int cml_exporter_is_complete(cml *h, const cml_title *title, const cml_chapter *chapter) {
+  if (!h || !title || !chapter) return 0;
+  for (size_t i = 0; i < h->sinks_len; i++)
+    if (!h->sinks[i].chapter_exists) return 0;
+  if (cml_names_need_next(chapter)) return 0;
+
+  char *title_dir = NULL;
+  char *prefix = NULL;
+  char *suffix = NULL;
+  char *chapter_dir = NULL;
+  if (cml_build_names(title, chapter, NULL, h->cfg.include_chapter_title, &title_dir, &prefix, &suffix, &chapter_dir) !=
+      CML_OK)
+    return 0;
+  cml_sink_chapter ch;
+  sink_chapter_fill(title, chapter, title_dir, chapter_dir, &ch);
+  int done = 1;
+  for (size_t i = 0; done && i < h->sinks_len; i++) done = h->sinks[i].chapter_exists(h->sinks[i].user, &ch);
+  free(title_dir);
+  free(prefix);
+  free(suffix);
+  free(chapter_dir);
+  return done;
+}
+
+// Hands the page to every sink that needs it.
+static cml_status deliver(cml_exporter *e, const cml_page_plan *plan, const cml_sink_page *page) {
+  cml_status st = CML_OK;
+  for (size_t i = 0; st == CML_OK && i < e->sinks_len; i++) {
+    if (!plan->need[i]) continue;
+    st = e->sinks[i].page(e->sinks[i].user, e->state[i], page);
+  }
+  return st;
+}
+
+// Like deliver, but a sink that keeps the page may take buf instead of copying it.
+static cml_status deliver_owned(cml_exporter *e, const cml_page_plan *plan, const cml_sink_page *page,
+                                cml_bytes *buf) {
+  e->h->bufs.offered = buf;
+  cml_status st = deliver(e, plan, page);
+  e->h->bufs.offered = NULL;
+  return st;
+}
+
+static cml_status page_filename(const cml_exporter *e, const cml_page_plan *plan, char **out) {
+  return cml_format_page_filename(e->chapter_prefix, e->chapter_suffix, plan->is_range, plan->start, plan->stop, "jpg",
+                                  out);
+}
+
+cml_status cml_exporter_plan_image(cml_exporter *e, int is_range, uint32_t start, uint32_t stop, cml_page_plan *out) {
+  if (!e || !out) return CML_ERR_INVALID;
+  memset(out, 0, sizeof(*out));
+  out->is_range = is_range != 0;
+  out->start = start;
+  out->stop = stop;
+  char *filename = NULL;
+  cml_status st = page_filename(e, out, &filename);
+  if (st != CML_OK) return st;
+  cml_sink_page page = {.filename = filename, .is_range = out->is_range, .start = start, .stop = stop};
+  out->action = CML_PAGE_SKIP;
+  for (size_t i = 0; i < e->sinks_len; i++) {
+    const cml_sink *s = &e->sinks[i];
+    out->need[i] = !s->page_exists || !s->page_exists(s->user, e->state[i], &page);
+    if (out->need[i]) out->action = CML_PAGE_FETCH;
+  }
+  if (out->action == CML_PAGE_FETCH && e->refs.path && cml_store_refs_find(&e->refs, filename))
+    out->action = CML_PAGE_STORED;
+  free(filename);
+  return CML_OK;
+}
+
+// Serves the page from the store, where an earlier run recorded it for this chapter.
+cml_status cml_exporter_add_stored(cml_exporter *e, const cml_page_plan *plan, int *out_served) {
+  if (!e || !plan || !out_served) return CML_ERR_INVALID;
+  *out_served = 0;
+  char *filename = NULL;
+  cml_status st = page_filename(e, plan, &filename);
+  if (st != CML_OK) return st;
+  const char *key = cml_store_refs_find(&e->refs, filename);
+  char *path = key ? cml_store_object_path(e->h, key) : NULL;
+  cml_bytes b = {0};
+  if (!path || cml_read_file_pooled(e->h, path, &b) != CML_OK) {
+    free(path);
+    free(filename);
+    return CML_OK;
+  }
+  // A damaged object is dropped and the page downloaded again.
+  char actual[CML_STORE_KEY_LEN + 1];
+  cml_store_key(b.data, b.len, actual);
+  if (strcmp(actual, key) != 0) {
+    unlink(path);
+    free(path);
+    free(filename);
+    cml_buf_put(e->h, &b);
+    return CML_OK;
+  }
+  cml_sink_page page = {.filename = filename,
+                        .is_range = plan->is_range,
+                        .start = plan->start,
+                        .stop = plan->stop,
+                        .data = b.data,
+                        .len = b.len,
+                        .stored_path = path};
+  st = deliver_owned(e, plan, &page, &b);
+  *out_served = 1;
+  e->h->store_stats.pages++;
+  e->h->store_stats.pages_deduped++;
+  e->h->store_stats.pages_reused++;
+  e->h->store_stats.bytes += page.len;
+  e->h->store_stats.bytes_saved += page.len;
+  free(path);
+  free(filename);
+  cml_buf_put(e->h, &b);
+  return st;
+}
+
+cml_status cml_exporter_add_image(cml_exporter *e, const cml_page_plan *plan, cml_bytes *img) {
+  if (!e || !plan || !img || !img->data) return CML_ERR_INVALID;
+  char *filename = NULL;
+  cml_status st = page_filename(e, plan, &filename);
+  if (st != CML_OK) {
+    cml_buf_put(e->h, img);
+    return st;
+  }
+  cml_sink_page page = {.filename = filename,
+                        .is_range = plan->is_range,
+                        .start = plan->start,
+                        .stop = plan->stop,
+                        .data = img->data,
+                        .len = img->len};
+
+  char *stored = NULL;
+  if (e->refs.path) {
+    char key[CML_STORE_KEY_LEN + 1];
+    st = cml_store_put(e->h, img->data, img->len, key, &stored);
+    if (st == CML_OK) st = cml_store_refs_set(&e->refs, filename, key);
+    page.stored_path = stored;
+  }
+  if (st == CML_OK) st = deliver_owned(e, plan, &page, img);
+  cml_buf_put(e->h, img);
+  free(stored);
+  free(filename);
+  return st;
+}
@@ -1,5 +1,6 @@
 #include "cml_internal.h"
 
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
@@ -7,6 +8,7 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 int cml_exists(const char *path) {
@@ -70,19 +72,42 @@ cml_status cml_rename_overwrite(const char *src, const char *dst) {
   return CML_ERR_IO;
 }
 
-cml_status cml_write_file_atomic(const char *path, const uint8_t *data, size_t len) {
-  if (!path || !data) return CML_ERR_INVALID;
-  size_t n = strlen(path) + 8;
-  char *tmp = (char *)malloc(n);
-  if (!tmp) return CML_ERR_OOM;
-  snprintf(tmp, n, "%s.tmp", path);
+// Temporary files are "<dir>/.<name>" CML_TMP_MARK "XXXXXX" next to their destination, so that
+// cml_dir_scan can tell them from anything else in the directory.
+#define CML_TMP_MARK ".cml-"
+// A temporary file this old is a leftover: writers rename theirs within seconds.
+#define CML_TMP_STALE_SEC 600
 
-  int fd = open(tmp, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+// Creates a temporary file for path; *out_tmp is malloc'd. Returns the open fd, or -1.
+static int tmp_create(const char *path, char **out_tmp) {
+  *out_tmp = NULL;
+  const char *slash = strrchr(path, '/');
+  size_t dir_len = slash ? (size_t)(slash - path + 1) : 0;
+  size_t n = strlen(path) + sizeof(CML_TMP_MARK) + 8;
+  char *tmp = (char *)malloc(n);
+  if (!tmp) return -1;
+  snprintf(tmp, n, "%.*s.%s" CML_TMP_MARK "XXXXXX", (int)dir_len, path, path + dir_len);
+  int fd = mkstemp(tmp);
   if (fd < 0) {
     free(tmp);
-    return CML_ERR_IO;
+    return -1;
   }
-  cml_status st = write_all(fd, data, len);
+  *out_tmp = tmp;
+  return fd;
+}
+
+static int is_tmp_name(const char *name) {
+  size_t n = strlen(name);
+  size_t m = sizeof(CML_TMP_MARK) - 1 + 6;
+  return name[0] == '.' && n > m + 1 && strncmp(name + n - m, CML_TMP_MARK, sizeof(CML_TMP_MARK) - 1) == 0;
+}
+
+cml_status cml_write_file_atomic(const char *path, const uint8_t *data, size_t len) {
+  if (!path || !data) return CML_ERR_INVALID;
+  char *tmp = NULL;
+  int fd = tmp_create(path, &tmp);
+  if (fd < 0) return errno == ENOMEM ? CML_ERR_OOM : CML_ERR_IO;
+  cml_status st = fchmod(fd, 0644) == 0 ? write_all(fd, data, len) : CML_ERR_IO;
   if (st == CML_OK && fsync(fd) != 0) st = CML_ERR_IO;
   if (close(fd) != 0) st = CML_ERR_IO;
   if (st != CML_OK) {
@@ -96,3 +121,102 @@ cml_status cml_write_file_atomic(const char *path, const uint8_t *data, size_t l
   return st;
 }
 
+
+cml_status cml_link_file_atomic(const char *src, const char *dst) {
+  if (!src || !dst) return CML_ERR_INVALID;
+  // mkstemp reserves a unique name; the link then takes its place.
+  char *tmp = NULL;
+  int fd = tmp_create(dst, &tmp);
+  if (fd < 0) return errno == ENOMEM ? CML_ERR_OOM : CML_ERR_IO;
+  close(fd);
+  unlink(tmp);
+  cml_status st = link(src, tmp) == 0 ? CML_OK : CML_ERR_IO;
+  if (st == CML_OK) {
+    st = cml_rename_overwrite(tmp, dst);
+    if (st != CML_OK) unlink(tmp);
+  }
+  free(tmp);
+  return st;
+}
+
+// With h, the buffer comes from (and is charged to) the page buffer pool.
+static cml_status read_file(cml *h, const char *path, cml_bytes *out) {
+  if (!path || !out) return CML_ERR_INVALID;
+  memset(out, 0, sizeof(*out));
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return CML_ERR_IO;
+  struct stat sb;
+  if (fstat(fd, &sb) != 0 || sb.st_size < 0) {
+    close(fd);
+    return CML_ERR_IO;
+  }
+  size_t len = (size_t)sb.st_size;
+  cml_bytes b = {0};
+  if (h) {
+    cml_status st = cml_buf_get(h, len ? len : 1, &b);
+    if (st != CML_OK) {
+      close(fd);
+      return st;
+    }
+  } else {
+    b.data = (uint8_t *)malloc(len ? len : 1);
+    b.cap = len ? len : 1;
+    if (!b.data) {
+      close(fd);
+      return CML_ERR_OOM;
+    }
+  }
+  size_t off = 0;
+  while (off < len) {
+    ssize_t r = read(fd, b.data + off, len - off);
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) break;
+    off += (size_t)r;
+  }
+  close(fd);
+  if (off != len) {
+    if (h) cml_buf_put(h, &b);
+    else free(b.data);
+    return CML_ERR_IO;
+  }
+  b.len = len;
+  *out = b;
+  return CML_OK;
+}
+
+cml_status cml_read_file(const char *path, cml_bytes *out) { return read_file(NULL, path, out); }
+
+cml_status cml_read_file_pooled(cml *h, const char *path, cml_bytes *out) {
+  if (!h) return CML_ERR_INVALID;
+  return read_file(h, path, out);
+}
+
+cml_status cml_dir_scan(const char *dir, cml_strset *out, size_t *out_stale) {
+  if (!dir || !out) return CML_ERR_INVALID;
+  if (out_stale) *out_stale = 0;
+  DIR *d = opendir(dir);
+  if (!d) return (errno == ENOENT) ? CML_OK : CML_ERR_IO;
+
+  cml_status st = CML_OK;
+  int dfd = dirfd(d);
+  struct dirent *ent;
+  while ((ent = readdir(d)) != NULL) {
+    const char *name = ent->d_name;
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+    // A temporary file of cml_write_file_atomic or cml_link_file_atomic. An old one is left over from
+    // an interrupted run; a recent one may belong to another process still writing it.
+    if (is_tmp_name(name)) {
+      struct stat sb;
+      if (fstatat(dfd, name, &sb, AT_SYMLINK_NOFOLLOW) == 0 && time(NULL) - sb.st_mtime >= CML_TMP_STALE_SEC &&
+          unlinkat(dfd, name, 0) == 0 && out_stale)
+        (*out_stale)++;
+      continue;
+    }
+    if (cml_strset_add(out, name) != 0) {
+      st = CML_ERR_OOM;
+      break;
+    }
+  }
+  closedir(d);
+  return st;
+}
@@ -0,0 +1,117 @@
+#include "cml_internal.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Hedged page downloads (cml_config.hedge_percentile). Every successful page download adds its time
+// to a ring of recent samples; a page still outstanding after the configured percentile of those
+// gets a second copy on the fetch worker's spare handle, and whichever copy completes first is used.
+// A hedge is only sent when it fits in everything a normal download has to fit in (a window slot,
+// the host's rate limit, the memory budget) and while the bytes thrown away with losing copies stay
+// under hedge_max_extra_pct of the page bytes downloaded.
+
+#define MIN_SAMPLES 20       // below this, the percentile says nothing yet
+#define RESORT_EVERY 16      // samples between recomputations of the delay
+#define DEFAULT_EXTRA_PCT 5
+
+static int cmp_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static void update_delay(cml_hedge_state *s) {
+  uint64_t sorted[CML_HEDGE_SAMPLES];
+  memcpy(sorted, s->samples, s->samples_len * sizeof(sorted[0]));
+  qsort(sorted, s->samples_len, sizeof(sorted[0]), cmp_u64);
+  size_t i = (s->samples_len * s->percentile + 99) / 100;
+  s->delay_ns = sorted[i ? i - 1 : 0];
+}
+
+uint64_t cml_hedge_delay_ns(cml *h) {
+  if (!h->hedge.percentile) return 0;
+  pthread_mutex_lock(&h->hedge.mu);
+  uint64_t d = h->hedge.delay_ns;
+  pthread_mutex_unlock(&h->hedge.mu);
+  return d;
+}
+
+void cml_hedge_sample(cml *h, uint64_t elapsed_ns, size_t bytes) {
+  cml_hedge_state *s = &h->hedge;
+  if (!s->percentile) return;
+  pthread_mutex_lock(&s->mu);
+  s->samples[s->next] = elapsed_ns;
+  s->next = (s->next + 1) % CML_HEDGE_SAMPLES;
+  if (s->samples_len < CML_HEDGE_SAMPLES) s->samples_len++;
+  s->page_bytes += bytes;
+  if (s->samples_len >= MIN_SAMPLES && (s->delay_ns == 0 || ++s->unsorted >= RESORT_EVERY)) {
+    s->unsorted = 0;
+    update_delay(s);
+  }
+  pthread_mutex_unlock(&s->mu);
+}
+
+bool cml_hedge_begin(cml *h, const char *url, cml_hedge_slot *slot) {
+  cml_hedge_state *s = &h->hedge;
+  memset(slot, 0, sizeof(*slot));
+  size_t est = cml_buf_estimate(h);
+  // Count a hedge as lost until it is not, so hedges in flight cannot overrun the cap together.
+  pthread_mutex_lock(&s->mu);
+  bool budget = est > 0 && (s->stats.wasted_bytes + s->pending + est) * 100 <= s->page_bytes * s->max_extra_pct;
+  if (budget) s->pending += est;
+  pthread_mutex_unlock(&s->mu);
+
+  bool held = budget && cml_window_try_enter(h);
+  bool reserved = held && cml_mem_reserve(h, est, false);
+  bool paced = reserved && cml_rate_try_acquire(h, url, &slot->bytes_charged);
+  if (reserved && !paced) cml_mem_unreserve(h, est);
+  if (held && !paced) cml_window_release(h);
+
+  pthread_mutex_lock(&s->mu);
+  if (paced) {
+    slot->reserved = est;
+    s->stats.hedges++;
+  } else {
+    if (budget) s->pending -= est;
+    s->stats.declined++;
+  }
+  pthread_mutex_unlock(&s->mu);
+  return paced;
+}
+
+void cml_hedge_end(cml *h, const char *url, const cml_hedge_slot *slot, bool won, size_t wasted) {
+  cml_hedge_state *s = &h->hedge;
+  cml_window_release(h);
+  cml_mem_unreserve(h, slot->reserved);
+  // Whichever copy lost, its bytes still went over the wire.
+  cml_rate_record(h, url, wasted, slot->bytes_charged, 0);
+  pthread_mutex_lock(&s->mu);
+  s->pending = s->pending > slot->reserved ? s->pending - slot->reserved : 0;
+  s->stats.wasted_bytes += wasted;
+  if (won) s->stats.won++;
+  pthread_mutex_unlock(&s->mu);
+}
+
+cml_status cml_hedge_init(cml *h) {
+  cml_hedge_state *s = &h->hedge;
+  s->percentile = h->cfg.hedge_percentile > 99 ? 99 : h->cfg.hedge_percentile;
+  s->max_extra_pct = h->cfg.hedge_max_extra_pct ? h->cfg.hedge_max_extra_pct : DEFAULT_EXTRA_PCT;
+  return pthread_mutex_init(&s->mu, NULL) == 0 ? CML_OK : CML_ERR_OOM;
+}
+
+void cml_hedge_free(cml *h) { pthread_mutex_destroy(&h->hedge.mu); }
+
+// The learned delay carries over from run to run; the byte allowance and the counters start afresh.
+void cml_hedge_reset_stats(cml *h) {
+  pthread_mutex_lock(&h->hedge.mu);
+  memset(&h->hedge.stats, 0, sizeof(h->hedge.stats));
+  h->hedge.page_bytes = 0;
+  pthread_mutex_unlock(&h->hedge.mu);
+}
+
+void cml_hedge_get_stats(cml *h, cml_hedge_stats *out) {
+  pthread_mutex_lock(&h->hedge.mu);
+  *out = h->hedge.stats;
+  out->delay_ns = h->hedge.delay_ns;
+  pthread_mutex_unlock(&h->hedge.mu);
+}
@@ -1,96 +1,606 @@
 #include "cml_internal.h"
 
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
-#include <errno.h>
+#include <strings.h>
 #include <time.h>
 
+// How long a page download that gave way for lack of memory waits before it is tried again.
+#define NO_ROOM_DELAY_NS (50ull * 1000000ull)
+
 typedef struct {
-  uint8_t *data;
-  size_t len;
-  size_t cap;
+  cml *h;
+  CURL *curl;
+  bool pooled;
+  const size_t *page;  // see cml_http_req
+  bool failed;
+  bool no_room;  // the body found no room in the memory budget in time (see cml_buf_get_page)
+  cml_bytes b;
+  char *etag;
+
+  // Response headers that decide whether a cut-off body can be continued.
+  char modified[64];  // Last-Modified
+  bool ranges;        // Accept-Ranges: bytes
+  bool encoded;       // Content-Encoding other than identity
+  uint64_t range_start;  // Content-Range of a 206
+  uint64_t range_total;
+
+  // Continuing a partial body (see cml_http_try): b starts with resume_from bytes.
+  size_t resume_from;
+  uint64_t resume_total;
+  bool checked;     // the response to the Range request has been looked at
+  bool resume_bad;  // a 206 that does not continue the body held
+
+  // Transfer watchdog, run from curl's progress callback.
+  cml_xfer_limits lim;
+  uint64_t start_ns;
+  uint64_t moved_ns;  // when bytes last moved
+  curl_off_t moved;
+  cml_xfer_abort why;
 } wbuf;
 
 static size_t write_cb(char *ptr, size_t size, size_t nmemb, void *userdata) {
-  wbuf *b = (wbuf *)userdata;
+  wbuf *w = (wbuf *)userdata;
   size_t n = size * nmemb;
   if (n == 0) return 0;
+  if (w->resume_from && !w->checked) {
+    w->checked = true;
+    long code = 0;
+    curl_easy_getinfo(w->curl, CURLINFO_RESPONSE_CODE, &code);
+    if (code != 206) {
+      // The whole body after all (the page changed or the range was ignored): start over.
+      w->b.len = 0;
+      w->resume_from = 0;
+    } else if (w->range_start != w->resume_from || w->range_total != w->resume_total) {
+      w->resume_bad = true;
+      return 0;
+    }
+  }
+  cml_bytes *b = &w->b;
   if (b->len + n > b->cap) {
-    size_t next = b->cap ? b->cap : 8192;
-    while (next < b->len + n) next *= 2;
-    void *p = realloc(b->data, next);
-    if (!p) return 0;
-    b->data = (uint8_t *)p;
-    b->cap = next;
+    size_t need = b->len + n;
+    // Size the first buffer from Content-Length so the body never has to be regrown.
+    size_t expect = 0;
+    curl_off_t cl = -1;
+    if (!b->data && curl_easy_getinfo(w->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &cl) == CURLE_OK && cl > 0 &&
+        (uint64_t)cl <= SIZE_MAX)
+      expect = (size_t)cl;
+    cml_status st = CML_OK;
+    if (w->pooled) {
+      if (!b->data) {
+        st = w->page ? cml_buf_get_page(w->h, expect, *w->page, b) : cml_buf_get(w->h, expect, b);
+        // Time spent waiting for room in the budget is not the transfer stalling.
+        w->moved_ns = cml_now_ns();
+        if (st == CML_OK && !b->data) {
+          w->no_room = true;
+          return 0;
+        }
+      }
+      if (st == CML_OK) st = cml_buf_grow(w->h, b, need);
+    } else {
+      size_t next = b->cap ? b->cap : (expect > 8192 ? expect : 8192);
+      while (next < need) next *= 2;
+      void *p = realloc(b->data, next);
+      if (p) {
+        b->data = (uint8_t *)p;
+        b->cap = next;
+      } else {
+        st = CML_ERR_OOM;
+      }
+    }
+    if (st != CML_OK) {
+      w->failed = true;
+      return 0;
+    }
   }
   memcpy(b->data + b->len, ptr, n);
   b->len += n;
   return n;
 }
 
+// Abandons a transfer that waits too long for its response, stops moving, or runs far slower than
+// its host usually does; the request is then retried like any other transport failure.
+static int xfer_cb(void *userdata, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow) {
+  (void)ultotal;
+  wbuf *w = (wbuf *)userdata;
+  uint64_t now = cml_now_ns();
+  if (dlnow + ulnow != w->moved) {
+    w->moved = dlnow + ulnow;
+    w->moved_ns = now;
+  }
+  uint64_t idle = now - w->moved_ns;
+  if (dlnow == 0 && idle > w->lim.first_byte_ns) w->why = CML_XFER_FIRST_BYTE;
+  else if (dlnow > 0 && idle > w->lim.stall_ns) w->why = CML_XFER_STALL;
+  else if (dltotal > dlnow) {
+    uint64_t deadline = cml_timeout_deadline_ns(&w->lim, (uint64_t)dltotal);
+    if (deadline && now - w->start_ns > deadline) w->why = CML_XFER_SLOW;
+  }
+  return w->why != CML_XFER_OK;
+}
+
 void cml_bytes_free(cml_bytes *b) {
   if (!b) return;
   free(b->data);
   b->data = NULL;
   b->len = 0;
+  b->cap = 0;
 }
 
 static int is_retryable_long(long code) { return code == 429 || (code >= 500 && code <= 599); }
 
-static void cml_sleep_usec(unsigned usec) {
+static void sleep_ns(uint64_t ns) {
   struct timespec ts;
-  ts.tv_sec = (time_t)(usec / 1000000u);
-  ts.tv_nsec = (long)((usec % 1000000u) * 1000u);
+  ts.tv_sec = (time_t)(ns / 1000000000ull);
+  ts.tv_nsec = (long)(ns % 1000000000ull);
   while (nanosleep(&ts, &ts) == -1 && errno == EINTR) {
   }
 }
 
-cml_status cml_http_get(cml *h, const char *url, cml_bytes *out) {
-  if (!h || !h->curl || !url || !out) return CML_ERR_INVALID;
-  memset(out, 0, sizeof(*out));
+void cml_http_resp_free(cml_http_resp *r) {
+  if (!r) return;
+  cml_bytes_free(&r->body);
+  free(r->etag);
+  r->etag = NULL;
+  free(r->last_modified);
+  r->last_modified = NULL;
+  r->code = 0;
+}
 
-  const int max_attempts = 4;
-  for (int attempt = 1; attempt <= max_attempts; attempt++) {
-    curl_easy_reset(h->curl);
-    wbuf wb = {0};
+// The value of header line ptr[0..n) when its name is name, trimmed into out; false otherwise.
+static bool header_value(const char *ptr, size_t n, const char *name, char *out, size_t out_size) {
+  size_t k = strlen(name);
+  if (n <= k || ptr[k] != ':' || strncasecmp(ptr, name, k) != 0) return false;
+  size_t a = k + 1;
+  size_t b = n;
+  while (a < b && (ptr[a] == ' ' || ptr[a] == '\t')) a++;
+  while (b > a && (ptr[b - 1] == '\r' || ptr[b - 1] == '\n' || ptr[b - 1] == ' ')) b--;
+  if (b - a >= out_size) b = a + out_size - 1;
+  memcpy(out, ptr + a, b - a);
+  out[b - a] = '\0';
+  return true;
+}
+
+static size_t header_cb(char *ptr, size_t size, size_t nmemb, void *userdata) {
+  wbuf *w = (wbuf *)userdata;
+  size_t n = size * nmemb;
+  char v[256];
+  if (n > 5 && strncmp(ptr, "HTTP/", 5) == 0) {
+    // A new response (after a redirect): only its own headers count.
+    w->modified[0] = '\0';
+    w->ranges = w->encoded = false;
+    w->range_start = w->range_total = 0;
+  } else if (header_value(ptr, n, "etag", v, sizeof(v))) {
+    free(w->etag);
+    w->etag = strdup(v);
+  } else if (header_value(ptr, n, "last-modified", v, sizeof(w->modified))) {
+    memcpy(w->modified, v, sizeof(w->modified));
+  } else if (header_value(ptr, n, "accept-ranges", v, sizeof(v))) {
+    w->ranges = strcasecmp(v, "bytes") == 0;
+  } else if (header_value(ptr, n, "content-encoding", v, sizeof(v))) {
+    w->encoded = strcasecmp(v, "identity") != 0;
+  } else if (header_value(ptr, n, "content-range", v, sizeof(v))) {
+    unsigned long long first = 0;
+    unsigned long long last = 0;
+    unsigned long long total = 0;
+    if (sscanf(v, "bytes %llu-%llu/%llu", &first, &last, &total) == 3) {
+      w->range_start = first;
+      w->range_total = total;
+    }
+  }
+  return n;
+}
 
-    curl_easy_setopt(h->curl, CURLOPT_URL, url);
-    curl_easy_setopt(h->curl, CURLOPT_FOLLOWLOCATION, 1L);
-    curl_easy_setopt(h->curl, CURLOPT_USERAGENT,
+static void setup_request(CURL *c, const cml_http_req *req) {
+  curl_easy_setopt(c, CURLOPT_URL, req->url);
+  if (strcmp(req->method, "GET") == 0) {
+    curl_easy_setopt(c, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(c, CURLOPT_USERAGENT,
                      "Mozilla/5.0 (Windows NT 10.0; Win64; x64; rv:72.0) Gecko/20100101 Firefox/72.0");
-    curl_easy_setopt(h->curl, CURLOPT_WRITEFUNCTION, write_cb);
-    curl_easy_setopt(h->curl, CURLOPT_WRITEDATA, &wb);
-    curl_easy_setopt(h->curl, CURLOPT_ACCEPT_ENCODING, "");
-    curl_easy_setopt(h->curl, CURLOPT_TIMEOUT, 60L);
+    curl_easy_setopt(c, CURLOPT_ACCEPT_ENCODING, "");
+  } else if (strcmp(req->method, "HEAD") == 0) {
+    curl_easy_setopt(c, CURLOPT_NOBODY, 1L);
+  } else {
+    curl_easy_setopt(c, CURLOPT_CUSTOMREQUEST, req->method);
+    if (req->body || strcmp(req->method, "DELETE") != 0) {
+      curl_easy_setopt(c, CURLOPT_POSTFIELDS, req->body ? (const char *)req->body : "");
+      curl_easy_setopt(c, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)req->body_len);
+    }
+  }
+  if (req->headers) curl_easy_setopt(c, CURLOPT_HTTPHEADER, req->headers);
+}
 
-    CURLcode rc = curl_easy_perform(h->curl);
-    long code = 0;
-    if (rc == CURLE_OK) curl_easy_getinfo(h->curl, CURLINFO_RESPONSE_CODE, &code);
+// Resets c for one transfer of req into wb.
+static void xfer_setup(cml *h, CURL *c, const cml_http_req *req, uint32_t attempt, wbuf *wb) {
+  curl_easy_reset(c);
+  *wb = (wbuf){.h = h, .curl = c, .pooled = req->pooled, .page = req->pooled ? req->page : NULL};
+  setup_request(c, req);
+  curl_easy_setopt(c, CURLOPT_WRITEFUNCTION, write_cb);
+  curl_easy_setopt(c, CURLOPT_WRITEDATA, wb);
+  curl_easy_setopt(c, CURLOPT_HEADERFUNCTION, header_cb);
+  curl_easy_setopt(c, CURLOPT_HEADERDATA, wb);
+  // The watchdog does the real work; this only bounds a transfer that keeps crawling along.
+  curl_easy_setopt(c, CURLOPT_TIMEOUT, 600L);
+  cml_timeout_plan(h, req->url, &wb->lim);
+  if (attempt > 1) wb->lim.min_rate_bps = 0;  // a retry may be slow, as long as it keeps moving
+  curl_easy_setopt(c, CURLOPT_NOPROGRESS, 0L);
+  curl_easy_setopt(c, CURLOPT_XFERINFOFUNCTION, xfer_cb);
+  curl_easy_setopt(c, CURLOPT_XFERINFODATA, wb);
+}
+
+static bool xfer_succeeded(CURL *c, CURLcode rc) {
+  long code = 0;
+  if (rc == CURLE_OK) curl_easy_getinfo(c, CURLINFO_RESPONSE_CODE, &code);
+  return code >= 200 && code < 300;
+}
 
-    if (rc == CURLE_OK && code >= 200 && code < 300) {
-      out->data = wb.data;
-      out->len = wb.len;
-      return CML_OK;
+// Runs a page download on the fetch worker's multi handle. Once it has been outstanding for the
+// hedge delay, a second copy starts on the spare handle; the first copy to succeed is used and the
+// other one is cancelled. When both fail, the first copy's failure is reported. On return, *c and
+// *wb are the copy that was used.
+static CURLcode perform_hedged(cml *h, const cml_http_req *req, uint32_t attempt, CURL **c, wbuf *wb) {
+  CURLM *m = req->multi;
+  CURL *handles[2] = {*c, req->hedge_curl};
+  wbuf hw = {0};
+  wbuf *bufs[2] = {wb, &hw};
+  CURLcode rc[2] = {CURLE_OK, CURLE_OK};
+  bool done[2] = {false, false};
+  bool hedged = false;
+  cml_hedge_slot slot;
+  uint64_t delay = cml_hedge_delay_ns(h);
+  if (curl_multi_add_handle(m, handles[0]) != CURLM_OK) return curl_easy_perform(*c);
+
+  int used = -1;
+  for (;;) {
+    int running = 0;
+    curl_multi_perform(m, &running);
+    CURLMsg *msg;
+    int left = 0;
+    while ((msg = curl_multi_info_read(m, &left)) != NULL) {
+      if (msg->msg != CURLMSG_DONE) continue;
+      int i = msg->easy_handle == handles[0] ? 0 : 1;
+      done[i] = true;
+      rc[i] = msg->data.result;
+      curl_multi_remove_handle(m, handles[i]);
+      if (used < 0 && xfer_succeeded(handles[i], rc[i])) used = i;
+    }
+    if (used < 0 && done[0] && (!hedged || done[1])) used = 0;
+    if (used >= 0) break;
+
+    uint64_t now = cml_now_ns();
+    if (!hedged && delay && !done[0] && now - wb->start_ns >= delay) {
+      if (cml_hedge_begin(h, req->url, &slot)) {
+        hedged = true;
+        xfer_setup(h, handles[1], req, attempt, &hw);
+        hw.start_ns = hw.moved_ns = now;
+        if (curl_multi_add_handle(m, handles[1]) != CURLM_OK) {
+          done[1] = true;
+          rc[1] = CURLE_FAILED_INIT;
+        }
+        cml_log(h, CML_LOG_DEBUG, "%s %s: outstanding for %llu ms, requesting a second copy", req->method, req->url,
+                (unsigned long long)((now - wb->start_ns) / 1000000ull));
+        continue;
+      }
+      delay = 0;  // no room for a hedge; this copy runs its course
     }
+    // The watchdog runs from curl's progress callback, so curl is driven at least every 100 ms.
+    int wait_ms = 100;
+    if (!hedged && delay && !done[0] && wb->start_ns + delay - now < 100000000ull)
+      wait_ms = (int)((wb->start_ns + delay - now) / 1000000ull) + 1;
+    curl_multi_poll(m, NULL, 0, wait_ms, NULL);
+  }
 
-    free(wb.data);
+  if (hedged) {
+    int lost = 1 - used;
+    if (!done[lost]) curl_multi_remove_handle(m, handles[lost]);
+    size_t wasted = bufs[lost]->b.len;
+    cml_buf_put(h, &bufs[lost]->b);
+    free(bufs[lost]->etag);
+    cml_hedge_end(h, req->url, &slot, used == 1, wasted);
+  }
+  if (used == 1) {
+    *c = handles[1];
+    *wb = hw;
+  }
+  return rc[used];
+}
+
+static bool transport_retryable(CURLcode rc) {
+  return rc == CURLE_COULDNT_RESOLVE_HOST || rc == CURLE_COULDNT_CONNECT || rc == CURLE_OPERATION_TIMEDOUT ||
+         rc == CURLE_RECV_ERROR || rc == CURLE_SEND_ERROR || rc == CURLE_PARTIAL_FILE;
+}
+
+static void resume_drop(cml *h, cml_http_try *t) {
+  cml_buf_put(h, &t->partial);
+  free(t->partial_validator);
+  t->partial_validator = NULL;
+  t->partial_total = 0;
+}
 
-    int retryable = 0;
-    if (rc != CURLE_OK) {
-      retryable = (rc == CURLE_COULDNT_RESOLVE_HOST || rc == CURLE_COULDNT_CONNECT || rc == CURLE_OPERATION_TIMEDOUT ||
-                   rc == CURLE_RECV_ERROR || rc == CURLE_SEND_ERROR);
+// Sends the attempt as the continuation of t's partial body, which moves into wb. If-Range makes
+// the server send the whole page instead if it is no longer the one the partial body came from.
+// Returns the header list to free after the transfer.
+static struct curl_slist *resume_setup(CURL *c, const cml_http_req *req, cml_http_try *t, wbuf *wb) {
+  char range[32];
+  snprintf(range, sizeof(range), "%zu-", t->partial.len);
+  curl_easy_setopt(c, CURLOPT_RANGE, range);
+  curl_easy_setopt(c, CURLOPT_ACCEPT_ENCODING, NULL);
+  struct curl_slist *headers = NULL;
+  if (t->partial_validator) {
+    for (const struct curl_slist *l = req->headers; l; l = l->next) headers = curl_slist_append(headers, l->data);
+    char line[300];
+    snprintf(line, sizeof(line), "If-Range: %s", t->partial_validator);
+    headers = curl_slist_append(headers, line);
+    if (headers) curl_easy_setopt(c, CURLOPT_HTTPHEADER, headers);
+  }
+  wb->b = t->partial;
+  wb->resume_from = t->partial.len;
+  wb->resume_total = t->partial_total;
+  memset(&t->partial, 0, sizeof(t->partial));
+  free(t->partial_validator);
+  t->partial_validator = NULL;
+  t->partial_total = 0;
+  return headers;
+}
+
+// Keeps the body of a page download cut short by a transport error for the next attempt, when the
+// server takes ranges and the body is plain bytes of a known size.
+static bool resume_keep(CURL *c, wbuf *wb, cml_http_try *t) {
+  if (!wb->pooled || wb->failed || wb->resume_bad || wb->encoded || wb->b.len == 0) return false;
+  long code = 0;
+  curl_easy_getinfo(c, CURLINFO_RESPONSE_CODE, &code);
+  uint64_t total = 0;
+  if (code == 206 && wb->resume_from) {
+    total = wb->range_total;
+  } else if (code == 200 && wb->ranges) {
+    curl_off_t cl = -1;
+    if (curl_easy_getinfo(c, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &cl) == CURLE_OK && cl > 0) total = (uint64_t)cl;
+  }
+  if (total <= wb->b.len) return false;
+  t->partial = wb->b;
+  t->partial_total = total;
+  const char *validator = wb->etag ? wb->etag : wb->modified[0] ? wb->modified : NULL;
+  t->partial_validator = validator ? strdup(validator) : NULL;
+  memset(&wb->b, 0, sizeof(wb->b));
+  return true;
+}
+
+// Answers the attempt from its recording instead of the network (cml_config.transport).
+static void replay(cml *h, const cml_http_req *req, wbuf *wb, long *code, uint64_t *ttfb_ns, uint64_t *total_ns) {
+  cml_http_resp r;
+  if (cml_replay_answer(h, req, &r, ttfb_ns, total_ns) != CML_OK) {
+    wb->failed = true;
+    return;
+  }
+  *code = r.code;
+  wb->b = r.body;
+  wb->etag = r.etag;
+  if (r.last_modified) snprintf(wb->modified, sizeof(wb->modified), "%s", r.last_modified);
+  free(r.last_modified);
+}
+
+static cml_status attempt(cml *h, const cml_http_req *req, cml_http_try *t, cml_http_resp *out, bool *again,
+                          uint64_t *delay_ns) {
+  *again = false;
+  *delay_ns = 0;
+  if (req->pooled) cml_buf_put(h, &out->body);
+  cml_http_resp_free(out);
+  CURL *c = req->curl ? req->curl : h->curl;
+  if (!c) return CML_ERR_INVALID;
+
+  uint64_t wait_ns = 0;
+  if (!t->paced) {
+    wait_ns = cml_rate_acquire(h, req->url, &t->bytes_charged);
+    if (wait_ns) {
+      // The slot is ours; the next call sends without asking again.
+      t->paced = true;
+      *again = true;
+      *delay_ns = wait_ns;
+      return CML_ERR_HTTP;
+    }
+  }
+  t->paced = false;
+  cml_breaker_verdict verdict = cml_breaker_check(h, req->url, &wait_ns);
+  if (verdict != CML_BREAKER_PASS) {
+    // Nothing is sent: the slot goes back, and the next attempt takes a new one.
+    cml_rate_refund(h, req->url, t->bytes_charged);
+    t->bytes_charged = 0;
+  }
+  if (verdict == CML_BREAKER_WAIT) {
+    *again = true;
+    *delay_ns = wait_ns;
+    return CML_ERR_HTTP;
+  }
+  uint32_t attempt = ++t->attempts;
+  bool last = attempt >= cml_retry_max_attempts(h);
+  if (verdict == CML_BREAKER_OPEN) {
+    *again = !last;
+    if (*again) {
+      *delay_ns = wait_ns + cml_retry_delay_ns(h, 1, 0);
     } else {
-      retryable = is_retryable_long(code);
+      atomic_fetch_add(&h->retry.stats.gave_up, 1);
+      cml_log(h, CML_LOG_WARN, "%s failed: %s (host paused after repeated failures)", req->method, req->url);
     }
+    return CML_ERR_HTTP;
+  }
+
+  atomic_fetch_add(&h->retry.stats.requests, 1);
+  if (attempt > 1) atomic_fetch_add(&h->retry.stats.retries, 1);
+  cml_transport_mode mode = cml_transport_for(h, req);
+  wbuf wb;
+  xfer_setup(h, c, req, attempt, &wb);
+  struct curl_slist *resume_headers =
+      req->pooled && t->partial.len && mode != CML_TRANSPORT_REPLAY ? resume_setup(c, req, t, &wb) : NULL;
 
-    if (!retryable || attempt == max_attempts) {
-      cml_log(h, CML_LOG_WARN, "GET failed: %s (curl=%d http=%ld)", url, (int)rc, code);
+  // Page downloads share the adaptive concurrency window; metadata and uploads are one at a time.
+  uint64_t queued = cml_now_ns();
+  uint64_t started = req->pooled ? cml_window_enter(h) : queued;
+  t->queued_ns = started - queued;
+  wb.start_ns = wb.moved_ns = started;
+  bool hedging = req->pooled && req->multi && req->hedge_curl && mode != CML_TRANSPORT_REPLAY;
+  CURLcode rc = CURLE_OK;
+  long code = 0;
+  uint64_t ttfb_ns = 0;
+  uint64_t total_ns = 0;
+  if (mode == CML_TRANSPORT_REPLAY) {
+    replay(h, req, &wb, &code, &ttfb_ns, &total_ns);
+    cml_http_stats_record(h, req, NULL, !wb.failed, wb.b.len, ttfb_ns, total_ns);
+  } else {
+    rc = hedging ? perform_hedged(h, req, attempt, &c, &wb) : curl_easy_perform(c);
+    curl_slist_free_all(resume_headers);
+    if (wb.no_room) {
+      // Not the host's doing: the attempt does not count, and the page goes back behind the ones
+      // holding the memory, among them the writer's next page.
+      free(wb.etag);
+      cml_window_leave(h, started, false, 0);
+      cml_rate_refund(h, req->url, t->bytes_charged);
+      t->bytes_charged = 0;
+      t->attempts--;
+      *again = true;
+      *delay_ns = NO_ROOM_DELAY_NS;
       return CML_ERR_HTTP;
     }
+    if (rc == CURLE_OK) curl_easy_getinfo(c, CURLINFO_RESPONSE_CODE, &code);
+    curl_off_t us = 0;
+    if (curl_easy_getinfo(c, CURLINFO_STARTTRANSFER_TIME_T, &us) == CURLE_OK) ttfb_ns = (uint64_t)us * 1000u;
+    if (curl_easy_getinfo(c, CURLINFO_TOTAL_TIME_T, &us) == CURLE_OK) total_ns = (uint64_t)us * 1000u;
+    cml_http_stats_record(h, req, c, rc == CURLE_OK, wb.b.len - wb.resume_from, ttfb_ns, total_ns);
+  }
+  if (rc == CURLE_OK && code == 206 && wb.b.len != wb.resume_total) {
+    // The continuation does not add up to the page; the next attempt fetches it whole.
+    rc = CURLE_PARTIAL_FILE;
+    wb.resume_bad = true;
+    code = 0;
+  }
+  out->code = code;
+  out->body = wb.b;
+  out->etag = wb.etag;
+  if (wb.modified[0]) out->last_modified = strdup(wb.modified);
+  bool answered = rc == CURLE_OK && ((code >= 200 && code < 300) || (code == 304 && req->conditional));
+  if (hedging && answered) cml_hedge_sample(h, cml_now_ns() - started, wb.b.len);
+  // Transient failures are not worth replaying; a 304 would have nothing to replay.
+  if (mode == CML_TRANSPORT_RECORD && rc == CURLE_OK && !wb.failed && code != 304 && !is_retryable_long(code))
+    cml_record_save(h, req, out);
+  // A slow transfer is a sample too: if the whole link has slowed down, the next ones are judged by it.
+  if (answered || wb.why == CML_XFER_SLOW) cml_timeout_record(h, req->url, ttfb_ns, total_ns, wb.b.len);
+  if (wb.why != CML_XFER_OK) {
+    uint64_t elapsed = cml_now_ns() - wb.start_ns;
+    cml_timeout_abort(h, wb.why, elapsed);
+    cml_log(h, CML_LOG_DEBUG, "%s %s: %s after %llu ms", req->method, req->url,
+            wb.why == CML_XFER_FIRST_BYTE ? "no response"
+            : wb.why == CML_XFER_STALL    ? "transfer stalled"
+                                          : "transfer far slower than usual",
+            (unsigned long long)(elapsed / 1000000ull));
+  }
+  if (req->pooled) {
+    bool congested = rc != CURLE_OK || is_retryable_long(code);
+    cml_window_leave(h, started, congested, rc == CURLE_OK ? ttfb_ns : 0);
+  }
 
-    unsigned usec = (unsigned)(250000u * (1u << (unsigned)(attempt - 1)));
-    cml_sleep_usec(usec);
+  cml_rate_record(h, req->url, wb.b.len + req->body_len, t->bytes_charged, code);
+  // A 429 asks for a lower rate, which the rate limiter provides; the host itself is fine.
+  bool host_failed = rc != CURLE_OK || (is_retryable_long(code) && code != 429);
+  cml_breaker_record(h, req->url, !host_failed);
+  if (wb.failed) {
+    cml_log(h, CML_LOG_WARN, "%s failed: %s (out of memory)", req->method, req->url);
+    return CML_ERR_OOM;
+  }
+  if (answered) {
+    if (wb.resume_from) {
+      atomic_fetch_add(&h->retry.stats.resumed, 1);
+      atomic_fetch_add(&h->retry.stats.resumed_bytes, wb.resume_from);
+    }
+    return CML_OK;
+  }
+
+  bool retryable =
+      rc != CURLE_OK ? transport_retryable(rc) || wb.why != CML_XFER_OK || wb.resume_bad : is_retryable_long(code);
+  if (!retryable || last) {
+    if (retryable) atomic_fetch_add(&h->retry.stats.gave_up, 1);
+    if (!(req->quiet_404 && code == 404))
+      cml_log(h, CML_LOG_WARN, "%s failed: %s (curl=%d http=%ld)", req->method, req->url, (int)rc, code);
+    return CML_ERR_HTTP;
   }
 
+  curl_off_t retry_after = 0;
+  if (rc == CURLE_OK && mode != CML_TRANSPORT_REPLAY &&
+      curl_easy_getinfo(c, CURLINFO_RETRY_AFTER, &retry_after) != CURLE_OK)
+    retry_after = 0;
+  *again = true;
+  *delay_ns = cml_retry_delay_ns(h, attempt, retry_after > 0 ? (uint64_t)retry_after * 1000000000ull : 0);
+  if (rc != CURLE_OK && resume_keep(c, &wb, t)) {
+    memset(&out->body, 0, sizeof(out->body));
+    cml_log(h, CML_LOG_DEBUG, "%s %s: curl=%d after %zu of %llu bytes, resuming in %llu ms", req->method, req->url,
+            (int)rc, t->partial.len, (unsigned long long)t->partial_total, (unsigned long long)(*delay_ns / 1000000ull));
+    return CML_ERR_HTTP;
+  }
+  cml_log(h, CML_LOG_DEBUG, "%s %s: curl=%d http=%ld, retrying in %llu ms", req->method, req->url, (int)rc, code,
+          (unsigned long long)(*delay_ns / 1000000ull));
   return CML_ERR_HTTP;
 }
+
+cml_status cml_http_attempt(cml *h, const cml_http_req *req, cml_http_try *t, cml_http_resp *out, bool *again,
+                            uint64_t *delay_ns) {
+  if (!h || !req || !req->method || !req->url || !t || !out || !again || !delay_ns) return CML_ERR_INVALID;
+  cml_status st = attempt(h, req, t, out, again, delay_ns);
+  // A partial body only ever waits for the next attempt.
+  if (!*again) resume_drop(h, t);
+  return st;
+}
+
+cml_status cml_http_send(cml *h, const cml_http_req *req, cml_http_resp *out) {
+  if (!h || !req || !out) return CML_ERR_INVALID;
+  memset(out, 0, sizeof(*out));
+  cml_http_try t = {0};
+  for (;;) {
+    bool again = false;
+    uint64_t delay_ns = 0;
+    cml_status st = cml_http_attempt(h, req, &t, out, &again, &delay_ns);
+    if (st == CML_OK || !again) return st;
+    sleep_ns(delay_ns);
+  }
+}
+
+// Without t, every attempt runs here, sleeping in between; otherwise only the next one.
+static cml_status http_get(cml *h, const cml_http_req *req, cml_http_try *t, cml_bytes *out, bool *again,
+                           uint64_t *delay_ns) {
+  if (!h || !req->url || !out) return CML_ERR_INVALID;
+  memset(out, 0, sizeof(*out));
+  cml_http_resp resp = {0};
+  cml_status st = t ? cml_http_attempt(h, req, t, &resp, again, delay_ns) : cml_http_send(h, req, &resp);
+  if (st == CML_OK) {
+    *out = resp.body;
+    memset(&resp.body, 0, sizeof(resp.body));
+  } else if (req->pooled) {
+    cml_buf_put(h, &resp.body);
+  }
+  cml_http_resp_free(&resp);
+  return st;
+}
+
+cml_status cml_http_get(cml *h, const char *url, cml_bytes *out) {
+  cml_http_req req = {.method = "GET", .url = url};
+  return http_get(h, &req, NULL, out, NULL, NULL);
+}
+
+cml_status cml_http_get_page(cml *h, CURL *curl, const char *url, cml_bytes *out) {
+  cml_http_req req = {.curl = curl, .method = "GET", .url = url, .pooled = true};
+  cml_status st = http_get(h, &req, NULL, out, NULL, NULL);
+  if (st == CML_OK) cml_buf_note_page(h, out->len);
+  return st;
+}
+
+cml_status cml_http_try_page(const cml_fetch_worker *w, const char *url, cml_http_try *t, cml_bytes *out, bool *again,
+                             uint64_t *delay_ns) {
+  if (!w || !t || !again || !delay_ns) return CML_ERR_INVALID;
+  cml_http_req req = {.curl = w->curl,
+                      .method = "GET",
+                      .url = url,
+                      .pooled = true,
+                      .page = &t->page,
+                      .hedge_curl = w->hedge_curl,
+                      .multi = w->multi};
+  cml_status st = http_get(w->h, &req, t, out, again, delay_ns);
+  if (st == CML_OK) cml_buf_note_page(w->h, out->len);
+  return st;
+}
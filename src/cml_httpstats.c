@@ -0,0 +1,151 @@
+#include "cml_internal.h"
+
+#include <string.h>
+
+// Per-run HTTP statistics. Every attempt adds to the counters of its class (metadata, pages,
+// uploads) with relaxed atomics, so fetch workers never wait on each other here; latencies go
+// into log-linear histograms that cml_get_stats copies out at the end of the run.
+
+#define SUB_BITS 4  // 16 buckets per power of two
+#define SUB_COUNT (1u << SUB_BITS)
+
+static size_t bucket_of(uint64_t us) {
+  if (us < SUB_COUNT) return (size_t)us;
+  unsigned msb = 63;
+  while (!(us >> msb)) msb--;
+  size_t i = (size_t)(msb - SUB_BITS + 1) * SUB_COUNT + (size_t)((us >> (msb - SUB_BITS)) & (SUB_COUNT - 1));
+  return i < CML_HIST_BUCKETS ? i : CML_HIST_BUCKETS - 1;
+}
+
+// Largest value bucket i holds.
+static uint64_t bucket_top(size_t i) {
+  if (i < SUB_COUNT) return i;
+  unsigned shift = (unsigned)(i / SUB_COUNT) - 1;
+  uint64_t low = (uint64_t)(SUB_COUNT + i % SUB_COUNT) << shift;
+  return low + ((uint64_t)1 << shift) - 1;
+}
+
+static void hist_add(cml_hist_counters *c, uint64_t ns) {
+  uint64_t us = ns / 1000u;
+  atomic_fetch_add_explicit(&c->count, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&c->sum_us, us, memory_order_relaxed);
+  atomic_fetch_add_explicit(&c->buckets[bucket_of(us)], 1, memory_order_relaxed);
+  uint64_t v = atomic_load_explicit(&c->min_us, memory_order_relaxed);
+  while (us < v && !atomic_compare_exchange_weak_explicit(&c->min_us, &v, us, memory_order_relaxed,
+                                                          memory_order_relaxed)) {
+  }
+  v = atomic_load_explicit(&c->max_us, memory_order_relaxed);
+  while (us > v && !atomic_compare_exchange_weak_explicit(&c->max_us, &v, us, memory_order_relaxed,
+                                                          memory_order_relaxed)) {
+  }
+}
+
+static void hist_reset(cml_hist_counters *c) {
+  atomic_store(&c->count, 0);
+  atomic_store(&c->sum_us, 0);
+  atomic_store(&c->min_us, UINT64_MAX);
+  atomic_store(&c->max_us, 0);
+  for (size_t i = 0; i < CML_HIST_BUCKETS; i++) atomic_store(&c->buckets[i], 0);
+}
+
+static void hist_get(cml_hist_counters *c, cml_histogram *out) {
+  out->count = atomic_load(&c->count);
+  out->sum_us = atomic_load(&c->sum_us);
+  out->min_us = out->count ? atomic_load(&c->min_us) : 0;
+  out->max_us = atomic_load(&c->max_us);
+  for (size_t i = 0; i < CML_HIST_BUCKETS; i++) out->buckets[i] = atomic_load(&c->buckets[i]);
+}
+
+uint64_t cml_histogram_percentile(const cml_histogram *h, double pct) {
+  if (!h || h->count == 0) return 0;
+  if (pct < 0.0) pct = 0.0;
+  if (pct > 100.0) pct = 100.0;
+  // The rank of the value, counted from 1.
+  uint64_t rank = (uint64_t)(pct / 100.0 * (double)h->count + 0.5);
+  if (rank == 0) rank = 1;
+  uint64_t seen = 0;
+  for (size_t i = 0; i < CML_HIST_BUCKETS; i++) {
+    seen += h->buckets[i];
+    if (seen >= rank) {
+      uint64_t top = bucket_top(i);
+      return top < h->max_us ? top : h->max_us;
+    }
+  }
+  return h->max_us;
+}
+
+static cml_http_class class_of(const cml_http_req *req) {
+  if (req->pooled) return CML_HTTP_PAGES;
+  return strcmp(req->method, "GET") == 0 ? CML_HTTP_METADATA : CML_HTTP_UPLOADS;
+}
+
+// curl reports each phase as the time from the start of the transfer to its end.
+static uint64_t info_ns(CURL *c, CURLINFO what) {
+  curl_off_t us = 0;
+  return curl_easy_getinfo(c, what, &us) == CURLE_OK && us > 0 ? (uint64_t)us * 1000u : 0;
+}
+
+void cml_http_stats_record(cml *h, const cml_http_req *req, CURL *c, bool responded, size_t received,
+                           uint64_t ttfb_ns, uint64_t total_ns) {
+  cml_http_class_counters *k = &h->http_stats.classes[class_of(req)];
+  atomic_fetch_add_explicit(&k->requests, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&k->bytes_received, received, memory_order_relaxed);
+  atomic_fetch_add_explicit(&k->bytes_sent, req->body_len, memory_order_relaxed);
+  if (!responded) atomic_fetch_add_explicit(&k->transport_errors, 1, memory_order_relaxed);
+  if (c) {
+    long opened = 0;
+    curl_easy_getinfo(c, CURLINFO_NUM_CONNECTS, &opened);
+    if (opened > 0) {
+      uint64_t dns = info_ns(c, CURLINFO_NAMELOOKUP_TIME_T);
+      uint64_t connected = info_ns(c, CURLINFO_CONNECT_TIME_T);
+      uint64_t tls = info_ns(c, CURLINFO_APPCONNECT_TIME_T);
+      atomic_fetch_add_explicit(&k->connections, (uint64_t)opened, memory_order_relaxed);
+      hist_add(&k->dns, dns);
+      if (connected) hist_add(&k->connect, connected > dns ? connected - dns : 0);
+      if (tls) hist_add(&k->tls, tls > connected ? tls - connected : 0);
+    } else if (responded) {
+      atomic_fetch_add_explicit(&k->reused, 1, memory_order_relaxed);
+    }
+  }
+  if (responded) {
+    hist_add(&k->ttfb, ttfb_ns);
+    hist_add(&k->total, total_ns);
+  }
+}
+
+void cml_http_reset_stats(cml *h) {
+  for (size_t i = 0; i < CML_HTTP_CLASSES; i++) {
+    cml_http_class_counters *k = &h->http_stats.classes[i];
+    atomic_store(&k->requests, 0);
+    atomic_store(&k->transport_errors, 0);
+    atomic_store(&k->bytes_received, 0);
+    atomic_store(&k->bytes_sent, 0);
+    atomic_store(&k->connections, 0);
+    atomic_store(&k->reused, 0);
+    hist_reset(&k->dns);
+    hist_reset(&k->connect);
+    hist_reset(&k->tls);
+    hist_reset(&k->ttfb);
+    hist_reset(&k->total);
+  }
+}
+
+static void class_get(cml_http_class_counters *k, cml_http_class_stats *out) {
+  out->requests = atomic_load(&k->requests);
+  out->transport_errors = atomic_load(&k->transport_errors);
+  out->bytes_received = atomic_load(&k->bytes_received);
+  out->bytes_sent = atomic_load(&k->bytes_sent);
+  out->connections = atomic_load(&k->connections);
+  out->reused = atomic_load(&k->reused);
+  hist_get(&k->dns, &out->dns);
+  hist_get(&k->connect, &out->connect);
+  hist_get(&k->tls, &out->tls);
+  hist_get(&k->ttfb, &out->ttfb);
+  hist_get(&k->total, &out->total);
+}
+
+void cml_http_get_stats(cml *h, cml_http_stats *out) {
+  class_get(&h->http_stats.classes[CML_HTTP_METADATA], &out->metadata);
+  class_get(&h->http_stats.classes[CML_HTTP_PAGES], &out->pages);
+  class_get(&h->http_stats.classes[CML_HTTP_UPLOADS], &out->uploads);
+}
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -12,6 +14,7 @@
 typedef struct {
   uint8_t *data;
   size_t len;
+  size_t cap;  // allocated size, when known (page buffers)
 } cml_bytes;
 
 typedef struct {
@@ -60,6 +63,7 @@ typedef struct {
   uint32_t chapter_id;
   uint32_t title_id;
   char *chapter_name;
+  size_t mem;  // bytes charged to the memory budget while the viewer is held
 } cml_manga_viewer;
 
 typedef struct {
@@ -73,29 +77,472 @@ typedef struct {
   cml_title title;
   cml_chapter_group *groups;
   size_t groups_len;
+  size_t mem;  // bytes charged to the memory budget while the detail is held
 } cml_title_detail;
 
+// Open-addressing set of owned strings (cml_strset.c)
+typedef struct {
+  char **slots;
+  size_t len;
+  size_t cap;  // power of two
+} cml_strset;
+
+typedef struct {
+  char *name;
+  uint64_t offset;  // local header offset
+  uint64_t size;    // stored, so compressed == uncompressed
+  uint32_t crc;
+  uint16_t dos_time;
+  uint16_t dos_date;
+} cml_zip_entry;
+
+// Append-only stored ZIP/ZIP64 writer (cml_zipw.c)
+typedef struct {
+  int fd;
+  uint64_t data_end;       // end of entry data; the central directory is written here
+  uint64_t committed_end;  // data_end as of the last commit
+  size_t committed;        // entries described by the on-disk central directory
+  cml_zip_entry *entries;
+  size_t len;
+  size_t cap;
+  cml_strset names;
+  bool read_only;  // opened with cml_zipw_open_read: nothing is ever added or written
+} cml_zipw;
+
+#define CML_STORE_KEY_LEN 32
+
+typedef struct {
+  char *name;  // page filename
+  char key[CML_STORE_KEY_LEN + 1];
+} cml_store_ref;
+
+// Page filename -> store key for one chapter (cml_store.c)
+typedef struct {
+  char *path;
+  cml_store_ref *items;
+  size_t len;
+  size_t cap;
+  bool dirty;
+} cml_store_refs;
+
 typedef struct cml_exporter cml_exporter;
 
+// One per cml_output_format value.
+#define CML_MAX_SINKS 6
+
+// Chapter pack layout (little-endian):
+//   [0, CML_PACK_ALIGN)  header: magic[8], u32 version, u32 page_count, u64 table_offset,
+//                        u64 names_offset, u64 names_len, u64 file_size, zero padding
+//   page payloads, each starting at a multiple of CML_PACK_ALIGN
+//   page table: page_count entries of {u64 offset, u64 len, u32 start, u32 stop, u32 name_offset, u32 name_len}
+//   names: NUL-terminated page filenames
+#define CML_PACK_MAGIC "CMLPACK\0"
+#define CML_PACK_VERSION 1
+#define CML_PACK_ALIGN 4096
+#define CML_PACK_HEADER_SIZE 64
+#define CML_PACK_ENTRY_SIZE 32
+
+// A chapter being written to the active sinks.
 struct cml_exporter {
-  cml_output_format fmt;
+  cml *h;
+  const cml_sink *sinks;
+  size_t sinks_len;
+  void *state[CML_MAX_SINKS];  // chapter_state returned by each sink's chapter_begin
   char *title_dir_name;
   char *chapter_dir_name;
   char *chapter_prefix;
   char *chapter_suffix;
-
-  char *title_dir_path;  // <out>/<title>
-  char *raw_dir_path;    // where images go when RAW
-  char *cbz_path;        // path to .cbz when CBZ
-  zip_t *zip;
-  bool skip_all;
+  cml_store_refs refs;  // only with cfg.store_dir
 };
 
+// Page buffer pool (cml_bufpool.c). Image buffers are recycled across pages and handed from HTTP
+// through decryption to the sinks without copies; a sink that keeps a page past its callback (CBZ)
+// takes ownership with cml_page_take instead of copying it.
+#define CML_BUF_POOL_SLOTS 64
+#define CML_BUF_POOL_MAX_BYTES (64u * 1024 * 1024)
+
+typedef struct {
+  uint64_t pages;         // pages that went through the pool
+  uint64_t allocs;        // malloc/realloc calls for page buffers
+  uint64_t reused;        // pages served by a recycled buffer
+  uint64_t bytes;         // page bytes
+  uint64_t bytes_copied;  // page bytes moved after receipt (buffer growth, sinks copying)
+} cml_buf_stats;
+
+typedef struct {
+  pthread_mutex_t mu;  // fetch workers allocate, the writer releases
+  cml_bytes free[CML_BUF_POOL_SLOTS];
+  size_t free_len;
+  size_t free_bytes;
+  size_t typical;  // running estimate of a page's size, used when Content-Length is missing
+  size_t largest;  // largest page seen
+  cml_buf_stats stats;
+  cml_bytes *offered;  // page currently being delivered to the sinks
+
+  // Memory budget (cfg.max_inflight_bytes). held counts page buffers in use or pooled, plus what
+  // sinks and metadata charge explicitly; reserved covers page downloads admitted but not yet back.
+  size_t limit;
+  size_t held;
+  size_t held_peak;
+  size_t reserved;
+  uint64_t stalls;  // page downloads held back by the budget (see cml_mem_note_stall)
+  // Reservations are estimates. A page body that turns out not to fit waits on room until memory is
+  // released (or gives way, see cml_buf_get_page), unless it is next_page, the writer's next page,
+  // which always goes ahead so the writer can make progress. SIZE_MAX: no page waits.
+  pthread_cond_t room;
+  size_t next_page;
+} cml_bufpool;
+
+typedef enum {
+  CML_PAGE_SKIP = 0,  // every sink has the page
+  CML_PAGE_STORED,    // the page store holds it for this chapter
+  CML_PAGE_FETCH,
+} cml_page_action;
+
+// What to do with one page of a chapter, decided before it is downloaded.
+typedef struct {
+  bool is_range;
+  uint32_t start;
+  uint32_t stop;
+  bool need[CML_MAX_SINKS];  // sinks still missing the page
+  cml_page_action action;
+} cml_page_plan;
+
+// Bounded multi-producer/multi-consumer queue (cml_queue.c): a lock-free ring with per-cell
+// sequence numbers. Threads only touch the mutex to sleep while the ring is empty or full.
+typedef struct {
+  _Atomic size_t seq;
+  void *item;
+} cml_queue_cell;
+
+typedef struct {
+  cml_queue_cell *cells;
+  size_t mask;
+  _Atomic size_t head;  // next push
+  _Atomic size_t tail;  // next pop
+  _Atomic bool closed;
+  _Atomic int waiters;
+  pthread_mutex_t mu;
+  pthread_cond_t cv;
+  // Depth sampled on every push.
+  _Atomic uint64_t depth_sum;
+  _Atomic uint64_t depth_samples;
+  _Atomic uint32_t depth_max;
+} cml_queue;
+
+// Progress of one request across its attempts (see cml_http_attempt).
+typedef struct {
+  uint32_t attempts;     // attempts used so far
+  bool paced;            // the next attempt already holds its slot under the host's rate limit
+  size_t bytes_charged;  // body size charged ahead for that slot
+  uint64_t queued_ns;    // time the last attempt waited for a slot in the download window
+  size_t page;           // page downloads: position in the chapter, for cml_buf_get_page
+
+  // Page body cut short by a transport error, kept for the next attempt to continue with a Range
+  // request when the server accepts ranges. Released once the request succeeds or gives up.
+  cml_bytes partial;
+  uint64_t partial_total;  // full body size the rest must add up to
+  char *partial_validator;  // ETag or Last-Modified of the partial body, for If-Range
+} cml_http_try;
+
+// One page travelling fetch -> decrypt -> write.
+typedef struct {
+  size_t index;  // position in the chapter, for the writer's reordering
+  const char *url;
+  const char *key;  // hex XOR key
+  cml_status st;
+  cml_bytes img;
+  cml_http_try fetch;
+  uint64_t due_ns;  // when a job waiting to be retried goes back to the fetch queue
+} cml_page_job;
+
+#define CML_PIPE_QUEUE_CAP 256
+#define CML_DEFAULT_FETCH_WORKERS 8
+#define CML_DEFAULT_INFLIGHT_BYTES (64u * 1024 * 1024)
+
+typedef struct {
+  cml *h;
+  CURL *curl;
+  CURL *hedge_curl;  // with cfg.hedge_percentile: the second copy of a slow page, run next to curl
+  CURLM *multi;
+  pthread_t thread;
+} cml_fetch_worker;
+
+// Page pipeline (cml_pipeline.c), alive for one cml_run. The writer is the cml_run thread.
+typedef struct {
+  bool started;
+  cml_queue fetch_q;    // jobs waiting for a fetch worker
+  cml_queue decrypt_q;  // fetched pages waiting for decryption
+  cml_queue done_q;     // pages ready for the writer, in completion order
+  cml_fetch_worker *workers;
+  uint32_t workers_len;
+  pthread_t decrypt_thread;
+  bool decrypt_running;
+
+  // Jobs backing off before their next attempt. A timer thread moves them back to fetch_q when they
+  // are due, so a backoff never holds a worker. The writer has at most CML_PIPE_QUEUE_CAP jobs out.
+  pthread_mutex_t retry_mu;
+  pthread_cond_t retry_cv;  // waits on CLOCK_MONOTONIC, like cml_now_ns
+  bool retry_sync;          // retry_mu/retry_cv initialized
+  cml_page_job *retry[CML_PIPE_QUEUE_CAP];
+  size_t retry_len;
+  bool retry_closed;
+  pthread_t retry_thread;
+  bool retry_running;
+
+  _Atomic uint64_t fetch_busy_ns;
+  _Atomic uint64_t fetch_pages;
+  _Atomic uint64_t decrypt_busy_ns;
+  _Atomic uint64_t decrypt_pages;
+  uint64_t write_busy_ns;
+  uint64_t write_pages;
+  uint64_t wall_ns;
+} cml_pipeline;
+
+// Retry policy and per-host circuit breakers (cml_retry.c).
+#define CML_MAX_BREAKERS 16
+
+typedef struct {
+  char host[64];  // host[:port]
+  uint32_t failures;  // consecutive
+  bool open;
+  bool probing;  // the one request allowed through after the cooldown is in flight
+  uint64_t open_until_ns;
+} cml_breaker;
+
+typedef struct {
+  _Atomic uint64_t requests;
+  _Atomic uint64_t retries;
+  _Atomic uint64_t retry_after;
+  _Atomic uint64_t backoff_ns;
+  _Atomic uint64_t gave_up;
+  _Atomic uint64_t breaker_opened;
+  _Atomic uint64_t breaker_rejected;
+  _Atomic uint64_t resumed;
+  _Atomic uint64_t resumed_bytes;
+} cml_retry_counters;
+
+typedef struct {
+  pthread_mutex_t mu;  // guards hosts
+  cml_breaker hosts[CML_MAX_BREAKERS];
+  size_t hosts_len;
+  _Atomic uint64_t rng;
+  cml_retry_counters stats;  // since the start of the last cml_run
+} cml_retry_state;
+
+// Per-host rate limits (cml_ratelimit.c).
+#define CML_MAX_LIMITERS 16  // idle ones make room for new hosts; a host beyond that is unlimited
+
+typedef struct {
+  char host[64];  // host[:port]
+  double rate;    // requests/s allowed now; 0: unlimited
+  double req_tokens;
+  double byte_tokens;     // both buckets go negative while slots are reserved ahead
+  size_t typical_bytes;  // charged ahead for each request's body
+  uint64_t refill_ns;
+  double cut_from;  // request rate the last 429 cut from, while the rate climbs back; 0 otherwise
+  uint64_t cut_ns;
+  uint64_t win_ns;  // start of the current one-second window of sent requests
+  uint32_t win_count;
+  double sent_rate;  // requests/s over the last full window
+} cml_limiter;
+
+typedef struct {
+  _Atomic uint64_t throttled;
+  _Atomic uint64_t wait_ns;
+  _Atomic uint64_t cuts;
+} cml_rate_counters;
+
+typedef struct {
+  double max_rps;  // from cml_config; 0: unlimited
+  double max_bps;
+  pthread_mutex_t mu;  // guards hosts and min_rate
+  cml_limiter hosts[CML_MAX_LIMITERS];
+  size_t hosts_len;
+  double min_rate;
+  cml_rate_counters stats;  // since the start of the last cml_run
+} cml_rate_state;
+
+// Adaptive page download concurrency (cml_concurrency.c).
+typedef struct {
+  pthread_mutex_t mu;
+  pthread_cond_t cv;  // a slot was freed
+  bool fixed;
+  uint32_t max;   // fetch worker threads
+  double window;  // downloads allowed in flight; grows by fractions of a slot
+  uint32_t inflight;
+  uint64_t cut_ns;  // requests started before the last cut cannot cut again
+  uint64_t min_ttfb_ns;
+  double srtt_ns;  // smoothed time to first byte; 0 until sampled
+  cml_concurrency_stats stats;
+} cml_window_state;
+
+// Adaptive transfer timeouts (cml_timeout.c).
+#define CML_MAX_TIMINGS 16
+
+typedef struct {
+  char host[64];  // host[:port]
+  double ttfb_ns;      // smoothed time to first byte; 0 until sampled
+  double ttfb_dev_ns;  // its smoothed mean deviation
+  double rate_bps;     // smoothed transfer rate after the first byte; 0 until sampled
+} cml_host_timing;
+
+typedef struct {
+  _Atomic uint64_t first_byte_timeouts;
+  _Atomic uint64_t stalls;
+  _Atomic uint64_t slow_aborts;
+  _Atomic uint64_t saved_ns;
+} cml_timeout_counters;
+
+typedef struct {
+  pthread_mutex_t mu;  // guards hosts
+  cml_host_timing hosts[CML_MAX_TIMINGS];
+  size_t hosts_len;
+  cml_timeout_counters stats;  // since the start of the last cml_run
+} cml_timeout_state;
+
+// Limits for one transfer, from its host's history.
+typedef struct {
+  uint64_t first_byte_ns;  // longest wait for the response to start
+  uint64_t stall_ns;       // longest time without any bytes moving once it has
+  double min_rate_bps;     // slowest acceptable average rate; 0 while the host's rate is unknown
+} cml_xfer_limits;
+
+typedef enum {
+  CML_XFER_OK = 0,
+  CML_XFER_FIRST_BYTE,
+  CML_XFER_STALL,
+  CML_XFER_SLOW,
+} cml_xfer_abort;
+
+// Hedged page downloads (cml_hedge.c).
+#define CML_HEDGE_SAMPLES 256
+
+typedef struct {
+  pthread_mutex_t mu;
+  uint32_t percentile;  // 0: hedging is off
+  uint32_t max_extra_pct;
+  uint64_t samples[CML_HEDGE_SAMPLES];  // recent page download times (ring)
+  size_t samples_len;
+  size_t next;
+  uint32_t unsorted;  // samples since delay_ns was computed
+  uint64_t delay_ns;  // 0 until there are enough samples
+  uint64_t page_bytes;  // downloaded this run, the base for the extra bandwidth cap
+  uint64_t pending;     // estimated bytes of hedges in flight
+  cml_hedge_stats stats;
+} cml_hedge_state;
+
+// Resources one hedge holds until cml_hedge_end.
+typedef struct {
+  size_t bytes_charged;  // under the host's byte limit
+  size_t reserved;       // against the memory budget
+} cml_hedge_slot;
+
+// HTTP statistics (cml_httpstats.c), updated by every thread that sends requests.
+typedef struct {
+  _Atomic uint64_t count;
+  _Atomic uint64_t sum_us;
+  _Atomic uint64_t min_us;  // UINT64_MAX while empty
+  _Atomic uint64_t max_us;
+  _Atomic uint64_t buckets[CML_HIST_BUCKETS];
+} cml_hist_counters;
+
+typedef struct {
+  _Atomic uint64_t requests;
+  _Atomic uint64_t transport_errors;
+  _Atomic uint64_t bytes_received;
+  _Atomic uint64_t bytes_sent;
+  _Atomic uint64_t connections;
+  _Atomic uint64_t reused;
+  cml_hist_counters dns;
+  cml_hist_counters connect;
+  cml_hist_counters tls;
+  cml_hist_counters ttfb;
+  cml_hist_counters total;
+} cml_http_class_counters;
+
+typedef enum {
+  CML_HTTP_METADATA = 0,
+  CML_HTTP_PAGES = 1,
+  CML_HTTP_UPLOADS = 2,
+  CML_HTTP_CLASSES = 3,
+} cml_http_class;
+
+typedef struct {
+  cml_http_class_counters classes[CML_HTTP_CLASSES];  // since the start of the last cml_run
+} cml_http_counters;
+
+// Run tracing (cml_trace.c), alive for one cml_run with cfg.trace_path.
+typedef struct cml_trace_ring cml_trace_ring;
+
+typedef struct {
+  bool on;  // set before the pipeline threads start and cleared after they are joined
+  uint64_t run;
+  uint64_t start_ns;
+  pthread_mutex_t mu;  // guards rings and threads while threads register
+  cml_trace_ring *rings;
+  uint32_t threads;
+} cml_trace_state;
+
+// Metadata responses kept for revalidation (cml_api.c); only the cml_run thread uses them.
+#define CML_API_CACHE_MAX 64
+
+typedef struct {
+  char *url;  // NULL: free slot
+  char *etag;
+  char *last_modified;
+  bool is_viewer;
+  cml_manga_viewer viewer;
+  cml_title_detail detail;
+  uint64_t used;  // for evicting the least recently used entry
+} cml_api_entry;
+
+typedef struct {
+  cml_api_entry items[CML_API_CACHE_MAX];
+  uint64_t clock;
+  cml_metadata_stats stats;  // since the start of the last cml_run
+} cml_api_cache;
+
 struct cml {
   cml_config cfg;
+  // Active outputs: a copy of cfg.sink, or the built-in sinks (user == this handle) for cfg.output(s).
+  cml_sink sinks[CML_MAX_SINKS];
+  size_t sinks_len;
+  cml_output_format outputs[CML_MAX_SINKS];
   CURL *curl;
   cml_u32_vec chapter_ids;
   cml_u32_vec title_ids;
+
+  // Directory listing of the last RAW output directory, reused across chapters of a title.
+  char *raw_index_dir;
+  cml_strset raw_index;
+
+  // Title archive currently open, for appending or (read_only) for looking up exported chapters;
+  // kept across the chapters of a title.
+  char *archive_path;
+  cml_zipw archive;
+
+  // Tar stream state: the end-of-archive blocks are written once per run.
+  bool tar_started;
+  int64_t tar_mtime;
+
+  cml_strset store_dirs;  // objects/<xx> directories known to exist
+  cml_store_stats store_stats;
+
+  cml_bufpool bufs;
+  cml_retry_state retry;
+  cml_rate_state rate;
+  cml_window_state window;
+  cml_timeout_state timeouts;
+  cml_hedge_state hedge;
+  cml_api_cache api;
+  cml_http_counters http_stats;
+  cml_work_stats work;  // decode and export time of the current run (cml_run thread only)
+  cml_trace_state trace;
+  cml_pipeline pipe;
+  cml_stats stats;  // snapshot of the last run
+
+  pthread_mutex_t log_mu;  // log_fn is also called from fetch workers, one call at a time
 };
 
 // Logging/progress (no-ops if callbacks not set)
@@ -107,23 +554,285 @@ int cml_u32_push(cml_u32_vec *v, uint32_t x);
 int cml_u32_sort_dedupe(cml_u32_vec *v);
 void cml_u32_free(cml_u32_vec *v);
 
+// strset
+int cml_strset_add(cml_strset *s, const char *key);
+int cml_strset_has(const cml_strset *s, const char *key);
+void cml_strset_free(cml_strset *s);
+
 // url
 int cml_url_extract_viewer_id(const char *s, uint32_t *out);
 int cml_url_extract_titles_id(const char *s, uint32_t *out);
+// "scheme://host[:port]/..." -> length of host[:port], which starts at *out_start.
+size_t cml_url_host(const char *url, const char **out_start);
 
 // http
 cml_status cml_http_get(cml *h, const char *url, cml_bytes *out);
+// Like cml_http_get, but the body lands in a pool buffer presized from Content-Length. curl may be a
+// fetch worker's own handle (NULL means h->curl).
+cml_status cml_http_get_page(cml *h, CURL *curl, const char *url, cml_bytes *out);
+// A single attempt of cml_http_get_page on a fetch worker's handles; see cml_http_attempt for
+// again/delay_ns.
+cml_status cml_http_try_page(const cml_fetch_worker *w, const char *url, cml_http_try *t, cml_bytes *out, bool *again,
+                             uint64_t *delay_ns);
 void cml_bytes_free(cml_bytes *b);
 
+typedef struct {
+  CURL *curl;          // NULL means h->curl (only the cml_run thread may use that one)
+  const char *method;  // GET, HEAD, PUT, POST or DELETE
+  const char *url;
+  const struct curl_slist *headers;
+  const uint8_t *body;  // request body for PUT/POST
+  size_t body_len;
+  bool quiet_404;  // a missing object is an expected answer, not worth a warning
+  bool pooled;     // receive the body into a page buffer from h->bufs
+  const size_t *page;  // pooled: the page's position in its chapter, whose buffer waits for the budget
+  bool conditional;  // sent with validators: a 304 is an answer, not a failure
+  // Pooled requests only: a second handle and the multi handle both copies run on, for hedging.
+  CURL *hedge_curl;
+  CURLM *multi;
+} cml_http_req;
+
+typedef struct {
+  long code;  // HTTP status of the last attempt (0 on transport errors)
+  cml_bytes body;
+  char *etag;  // ETag response header, if any
+  char *last_modified;  // Last-Modified response header, if any
+} cml_http_resp;
+
+// Performs req under the retry policy, sleeping between attempts; non-2xx answers return
+// CML_ERR_HTTP with out->code set.
+cml_status cml_http_send(cml *h, const cml_http_req *req, cml_http_resp *out);
+// One attempt of req, with t zeroed before the first. t->attempts is advanced unless the request
+// only had to wait for its host's rate limit or for another request probing the host. On failure,
+// *again tells whether the policy allows another attempt and *delay_ns how long to wait before it;
+// the caller does the waiting.
+cml_status cml_http_attempt(cml *h, const cml_http_req *req, cml_http_try *t, cml_http_resp *out, bool *again,
+                            uint64_t *delay_ns);
+void cml_http_resp_free(cml_http_resp *r);
+
+// transport (record and replay, cml_transport.c)
+// Checks cfg.transport.dir: created for RECORD, required to exist for REPLAY.
+cml_status cml_transport_init(cml *h);
+// How req is answered: cfg.transport.mode for GET requests, live for everything else.
+cml_transport_mode cml_transport_for(const cml *h, const cml_http_req *req);
+// Saves a final response to req (code, validators and body) for REPLAY.
+void cml_record_save(cml *h, const cml_http_req *req, const cml_http_resp *resp);
+// Answers req from its recording after the configured latency and delivery time (*ttfb_ns and
+// *total_ns report them). A request carrying the recorded validator gets a 304; one that was never
+// recorded gets a 404.
+cml_status cml_replay_answer(cml *h, const cml_http_req *req, cml_http_resp *out, uint64_t *ttfb_ns,
+                             uint64_t *total_ns);
+
+// sha256
+typedef struct {
+  uint32_t h[8];
+  uint64_t total;
+  uint8_t buf[64];
+  size_t buf_len;
+} cml_sha256;
+
+void cml_sha256_init(cml_sha256 *c);
+void cml_sha256_update(cml_sha256 *c, const void *data, size_t len);
+void cml_sha256_final(cml_sha256 *c, uint8_t out[32]);
+void cml_sha256_hex(const void *data, size_t len, char out[65]);
+void cml_hmac_sha256(const void *key, size_t key_len, const void *msg, size_t msg_len, uint8_t out[32]);
+
+// S3 request signing (cml_export_s3.c)
+typedef struct {
+  const char *method;
+  const char *uri;    // URI-encoded path
+  const char *query;  // canonical query string; "" for none
+  const char *host;
+  size_t host_len;
+  const char *payload_hash;  // hex SHA-256 of the body
+  const char *amz_date;      // YYYYMMDDTHHMMSSZ
+} cml_s3_signed;
+
+// SigV4 signature (lowercase hex) of a canonical request to service s3, scoped to amz_date's day.
+cml_status cml_sigv4_sign(const char *secret_key, const char *region, const char *amz_date, const char *canonical,
+                          char out[65]);
+// Signs r with host, x-amz-content-sha256 and x-amz-date as the signed headers, as S3 requests are sent.
+cml_status cml_s3_sign(const cml_s3_signed *r, const char *region, const char *secret_key, char out[65]);
+
+// page buffers
+// Returns a buffer with cap >= want (0: the typical page size) and len 0.
+cml_status cml_buf_get(cml *h, size_t want, cml_bytes *out);
+// Grows b to hold need bytes, keeping its contents.
+cml_status cml_buf_grow(cml *h, cml_bytes *b, size_t need);
+// Gives b back to the pool (or frees it when the pool is full) and clears it.
+void cml_buf_put(cml *h, cml_bytes *b);
+void cml_buf_note_copy(cml *h, size_t n);
+// Records a received page and updates the typical page size.
+void cml_buf_note_page(cml *h, size_t len);
+// Memory to budget for the next page's buffer; 0 until a page has been seen.
+size_t cml_buf_estimate(cml *h);
+cml_status cml_bufpool_init(cml *h);
+// cml_buf_get for the body of page downloads: waits for room in the budget unless page is the
+// writer's next one (see cml_mem_next_page). Returns CML_OK with out left empty when no room came up
+// in time; the download then gives way and is tried again later.
+cml_status cml_buf_get_page(cml *h, size_t want, size_t page, cml_bytes *out);
+
+// memory budget
+size_t cml_mem_limit(cml *h);
+void cml_mem_charge(cml *h, size_t n);
+void cml_mem_release(cml *h, size_t n);
+// Reserves n bytes for a page download when they fit (idle pooled buffers are freed to make room),
+// or unconditionally with force. Returns whether the reservation was made.
+bool cml_mem_reserve(cml *h, size_t n, bool force);
+// Counts a page download held back by the budget; the writer calls it once per page, however many
+// times it retries the reservation.
+void cml_mem_note_stall(cml *h);
+void cml_mem_unreserve(cml *h, size_t n);
+// Whether the writer's next page might not fit beside what is in use (idle pooled buffers count as
+// free); sinks that keep pages in memory give some up while it is.
+bool cml_mem_tight(cml *h);
+// Sets the page the writer needs next (SIZE_MAX once it needs none, e.g. after a failure), waking
+// downloads that wait for room.
+void cml_mem_next_page(cml *h, size_t page);
+// Starts a run's counters: the peak restarts from what is held now.
+void cml_mem_reset(cml *h);
+void cml_bufpool_free(cml *h);
+// Moves the buffer behind page->data to the caller when it is the pooled page being delivered and
+// nobody took it yet; returns 0 otherwise (the caller must copy).
+int cml_page_take(cml *h, const cml_sink_page *page, cml_bytes *out);
+
+// queue
+// cap must be a power of two.
+cml_status cml_queue_init(cml_queue *q, size_t cap);
+void cml_queue_destroy(cml_queue *q);
+// Blocks while the queue is full; false once it is closed.
+bool cml_queue_push(cml_queue *q, void *item);
+// Blocks while the queue is empty; false once it is closed and drained.
+bool cml_queue_pop(cml_queue *q, void **out);
+void cml_queue_close(cml_queue *q);
+
+// retry
+cml_status cml_retry_init(cml *h);
+void cml_retry_free(cml *h);
+uint32_t cml_retry_max_attempts(const cml *h);
+// Delay before the next attempt after `failed` failed ones; a longer Retry-After wins unless ignored.
+uint64_t cml_retry_delay_ns(cml *h, uint32_t failed, uint64_t retry_after_ns);
+typedef enum {
+  CML_BREAKER_PASS = 0,  // send the request
+  CML_BREAKER_OPEN,      // the host is paused; refusing uses up an attempt
+  CML_BREAKER_WAIT,      // another request is probing the host; try again later, for free
+} cml_breaker_verdict;
+
+// Whether a request to url's host may be sent now; if not, *wait_ns is when to try again.
+cml_breaker_verdict cml_breaker_check(cml *h, const char *url, uint64_t *wait_ns);
+// Records the outcome of an allowed request; host_ok is false for transport errors and 5xx.
+void cml_breaker_record(cml *h, const char *url, bool host_ok);
+void cml_retry_reset_stats(cml *h);
+void cml_retry_get_stats(cml *h, cml_retry_stats *out);
+// Shared pseudo-random numbers for spreading delays.
+uint64_t cml_random(cml *h);
+
+// rate limits
+cml_status cml_rate_init(cml *h);
+void cml_rate_free(cml *h);
+// Reserves the next request slot for url's host and returns how long to wait for it (0: send now).
+// *bytes_charged is the body size charged ahead to the byte limit; pass it back to cml_rate_record.
+uint64_t cml_rate_acquire(cml *h, const char *url, size_t *bytes_charged);
+// Takes a slot only when one is free right now; settle it with cml_rate_record as well.
+bool cml_rate_try_acquire(cml *h, const char *url, size_t *bytes_charged);
+// Gives back a slot whose request was never sent (bytes_charged as cml_rate_acquire set it).
+void cml_rate_refund(cml *h, const char *url, size_t bytes_charged);
+// Settles the bytes a request moved against what was charged ahead; a 429 lowers the host's
+// request rate.
+void cml_rate_record(cml *h, const char *url, size_t bytes, size_t bytes_charged, long code);
+void cml_rate_reset_stats(cml *h);
+void cml_rate_get_stats(cml *h, cml_rate_stats *out);
+
+// concurrency window
+cml_status cml_window_init(cml *h);
+void cml_window_free(cml *h);
+// Waits for a free slot in the page download window; returns the request's start time.
+uint64_t cml_window_enter(cml *h);
+// Frees the slot and adapts the window: congested is a 429, 5xx or transport error; ttfb_ns is the
+// time to first byte of a successful answer (0 when unknown).
+void cml_window_leave(cml *h, uint64_t start_ns, bool congested, uint64_t ttfb_ns);
+// Takes a slot for a hedge without waiting (one beyond the window is allowed); cml_window_release
+// frees it without adapting the window.
+bool cml_window_try_enter(cml *h);
+void cml_window_release(cml *h);
+uint32_t cml_window_current(cml *h);
+void cml_window_reset_stats(cml *h);
+void cml_window_get_stats(cml *h, cml_concurrency_stats *out);
+
+// transfer timeouts
+cml_status cml_timeout_init(cml *h);
+void cml_timeout_free(cml *h);
+void cml_timeout_plan(cml *h, const char *url, cml_xfer_limits *out);
+// How long a transfer of total_bytes may take in all under l; 0 when there is no basis for a limit.
+uint64_t cml_timeout_deadline_ns(const cml_xfer_limits *l, uint64_t total_bytes);
+// Feeds a completed transfer's time to first byte, total time and body size into its host's history.
+void cml_timeout_record(cml *h, const char *url, uint64_t ttfb_ns, uint64_t total_ns, size_t bytes);
+// Counts a transfer abandoned after elapsed_ns.
+void cml_timeout_abort(cml *h, cml_xfer_abort why, uint64_t elapsed_ns);
+void cml_timeout_reset_stats(cml *h);
+void cml_timeout_get_stats(cml *h, cml_timeout_stats *out);
+
+// hedging
+cml_status cml_hedge_init(cml *h);
+void cml_hedge_free(cml *h);
+// How long a page may be outstanding before it is hedged; 0: do not hedge (yet).
+uint64_t cml_hedge_delay_ns(cml *h);
+// Records a successful page download.
+void cml_hedge_sample(cml *h, uint64_t elapsed_ns, size_t bytes);
+// Takes what a second copy needs (window slot, rate limit slot, memory) if the extra bandwidth cap
+// allows one; returns false, holding nothing, otherwise.
+bool cml_hedge_begin(cml *h, const char *url, cml_hedge_slot *slot);
+// Releases the slot; wasted is what the losing copy received, whichever copy that was.
+void cml_hedge_end(cml *h, const char *url, const cml_hedge_slot *slot, bool won, size_t wasted);
+void cml_hedge_reset_stats(cml *h);
+void cml_hedge_get_stats(cml *h, cml_hedge_stats *out);
+
+// HTTP statistics
+// Counts one attempt of req. c is the handle that carried it, for curl's timings; NULL for a replayed
+// answer, which only has ttfb_ns and total_ns. received is the body bytes this attempt transferred.
+void cml_http_stats_record(cml *h, const cml_http_req *req, CURL *c, bool responded, size_t received,
+                           uint64_t ttfb_ns, uint64_t total_ns);
+void cml_http_reset_stats(cml *h);
+void cml_http_get_stats(cml *h, cml_http_stats *out);
+
+// pipeline
+uint64_t cml_now_ns(void);
+cml_status cml_pipeline_start(cml *h);
+// Joins the threads and stores the run's counters in h->stats.
+void cml_pipeline_stop(cml *h);
+void cml_pipeline_submit(cml *h, cml_page_job *job);
+// Next finished job, in completion order.
+cml_page_job *cml_pipeline_wait(cml *h);
+
+// tracing
+cml_status cml_trace_start(cml *h);
+// Writes the run's spans to cfg.trace_path and releases them.
+cml_status cml_trace_finish(cml *h);
+// Names the calling thread in the trace (index >= 0 is appended); call once as a thread starts.
+void cml_trace_thread(cml *h, const char *name, int index);
+void cml_trace_span(cml *h, const char *cat, const char *name, uint64_t start_ns, uint64_t end_ns,
+                    const char *arg_name, uint64_t arg);
+
+// A span costs one test of h->trace.on while tracing is off: cml_trace_end only tests the start time
+// cml_trace_begin returned, which is 0 then.
+static inline uint64_t cml_trace_begin(const cml *h) { return h->trace.on ? cml_now_ns() : 0; }
+static inline void cml_trace_end(cml *h, uint64_t start_ns, const char *cat, const char *name, const char *arg_name,
+                                 uint64_t arg) {
+  if (start_ns) cml_trace_span(h, cat, name, start_ns, cml_now_ns(), arg_name, arg);
+}
+
 // api
 cml_status cml_api_get_manga_viewer(cml *h, uint32_t chapter_id, cml_manga_viewer *out);
 cml_status cml_api_get_title_detail(cml *h, uint32_t title_id, cml_title_detail *out);
+void cml_api_cache_free(cml *h);
 
 // proto
 cml_status cml_proto_parse_manga_viewer(const uint8_t *buf, size_t len, cml_manga_viewer *out);
 cml_status cml_proto_parse_title_detail(const uint8_t *buf, size_t len, cml_title_detail *out);
 void cml_proto_free_manga_viewer(cml_manga_viewer *v);
 void cml_proto_free_title_detail(cml_title_detail *d);
+cml_status cml_proto_copy_manga_viewer(const cml_manga_viewer *src, cml_manga_viewer *out);
+cml_status cml_proto_copy_title_detail(const cml_title_detail *src, cml_title_detail *out);
 
 // crypto
 cml_status cml_decrypt_xor_hex(uint8_t *data, size_t data_len, const char *hex_key);
@@ -131,8 +840,49 @@ cml_status cml_decrypt_xor_hex(uint8_t *data, size_t data_len, const char *hex_k
 // fs
 cml_status cml_mkdir_p(const char *path);
 int cml_exists(const char *path);
+// Writes through a temporary ".<name>.cml-XXXXXX" next to path, then renames it into place.
 cml_status cml_write_file_atomic(const char *path, const uint8_t *data, size_t len);
 cml_status cml_rename_overwrite(const char *src, const char *dst);
+// Hardlinks src to dst via such a temporary name + rename; fails (without fallback) across filesystems.
+cml_status cml_link_file_atomic(const char *src, const char *dst);
+cml_status cml_read_file(const char *path, cml_bytes *out);
+// Like cml_read_file, into a page buffer (release it with cml_buf_put).
+cml_status cml_read_file_pooled(cml *h, const char *path, cml_bytes *out);
+// Adds every entry of dir to out, except cml's temporary files, and removes those that are stale
+// (older than ten minutes); a missing dir yields an empty set.
+cml_status cml_dir_scan(const char *dir, cml_strset *out, size_t *out_stale);
+
+// zip writer
+uint32_t cml_crc32(const uint8_t *data, size_t len);
+void cml_zip_dos_now(uint16_t *out_time, uint16_t *out_date);
+// Encodes e's local file header (30 bytes + name) into out; returns its length.
+size_t cml_zip_local_header(uint8_t *out, const cml_zip_entry *e);
+// Central directory plus (ZIP64) end records for entries, placed at cd_off; *out is malloc'd.
+cml_status cml_zip_central_dir(const cml_zip_entry *entries, size_t len, uint64_t cd_off, uint8_t **out,
+                               size_t *out_len);
+// Opens or creates path; an archive cut short while appending is recovered from its local headers.
+cml_status cml_zipw_open(const char *path, cml_zipw *z);
+// Opens path for reading its committed entries only; CML_ERR_ZIP when it has no usable end of
+// central directory. Never writes, so nothing is recovered.
+cml_status cml_zipw_open_read(const char *path, cml_zipw *z);
+int cml_zipw_has(const cml_zipw *z, const char *name);
+cml_status cml_zipw_add(cml_zipw *z, const char *name, const uint8_t *data, size_t len);
+// Writes the central directory for every entry added so far.
+cml_status cml_zipw_commit(cml_zipw *z);
+// Drops entries added since the last commit and restores its central directory.
+cml_status cml_zipw_rollback(cml_zipw *z);
+void cml_zipw_close(cml_zipw *z);
+
+// page store
+void cml_store_key(const uint8_t *data, size_t len, char out[CML_STORE_KEY_LEN + 1]);
+char *cml_store_object_path(const cml *h, const char *key);
+// Stores the page unless its content is already present; *out_path is the object path.
+cml_status cml_store_put(cml *h, const uint8_t *data, size_t len, char key[CML_STORE_KEY_LEN + 1], char **out_path);
+cml_status cml_store_refs_load(const cml *h, const char *title_dir, const char *chapter_dir, cml_store_refs *out);
+const char *cml_store_refs_find(const cml_store_refs *r, const char *name);
+cml_status cml_store_refs_set(cml_store_refs *r, const char *name, const char *key);
+cml_status cml_store_refs_save(cml_store_refs *r);
+void cml_store_refs_free(cml_store_refs *r);
 
 // naming
 cml_status cml_build_names(const cml_title *title, const cml_chapter *chapter, const cml_chapter *next_chapter,
@@ -144,14 +894,38 @@ char *cml_escape_component(const char *s);
 char *cml_titlecase_ascii(const char *s);
 int cml_chapter_name_to_int(const char *s, int *out);
 int cml_is_oneshot(const char *chapter_name, const char *chapter_subtitle);
+// Extras are numbered after the following chapter, which only the viewer reports reliably.
+int cml_names_need_next(const cml_chapter *chapter);
+
+// built-in sinks (user must be the cml handle)
+extern const cml_sink cml_raw_sink;
+extern const cml_sink cml_cbz_sink;
+extern const cml_sink cml_title_sink;
+extern const cml_sink cml_tar_sink;
+extern const cml_sink cml_pack_sink;
+extern const cml_sink cml_s3_sink;
+#define CML_S3_MIN_PART (5u * 1024 * 1024)
+#define CML_S3_DEFAULT_PART (8u * 1024 * 1024)
+void cml_export_raw_reset_index(cml *h);
+// Closes the title archive kept open across chapters, if any.
+void cml_export_title_close(cml *h);
 
-// exporters
+// exporters (drive the active sinks; pages are handed to every sink that does not have them yet)
 cml_status cml_exporter_open(cml *h, const cml_title *title, const cml_chapter *chapter, const cml_chapter *next_chapter,
                              cml_exporter **out);
-void cml_exporter_close_destroy(cml_exporter *e, bool success);
-int cml_exporter_skip_image(cml_exporter *e, int is_range, uint32_t start, uint32_t stop);
-cml_status cml_exporter_add_image(cml_exporter *e, const uint8_t *data, size_t len, int is_range, uint32_t start,
-                                  uint32_t stop);
+cml_status cml_exporter_close_destroy(cml_exporter *e, bool success);
+// Run-level teardown, forwarded to each sink's run_end.
+cml_status cml_exporter_end_run(cml *h);
+// 1 when every output of the chapter is provably complete from title metadata alone (no viewer needed).
+int cml_exporter_is_complete(cml *h, const cml_title *title, const cml_chapter *chapter);
+// Decides, before any download, which sinks still need the page and whether the page store can
+// provide it.
+cml_status cml_exporter_plan_image(cml_exporter *e, int is_range, uint32_t start, uint32_t stop, cml_page_plan *out);
+// Hands a CML_PAGE_STORED page to the sinks; *out_served = 0 when the stored copy turned out to be
+// unusable and the page has to be downloaded after all.
+cml_status cml_exporter_add_stored(cml_exporter *e, const cml_page_plan *plan, int *out_served);
+// Takes ownership of img (a page buffer) whatever the outcome.
+cml_status cml_exporter_add_image(cml_exporter *e, const cml_page_plan *plan, cml_bytes *img);
 
 // loader
 cml_status cml_loader_run(cml *h);
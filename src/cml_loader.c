@@ -72,6 +72,28 @@ static cml_status entry_add_chapter(title_entry *e, const cml_chapter *src) {
   return CML_OK;
 }
 
+static int chapter_id_cmp(const void *a, const void *b) {
+  uint32_t ua = ((const cml_chapter *)a)->chapter_id;
+  uint32_t ub = ((const cml_chapter *)b)->chapter_id;
+  if (ua < ub) return -1;
+  if (ua > ub) return 1;
+  return 0;
+}
+
+static void entry_sort_dedupe(title_entry *e) {
+  if (e->chapters_len < 2) return;
+  qsort(e->chapters, e->chapters_len, sizeof(cml_chapter), chapter_id_cmp);
+  size_t out = 1;
+  for (size_t i = 1; i < e->chapters_len; i++) {
+    if (e->chapters[i].chapter_id == e->chapters[out - 1].chapter_id) {
+      chapter_free_fields(&e->chapters[i]);
+      continue;
+    }
+    e->chapters[out++] = e->chapters[i];
+  }
+  e->chapters_len = out;
+}
+
 typedef struct {
   uint32_t id;
   cml_manga_viewer viewer;
@@ -83,13 +105,34 @@ typedef struct {
   size_t cap;
 } viewer_cache;
 
-static void viewer_cache_free(viewer_cache *c) {
+static void viewer_cache_free(cml *h, viewer_cache *c) {
   if (!c) return;
-  for (size_t i = 0; i < c->len; i++) cml_proto_free_manga_viewer(&c->items[i].viewer);
+  for (size_t i = 0; i < c->len; i++) {
+    cml_mem_release(h, c->items[i].viewer.mem);
+    cml_proto_free_manga_viewer(&c->items[i].viewer);
+  }
   free(c->items);
   memset(c, 0, sizeof(*c));
 }
 
+// A chapter's viewer is not needed once the chapter has been downloaded.
+static void viewer_cache_drop(cml *h, viewer_cache *c, uint32_t chapter_id) {
+  for (size_t i = 0; i < c->len; i++) {
+    if (c->items[i].id != chapter_id) continue;
+    cml_mem_release(h, c->items[i].viewer.mem);
+    cml_proto_free_manga_viewer(&c->items[i].viewer);
+    c->items[i] = c->items[--c->len];
+    return;
+  }
+}
+
+static int viewer_cached(const viewer_cache *c, uint32_t chapter_id) {
+  for (size_t i = 0; i < c->len; i++) {
+    if (c->items[i].id == chapter_id) return 1;
+  }
+  return 0;
+}
+
 static cml_status viewer_cached_get(cml *h, viewer_cache *c, uint32_t chapter_id, cml_manga_viewer **out) {
   for (size_t i = 0; i < c->len; i++) {
     if (c->items[i].id == chapter_id) {
@@ -124,9 +167,12 @@ typedef struct {
   size_t cap;
 } detail_cache;
 
-static void detail_cache_free(detail_cache *c) {
+static void detail_cache_free(cml *h, detail_cache *c) {
   if (!c) return;
-  for (size_t i = 0; i < c->len; i++) cml_proto_free_title_detail(&c->items[i].detail);
+  for (size_t i = 0; i < c->len; i++) {
+    cml_mem_release(h, c->items[i].detail.mem);
+    cml_proto_free_title_detail(&c->items[i].detail);
+  }
   free(c->items);
   memset(c, 0, sizeof(*c));
 }
@@ -268,6 +314,132 @@ static const cml_last_page *viewer_last_page(const cml_manga_viewer *v) {
   return NULL;
 }
 
+typedef struct {
+  cml_page_plan plan;
+  cml_page_job job;
+  size_t reserved;  // budget reserved for the download until it comes back
+  bool ready;
+} page_slot;
+
+// Downloads a page on this thread; used when a stored copy turns out to be unusable.
+static cml_status fetch_inline(cml *h, cml_page_job *job) {
+  uint64_t t0 = cml_trace_begin(h);
+  cml_status st = cml_http_get_page(h, NULL, job->url, &job->img);
+  cml_trace_end(h, t0, "http", "image GET", "bytes", job->img.len);
+  if (st != CML_OK) return st;
+  t0 = cml_trace_begin(h);
+  st = cml_decrypt_xor_hex(job->img.data, job->img.len, job->key);
+  cml_trace_end(h, t0, "crypto", "cml_decrypt_xor_hex", "bytes", job->img.len);
+  return st;
+}
+
+static cml_status write_page(cml *h, cml_exporter *exp, page_slot *slot) {
+  cml_page_job *job = &slot->job;
+  if (slot->plan.action == CML_PAGE_SKIP) return CML_OK;
+  if (slot->plan.action == CML_PAGE_STORED) {
+    int served = 0;
+    cml_status st = cml_exporter_add_stored(exp, &slot->plan, &served);
+    if (st != CML_OK || served) return st;
+    job->st = fetch_inline(h, job);
+  }
+  if (job->st != CML_OK) {
+    cml_buf_put(h, &job->img);
+    return job->st;
+  }
+  size_t len = job->img.len;
+  uint64_t t0 = cml_trace_begin(h);
+  cml_status st = cml_exporter_add_image(exp, &slot->plan, &job->img);
+  cml_trace_end(h, t0, "export", "cml_exporter_add_image", "bytes", len);
+  return st;
+}
+
+// Feeds the chapter's downloads to the pipeline and writes pages in order as they come back. A
+// download is submitted only when its estimated size fits the memory budget next to everything
+// already held; pages are submitted in order, so the next page to write always has its share and
+// the writer cannot wait behind pages that do not fit. With nothing in flight or waiting to be
+// written, the next page is admitted regardless so the run always makes progress.
+static cml_status write_pages(cml *h, cml_exporter *exp, page_slot *slots, size_t n, cml_progress_event *ev) {
+  cml_pipeline *pipe = &h->pipe;
+  size_t next_submit = 0;
+  size_t next_write = 0;
+  size_t outstanding = 0;
+  size_t stalled = SIZE_MAX;  // page whose download last waited for the budget
+  bool failed = false;
+  cml_status st = CML_OK;
+  uint64_t t_start = cml_now_ns();
+  cml_mem_next_page(h, 0);
+
+  while (st == CML_OK && next_write < n) {
+    while (!failed && next_submit < n && outstanding < CML_PIPE_QUEUE_CAP) {
+      page_slot *slot = &slots[next_submit];
+      if (slot->plan.action != CML_PAGE_FETCH) {
+        slot->ready = true;
+        next_submit++;
+        continue;
+      }
+      // Until a page has been seen there is nothing to estimate from, so pages go one at a time.
+      size_t est = cml_buf_estimate(h);
+      bool idle = outstanding == 0 && next_write == next_submit;
+      if (!idle && (est == 0 || !cml_mem_reserve(h, est, false))) {
+        if (est && stalled != next_submit) {
+          cml_mem_note_stall(h);
+          stalled = next_submit;
+        }
+        break;
+      }
+      if (idle) cml_mem_reserve(h, est, true);
+      slot->reserved = est;
+      outstanding++;
+      next_submit++;
+      cml_pipeline_submit(h, &slot->job);
+    }
+
+    page_slot *slot = &slots[next_write];
+    if (slot->ready) {
+      uint64_t t0 = cml_now_ns();
+      ev->done = (uint32_t)(next_write + 1);
+      ev->concurrency = cml_window_current(h);
+      cml_progress(h, ev);
+      uint64_t t1 = cml_now_ns();
+      st = write_page(h, exp, slot);
+      next_write++;
+      cml_mem_next_page(h, next_write);
+      uint64_t t2 = cml_now_ns();
+      h->work.export_ns += t2 - t1;
+      pipe->write_busy_ns += t2 - t0;
+      if (slot->plan.action != CML_PAGE_SKIP) pipe->write_pages++;
+      continue;
+    }
+
+    cml_page_job *job = cml_pipeline_wait(h);
+    if (!job) {
+      st = CML_ERR_INVALID;
+      break;
+    }
+    page_slot *done = &slots[job->index];
+    done->ready = true;
+    outstanding--;
+    // The page buffer is charged by the pool now.
+    cml_mem_unreserve(h, done->reserved);
+    done->reserved = 0;
+    if (job->st != CML_OK) failed = true;
+  }
+
+  // On failure, collect what is still in flight and drop every page that was not written. Nothing
+  // will be written any more, so no download waits for room.
+  cml_mem_next_page(h, SIZE_MAX);
+  while (outstanding > 0) {
+    cml_page_job *job = cml_pipeline_wait(h);
+    if (!job) break;
+    cml_mem_unreserve(h, slots[job->index].reserved);
+    slots[job->index].reserved = 0;
+    outstanding--;
+  }
+  for (size_t i = next_write; i < n; i++) cml_buf_put(h, &slots[i].job.img);
+  pipe->wall_ns += cml_now_ns() - t_start;
+  return st;
+}
+
 static cml_status download_one_chapter(cml *h, const cml_title *title, uint32_t title_done, uint32_t title_total,
                                        uint32_t chapter_done, uint32_t chapter_total, uint32_t chapter_id,
                                        viewer_cache *vc) {
@@ -279,66 +451,73 @@ static cml_status download_one_chapter(cml *h, const cml_title *title, uint32_t
   if (!lp) return CML_ERR_PROTO;
 
   cml_exporter *exp = NULL;
+  uint64_t t0 = cml_now_ns();
   st = cml_exporter_open(h, title, &lp->current_chapter, lp->has_next_chapter ? &lp->next_chapter : NULL, &exp);
+  h->work.export_ns += cml_now_ns() - t0;
   if (st != CML_OK) return st;
 
-  uint32_t total = 0;
+  size_t n = 0;
   for (size_t i = 0; i < viewer->pages_len; i++) {
     if (viewer->pages[i].has_manga_page && viewer->pages[i].manga_page.image_url && viewer->pages[i].manga_page.image_url[0])
-      total++;
+      n++;
+  }
+  page_slot *slots = n ? (page_slot *)calloc(n, sizeof(page_slot)) : NULL;
+  if (n && !slots) {
+    cml_exporter_close_destroy(exp, false);
+    return CML_ERR_OOM;
   }
 
-  uint32_t done = 0;
+  // Plan every page up front; sinks answer page_exists from their state at chapter_begin.
   uint32_t page_no = 0;
-  for (size_t i = 0; i < viewer->pages_len; i++) {
+  size_t k = 0;
+  for (size_t i = 0; st == CML_OK && i < viewer->pages_len; i++) {
     const cml_page *p = &viewer->pages[i];
     if (!p->has_manga_page || !p->manga_page.image_url || !p->manga_page.image_url[0]) continue;
-    done++;
-
     int is_range = (p->manga_page.type == 3);
     uint32_t start = page_no;
-    uint32_t stop = page_no + 1;
     page_no += is_range ? 2 : 1;
-
-    cml_progress_event ev = {.stage = "images",
-                             .title_name = title->name,
-                             .title_author = title->author,
-                             .title_done = title_done,
-                             .title_total = title_total,
-                             .chapter_name = viewer->chapter_name,
-                             .chapter_no = lp->current_chapter.name,
-                             .chapter_title = lp->current_chapter.sub_title,
-                             .chapter_done = chapter_done,
-                             .chapter_total = chapter_total,
-                             .done = done,
-                             .total = total};
-    cml_progress(h, &ev);
-
-    if (cml_exporter_skip_image(exp, is_range, start, stop)) continue;
-
-    cml_bytes img = {0};
-    st = cml_http_get(h, p->manga_page.image_url, &img);
-    if (st != CML_OK) {
-      cml_bytes_free(&img);
-      cml_exporter_close_destroy(exp, false);
-      return st;
-    }
-    st = cml_decrypt_xor_hex(img.data, img.len, p->manga_page.encryption_key);
-    if (st != CML_OK) {
-      cml_bytes_free(&img);
-      cml_exporter_close_destroy(exp, false);
-      return st;
-    }
-    st = cml_exporter_add_image(exp, img.data, img.len, is_range, start, stop);
-    cml_bytes_free(&img);
-    if (st != CML_OK) {
-      cml_exporter_close_destroy(exp, false);
-      return st;
-    }
+    page_slot *slot = &slots[k];
+    slot->job.index = k;
+    slot->job.fetch.page = k;
+    slot->job.url = p->manga_page.image_url;
+    slot->job.key = p->manga_page.encryption_key;
+    st = cml_exporter_plan_image(exp, is_range, start, start + 1, &slot->plan);
+    k++;
   }
 
-  cml_exporter_close_destroy(exp, true);
-  return CML_OK;
+  cml_progress_event ev = {.stage = "images",
+                           .title_name = title->name,
+                           .title_author = title->author,
+                           .title_done = title_done,
+                           .title_total = title_total,
+                           .chapter_name = viewer->chapter_name,
+                           .chapter_no = lp->current_chapter.name,
+                           .chapter_title = lp->current_chapter.sub_title,
+                           .chapter_done = chapter_done,
+                           .chapter_total = chapter_total,
+                           .done = 0,
+                           .total = (uint32_t)n};
+  if (st == CML_OK) st = write_pages(h, exp, slots, n, &ev);
+  free(slots);
+  t0 = cml_now_ns();
+  cml_status close_st = cml_exporter_close_destroy(exp, st == CML_OK);
+  h->work.export_ns += cml_now_ns() - t0;
+  return st != CML_OK ? st : close_st;
+}
+
+// Copies the counters of the run into h->stats, next to the stage stats cml_pipeline_stop left there
+// (all zero when the pipeline never started). Every return of cml_loader_run after the reset goes
+// through here, so cml_get_stats never reports an earlier run.
+static void collect_stats(cml *h) {
+  cml_retry_get_stats(h, &h->stats.retry);
+  cml_rate_get_stats(h, &h->stats.rate);
+  cml_window_get_stats(h, &h->stats.concurrency);
+  cml_timeout_get_stats(h, &h->stats.timeouts);
+  cml_hedge_get_stats(h, &h->stats.hedge);
+  h->stats.metadata = h->api.stats;
+  cml_http_get_stats(h, &h->stats.http);
+  h->stats.work = h->work;
+  h->stats.work.decrypt_ns = h->stats.decrypt.busy_ns;
 }
 
 cml_status cml_loader_run(cml *h) {
@@ -348,10 +527,38 @@ cml_status cml_loader_run(cml *h) {
   detail_cache dc = {0};
   title_map map = {0};
 
+  // Output directories may have changed since a previous run on this handle.
+  cml_export_raw_reset_index(h);
+  memset(&h->store_stats, 0, sizeof(h->store_stats));
+  memset(&h->bufs.stats, 0, sizeof(h->bufs.stats));
+  cml_mem_reset(h);
+  cml_retry_reset_stats(h);
+  cml_rate_reset_stats(h);
+  cml_window_reset_stats(h);
+  cml_timeout_reset_stats(h);
+  cml_hedge_reset_stats(h);
+  memset(&h->api.stats, 0, sizeof(h->api.stats));
+  cml_http_reset_stats(h);
+  memset(&h->work, 0, sizeof(h->work));
+
+  memset(&h->stats, 0, sizeof(h->stats));
+
+  uint64_t trace_t0 = cml_trace_begin(h);
   cml_status st = normalize_inputs(h, &vc, &dc, &map);
+  cml_trace_end(h, trace_t0, "loader", "normalize_inputs", "titles", map.len);
+  if (st != CML_OK) {
+    collect_stats(h);
+    viewer_cache_free(h, &vc);
+    detail_cache_free(h, &dc);
+    map_free(&map);
+    return st;
+  }
+
+  st = cml_pipeline_start(h);
   if (st != CML_OK) {
-    viewer_cache_free(&vc);
-    detail_cache_free(&dc);
+    collect_stats(h);
+    viewer_cache_free(h, &vc);
+    detail_cache_free(h, &dc);
     map_free(&map);
     return st;
   }
@@ -367,27 +574,13 @@ cml_status cml_loader_run(cml *h) {
     const cml_title *title = &detail->title;
     cml_log(h, CML_LOG_INFO, "manga: %s", title->name ? title->name : "(unknown)");
 
-    cml_u32_vec chap_ids = {0};
-    for (size_t j = 0; j < map.items[i].chapters_len; j++) {
-      if (cml_u32_push(&chap_ids, map.items[i].chapters[j].chapter_id) != 0) {
-        st = CML_ERR_OOM;
-        break;
-      }
-    }
-    if (st != CML_OK) {
-      cml_u32_free(&chap_ids);
-      break;
-    }
-    if (cml_u32_sort_dedupe(&chap_ids) != 0) {
-      cml_u32_free(&chap_ids);
-      st = CML_ERR_OOM;
-      break;
-    }
+    title_entry *entry = &map.items[i];
+    entry_sort_dedupe(entry);
 
-    uint32_t chapter_total = (uint32_t)chap_ids.len;
-    for (size_t j = 0; j < chap_ids.len; j++) {
+    uint32_t chapter_total = (uint32_t)entry->chapters_len;
+    for (size_t j = 0; j < entry->chapters_len; j++) {
       uint32_t chapter_done = (uint32_t)(j + 1);
-      uint32_t chapter_id = chap_ids.items[j];
+      const cml_chapter *meta = &entry->chapters[j];
       cml_progress_event ev = {.stage = "metadata",
                                .title_name = title->name,
                                .title_author = title->author,
@@ -401,18 +594,99 @@ cml_status cml_loader_run(cml *h) {
                                .done = chapter_done,
                                .total = chapter_total};
       cml_progress(h, &ev);
-      st = download_one_chapter(h, title, title_done, title_total, chapter_done, chapter_total, chapter_id, &vc);
+      // Title metadata is usually enough to name the output; only fetch the viewer when it isn't.
+      if (!viewer_cached(&vc, meta->chapter_id) && cml_exporter_is_complete(h, title, meta)) {
+        cml_log(h, CML_LOG_INFO, "skipping chapter %s: already exported", meta->name ? meta->name : "(unknown)");
+        continue;
+      }
+      st = download_one_chapter(h, title, title_done, title_total, chapter_done, chapter_total, meta->chapter_id, &vc);
+      viewer_cache_drop(h, &vc, meta->chapter_id);
       if (st != CML_OK) {
         cml_log(h, CML_LOG_ERROR, "failed: %s", cml_status_string(st));
         break;
       }
     }
-    cml_u32_free(&chap_ids);
     if (st != CML_OK) break;
   }
 
-  viewer_cache_free(&vc);
-  detail_cache_free(&dc);
+  cml_pipeline_stop(h);
+  uint64_t t0 = cml_now_ns();
+  cml_status end_st = cml_exporter_end_run(h);
+  h->work.export_ns += cml_now_ns() - t0;
+  if (st == CML_OK) st = end_st;
+  collect_stats(h);
+  // Per-feature summaries for debugging; callers read the same counters with cml_get_stats (the CLI
+  // prints them with --stats).
+  if (h->store_stats.pages) {
+    const cml_store_stats *ss = &h->store_stats;
+    cml_log(h, CML_LOG_DEBUG,
+            "page store: %llu/%llu pages deduplicated (%.1f%%), %llu reused without download, %llu bytes saved",
+            (unsigned long long)ss->pages_deduped, (unsigned long long)ss->pages,
+            100.0 * (double)ss->pages_deduped / (double)ss->pages, (unsigned long long)ss->pages_reused,
+            (unsigned long long)ss->bytes_saved);
+  }
+  if (h->bufs.stats.pages) {
+    const cml_buf_stats *bs = &h->bufs.stats;
+    cml_log(h, CML_LOG_DEBUG,
+            "page buffers: %llu pages, %.2f allocations and %.0f bytes copied per page, %llu recycled",
+            (unsigned long long)bs->pages, (double)bs->allocs / (double)bs->pages,
+            (double)bs->bytes_copied / (double)bs->pages, (unsigned long long)bs->reused);
+  }
+  if (h->stats.wall_ns) {
+    const cml_stats *ps = &h->stats;
+    cml_log(h, CML_LOG_DEBUG,
+            "pipeline: fetch %.0f%% busy (%u threads, queue avg %.1f max %u), decrypt %.0f%% (queue avg %.1f max %u), "
+            "write %.0f%% (queue avg %.1f max %u), peak %llu of %zu bytes in flight, %llu budget stalls",
+            100.0 * ps->fetch.utilization, ps->fetch.threads, ps->fetch.queue_depth_avg, ps->fetch.queue_depth_max,
+            100.0 * ps->decrypt.utilization, ps->decrypt.queue_depth_avg, ps->decrypt.queue_depth_max,
+            100.0 * ps->write.utilization, ps->write.queue_depth_avg, ps->write.queue_depth_max,
+            (unsigned long long)ps->inflight_bytes_peak, cml_mem_limit(h), (unsigned long long)ps->budget_stalls);
+  }
+  if (h->stats.retry.retries || h->stats.retry.breaker_opened) {
+    const cml_retry_stats *rs = &h->stats.retry;
+    cml_log(h, CML_LOG_DEBUG,
+            "retries: %llu of %llu requests, %.0f ms backoff (%llu from Retry-After), %llu gave up, "
+            "breakers opened %llu times and refused %llu attempts, %llu pages resumed (%llu bytes saved)",
+            (unsigned long long)rs->retries, (unsigned long long)rs->requests, (double)rs->backoff_ns / 1e6,
+            (unsigned long long)rs->retry_after, (unsigned long long)rs->gave_up,
+            (unsigned long long)rs->breaker_opened, (unsigned long long)rs->breaker_rejected,
+            (unsigned long long)rs->resumed, (unsigned long long)rs->resumed_bytes);
+  }
+  if (h->stats.concurrency.increases || h->stats.concurrency.error_cuts || h->stats.concurrency.latency_cuts) {
+    const cml_concurrency_stats *cs = &h->stats.concurrency;
+    cml_log(h, CML_LOG_DEBUG,
+            "concurrency: window %u (range %u-%u), grew %llu times, halved %llu times on errors and %llu on latency",
+            cs->window, cs->window_min, cs->window_max, (unsigned long long)cs->increases,
+            (unsigned long long)cs->error_cuts, (unsigned long long)cs->latency_cuts);
+  }
+  const cml_timeout_stats *ts = &h->stats.timeouts;
+  if (ts->first_byte_timeouts || ts->stalls || ts->slow_aborts) {
+    cml_log(h, CML_LOG_DEBUG,
+            "timeouts: %llu waits for a first byte, %llu stalls and %llu slow transfers abandoned early, %.1f s saved",
+            (unsigned long long)ts->first_byte_timeouts, (unsigned long long)ts->stalls,
+            (unsigned long long)ts->slow_aborts, (double)ts->saved_ns / 1e9);
+  }
+  if (h->stats.metadata.revalidated) {
+    const cml_metadata_stats *ms = &h->stats.metadata;
+    cml_log(h, CML_LOG_DEBUG, "metadata: %llu of %llu responses unchanged since the last request (%llu bytes saved)",
+            (unsigned long long)ms->revalidated, (unsigned long long)ms->requests,
+            (unsigned long long)ms->bytes_saved);
+  }
+  if (h->stats.hedge.hedges || h->stats.hedge.declined) {
+    const cml_hedge_stats *hs = &h->stats.hedge;
+    cml_log(h, CML_LOG_DEBUG,
+            "hedging: %llu pages hedged after %.0f ms, %llu second copies won, %llu declined, %llu bytes wasted",
+            (unsigned long long)hs->hedges, (double)hs->delay_ns / 1e6, (unsigned long long)hs->won,
+            (unsigned long long)hs->declined, (unsigned long long)hs->wasted_bytes);
+  }
+  if (h->stats.rate.throttled || h->stats.rate.cuts) {
+    const cml_rate_stats *rs = &h->stats.rate;
+    cml_log(h, CML_LOG_DEBUG, "rate limits: %llu requests waited %.0f ms, %llu cuts after 429 (lowest %.1f requests/s)",
+            (unsigned long long)rs->throttled, (double)rs->wait_ns / 1e6, (unsigned long long)rs->cuts,
+            rs->min_requests_per_sec);
+  }
+  viewer_cache_free(h, &vc);
+  detail_cache_free(h, &dc);
   map_free(&map);
   return st;
 }
@@ -168,6 +168,11 @@ static int is_extra(const char *chapter_name) {
   return strcmp(chapter_name, "ex") == 0;
 }
 
+int cml_names_need_next(const cml_chapter *chapter) {
+  if (!chapter) return 0;
+  return !cml_is_oneshot(chapter->name, chapter->sub_title) && is_extra(chapter->name);
+}
+
 cml_status cml_build_names(const cml_title *title, const cml_chapter *chapter, const cml_chapter *next_chapter,
                            bool include_chapter_title, char **out_title_dir, char **out_chapter_prefix,
                            char **out_chapter_suffix, char **out_chapter_dir) {
@@ -0,0 +1,97 @@
+#include "cml_internal.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Read side of the chapter pack format (see cml_export_pack.c). Opening maps the file and checks
+// the header; page lookups index straight into the mapped page table.
+
+struct cml_pack {
+  const uint8_t *base;
+  size_t size;
+  uint32_t page_count;
+  const uint8_t *table;
+  const char *names;
+  uint64_t names_len;
+};
+
+static uint32_t get32(const uint8_t *p) {
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+static uint64_t get64(const uint8_t *p) { return (uint64_t)get32(p) | ((uint64_t)get32(p + 4) << 32); }
+
+cml_status cml_pack_open(const char *path, cml_pack **out) {
+  if (!path || !out) return CML_ERR_INVALID;
+  *out = NULL;
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return CML_ERR_IO;
+  struct stat sb;
+  if (fstat(fd, &sb) != 0) {
+    close(fd);
+    return CML_ERR_IO;
+  }
+  if ((uint64_t)sb.st_size < CML_PACK_HEADER_SIZE) {
+    close(fd);
+    return CML_ERR_INVALID;
+  }
+  size_t size = (size_t)sb.st_size;
+  void *m = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (m == MAP_FAILED) return CML_ERR_IO;
+  const uint8_t *base = (const uint8_t *)m;
+
+  uint32_t count = get32(base + 12);
+  uint64_t table_off = get64(base + 16);
+  uint64_t names_off = get64(base + 24);
+  uint64_t names_len = get64(base + 32);
+  uint64_t file_size = get64(base + 40);
+  if (memcmp(base, CML_PACK_MAGIC, 8) != 0 || get32(base + 8) != CML_PACK_VERSION || file_size != size ||
+      table_off > size || (uint64_t)count * CML_PACK_ENTRY_SIZE > size - table_off ||
+      names_off != table_off + (uint64_t)count * CML_PACK_ENTRY_SIZE || names_len > size - names_off) {
+    munmap(m, size);
+    return CML_ERR_INVALID;
+  }
+
+  cml_pack *p = (cml_pack *)calloc(1, sizeof(*p));
+  if (!p) {
+    munmap(m, size);
+    return CML_ERR_OOM;
+  }
+  p->base = base;
+  p->size = size;
+  p->page_count = count;
+  p->table = base + table_off;
+  p->names = (const char *)(base + names_off);
+  p->names_len = names_len;
+  *out = p;
+  return CML_OK;
+}
+
+size_t cml_pack_page_count(const cml_pack *p) { return p ? p->page_count : 0; }
+
+cml_status cml_pack_page_get(const cml_pack *p, size_t index, cml_pack_page *out) {
+  if (!p || !out || index >= p->page_count) return CML_ERR_INVALID;
+  const uint8_t *e = p->table + index * CML_PACK_ENTRY_SIZE;
+  uint64_t off = get64(e);
+  uint64_t len = get64(e + 8);
+  uint32_t name_off = get32(e + 24);
+  uint32_t name_len = get32(e + 28);
+  if (off > p->size || len > p->size - off) return CML_ERR_INVALID;
+  if ((uint64_t)name_off + name_len >= p->names_len || p->names[name_off + name_len] != '\0') return CML_ERR_INVALID;
+  out->data = p->base + off;
+  out->len = (size_t)len;
+  out->start = get32(e + 16);
+  out->stop = get32(e + 20);
+  out->filename = p->names + name_off;
+  return CML_OK;
+}
+
+void cml_pack_close(cml_pack *p) {
+  if (!p) return;
+  munmap((void *)p->base, p->size);
+  free(p);
+}
@@ -0,0 +1,249 @@
+#include "cml_internal.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Page pipeline: fetch workers (each with its own curl handle, so connections stay warm across
+// chapters) -> one decrypt thread -> the writer, which is the thread inside cml_run. Jobs are owned
+// by the loader; the stages only pass pointers along the queues.
+
+uint64_t cml_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// Parks job until due_ns; the retry thread hands it back to the fetch workers.
+static void defer_job(cml_pipeline *p, cml_page_job *job) {
+  pthread_mutex_lock(&p->retry_mu);
+  p->retry[p->retry_len++] = job;
+  pthread_cond_signal(&p->retry_cv);
+  pthread_mutex_unlock(&p->retry_mu);
+}
+
+static void *retry_main(void *arg) {
+  cml_pipeline *p = (cml_pipeline *)arg;
+  pthread_mutex_lock(&p->retry_mu);
+  while (!p->retry_closed) {
+    if (p->retry_len == 0) {
+      pthread_cond_wait(&p->retry_cv, &p->retry_mu);
+      continue;
+    }
+    // At most CML_PIPE_QUEUE_CAP jobs wait here, so a scan for the earliest one is cheap enough.
+    size_t first = 0;
+    for (size_t i = 1; i < p->retry_len; i++)
+      if (p->retry[i]->due_ns < p->retry[first]->due_ns) first = i;
+    cml_page_job *job = p->retry[first];
+    if (job->due_ns <= cml_now_ns()) {
+      p->retry[first] = p->retry[--p->retry_len];
+      pthread_mutex_unlock(&p->retry_mu);
+      cml_queue_push(&p->fetch_q, job);
+      pthread_mutex_lock(&p->retry_mu);
+      continue;
+    }
+    struct timespec ts = {.tv_sec = (time_t)(job->due_ns / 1000000000ull),
+                          .tv_nsec = (long)(job->due_ns % 1000000000ull)};
+    pthread_cond_timedwait(&p->retry_cv, &p->retry_mu, &ts);
+  }
+  pthread_mutex_unlock(&p->retry_mu);
+  return NULL;
+}
+
+static void *fetch_main(void *arg) {
+  cml_fetch_worker *w = (cml_fetch_worker *)arg;
+  cml_pipeline *p = &w->h->pipe;
+  cml_trace_thread(w->h, "fetch", (int)(w - p->workers));
+  void *item = NULL;
+  while (cml_queue_pop(&p->fetch_q, &item)) {
+    cml_page_job *job = (cml_page_job *)item;
+    uint64_t t0 = cml_now_ns();
+    bool again = false;
+    uint64_t delay_ns = 0;
+    job->st = cml_http_try_page(w, job->url, &job->fetch, &job->img, &again, &delay_ns);
+    uint64_t t1 = cml_now_ns();
+    if (w->h->trace.on) cml_trace_span(w->h, "http", "image GET", t0, t1, "bytes", job->img.len);
+    // Waiting for a slot in the download window is idle time.
+    atomic_fetch_add(&p->fetch_busy_ns, t1 - t0 - job->fetch.queued_ns);
+    job->fetch.queued_ns = 0;
+    if (job->st != CML_OK && again) {
+      job->due_ns = t1 + delay_ns;
+      defer_job(p, job);
+      continue;
+    }
+    atomic_fetch_add(&p->fetch_pages, 1);
+    cml_queue_push(&p->decrypt_q, job);
+  }
+  return NULL;
+}
+
+static void *decrypt_main(void *arg) {
+  cml *h = (cml *)arg;
+  cml_pipeline *p = &h->pipe;
+  cml_trace_thread(h, "decrypt", -1);
+  void *item = NULL;
+  while (cml_queue_pop(&p->decrypt_q, &item)) {
+    cml_page_job *job = (cml_page_job *)item;
+    if (job->st == CML_OK) {
+      uint64_t t0 = cml_now_ns();
+      job->st = cml_decrypt_xor_hex(job->img.data, job->img.len, job->key);
+      uint64_t t1 = cml_now_ns();
+      if (h->trace.on) cml_trace_span(h, "crypto", "cml_decrypt_xor_hex", t0, t1, "bytes", job->img.len);
+      atomic_fetch_add(&p->decrypt_busy_ns, t1 - t0);
+      atomic_fetch_add(&p->decrypt_pages, 1);
+    }
+    cml_queue_push(&p->done_q, job);
+  }
+  return NULL;
+}
+
+static void worker_cleanup(cml_fetch_worker *w) {
+  if (w->multi) curl_multi_cleanup(w->multi);
+  if (w->hedge_curl) curl_easy_cleanup(w->hedge_curl);
+  if (w->curl) curl_easy_cleanup(w->curl);
+  w->multi = NULL;
+  w->hedge_curl = NULL;
+  w->curl = NULL;
+}
+
+// A worker that hedges runs both copies of a page on a multi handle. Its copies never share a
+// connection: the point of the second one is to avoid whatever holds up the first.
+static bool worker_init(cml *h, cml_fetch_worker *w) {
+  w->h = h;
+  w->curl = curl_easy_init();
+  if (!w->curl) return false;
+  if (!h->cfg.hedge_percentile) return true;
+  w->hedge_curl = curl_easy_init();
+  w->multi = curl_multi_init();
+  if (w->hedge_curl && w->multi && curl_multi_setopt(w->multi, CURLMOPT_PIPELINING, CURLPIPE_NOTHING) == CURLM_OK)
+    return true;
+  worker_cleanup(w);
+  return false;
+}
+
+static cml_status retry_sync_init(cml_pipeline *p) {
+  pthread_condattr_t attr;
+  if (pthread_condattr_init(&attr) != 0) return CML_ERR_OOM;
+  bool ok = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC) == 0 && pthread_cond_init(&p->retry_cv, &attr) == 0;
+  pthread_condattr_destroy(&attr);
+  if (!ok) return CML_ERR_OOM;
+  if (pthread_mutex_init(&p->retry_mu, NULL) != 0) {
+    pthread_cond_destroy(&p->retry_cv);
+    return CML_ERR_OOM;
+  }
+  p->retry_sync = true;
+  return CML_OK;
+}
+
+cml_status cml_pipeline_start(cml *h) {
+  if (!h) return CML_ERR_INVALID;
+  cml_pipeline *p = &h->pipe;
+  memset(p, 0, sizeof(*p));
+  uint32_t n = h->cfg.fetch_workers ? h->cfg.fetch_workers : CML_DEFAULT_FETCH_WORKERS;
+
+  cml_status st = cml_queue_init(&p->fetch_q, CML_PIPE_QUEUE_CAP);
+  if (st == CML_OK) st = cml_queue_init(&p->decrypt_q, CML_PIPE_QUEUE_CAP);
+  if (st == CML_OK) st = cml_queue_init(&p->done_q, CML_PIPE_QUEUE_CAP);
+  p->started = true;
+  if (st == CML_OK) st = retry_sync_init(p);
+  if (st != CML_OK) {
+    cml_pipeline_stop(h);
+    return st;
+  }
+
+  p->workers = (cml_fetch_worker *)calloc(n, sizeof(cml_fetch_worker));
+  if (!p->workers) {
+    cml_pipeline_stop(h);
+    return CML_ERR_OOM;
+  }
+  for (uint32_t i = 0; i < n; i++) {
+    cml_fetch_worker *w = &p->workers[i];
+    if (!worker_init(h, w) || pthread_create(&w->thread, NULL, fetch_main, w) != 0) {
+      worker_cleanup(w);
+      cml_pipeline_stop(h);
+      return CML_ERR_OOM;
+    }
+    p->workers_len = i + 1;
+  }
+  if (pthread_create(&p->decrypt_thread, NULL, decrypt_main, h) != 0) {
+    cml_pipeline_stop(h);
+    return CML_ERR_OOM;
+  }
+  p->decrypt_running = true;
+  if (pthread_create(&p->retry_thread, NULL, retry_main, p) != 0) {
+    cml_pipeline_stop(h);
+    return CML_ERR_OOM;
+  }
+  p->retry_running = true;
+  return CML_OK;
+}
+
+static void stage_fill(cml_stage_stats *out, uint32_t threads, uint64_t pages, uint64_t busy_ns, uint64_t wall_ns,
+                       const cml_queue *q) {
+  out->threads = threads;
+  out->pages = pages;
+  out->busy_ns = busy_ns;
+  out->utilization = (wall_ns && threads) ? (double)busy_ns / ((double)wall_ns * threads) : 0.0;
+  uint64_t samples = q->cells ? atomic_load(&q->depth_samples) : 0;
+  out->queue_depth_avg = samples ? (double)atomic_load(&q->depth_sum) / (double)samples : 0.0;
+  out->queue_depth_max = q->cells ? atomic_load(&q->depth_max) : 0;
+}
+
+void cml_pipeline_stop(cml *h) {
+  if (!h || !h->pipe.started) return;
+  cml_pipeline *p = &h->pipe;
+  // The writer has collected every job it submitted, so nothing is waiting for a retry.
+  if (p->retry_running) {
+    pthread_mutex_lock(&p->retry_mu);
+    p->retry_closed = true;
+    pthread_cond_broadcast(&p->retry_cv);
+    pthread_mutex_unlock(&p->retry_mu);
+    pthread_join(p->retry_thread, NULL);
+  }
+  // Each stage drains its queue before the next one is closed.
+  if (p->fetch_q.cells) cml_queue_close(&p->fetch_q);
+  for (uint32_t i = 0; i < p->workers_len; i++) {
+    pthread_join(p->workers[i].thread, NULL);
+    worker_cleanup(&p->workers[i]);
+  }
+  if (p->decrypt_q.cells) cml_queue_close(&p->decrypt_q);
+  if (p->decrypt_running) pthread_join(p->decrypt_thread, NULL);
+  if (p->done_q.cells) cml_queue_close(&p->done_q);
+
+  cml_stats *s = &h->stats;
+  memset(s, 0, sizeof(*s));
+  s->wall_ns = p->wall_ns;
+  stage_fill(&s->fetch, p->workers_len, atomic_load(&p->fetch_pages), atomic_load(&p->fetch_busy_ns), p->wall_ns,
+             &p->fetch_q);
+  stage_fill(&s->decrypt, p->decrypt_running ? 1 : 0, atomic_load(&p->decrypt_pages),
+             atomic_load(&p->decrypt_busy_ns), p->wall_ns, &p->decrypt_q);
+  stage_fill(&s->write, 1, p->write_pages, p->write_busy_ns, p->wall_ns, &p->done_q);
+  pthread_mutex_lock(&h->bufs.mu);
+  s->inflight_bytes_peak = h->bufs.held_peak;
+  s->budget_stalls = h->bufs.stalls;
+  pthread_mutex_unlock(&h->bufs.mu);
+
+  cml_queue_destroy(&p->fetch_q);
+  cml_queue_destroy(&p->decrypt_q);
+  cml_queue_destroy(&p->done_q);
+  if (p->retry_sync) {
+    pthread_cond_destroy(&p->retry_cv);
+    pthread_mutex_destroy(&p->retry_mu);
+  }
+  free(p->workers);
+  memset(p, 0, sizeof(*p));
+}
+
+void cml_pipeline_submit(cml *h, cml_page_job *job) { cml_queue_push(&h->pipe.fetch_q, job); }
+
+cml_page_job *cml_pipeline_wait(cml *h) {
+  void *item = NULL;
+  if (!cml_queue_pop(&h->pipe.done_q, &item)) return NULL;
+  return (cml_page_job *)item;
+}
+
+cml_status cml_get_stats(const cml *h, cml_stats *out) {
+  if (!h || !out) return CML_ERR_INVALID;
+  *out = h->stats;
+  return CML_OK;
+}
@@ -508,3 +508,96 @@ void cml_proto_free_title_detail(cml_title_detail *d) {
   memset(d, 0, sizeof(*d));
 }
 
+
+// Deep copies, for answering a request from a kept result. A failed allocation clears *ok and leaves
+// the copy freeable.
+static char *copy_str(const char *s, bool *ok) {
+  if (!s) return NULL;
+  char *d = strdup(s);
+  if (!d) *ok = false;
+  return d;
+}
+
+static void copy_chapter(cml_chapter *dst, const cml_chapter *src, bool *ok) {
+  dst->chapter_id = src->chapter_id;
+  dst->name = copy_str(src->name, ok);
+  dst->sub_title = copy_str(src->sub_title, ok);
+}
+
+static cml_chapter *copy_chapters(const cml_chapter *src, size_t n, size_t *out_len, bool *ok) {
+  *out_len = 0;
+  if (n == 0) return NULL;
+  cml_chapter *dst = (cml_chapter *)calloc(n, sizeof(cml_chapter));
+  if (!dst) {
+    *ok = false;
+    return NULL;
+  }
+  for (size_t i = 0; i < n; i++) copy_chapter(&dst[i], &src[i], ok);
+  *out_len = n;
+  return dst;
+}
+
+static void copy_page(cml_page *dst, const cml_page *src, bool *ok) {
+  dst->has_manga_page = src->has_manga_page;
+  if (src->has_manga_page) {
+    dst->manga_page.image_url = copy_str(src->manga_page.image_url, ok);
+    dst->manga_page.encryption_key = copy_str(src->manga_page.encryption_key, ok);
+    dst->manga_page.type = src->manga_page.type;
+  }
+  dst->has_last_page = src->has_last_page;
+  if (src->has_last_page) {
+    copy_chapter(&dst->last_page.current_chapter, &src->last_page.current_chapter, ok);
+    copy_chapter(&dst->last_page.next_chapter, &src->last_page.next_chapter, ok);
+    dst->last_page.has_next_chapter = src->last_page.has_next_chapter;
+  }
+}
+
+cml_status cml_proto_copy_manga_viewer(const cml_manga_viewer *src, cml_manga_viewer *out) {
+  if (!src || !out) return CML_ERR_INVALID;
+  memset(out, 0, sizeof(*out));
+  bool ok = true;
+  if (src->pages_len) {
+    out->pages = (cml_page *)calloc(src->pages_len, sizeof(cml_page));
+    if (out->pages) {
+      out->pages_len = src->pages_len;
+      for (size_t i = 0; i < src->pages_len; i++) copy_page(&out->pages[i], &src->pages[i], &ok);
+    } else {
+      ok = false;
+    }
+  }
+  out->chapters = copy_chapters(src->chapters, src->chapters_len, &out->chapters_len, &ok);
+  out->chapter_id = src->chapter_id;
+  out->title_id = src->title_id;
+  out->chapter_name = copy_str(src->chapter_name, &ok);
+  out->mem = src->mem;
+  if (ok) return CML_OK;
+  cml_proto_free_manga_viewer(out);
+  return CML_ERR_OOM;
+}
+
+cml_status cml_proto_copy_title_detail(const cml_title_detail *src, cml_title_detail *out) {
+  if (!src || !out) return CML_ERR_INVALID;
+  memset(out, 0, sizeof(*out));
+  bool ok = true;
+  out->title.title_id = src->title.title_id;
+  out->title.name = copy_str(src->title.name, &ok);
+  out->title.author = copy_str(src->title.author, &ok);
+  out->title.language = src->title.language;
+  if (src->groups_len) {
+    out->groups = (cml_chapter_group *)calloc(src->groups_len, sizeof(cml_chapter_group));
+    if (out->groups) {
+      out->groups_len = src->groups_len;
+      for (size_t i = 0; i < src->groups_len; i++) {
+        const cml_chapter_group *g = &src->groups[i];
+        out->groups[i].first = copy_chapters(g->first, g->first_len, &out->groups[i].first_len, &ok);
+        out->groups[i].last = copy_chapters(g->last, g->last_len, &out->groups[i].last_len, &ok);
+      }
+    } else {
+      ok = false;
+    }
+  }
+  out->mem = src->mem;
+  if (ok) return CML_OK;
+  cml_proto_free_title_detail(out);
+  return CML_ERR_OOM;
+}
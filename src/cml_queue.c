@@ -0,0 +1,145 @@
+#include "cml_internal.h"
+
+#include <stdlib.h>
+
+// Vyukov's bounded MPMC ring: a cell is free for the push at position pos when its seq equals pos,
+// and holds an item for the pop at pos when its seq equals pos + 1. Producers and consumers claim
+// positions with a CAS on head/tail and never lock; the mutex and condition variable are only used
+// to sleep when a try fails, and a push or pop wakes sleepers only when there are any.
+
+cml_status cml_queue_init(cml_queue *q, size_t cap) {
+  if (!q || cap < 2 || (cap & (cap - 1)) != 0) return CML_ERR_INVALID;
+  q->cells = (cml_queue_cell *)calloc(cap, sizeof(cml_queue_cell));
+  if (!q->cells) return CML_ERR_OOM;
+  for (size_t i = 0; i < cap; i++) atomic_init(&q->cells[i].seq, i);
+  q->mask = cap - 1;
+  atomic_init(&q->head, 0);
+  atomic_init(&q->tail, 0);
+  atomic_init(&q->closed, false);
+  atomic_init(&q->waiters, 0);
+  atomic_init(&q->depth_sum, 0);
+  atomic_init(&q->depth_samples, 0);
+  atomic_init(&q->depth_max, 0);
+  if (pthread_mutex_init(&q->mu, NULL) != 0) {
+    free(q->cells);
+    q->cells = NULL;
+    return CML_ERR_OOM;
+  }
+  if (pthread_cond_init(&q->cv, NULL) != 0) {
+    pthread_mutex_destroy(&q->mu);
+    free(q->cells);
+    q->cells = NULL;
+    return CML_ERR_OOM;
+  }
+  return CML_OK;
+}
+
+void cml_queue_destroy(cml_queue *q) {
+  if (!q || !q->cells) return;
+  pthread_cond_destroy(&q->cv);
+  pthread_mutex_destroy(&q->mu);
+  free(q->cells);
+  q->cells = NULL;
+}
+
+static bool try_push(cml_queue *q, void *item) {
+  size_t pos = atomic_load(&q->head);
+  for (;;) {
+    cml_queue_cell *c = &q->cells[pos & q->mask];
+    size_t seq = atomic_load(&c->seq);
+    if (seq == pos) {
+      if (atomic_compare_exchange_weak(&q->head, &pos, pos + 1)) {
+        c->item = item;
+        atomic_store(&c->seq, pos + 1);
+        return true;
+      }
+    } else if (seq < pos) {
+      return false;  // full
+    } else {
+      pos = atomic_load(&q->head);
+    }
+  }
+}
+
+static bool try_pop(cml_queue *q, void **out) {
+  size_t pos = atomic_load(&q->tail);
+  for (;;) {
+    cml_queue_cell *c = &q->cells[pos & q->mask];
+    size_t seq = atomic_load(&c->seq);
+    if (seq == pos + 1) {
+      if (atomic_compare_exchange_weak(&q->tail, &pos, pos + 1)) {
+        *out = c->item;
+        atomic_store(&c->seq, pos + q->mask + 1);
+        return true;
+      }
+    } else if (seq < pos + 1) {
+      return false;  // empty
+    } else {
+      pos = atomic_load(&q->tail);
+    }
+  }
+}
+
+static void wake(cml_queue *q) {
+  if (atomic_load(&q->waiters) == 0) return;
+  pthread_mutex_lock(&q->mu);
+  pthread_cond_broadcast(&q->cv);
+  pthread_mutex_unlock(&q->mu);
+}
+
+static void sample_depth(cml_queue *q) {
+  size_t head = atomic_load(&q->head);
+  size_t tail = atomic_load(&q->tail);
+  uint32_t depth = head > tail ? (uint32_t)(head - tail) : 0;
+  atomic_fetch_add(&q->depth_sum, depth);
+  atomic_fetch_add(&q->depth_samples, 1);
+  uint32_t max = atomic_load(&q->depth_max);
+  while (depth > max && !atomic_compare_exchange_weak(&q->depth_max, &max, depth)) {
+  }
+}
+
+bool cml_queue_push(cml_queue *q, void *item) {
+  for (;;) {
+    if (atomic_load(&q->closed)) return false;
+    if (try_push(q, item)) break;
+    // Waiters are counted before the retry under the mutex, so a pop that frees a cell either sees
+    // the count and broadcasts, or happened before the retry and lets it succeed.
+    pthread_mutex_lock(&q->mu);
+    atomic_fetch_add(&q->waiters, 1);
+    bool pushed = !atomic_load(&q->closed) && try_push(q, item);
+    if (!pushed && !atomic_load(&q->closed)) pthread_cond_wait(&q->cv, &q->mu);
+    atomic_fetch_sub(&q->waiters, 1);
+    pthread_mutex_unlock(&q->mu);
+    if (pushed) break;
+  }
+  sample_depth(q);
+  wake(q);
+  return true;
+}
+
+bool cml_queue_pop(cml_queue *q, void **out) {
+  for (;;) {
+    if (try_pop(q, out)) break;
+    if (atomic_load(&q->closed)) {
+      // Items pushed before the close are still delivered.
+      if (try_pop(q, out)) break;
+      return false;
+    }
+    pthread_mutex_lock(&q->mu);
+    atomic_fetch_add(&q->waiters, 1);
+    bool popped = try_pop(q, out);
+    if (!popped && !atomic_load(&q->closed)) pthread_cond_wait(&q->cv, &q->mu);
+    atomic_fetch_sub(&q->waiters, 1);
+    pthread_mutex_unlock(&q->mu);
+    if (popped) break;
+  }
+  wake(q);
+  return true;
+}
+
+void cml_queue_close(cml_queue *q) {
+  atomic_store(&q->closed, true);
+  pthread_mutex_lock(&q->mu);
+  pthread_cond_broadcast(&q->cv);
+  pthread_mutex_unlock(&q->mu);
+}
@@ -0,0 +1,218 @@
+#include "cml_internal.h"
+
+#include <string.h>
+
+// Per-host token buckets in front of every request (cml_config.max_requests_per_sec and
+// max_bytes_per_sec). A request reserves its slot up front: it takes a request token and the typical
+// body size from the byte bucket, and when a bucket runs into debt it is told how long to wait for
+// its slot instead of polling for it. The real body size is settled once the response arrives. A 429
+// cuts the host's request rate below what it was sending and the rate then climbs back slowly, so
+// the run settles just under the point where the server starts throttling.
+
+#define NS_PER_SEC 1000000000ull
+#define BURST_SEC 0.25        // bucket size, in seconds of the rate
+#define CUT 0.7               // a 429 lowers the rate to this share of what was being sent
+#define RECOVER_PER_SEC 0.05  // share of the pre-429 rate regained per second
+#define MIN_RATE 0.5          // requests/s; a 429 never cuts below this
+
+static double burst(double rate) { return rate * BURST_SEC > 1.0 ? rate * BURST_SEC : 1.0; }
+
+static void refill(cml_rate_state *r, cml_limiter *l, uint64_t now) {
+  double dt = (double)(now - l->refill_ns) / (double)NS_PER_SEC;
+  l->refill_ns = now;
+  if (l->cut_from > 0 && now - l->cut_ns >= NS_PER_SEC) {
+    // Back where the server pushed back (or at the configured limit): try the full rate again.
+    l->rate += l->cut_from * RECOVER_PER_SEC * dt;
+    double target = r->max_rps > 0 ? r->max_rps : l->cut_from;
+    if (l->rate >= target) {
+      l->rate = r->max_rps;
+      l->cut_from = 0;
+    }
+  }
+  if (l->rate > 0) {
+    l->req_tokens += l->rate * dt;
+    if (l->req_tokens > burst(l->rate)) l->req_tokens = burst(l->rate);
+  }
+  if (r->max_bps > 0) {
+    l->byte_tokens += r->max_bps * dt;
+    if (l->byte_tokens > r->max_bps * BURST_SEC) l->byte_tokens = r->max_bps * BURST_SEC;
+  }
+}
+
+// A limiter with full buckets and no 429 to recover from is what a new one would be.
+static bool limiter_idle(cml_rate_state *r, cml_limiter *l, uint64_t now) {
+  refill(r, l, now);
+  return l->cut_from == 0 && (l->rate <= 0 || l->req_tokens >= burst(l->rate)) &&
+         (r->max_bps <= 0 || l->byte_tokens >= r->max_bps * BURST_SEC);
+}
+
+static cml_limiter *limiter_find(cml_rate_state *r, const char *url, bool create, uint64_t now) {
+  const char *host = NULL;
+  size_t n = cml_url_host(url, &host);
+  if (n == 0 || n >= sizeof(r->hosts[0].host)) return NULL;
+  for (size_t i = 0; i < r->hosts_len; i++) {
+    if (strlen(r->hosts[i].host) == n && memcmp(r->hosts[i].host, host, n) == 0) return &r->hosts[i];
+  }
+  if (!create) return NULL;
+  cml_limiter *l = NULL;
+  if (r->hosts_len < CML_MAX_LIMITERS) {
+    l = &r->hosts[r->hosts_len++];
+  } else {
+    for (size_t i = 0; !l && i < r->hosts_len; i++)
+      if (limiter_idle(r, &r->hosts[i], now)) l = &r->hosts[i];
+    // Every host is busy: this one goes unlimited rather than sharing another host's buckets.
+    if (!l) return NULL;
+  }
+  memset(l, 0, sizeof(*l));
+  memcpy(l->host, host, n);
+  l->rate = r->max_rps;
+  l->req_tokens = burst(l->rate);
+  l->byte_tokens = r->max_bps * BURST_SEC;
+  l->refill_ns = now;
+  l->win_ns = now;
+  return l;
+}
+
+// Requests/s the host has been accepting: the last full second, or the current one once it has run
+// long enough to say something.
+static double sent_rate(const cml_limiter *l, uint64_t now) {
+  double elapsed = (double)(now - l->win_ns) / (double)NS_PER_SEC;
+  double current = elapsed >= 0.1 ? (double)l->win_count / elapsed : 0.0;
+  return current > l->sent_rate ? current : l->sent_rate;
+}
+
+uint64_t cml_rate_acquire(cml *h, const char *url, size_t *bytes_charged) {
+  cml_rate_state *r = &h->rate;
+  uint64_t now = cml_now_ns();
+  double wait = 0;
+  *bytes_charged = 0;
+  pthread_mutex_lock(&r->mu);
+  cml_limiter *l = limiter_find(r, url, true, now);
+  if (l) {
+    refill(r, l, now);
+    if (l->rate > 0) {
+      l->req_tokens -= 1.0;
+      if (l->req_tokens < 0) wait = -l->req_tokens / l->rate;
+    }
+    if (r->max_bps > 0) {
+      *bytes_charged = l->typical_bytes;
+      l->byte_tokens -= (double)l->typical_bytes;
+      if (l->byte_tokens < 0 && -l->byte_tokens / r->max_bps > wait) wait = -l->byte_tokens / r->max_bps;
+    }
+  }
+  pthread_mutex_unlock(&r->mu);
+  if (wait <= 0) return 0;
+  uint64_t wait_ns = (uint64_t)(wait * (double)NS_PER_SEC) + 1;
+  atomic_fetch_add(&r->stats.throttled, 1);
+  atomic_fetch_add(&r->stats.wait_ns, wait_ns);
+  return wait_ns;
+}
+
+bool cml_rate_try_acquire(cml *h, const char *url, size_t *bytes_charged) {
+  cml_rate_state *r = &h->rate;
+  uint64_t now = cml_now_ns();
+  bool ok = true;
+  *bytes_charged = 0;
+  pthread_mutex_lock(&r->mu);
+  cml_limiter *l = limiter_find(r, url, true, now);
+  if (l) {
+    refill(r, l, now);
+    ok = (l->rate <= 0 || l->req_tokens >= 1.0) && (r->max_bps <= 0 || l->byte_tokens >= (double)l->typical_bytes);
+    if (ok && l->rate > 0) l->req_tokens -= 1.0;
+    if (ok && r->max_bps > 0) {
+      *bytes_charged = l->typical_bytes;
+      l->byte_tokens -= (double)l->typical_bytes;
+    }
+  }
+  pthread_mutex_unlock(&r->mu);
+  return ok;
+}
+
+void cml_rate_refund(cml *h, const char *url, size_t bytes_charged) {
+  cml_rate_state *r = &h->rate;
+  uint64_t now = cml_now_ns();
+  pthread_mutex_lock(&r->mu);
+  cml_limiter *l = limiter_find(r, url, false, now);
+  if (l) {
+    refill(r, l, now);
+    if (l->rate > 0) {
+      l->req_tokens += 1.0;
+      if (l->req_tokens > burst(l->rate)) l->req_tokens = burst(l->rate);
+    }
+    if (r->max_bps > 0) {
+      l->byte_tokens += (double)bytes_charged;
+      if (l->byte_tokens > r->max_bps * BURST_SEC) l->byte_tokens = r->max_bps * BURST_SEC;
+    }
+  }
+  pthread_mutex_unlock(&r->mu);
+}
+
+void cml_rate_record(cml *h, const char *url, size_t bytes, size_t bytes_charged, long code) {
+  cml_rate_state *r = &h->rate;
+  uint64_t now = cml_now_ns();
+  double cut_to = 0;
+  char host[sizeof(r->hosts[0].host)];
+  pthread_mutex_lock(&r->mu);
+  cml_limiter *l = limiter_find(r, url, false, now);
+  if (l && code != 429) {
+    // What the host accepted is counted, not reservations, which may lie in the future.
+    if (now - l->win_ns >= NS_PER_SEC) {
+      l->sent_rate = (double)l->win_count / ((double)(now - l->win_ns) / (double)NS_PER_SEC);
+      l->win_ns = now;
+      l->win_count = 0;
+    }
+    l->win_count++;
+  }
+  if (l && r->max_bps > 0) {
+    l->byte_tokens -= (double)bytes - (double)bytes_charged;
+    if (bytes) l->typical_bytes = l->typical_bytes ? (l->typical_bytes * 7 + bytes) / 8 : bytes;
+  }
+  // The requests already in flight when the server started refusing answer 429 together; that is
+  // one signal, not one per request.
+  if (l && code == 429 && (l->cut_ns == 0 || now - l->cut_ns >= NS_PER_SEC)) {
+    double sent = sent_rate(l, now);
+    double from = l->rate > 0 && (sent <= 0 || l->rate < sent) ? l->rate : sent;
+    if (from <= 0) from = 1.0;
+    l->cut_from = from;
+    l->rate = from * CUT > MIN_RATE ? from * CUT : MIN_RATE;
+    // Slots already handed out keep their place; there is just no burst left after them.
+    if (l->req_tokens > 0) l->req_tokens = 0;
+    l->cut_ns = now;
+    cut_to = l->rate;
+    if (r->min_rate == 0 || cut_to < r->min_rate) r->min_rate = cut_to;
+    memcpy(host, l->host, sizeof(host));
+  }
+  pthread_mutex_unlock(&r->mu);
+  if (cut_to > 0) {
+    atomic_fetch_add(&r->stats.cuts, 1);
+    cml_log(h, CML_LOG_INFO, "%s is throttling requests, slowing down to %.1f requests/s", host, cut_to);
+  }
+}
+
+cml_status cml_rate_init(cml *h) {
+  h->rate.max_rps = (double)h->cfg.max_requests_per_sec;
+  h->rate.max_bps = (double)h->cfg.max_bytes_per_sec;
+  return pthread_mutex_init(&h->rate.mu, NULL) == 0 ? CML_OK : CML_ERR_OOM;
+}
+
+void cml_rate_free(cml *h) { pthread_mutex_destroy(&h->rate.mu); }
+
+void cml_rate_reset_stats(cml *h) {
+  cml_rate_state *r = &h->rate;
+  atomic_store(&r->stats.throttled, 0);
+  atomic_store(&r->stats.wait_ns, 0);
+  atomic_store(&r->stats.cuts, 0);
+  pthread_mutex_lock(&r->mu);
+  r->min_rate = 0;
+  pthread_mutex_unlock(&r->mu);
+}
+
+void cml_rate_get_stats(cml *h, cml_rate_stats *out) {
+  cml_rate_state *r = &h->rate;
+  out->throttled = atomic_load(&r->stats.throttled);
+  out->wait_ns = atomic_load(&r->stats.wait_ns);
+  out->cuts = atomic_load(&r->stats.cuts);
+  pthread_mutex_lock(&r->mu);
+  out->min_requests_per_sec = r->min_rate;
+  pthread_mutex_unlock(&r->mu);
+}
@@ -0,0 +1,169 @@
+#include "cml_internal.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Retry policy (cml_config.retry) and per-host circuit breakers. Both are shared by the cml_run
+// thread and the fetch workers: the policy is read-only, breakers sit behind a mutex and the
+// counters are atomics.
+
+#define DEFAULT_ATTEMPTS 4
+#define DEFAULT_BASE_MS 250
+#define DEFAULT_MAX_MS 8000
+#define DEFAULT_BREAKER_FAILURES 5
+#define DEFAULT_BREAKER_COOLDOWN_MS 10000
+
+static uint64_t ms_ns(uint32_t ms) { return (uint64_t)ms * 1000000ull; }
+
+static uint64_t base_ns(const cml *h) {
+  return ms_ns(h->cfg.retry.base_delay_ms ? h->cfg.retry.base_delay_ms : DEFAULT_BASE_MS);
+}
+
+static uint64_t max_ns(const cml *h) {
+  return ms_ns(h->cfg.retry.max_delay_ms ? h->cfg.retry.max_delay_ms : DEFAULT_MAX_MS);
+}
+
+static uint64_t cooldown_ns(const cml *h) {
+  return ms_ns(h->cfg.retry.breaker_cooldown_ms ? h->cfg.retry.breaker_cooldown_ms : DEFAULT_BREAKER_COOLDOWN_MS);
+}
+
+// splitmix64 over a shared counter: cheap, lock-free and good enough to spread retries apart.
+uint64_t cml_random(cml *h) {
+  uint64_t z = atomic_fetch_add(&h->retry.rng, 0x9e3779b97f4a7c15ull) + 0x9e3779b97f4a7c15ull;
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  return z ^ (z >> 31);
+}
+
+static uint64_t jitter(cml *h, uint64_t ceiling) {
+  if (h->cfg.retry.no_jitter || ceiling == 0) return ceiling;
+  return cml_random(h) % (ceiling + 1);
+}
+
+uint32_t cml_retry_max_attempts(const cml *h) {
+  return h->cfg.retry.max_attempts ? h->cfg.retry.max_attempts : DEFAULT_ATTEMPTS;
+}
+
+uint64_t cml_retry_delay_ns(cml *h, uint32_t failed, uint64_t retry_after_ns) {
+  uint64_t ceiling = max_ns(h);
+  uint64_t d = base_ns(h);
+  for (uint32_t i = 1; i < failed && d < ceiling; i++) d *= 2;
+  if (d > ceiling) d = ceiling;
+  d = jitter(h, d);
+  if (retry_after_ns > d && !h->cfg.retry.ignore_retry_after) {
+    atomic_fetch_add(&h->retry.stats.retry_after, 1);
+    d = retry_after_ns;
+  }
+  atomic_fetch_add(&h->retry.stats.backoff_ns, d);
+  return d;
+}
+
+static cml_breaker *breaker_find(cml_retry_state *r, const char *url, bool create) {
+  const char *host = NULL;
+  size_t n = cml_url_host(url, &host);
+  if (n == 0 || n >= sizeof(r->hosts[0].host)) return NULL;
+  for (size_t i = 0; i < r->hosts_len; i++) {
+    if (strlen(r->hosts[i].host) == n && memcmp(r->hosts[i].host, host, n) == 0) return &r->hosts[i];
+  }
+  if (!create) return NULL;
+  cml_breaker *b = NULL;
+  if (r->hosts_len < CML_MAX_BREAKERS) {
+    b = &r->hosts[r->hosts_len++];
+  } else {
+    // Hosts with a clean record carry no state worth keeping.
+    for (size_t i = 0; !b && i < r->hosts_len; i++)
+      if (r->hosts[i].failures == 0 && !r->hosts[i].open) b = &r->hosts[i];
+    if (!b) return NULL;
+  }
+  memset(b, 0, sizeof(*b));
+  memcpy(b->host, host, n);
+  return b;
+}
+
+cml_breaker_verdict cml_breaker_check(cml *h, const char *url, uint64_t *wait_ns) {
+  cml_retry_state *r = &h->retry;
+  cml_breaker_verdict v = CML_BREAKER_PASS;
+  *wait_ns = 0;
+  pthread_mutex_lock(&r->mu);
+  cml_breaker *b = breaker_find(r, url, false);
+  if (b && b->open) {
+    uint64_t now = cml_now_ns();
+    if (now < b->open_until_ns) {
+      v = CML_BREAKER_OPEN;
+      *wait_ns = b->open_until_ns - now;
+    } else if (b->probing) {
+      // One request probes the host; the others wait for its answer.
+      v = CML_BREAKER_WAIT;
+      *wait_ns = base_ns(h);
+    } else {
+      b->probing = true;
+    }
+  }
+  pthread_mutex_unlock(&r->mu);
+  if (v != CML_BREAKER_PASS) atomic_fetch_add(&r->stats.breaker_rejected, 1);
+  return v;
+}
+
+void cml_breaker_record(cml *h, const char *url, bool host_ok) {
+  cml_retry_state *r = &h->retry;
+  uint32_t threshold = h->cfg.retry.breaker_failures ? h->cfg.retry.breaker_failures : DEFAULT_BREAKER_FAILURES;
+  bool opened = false;
+  char host[sizeof(r->hosts[0].host)];
+  pthread_mutex_lock(&r->mu);
+  cml_breaker *b = breaker_find(r, url, !host_ok);
+  if (b && host_ok) {
+    b->failures = 0;
+    b->open = false;
+    b->probing = false;
+  } else if (b) {
+    b->failures++;
+    // A failed probe reopens the breaker at once.
+    if (b->probing || (!b->open && b->failures >= threshold)) {
+      opened = true;
+      b->open = true;
+      b->probing = false;
+      b->open_until_ns = cml_now_ns() + cooldown_ns(h);
+      memcpy(host, b->host, sizeof(host));
+    }
+  }
+  pthread_mutex_unlock(&r->mu);
+  if (opened) {
+    atomic_fetch_add(&r->stats.breaker_opened, 1);
+    cml_log(h, CML_LOG_WARN, "%s keeps failing, pausing requests to it for %u ms", host,
+            (unsigned)(cooldown_ns(h) / 1000000ull));
+  }
+}
+
+cml_status cml_retry_init(cml *h) {
+  // Handles started together should not retry in lockstep.
+  atomic_init(&h->retry.rng, cml_now_ns() ^ (uint64_t)(uintptr_t)h);
+  return pthread_mutex_init(&h->retry.mu, NULL) == 0 ? CML_OK : CML_ERR_OOM;
+}
+
+void cml_retry_free(cml *h) { pthread_mutex_destroy(&h->retry.mu); }
+
+void cml_retry_reset_stats(cml *h) {
+  cml_retry_counters *c = &h->retry.stats;
+  atomic_store(&c->requests, 0);
+  atomic_store(&c->retries, 0);
+  atomic_store(&c->retry_after, 0);
+  atomic_store(&c->backoff_ns, 0);
+  atomic_store(&c->gave_up, 0);
+  atomic_store(&c->breaker_opened, 0);
+  atomic_store(&c->breaker_rejected, 0);
+  atomic_store(&c->resumed, 0);
+  atomic_store(&c->resumed_bytes, 0);
+}
+
+void cml_retry_get_stats(cml *h, cml_retry_stats *out) {
+  cml_retry_counters *c = &h->retry.stats;
+  out->requests = atomic_load(&c->requests);
+  out->retries = atomic_load(&c->retries);
+  out->retry_after = atomic_load(&c->retry_after);
+  out->backoff_ns = atomic_load(&c->backoff_ns);
+  out->gave_up = atomic_load(&c->gave_up);
+  out->breaker_opened = atomic_load(&c->breaker_opened);
+  out->breaker_rejected = atomic_load(&c->breaker_rejected);
+  out->resumed = atomic_load(&c->resumed);
+  out->resumed_bytes = atomic_load(&c->resumed_bytes);
+}
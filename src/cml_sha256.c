@@ -0,0 +1,132 @@
+#include "cml_internal.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// SHA-256 (FIPS 180-4) and HMAC-SHA256, for signing object storage requests.
+
+static const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static uint32_t rotr(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+static void sha256_block(cml_sha256 *c, const uint8_t *p) {
+  uint32_t w[64];
+  for (int i = 0; i < 16; i++)
+    w[i] = ((uint32_t)p[i * 4] << 24) | ((uint32_t)p[i * 4 + 1] << 16) | ((uint32_t)p[i * 4 + 2] << 8) | p[i * 4 + 3];
+  for (int i = 16; i < 64; i++) {
+    uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+    uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+  uint32_t a = c->h[0], b = c->h[1], cc = c->h[2], d = c->h[3], e = c->h[4], f = c->h[5], g = c->h[6], h = c->h[7];
+  for (int i = 0; i < 64; i++) {
+    uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+    uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & cc) ^ (b & cc));
+    h = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = cc;
+    cc = b;
+    b = a;
+    a = t1 + t2;
+  }
+  c->h[0] += a;
+  c->h[1] += b;
+  c->h[2] += cc;
+  c->h[3] += d;
+  c->h[4] += e;
+  c->h[5] += f;
+  c->h[6] += g;
+  c->h[7] += h;
+}
+
+void cml_sha256_init(cml_sha256 *c) {
+  static const uint32_t iv[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+  memcpy(c->h, iv, sizeof(iv));
+  c->total = 0;
+  c->buf_len = 0;
+}
+
+void cml_sha256_update(cml_sha256 *c, const void *data, size_t len) {
+  const uint8_t *p = (const uint8_t *)data;
+  c->total += len;
+  if (c->buf_len) {
+    size_t take = 64 - c->buf_len;
+    if (take > len) take = len;
+    memcpy(c->buf + c->buf_len, p, take);
+    c->buf_len += take;
+    p += take;
+    len -= take;
+    if (c->buf_len < 64) return;
+    sha256_block(c, c->buf);
+    c->buf_len = 0;
+  }
+  for (; len >= 64; p += 64, len -= 64) sha256_block(c, p);
+  memcpy(c->buf, p, len);
+  c->buf_len = len;
+}
+
+void cml_sha256_final(cml_sha256 *c, uint8_t out[32]) {
+  uint64_t bits = c->total * 8;
+  uint8_t pad = 0x80;
+  cml_sha256_update(c, &pad, 1);
+  uint8_t zero = 0;
+  while (c->buf_len != 56) cml_sha256_update(c, &zero, 1);
+  uint8_t len_be[8];
+  for (int i = 0; i < 8; i++) len_be[i] = (uint8_t)(bits >> (56 - 8 * i));
+  cml_sha256_update(c, len_be, 8);
+  for (int i = 0; i < 8; i++) {
+    out[i * 4] = (uint8_t)(c->h[i] >> 24);
+    out[i * 4 + 1] = (uint8_t)(c->h[i] >> 16);
+    out[i * 4 + 2] = (uint8_t)(c->h[i] >> 8);
+    out[i * 4 + 3] = (uint8_t)c->h[i];
+  }
+}
+
+void cml_sha256_hex(const void *data, size_t len, char out[65]) {
+  cml_sha256 c;
+  uint8_t d[32];
+  cml_sha256_init(&c);
+  cml_sha256_update(&c, data, len);
+  cml_sha256_final(&c, d);
+  for (int i = 0; i < 32; i++) snprintf(out + i * 2, 3, "%02x", d[i]);
+}
+
+void cml_hmac_sha256(const void *key, size_t key_len, const void *msg, size_t msg_len, uint8_t out[32]) {
+  uint8_t k[64] = {0};
+  if (key_len > 64) {
+    cml_sha256 c;
+    cml_sha256_init(&c);
+    cml_sha256_update(&c, key, key_len);
+    cml_sha256_final(&c, k);
+  } else {
+    memcpy(k, key, key_len);
+  }
+  uint8_t ipad[64];
+  uint8_t opad[64];
+  for (int i = 0; i < 64; i++) {
+    ipad[i] = k[i] ^ 0x36;
+    opad[i] = k[i] ^ 0x5c;
+  }
+  uint8_t inner[32];
+  cml_sha256 c;
+  cml_sha256_init(&c);
+  cml_sha256_update(&c, ipad, 64);
+  cml_sha256_update(&c, msg, msg_len);
+  cml_sha256_final(&c, inner);
+  cml_sha256_init(&c);
+  cml_sha256_update(&c, opad, 64);
+  cml_sha256_update(&c, inner, 32);
+  cml_sha256_final(&c, out);
+}
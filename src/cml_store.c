@@ -0,0 +1,259 @@
+#include "cml_internal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Content-addressed page store (cfg.store_dir):
+//   objects/<k[0..1]>/<k>   decrypted page bytes, k = 128-bit content key in hex
+//   refs/<quality>[-split]/<title>/<chapter>.refs   "<k> <page filename>" lines
+// Objects are shared by every chapter, output directory and run; refs record which object a page of
+// a chapter resolved to, so a later run can serve it without downloading.
+
+#define P1 0x9E3779B185EBCA87ull
+#define P2 0xC2B2AE3D27D4EB4Full
+#define P3 0x165667B19E3779F9ull
+#define P4 0x85EBCA77C2B2AE63ull
+#define P5 0x27D4EB2F165667C5ull
+
+static uint64_t rotl64(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+static uint64_t read64(const uint8_t *p) {
+  uint64_t v = 0;
+  for (int i = 7; i >= 0; i--) v = (v << 8) | p[i];
+  return v;
+}
+
+static uint32_t read32(const uint8_t *p) {
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t xxh_round(uint64_t acc, uint64_t input) {
+  acc += input * P2;
+  acc = rotl64(acc, 31);
+  return acc * P1;
+}
+
+static uint64_t xxh_merge(uint64_t acc, uint64_t val) {
+  acc ^= xxh_round(0, val);
+  return acc * P1 + P4;
+}
+
+// XXH64
+static uint64_t xxh64(const uint8_t *p, size_t len, uint64_t seed) {
+  const uint8_t *end = p + len;
+  uint64_t h;
+  if (len >= 32) {
+    uint64_t v1 = seed + P1 + P2;
+    uint64_t v2 = seed + P2;
+    uint64_t v3 = seed;
+    uint64_t v4 = seed - P1;
+    const uint8_t *limit = end - 32;
+    do {
+      v1 = xxh_round(v1, read64(p));
+      v2 = xxh_round(v2, read64(p + 8));
+      v3 = xxh_round(v3, read64(p + 16));
+      v4 = xxh_round(v4, read64(p + 24));
+      p += 32;
+    } while (p <= limit);
+    h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+    h = xxh_merge(h, v1);
+    h = xxh_merge(h, v2);
+    h = xxh_merge(h, v3);
+    h = xxh_merge(h, v4);
+  } else {
+    h = seed + P5;
+  }
+  h += (uint64_t)len;
+  for (; p + 8 <= end; p += 8) {
+    h ^= xxh_round(0, read64(p));
+    h = rotl64(h, 27) * P1 + P4;
+  }
+  if (p + 4 <= end) {
+    h ^= (uint64_t)read32(p) * P1;
+    h = rotl64(h, 23) * P2 + P3;
+    p += 4;
+  }
+  for (; p < end; p++) {
+    h ^= (uint64_t)(*p) * P5;
+    h = rotl64(h, 11) * P1;
+  }
+  h ^= h >> 33;
+  h *= P2;
+  h ^= h >> 29;
+  h *= P3;
+  h ^= h >> 32;
+  return h;
+}
+
+void cml_store_key(const uint8_t *data, size_t len, char out[CML_STORE_KEY_LEN + 1]) {
+  // Two independently seeded 64-bit hashes: accidental collisions across a library are not a concern.
+  uint64_t a = xxh64(data, len, 0);
+  uint64_t b = xxh64(data, len, P5);
+  snprintf(out, CML_STORE_KEY_LEN + 1, "%016llx%016llx", (unsigned long long)a, (unsigned long long)b);
+}
+
+static const char *quality_dir(cml_quality q) {
+  switch (q) {
+    case CML_QUALITY_HIGH:
+      return "high";
+    case CML_QUALITY_LOW:
+      return "low";
+    case CML_QUALITY_SUPER_HIGH:
+    default:
+      return "super_high";
+  }
+}
+
+char *cml_store_object_path(const cml *h, const char *key) {
+  size_t n = strlen(h->cfg.store_dir) + strlen(key) + 16;
+  char *out = (char *)malloc(n);
+  if (!out) return NULL;
+  snprintf(out, n, "%s/objects/%.2s/%s", h->cfg.store_dir, key, key);
+  return out;
+}
+
+static char *refs_path(const cml *h, const char *title_dir, const char *chapter_dir) {
+  size_t n = strlen(h->cfg.store_dir) + strlen(title_dir) + strlen(chapter_dir) + 48;
+  char *out = (char *)malloc(n);
+  if (!out) return NULL;
+  snprintf(out, n, "%s/refs/%s%s/%s/%s.refs", h->cfg.store_dir, quality_dir(h->cfg.quality),
+           h->cfg.split ? "-split" : "", title_dir, chapter_dir);
+  return out;
+}
+
+cml_status cml_store_put(cml *h, const uint8_t *data, size_t len, char key[CML_STORE_KEY_LEN + 1], char **out_path) {
+  if (!h || !data || !out_path) return CML_ERR_INVALID;
+  *out_path = NULL;
+  cml_store_key(data, len, key);
+  char *path = cml_store_object_path(h, key);
+  if (!path) return CML_ERR_OOM;
+
+  h->store_stats.pages++;
+  h->store_stats.bytes += len;
+  if (cml_exists(path)) {
+    h->store_stats.pages_deduped++;
+    h->store_stats.bytes_saved += len;
+    *out_path = path;
+    return CML_OK;
+  }
+
+  // objects/<xx>: create each fan-out directory once per handle.
+  char *slash = strrchr(path, '/');
+  *slash = '\0';
+  cml_status st = CML_OK;
+  if (!cml_strset_has(&h->store_dirs, path)) {
+    st = cml_mkdir_p(path);
+    if (st == CML_OK && cml_strset_add(&h->store_dirs, path) != 0) st = CML_ERR_OOM;
+  }
+  *slash = '/';
+  if (st == CML_OK) st = cml_write_file_atomic(path, data, len);
+  if (st != CML_OK) {
+    free(path);
+    return st;
+  }
+  *out_path = path;
+  return CML_OK;
+}
+
+void cml_store_refs_free(cml_store_refs *r) {
+  if (!r) return;
+  for (size_t i = 0; i < r->len; i++) free(r->items[i].name);
+  free(r->items);
+  free(r->path);
+  memset(r, 0, sizeof(*r));
+}
+
+const char *cml_store_refs_find(const cml_store_refs *r, const char *name) {
+  for (size_t i = 0; i < r->len; i++)
+    if (strcmp(r->items[i].name, name) == 0) return r->items[i].key;
+  return NULL;
+}
+
+cml_status cml_store_refs_set(cml_store_refs *r, const char *name, const char *key) {
+  for (size_t i = 0; i < r->len; i++) {
+    if (strcmp(r->items[i].name, name) != 0) continue;
+    if (strcmp(r->items[i].key, key) != 0) {
+      memcpy(r->items[i].key, key, CML_STORE_KEY_LEN + 1);
+      r->dirty = true;
+    }
+    return CML_OK;
+  }
+  if (r->len == r->cap) {
+    size_t next = r->cap ? (r->cap * 2) : 32;
+    void *p = realloc(r->items, next * sizeof(cml_store_ref));
+    if (!p) return CML_ERR_OOM;
+    r->items = (cml_store_ref *)p;
+    r->cap = next;
+  }
+  char *copy = strdup(name);
+  if (!copy) return CML_ERR_OOM;
+  r->items[r->len].name = copy;
+  memcpy(r->items[r->len].key, key, CML_STORE_KEY_LEN + 1);
+  r->len++;
+  r->dirty = true;
+  return CML_OK;
+}
+
+cml_status cml_store_refs_load(const cml *h, const char *title_dir, const char *chapter_dir, cml_store_refs *out) {
+  memset(out, 0, sizeof(*out));
+  out->path = refs_path(h, title_dir, chapter_dir);
+  if (!out->path) return CML_ERR_OOM;
+  if (!cml_exists(out->path)) return CML_OK;
+
+  cml_bytes b = {0};
+  cml_status st = cml_read_file(out->path, &b);
+  if (st != CML_OK) return st;
+  size_t pos = 0;
+  while (st == CML_OK && pos < b.len) {
+    uint8_t *nl = (uint8_t *)memchr(b.data + pos, '\n', b.len - pos);
+    size_t line_end = nl ? (size_t)(nl - b.data) : b.len;
+    size_t line_len = line_end - pos;
+    // Anything malformed is ignored: at worst the page is downloaded again.
+    if (line_len > CML_STORE_KEY_LEN + 1 && b.data[pos + CML_STORE_KEY_LEN] == ' ') {
+      char key[CML_STORE_KEY_LEN + 1];
+      memcpy(key, b.data + pos, CML_STORE_KEY_LEN);
+      key[CML_STORE_KEY_LEN] = '\0';
+      char *name = strndup((const char *)b.data + pos + CML_STORE_KEY_LEN + 1, line_len - CML_STORE_KEY_LEN - 1);
+      if (!name) {
+        st = CML_ERR_OOM;
+        break;
+      }
+      st = cml_store_refs_set(out, name, key);
+      free(name);
+    }
+    pos = line_end + 1;
+  }
+  cml_bytes_free(&b);
+  out->dirty = false;
+  return st;
+}
+
+cml_status cml_store_refs_save(cml_store_refs *r) {
+  if (!r->dirty) return CML_OK;
+  size_t n = 0;
+  for (size_t i = 0; i < r->len; i++) n += CML_STORE_KEY_LEN + 1 + strlen(r->items[i].name) + 1;
+  char *buf = (char *)malloc(n + 1);
+  if (!buf) return CML_ERR_OOM;
+  size_t off = 0;
+  for (size_t i = 0; i < r->len; i++)
+    off += (size_t)snprintf(buf + off, n + 1 - off, "%s %s\n", r->items[i].key, r->items[i].name);
+
+  char *dir = strdup(r->path);
+  cml_status st = dir ? CML_OK : CML_ERR_OOM;
+  if (st == CML_OK) {
+    *strrchr(dir, '/') = '\0';
+    st = cml_mkdir_p(dir);
+  }
+  if (st == CML_OK) st = cml_write_file_atomic(r->path, (const uint8_t *)buf, off);
+  if (st == CML_OK) r->dirty = false;
+  free(dir);
+  free(buf);
+  return st;
+}
+
+cml_status cml_get_store_stats(const cml *h, cml_store_stats *out) {
+  if (!h || !out) return CML_ERR_INVALID;
+  *out = h->store_stats;
+  return CML_OK;
+}
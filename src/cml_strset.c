@@ -0,0 +1,63 @@
+#include "cml_internal.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static uint64_t str_hash(const char *s) {
+  uint64_t h = 1469598103934665603ull;
+  for (const unsigned char *p = (const unsigned char *)s; *p; p++) {
+    h ^= *p;
+    h *= 1099511628211ull;
+  }
+  return h;
+}
+
+static int strset_grow(cml_strset *s) {
+  size_t next = s->cap ? (s->cap * 2) : 64;
+  char **slots = (char **)calloc(next, sizeof(char *));
+  if (!slots) return -1;
+  for (size_t i = 0; i < s->cap; i++) {
+    char *k = s->slots[i];
+    if (!k) continue;
+    size_t j = (size_t)str_hash(k) & (next - 1);
+    while (slots[j]) j = (j + 1) & (next - 1);
+    slots[j] = k;
+  }
+  free(s->slots);
+  s->slots = slots;
+  s->cap = next;
+  return 0;
+}
+
+int cml_strset_has(const cml_strset *s, const char *key) {
+  if (!s || !key || s->cap == 0) return 0;
+  size_t j = (size_t)str_hash(key) & (s->cap - 1);
+  while (s->slots[j]) {
+    if (strcmp(s->slots[j], key) == 0) return 1;
+    j = (j + 1) & (s->cap - 1);
+  }
+  return 0;
+}
+
+int cml_strset_add(cml_strset *s, const char *key) {
+  if (!s || !key) return -1;
+  if (cml_strset_has(s, key)) return 0;
+  // Keep the load factor under 1/2 so probe chains stay short.
+  if ((s->len + 1) * 2 > s->cap && strset_grow(s) != 0) return -1;
+  char *k = strdup(key);
+  if (!k) return -1;
+  size_t j = (size_t)str_hash(k) & (s->cap - 1);
+  while (s->slots[j]) j = (j + 1) & (s->cap - 1);
+  s->slots[j] = k;
+  s->len++;
+  return 0;
+}
+
+void cml_strset_free(cml_strset *s) {
+  if (!s) return;
+  for (size_t i = 0; i < s->cap; i++) free(s->slots[i]);
+  free(s->slots);
+  s->slots = NULL;
+  s->len = 0;
+  s->cap = 0;
+}
@@ -0,0 +1,110 @@
+#include "cml_internal.h"
+
+#include <string.h>
+
+// Adaptive transfer timeouts. Each host keeps a smoothed time to first byte (with its mean deviation,
+// as TCP does for round trips) and a smoothed transfer rate after the first byte. A request then
+// gets a first-byte budget from the former and, once its size is known, a deadline from the latter,
+// so a large page on a slow link is given the time it needs while a transfer that stops moving is
+// abandoned within seconds instead of waiting out a fixed timeout.
+
+#define NS_PER_SEC 1000000000ull
+#define FIRST_BYTE_DEFAULT_NS (15 * NS_PER_SEC)  // before the host has answered anything
+#define FIRST_BYTE_MIN_NS (2 * NS_PER_SEC)
+#define FIRST_BYTE_MAX_NS (30 * NS_PER_SEC)
+#define STALL_NS (3 * NS_PER_SEC)          // no bytes moved for this long
+#define SLOW_FACTOR 10.0                   // a transfer this many times slower than usual is abandoned
+#define DEADLINE_SLACK_NS (2 * NS_PER_SEC)
+#define RATE_MIN_BYTES 16384               // smaller bodies say little about the transfer rate
+#define FORMER_TIMEOUT_NS (60 * NS_PER_SEC)
+
+static cml_host_timing *timing_find(cml_timeout_state *t, const char *url, bool create) {
+  const char *host = NULL;
+  size_t n = cml_url_host(url, &host);
+  if (n == 0 || n >= sizeof(t->hosts[0].host)) return NULL;
+  for (size_t i = 0; i < t->hosts_len; i++) {
+    if (strlen(t->hosts[i].host) == n && memcmp(t->hosts[i].host, host, n) == 0) return &t->hosts[i];
+  }
+  if (!create || t->hosts_len == CML_MAX_TIMINGS) return NULL;
+  cml_host_timing *ht = &t->hosts[t->hosts_len++];
+  memset(ht, 0, sizeof(*ht));
+  memcpy(ht->host, host, n);
+  return ht;
+}
+
+void cml_timeout_plan(cml *h, const char *url, cml_xfer_limits *out) {
+  cml_timeout_state *t = &h->timeouts;
+  memset(out, 0, sizeof(*out));
+  out->first_byte_ns = FIRST_BYTE_DEFAULT_NS;
+  out->stall_ns = STALL_NS;
+  pthread_mutex_lock(&t->mu);
+  cml_host_timing *ht = timing_find(t, url, false);
+  if (ht && ht->ttfb_ns > 0) {
+    double budget = 4.0 * (ht->ttfb_ns + 4.0 * ht->ttfb_dev_ns);
+    if (budget < (double)FIRST_BYTE_MIN_NS) budget = (double)FIRST_BYTE_MIN_NS;
+    if (budget > (double)FIRST_BYTE_MAX_NS) budget = (double)FIRST_BYTE_MAX_NS;
+    out->first_byte_ns = (uint64_t)budget;
+  }
+  if (ht) out->min_rate_bps = ht->rate_bps / SLOW_FACTOR;
+  pthread_mutex_unlock(&t->mu);
+}
+
+uint64_t cml_timeout_deadline_ns(const cml_xfer_limits *l, uint64_t total_bytes) {
+  if (l->min_rate_bps <= 0 || total_bytes == 0) return 0;
+  return l->first_byte_ns + (uint64_t)((double)total_bytes / l->min_rate_bps * (double)NS_PER_SEC) +
+         DEADLINE_SLACK_NS;
+}
+
+void cml_timeout_record(cml *h, const char *url, uint64_t ttfb_ns, uint64_t total_ns, size_t bytes) {
+  if (ttfb_ns == 0) return;
+  cml_timeout_state *t = &h->timeouts;
+  pthread_mutex_lock(&t->mu);
+  cml_host_timing *ht = timing_find(t, url, true);
+  if (ht) {
+    double sample = (double)ttfb_ns;
+    if (ht->ttfb_ns <= 0) {
+      ht->ttfb_ns = sample;
+      ht->ttfb_dev_ns = sample / 2;
+    } else {
+      double err = sample > ht->ttfb_ns ? sample - ht->ttfb_ns : ht->ttfb_ns - sample;
+      ht->ttfb_dev_ns = (ht->ttfb_dev_ns * 3 + err) / 4;
+      ht->ttfb_ns = (ht->ttfb_ns * 7 + sample) / 8;
+    }
+    if (bytes >= RATE_MIN_BYTES && total_ns > ttfb_ns) {
+      double rate = (double)bytes / ((double)(total_ns - ttfb_ns) / (double)NS_PER_SEC);
+      ht->rate_bps = ht->rate_bps > 0 ? (ht->rate_bps * 7 + rate) / 8 : rate;
+    }
+  }
+  pthread_mutex_unlock(&t->mu);
+}
+
+void cml_timeout_abort(cml *h, cml_xfer_abort why, uint64_t elapsed_ns) {
+  cml_timeout_counters *c = &h->timeouts.stats;
+  if (why == CML_XFER_FIRST_BYTE) atomic_fetch_add(&c->first_byte_timeouts, 1);
+  else if (why == CML_XFER_STALL) atomic_fetch_add(&c->stalls, 1);
+  else if (why == CML_XFER_SLOW) atomic_fetch_add(&c->slow_aborts, 1);
+  // A dead transfer used to hold its worker until the fixed timeout; a slow one would have finished
+  // at some unknown point, so it is not counted.
+  if (why != CML_XFER_SLOW && elapsed_ns < FORMER_TIMEOUT_NS)
+    atomic_fetch_add(&c->saved_ns, FORMER_TIMEOUT_NS - elapsed_ns);
+}
+
+cml_status cml_timeout_init(cml *h) { return pthread_mutex_init(&h->timeouts.mu, NULL) == 0 ? CML_OK : CML_ERR_OOM; }
+
+void cml_timeout_free(cml *h) { pthread_mutex_destroy(&h->timeouts.mu); }
+
+void cml_timeout_reset_stats(cml *h) {
+  cml_timeout_counters *c = &h->timeouts.stats;
+  atomic_store(&c->first_byte_timeouts, 0);
+  atomic_store(&c->stalls, 0);
+  atomic_store(&c->slow_aborts, 0);
+  atomic_store(&c->saved_ns, 0);
+}
+
+void cml_timeout_get_stats(cml *h, cml_timeout_stats *out) {
+  cml_timeout_counters *c = &h->timeouts.stats;
+  out->first_byte_timeouts = atomic_load(&c->first_byte_timeouts);
+  out->stalls = atomic_load(&c->stalls);
+  out->slow_aborts = atomic_load(&c->slow_aborts);
+  out->saved_ns = atomic_load(&c->saved_ns);
+}
@@ -0,0 +1,174 @@
+#include "cml_internal.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Run tracing (cfg.trace_path). Each thread records its spans into a ring of its own, so recording
+// never takes a lock; a thread registers its ring once per run. When the run is over and its threads
+// are joined, the rings are written out as Chrome trace-event JSON, which Perfetto and
+// chrome://tracing open directly. A thread that records more than CML_TRACE_RING_EVENTS spans keeps
+// the most recent ones.
+
+#define CML_TRACE_RING_EVENTS 16384
+
+typedef struct {
+  const char *cat;
+  const char *name;
+  const char *arg_name;  // NULL: no argument
+  uint64_t arg;
+  uint64_t start_ns;
+  uint64_t dur_ns;
+} trace_event;
+
+struct cml_trace_ring {
+  cml_trace_ring *next;
+  uint32_t tid;
+  char thread_name[32];
+  uint64_t written;  // events recorded; the ring holds the last CML_TRACE_RING_EVENTS of them
+  trace_event events[CML_TRACE_RING_EVENTS];
+};
+
+// The calling thread's ring. run tells whether it belongs to the current run of a handle: run ids
+// are unique across handles, so a pointer left over from an earlier run is never followed.
+static _Thread_local struct {
+  uint64_t run;
+  cml_trace_ring *ring;
+} tls;
+
+static _Atomic uint64_t next_run = 1;
+
+static cml_trace_ring *ring_register(cml *h, const char *name, int index) {
+  cml_trace_state *t = &h->trace;
+  cml_trace_ring *r = (cml_trace_ring *)malloc(sizeof(*r));
+  if (!r) return NULL;
+  r->written = 0;
+  if (index >= 0) snprintf(r->thread_name, sizeof(r->thread_name), "%s %d", name, index);
+  else snprintf(r->thread_name, sizeof(r->thread_name), "%s", name);
+  pthread_mutex_lock(&t->mu);
+  r->tid = ++t->threads;
+  r->next = t->rings;
+  t->rings = r;
+  pthread_mutex_unlock(&t->mu);
+  tls.run = t->run;
+  tls.ring = r;
+  return r;
+}
+
+cml_status cml_trace_start(cml *h) {
+  cml_trace_state *t = &h->trace;
+  memset(t, 0, sizeof(*t));
+  if (!h->cfg.trace_path) return CML_OK;
+  if (pthread_mutex_init(&t->mu, NULL) != 0) return CML_ERR_OOM;
+  t->run = atomic_fetch_add(&next_run, 1);
+  t->start_ns = cml_now_ns();
+  t->on = true;
+  cml_trace_thread(h, "cml_run", -1);
+  return CML_OK;
+}
+
+void cml_trace_thread(cml *h, const char *name, int index) {
+  if (h->trace.on && tls.run != h->trace.run) ring_register(h, name, index);
+}
+
+void cml_trace_span(cml *h, const char *cat, const char *name, uint64_t start_ns, uint64_t end_ns,
+                    const char *arg_name, uint64_t arg) {
+  cml_trace_ring *r = tls.run == h->trace.run ? tls.ring : ring_register(h, "thread", -1);
+  if (!r) return;
+  trace_event *e = &r->events[r->written++ % CML_TRACE_RING_EVENTS];
+  e->cat = cat;
+  e->name = name;
+  e->arg_name = arg_name;
+  e->arg = arg;
+  e->start_ns = start_ns;
+  e->dur_ns = end_ns > start_ns ? end_ns - start_ns : 0;
+}
+
+typedef struct {
+  char *data;
+  size_t len;
+  size_t cap;
+  bool oom;
+} json_buf;
+
+static void out(json_buf *b, const char *fmt, ...) {
+  if (b->oom) return;
+  for (;;) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(b->data ? b->data + b->len : NULL, b->cap - b->len, fmt, ap);
+    va_end(ap);
+    if (n < 0) {
+      b->oom = true;
+      return;
+    }
+    if ((size_t)n < b->cap - b->len) {
+      b->len += (size_t)n;
+      return;
+    }
+    size_t cap = b->cap ? b->cap * 2 : 64 * 1024;
+    while (cap - b->len <= (size_t)n) cap *= 2;
+    char *p = (char *)realloc(b->data, cap);
+    if (!p) {
+      b->oom = true;
+      return;
+    }
+    b->data = p;
+    b->cap = cap;
+  }
+}
+
+// Timestamps are microseconds since the start of the run, as the format wants.
+static void write_ring(json_buf *b, const cml_trace_state *t, const cml_trace_ring *r) {
+  out(b, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}", r->tid,
+      r->thread_name);
+  uint64_t first = r->written > CML_TRACE_RING_EVENTS ? r->written - CML_TRACE_RING_EVENTS : 0;
+  for (uint64_t i = first; i < r->written; i++) {
+    const trace_event *e = &r->events[i % CML_TRACE_RING_EVENTS];
+    uint64_t ts = e->start_ns > t->start_ns ? e->start_ns - t->start_ns : 0;
+    out(b, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f", e->name,
+        e->cat, r->tid, (double)ts / 1e3, (double)e->dur_ns / 1e3);
+    if (e->arg_name) out(b, ",\"args\":{\"%s\":%llu}", e->arg_name, (unsigned long long)e->arg);
+    out(b, "}");
+  }
+}
+
+cml_status cml_trace_finish(cml *h) {
+  cml_trace_state *t = &h->trace;
+  if (!t->on) return CML_OK;
+  t->on = false;
+
+  // Rings were pushed at the front; write them in registration order, cml_run's first.
+  size_t n = 0;
+  for (cml_trace_ring *r = t->rings; r; r = r->next) n++;
+  cml_trace_ring **order = (cml_trace_ring **)calloc(n ? n : 1, sizeof(*order));
+  json_buf b = {0};
+  uint64_t dropped = 0;
+  out(&b, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+  out(&b, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"cml\"}}");
+  size_t i = n;
+  for (cml_trace_ring *r = t->rings; r && order; r = r->next) order[--i] = r;
+  for (i = 0; i < n && order; i++) {
+    write_ring(&b, t, order[i]);
+    if (order[i]->written > CML_TRACE_RING_EVENTS) dropped += order[i]->written - CML_TRACE_RING_EVENTS;
+  }
+  out(&b, "\n]}\n");
+
+  cml_status st = CML_ERR_OOM;
+  if (order && !b.oom) st = cml_write_file_atomic(h->cfg.trace_path, (const uint8_t *)b.data, b.len);
+  if (st != CML_OK) cml_log(h, CML_LOG_ERROR, "trace: cannot write %s: %s", h->cfg.trace_path, cml_status_string(st));
+  else if (dropped) cml_log(h, CML_LOG_WARN, "trace: %llu oldest spans dropped", (unsigned long long)dropped);
+  free(b.data);
+  free(order);
+
+  cml_trace_ring *r = t->rings;
+  while (r) {
+    cml_trace_ring *next = r->next;
+    free(r);
+    r = next;
+  }
+  t->rings = NULL;
+  pthread_mutex_destroy(&t->mu);
+  return st;
+}
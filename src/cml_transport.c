@@ -0,0 +1,201 @@
+#include "cml_internal.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+// Record and replay (cml_config.transport). RECORD saves every final response to a GET in
+// transport.dir as two files named by the SHA-256 of the URL: "<key>.body" holds the body and
+// "<key>.head" a few "name value" lines (status, URL, validators, body length). REPLAY answers GETs
+// from those files instead of the network, after the configured latency and at the configured rate,
+// so a whole run can be repeated offline against the same responses.
+
+#define NS_PER_SEC 1000000000ull
+
+typedef struct {
+  long code;
+  char *url;
+  char *etag;
+  char *last_modified;
+  size_t length;
+} recording;
+
+static void recording_free(recording *r) {
+  free(r->url);
+  free(r->etag);
+  free(r->last_modified);
+  memset(r, 0, sizeof(*r));
+}
+
+// "<dir>/<sha256(url)><ext>"
+static char *recording_path(const cml *h, const char *url, const char *ext) {
+  char key[65];
+  cml_sha256_hex(url, strlen(url), key);
+  const char *dir = h->cfg.transport.dir;
+  size_t n = strlen(dir) + 1 + 64 + strlen(ext) + 1;
+  char *path = (char *)malloc(n);
+  if (path) snprintf(path, n, "%s/%s%s", dir, key, ext);
+  return path;
+}
+
+static cml_status head_parse(const cml_bytes *b, recording *out) {
+  memset(out, 0, sizeof(*out));
+  const char *p = (const char *)b->data;
+  const char *end = p + b->len;
+  bool has_length = false;
+  while (p < end) {
+    const char *nl = memchr(p, '\n', (size_t)(end - p));
+    if (!nl) nl = end;
+    const char *sp = memchr(p, ' ', (size_t)(nl - p));
+    if (sp) {
+      size_t k = (size_t)(sp - p);
+      char *v = strndup(sp + 1, (size_t)(nl - sp - 1));
+      if (!v) {
+        recording_free(out);
+        return CML_ERR_OOM;
+      }
+      if (k == 4 && memcmp(p, "code", 4) == 0) {
+        out->code = strtol(v, NULL, 10);
+      } else if (k == 6 && memcmp(p, "length", 6) == 0) {
+        out->length = (size_t)strtoull(v, NULL, 10);
+        has_length = true;
+      }
+      char **slot = k == 3 && memcmp(p, "url", 3) == 0              ? &out->url
+                    : k == 4 && memcmp(p, "etag", 4) == 0           ? &out->etag
+                    : k == 13 && memcmp(p, "last-modified", 13) == 0 ? &out->last_modified
+                                                                     : NULL;
+      if (slot) {
+        free(*slot);
+        *slot = v;
+      } else {
+        free(v);
+      }
+    }
+    p = nl + 1;
+  }
+  if (out->code < 100 || !out->url || !has_length) {
+    recording_free(out);
+    return CML_ERR_IO;
+  }
+  return CML_OK;
+}
+
+// The value of header name in list l ("Name: value"), or NULL.
+static const char *header_find(const struct curl_slist *l, const char *name) {
+  size_t k = strlen(name);
+  for (; l; l = l->next) {
+    if (strncasecmp(l->data, name, k) == 0 && l->data[k] == ':') {
+      const char *v = l->data + k + 1;
+      while (*v == ' ') v++;
+      return v;
+    }
+  }
+  return NULL;
+}
+
+static void sleep_ns(uint64_t ns) {
+  struct timespec ts = {.tv_sec = (time_t)(ns / NS_PER_SEC), .tv_nsec = (long)(ns % NS_PER_SEC)};
+  while (nanosleep(&ts, &ts) == -1 && errno == EINTR) {
+  }
+}
+
+cml_status cml_transport_init(cml *h) {
+  const cml_transport_config *t = &h->cfg.transport;
+  if (t->mode == CML_TRANSPORT_LIVE) return CML_OK;
+  if (t->mode == CML_TRANSPORT_RECORD) {
+    if (cml_mkdir_p(t->dir) == CML_OK) return CML_OK;
+    cml_log(h, CML_LOG_ERROR, "cannot create recording directory %s", t->dir);
+    return CML_ERR_IO;
+  }
+  if (cml_exists(t->dir)) return CML_OK;
+  cml_log(h, CML_LOG_ERROR, "recording directory %s does not exist", t->dir);
+  return CML_ERR_IO;
+}
+
+cml_transport_mode cml_transport_for(const cml *h, const cml_http_req *req) {
+  return strcmp(req->method, "GET") == 0 ? h->cfg.transport.mode : CML_TRANSPORT_LIVE;
+}
+
+void cml_record_save(cml *h, const cml_http_req *req, const cml_http_resp *resp) {
+  // A resumed page arrives as a 206 but is whole by now.
+  long code = resp->code == 206 ? 200 : resp->code;
+  const char *etag = resp->etag ? resp->etag : "";
+  const char *modified = resp->last_modified ? resp->last_modified : "";
+  const char *fmt = "code %ld\nurl %s\netag %s\nlast-modified %s\nlength %zu\n";
+  int n = snprintf(NULL, 0, fmt, code, req->url, etag, modified, resp->body.len);
+  char *head = n > 0 ? (char *)malloc((size_t)n + 1) : NULL;
+  char *body_path = recording_path(h, req->url, ".body");
+  char *head_path = recording_path(h, req->url, ".head");
+  cml_status st = head && body_path && head_path ? CML_OK : CML_ERR_OOM;
+  // The head goes last, so a recording that has one is complete.
+  static const uint8_t empty[1];
+  if (st == CML_OK) st = cml_write_file_atomic(body_path, resp->body.data ? resp->body.data : empty, resp->body.len);
+  if (st == CML_OK) {
+    snprintf(head, (size_t)n + 1, fmt, code, req->url, etag, modified, resp->body.len);
+    st = cml_write_file_atomic(head_path, (const uint8_t *)head, (size_t)n);
+  }
+  if (st != CML_OK) cml_log(h, CML_LOG_WARN, "cannot record %s: %s", req->url, cml_status_string(st));
+  free(head);
+  free(body_path);
+  free(head_path);
+}
+
+// Reads the recording of req into r and, unless unchanged, its body into out->body.
+static cml_status recording_load(cml *h, const cml_http_req *req, recording *r, bool *unchanged, cml_http_resp *out) {
+  char *head_path = recording_path(h, req->url, ".head");
+  char *body_path = recording_path(h, req->url, ".body");
+  cml_bytes head = {0};
+  cml_status st = head_path && body_path ? cml_read_file(head_path, &head) : CML_ERR_OOM;
+  if (st == CML_OK) st = head_parse(&head, r);
+  cml_bytes_free(&head);
+  if (st == CML_OK && strcmp(r->url, req->url) != 0) st = CML_ERR_IO;
+
+  // Answered as the server would: a request that carries the recorded validator gets a 304.
+  const char *inm = header_find(req->headers, "If-None-Match");
+  const char *ims = header_find(req->headers, "If-Modified-Since");
+  *unchanged = st == CML_OK && ((inm && r->etag && strcmp(inm, r->etag) == 0) ||
+                                (!inm && ims && r->last_modified && strcmp(ims, r->last_modified) == 0));
+  if (st == CML_OK && !*unchanged) {
+    st = req->pooled ? cml_read_file_pooled(h, body_path, &out->body) : cml_read_file(body_path, &out->body);
+    if (st == CML_OK && out->body.len != r->length) st = CML_ERR_IO;
+    if (st != CML_OK && req->pooled) cml_buf_put(h, &out->body);
+    if (st != CML_OK) cml_bytes_free(&out->body);
+  }
+  free(head_path);
+  free(body_path);
+  return st;
+}
+
+cml_status cml_replay_answer(cml *h, const cml_http_req *req, cml_http_resp *out, uint64_t *ttfb_ns,
+                             uint64_t *total_ns) {
+  const cml_transport_config *t = &h->cfg.transport;
+  memset(out, 0, sizeof(*out));
+  *ttfb_ns = *total_ns = 0;
+  recording r = {0};
+  bool unchanged = false;
+  cml_status st = recording_load(h, req, &r, &unchanged, out);
+  if (st == CML_ERR_OOM) {
+    recording_free(&r);
+    return st;
+  }
+  if (st != CML_OK) {
+    cml_log(h, CML_LOG_WARN, "no usable recording of %s in %s", req->url, t->dir);
+    out->code = 404;
+  } else {
+    out->code = unchanged ? 304 : r.code;
+    if (r.etag && *r.etag) out->etag = r.etag;
+    if (r.last_modified && *r.last_modified) out->last_modified = r.last_modified;
+    if (out->etag) r.etag = NULL;
+    if (out->last_modified) r.last_modified = NULL;
+  }
+  recording_free(&r);
+
+  *ttfb_ns = (uint64_t)t->latency_ms * 1000000ull;
+  *total_ns = *ttfb_ns;
+  if (t->bytes_per_sec) *total_ns += (uint64_t)((double)out->body.len / (double)t->bytes_per_sec * (double)NS_PER_SEC);
+  sleep_ns(*total_ns);
+  return CML_OK;
+}
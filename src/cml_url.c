@@ -38,3 +38,10 @@ int cml_url_extract_titles_id(const char *s, uint32_t *out) {
   return parse_u32_prefix(p, out);
 }
 
+
+size_t cml_url_host(const char *url, const char **out_start) {
+  const char *p = strstr(url, "://");
+  p = p ? p + 3 : url;
+  *out_start = p;
+  return strcspn(p, "/?#");
+}
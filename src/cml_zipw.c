@@ -0,0 +1,514 @@
+#include "cml_internal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// Append-only ZIP writer for title archives. Entries are stored (JPEGs do not deflate) and never
+// rewritten: new entries are written over the old central directory, then a fresh central directory
+// is appended. ZIP64 records are emitted once offsets or counts exceed the classic limits.
+
+#define SIG_LOCAL 0x04034b50u
+#define SIG_CENTRAL 0x02014b50u
+#define SIG_EOCD 0x06054b50u
+#define SIG_EOCD64 0x06064b50u
+#define SIG_EOCD64_LOC 0x07064b50u
+
+// Built once per process; several handles (and sinks) may checksum on different threads.
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init(void) {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t c = i;
+    for (int k = 0; k < 8; k++) c = (c & 1) ? (0xedb88320u ^ (c >> 1)) : (c >> 1);
+    crc_table[i] = c;
+  }
+}
+
+uint32_t cml_crc32(const uint8_t *data, size_t len) {
+  pthread_once(&crc_once, crc_init);
+  uint32_t c = 0xffffffffu;
+  for (size_t i = 0; i < len; i++) c = crc_table[(c ^ data[i]) & 0xff] ^ (c >> 8);
+  return c ^ 0xffffffffu;
+}
+
+static void put16(uint8_t *p, uint16_t v) {
+  p[0] = (uint8_t)v;
+  p[1] = (uint8_t)(v >> 8);
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+  put16(p, (uint16_t)v);
+  put16(p + 2, (uint16_t)(v >> 16));
+}
+
+static void put64(uint8_t *p, uint64_t v) {
+  put32(p, (uint32_t)v);
+  put32(p + 4, (uint32_t)(v >> 32));
+}
+
+static uint16_t get16(const uint8_t *p) { return (uint16_t)(p[0] | (p[1] << 8)); }
+static uint32_t get32(const uint8_t *p) { return (uint32_t)get16(p) | ((uint32_t)get16(p + 2) << 16); }
+static uint64_t get64(const uint8_t *p) { return (uint64_t)get32(p) | ((uint64_t)get32(p + 4) << 32); }
+
+static cml_status pwrite_all(int fd, const uint8_t *data, size_t len, uint64_t off) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t w = pwrite(fd, data + done, len - done, (off_t)(off + done));
+    if (w < 0) {
+      if (errno == EINTR) continue;
+      return CML_ERR_IO;
+    }
+    done += (size_t)w;
+  }
+  return CML_OK;
+}
+
+static cml_status pread_all(int fd, uint8_t *data, size_t len, uint64_t off) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t r = pread(fd, data + done, len - done, (off_t)(off + done));
+    if (r < 0) {
+      if (errno == EINTR) continue;
+      return CML_ERR_IO;
+    }
+    if (r == 0) return CML_ERR_ZIP;
+    done += (size_t)r;
+  }
+  return CML_OK;
+}
+
+void cml_zip_dos_now(uint16_t *out_time, uint16_t *out_date) {
+  time_t now = time(NULL);
+  struct tm tm;
+  if (!localtime_r(&now, &tm) || tm.tm_year < 80) {
+    *out_time = 0;
+    *out_date = (1 << 5) | 1;
+    return;
+  }
+  *out_time = (uint16_t)((tm.tm_hour << 11) | (tm.tm_min << 5) | (tm.tm_sec / 2));
+  *out_date = (uint16_t)(((tm.tm_year - 80) << 9) | ((tm.tm_mon + 1) << 5) | tm.tm_mday);
+}
+
+size_t cml_zip_local_header(uint8_t *out, const cml_zip_entry *e) {
+  size_t name_len = strlen(e->name);
+  put32(out, SIG_LOCAL);
+  put16(out + 4, 20);
+  put16(out + 6, 0x0800);
+  put16(out + 8, 0);
+  put16(out + 10, e->dos_time);
+  put16(out + 12, e->dos_date);
+  put32(out + 14, e->crc);
+  put32(out + 18, (uint32_t)e->size);
+  put32(out + 22, (uint32_t)e->size);
+  put16(out + 26, (uint16_t)name_len);
+  put16(out + 28, 0);
+  memcpy(out + 30, e->name, name_len);
+  return 30 + name_len;
+}
+
+static cml_status entry_push(cml_zipw *z, const cml_zip_entry *src) {
+  if (z->len == z->cap) {
+    size_t next = z->cap ? (z->cap * 2) : 64;
+    void *p = realloc(z->entries, next * sizeof(cml_zip_entry));
+    if (!p) return CML_ERR_OOM;
+    z->entries = (cml_zip_entry *)p;
+    z->cap = next;
+  }
+  z->entries[z->len++] = *src;
+  return CML_OK;
+}
+
+static void entries_truncate(cml_zipw *z, size_t len) {
+  for (size_t i = len; i < z->len; i++) free(z->entries[i].name);
+  z->len = len;
+}
+
+static cml_status names_rebuild(cml_zipw *z) {
+  cml_strset_free(&z->names);
+  for (size_t i = 0; i < z->len; i++) {
+    if (cml_strset_add(&z->names, z->entries[i].name) != 0) return CML_ERR_OOM;
+  }
+  return CML_OK;
+}
+
+static cml_status load_central(cml_zipw *z, uint64_t cd_off, uint64_t cd_size, uint64_t count) {
+  if (cd_size > SIZE_MAX || cd_off + cd_size < cd_off) return CML_ERR_ZIP;
+  uint8_t *cd = (uint8_t *)malloc(cd_size ? (size_t)cd_size : 1);
+  if (!cd) return CML_ERR_OOM;
+  cml_status st = pread_all(z->fd, cd, (size_t)cd_size, cd_off);
+  size_t off = 0;
+  for (uint64_t i = 0; st == CML_OK && i < count; i++) {
+    if (off + 46 > cd_size || get32(cd + off) != SIG_CENTRAL) {
+      st = CML_ERR_ZIP;
+      break;
+    }
+    const uint8_t *h = cd + off;
+    uint16_t name_len = get16(h + 28);
+    uint16_t extra_len = get16(h + 30);
+    uint16_t comment_len = get16(h + 32);
+    if (off + 46 + name_len + extra_len + comment_len > cd_size) {
+      st = CML_ERR_ZIP;
+      break;
+    }
+    cml_zip_entry e = {.name = NULL,
+                       .offset = get32(h + 42),
+                       .size = get32(h + 24),
+                       .crc = get32(h + 16),
+                       .dos_time = get16(h + 12),
+                       .dos_date = get16(h + 14)};
+    // ZIP64 extended information carries only the saturated fields, in this order.
+    bool wide_size = (e.size == 0xffffffffu);
+    bool wide_comp = (get32(h + 20) == 0xffffffffu);
+    bool wide_off = (e.offset == 0xffffffffu);
+    const uint8_t *x = h + 46 + name_len;
+    const uint8_t *xend = x + extra_len;
+    while (x + 4 <= xend) {
+      uint16_t id = get16(x);
+      const uint8_t *v = x + 4;
+      const uint8_t *vend = v + get16(x + 2);
+      if (vend > xend) break;
+      if (id == 0x0001) {
+        if (wide_size && v + 8 <= vend) {
+          e.size = get64(v);
+          v += 8;
+        }
+        if (wide_comp && v + 8 <= vend) v += 8;
+        if (wide_off && v + 8 <= vend) e.offset = get64(v);
+      }
+      x = vend;
+    }
+    e.name = (char *)malloc((size_t)name_len + 1);
+    if (!e.name) {
+      st = CML_ERR_OOM;
+      break;
+    }
+    memcpy(e.name, h + 46, name_len);
+    e.name[name_len] = '\0';
+    st = entry_push(z, &e);
+    if (st != CML_OK) {
+      free(e.name);
+      break;
+    }
+    off += 46 + (size_t)name_len + extra_len + comment_len;
+  }
+  free(cd);
+  if (st == CML_OK) st = names_rebuild(z);
+  return st;
+}
+
+// Finds the end of central directory record and loads the entries it describes. Returns
+// CML_ERR_ZIP when the file has no usable EOCD (e.g. a crash while appending).
+static cml_status load_eocd(cml_zipw *z, uint64_t file_size) {
+  size_t tail_len = (file_size < 22 + 0xffff) ? (size_t)file_size : (size_t)(22 + 0xffff);
+  if (tail_len < 22) return CML_ERR_ZIP;
+  uint8_t *tail = (uint8_t *)malloc(tail_len);
+  if (!tail) return CML_ERR_OOM;
+  uint64_t tail_off = file_size - tail_len;
+  cml_status st = pread_all(z->fd, tail, tail_len, tail_off);
+  if (st != CML_OK) {
+    free(tail);
+    return st;
+  }
+  size_t pos = tail_len - 22 + 1;
+  int found = 0;
+  while (pos-- > 0) {
+    if (get32(tail + pos) == SIG_EOCD && pos + 22 + get16(tail + pos + 20) == tail_len) {
+      found = 1;
+      break;
+    }
+  }
+  if (!found) {
+    free(tail);
+    return CML_ERR_ZIP;
+  }
+  uint64_t count = get16(tail + pos + 10);
+  uint64_t cd_size = get32(tail + pos + 12);
+  uint64_t cd_off = get32(tail + pos + 16);
+  uint64_t eocd_off = tail_off + pos;
+  free(tail);
+
+  if (count == 0xffff || cd_size == 0xffffffffu || cd_off == 0xffffffffu) {
+    uint8_t loc[20];
+    uint8_t rec[56];
+    if (eocd_off < 20) return CML_ERR_ZIP;
+    st = pread_all(z->fd, loc, sizeof(loc), eocd_off - 20);
+    if (st != CML_OK) return st;
+    if (get32(loc) != SIG_EOCD64_LOC) return CML_ERR_ZIP;
+    st = pread_all(z->fd, rec, sizeof(rec), get64(loc + 8));
+    if (st != CML_OK) return st;
+    if (get32(rec) != SIG_EOCD64) return CML_ERR_ZIP;
+    count = get64(rec + 32);
+    cd_size = get64(rec + 40);
+    cd_off = get64(rec + 48);
+  }
+  if (cd_off > file_size) return CML_ERR_ZIP;
+  st = load_central(z, cd_off, cd_size, count);
+  if (st != CML_OK) return st;
+  z->data_end = cd_off;
+  return CML_OK;
+}
+
+// Rebuilds the entry list from local headers when the archive was cut short before its central
+// directory was rewritten. Entries whose payload is incomplete or fails its CRC are dropped.
+static cml_status recover_local(cml_zipw *z, uint64_t file_size) {
+  uint64_t off = 0;
+  uint8_t h[30];
+  uint8_t *buf = NULL;
+  size_t buf_cap = 0;
+  cml_status st = CML_OK;
+  while (off + sizeof(h) <= file_size) {
+    if (pread_all(z->fd, h, sizeof(h), off) != CML_OK || get32(h) != SIG_LOCAL) break;
+    uint16_t name_len = get16(h + 26);
+    uint16_t extra_len = get16(h + 28);
+    uint64_t size = get32(h + 18);
+    uint64_t data_off = off + sizeof(h) + name_len + extra_len;
+    if (get16(h + 8) != 0 || get32(h + 22) != size || data_off + size > file_size) break;
+    size_t need = (size_t)name_len + (size_t)size;
+    if (need > buf_cap) {
+      void *p = realloc(buf, need ? need : 1);
+      if (!p) {
+        st = CML_ERR_OOM;
+        break;
+      }
+      buf = (uint8_t *)p;
+      buf_cap = need;
+    }
+    if (pread_all(z->fd, buf, name_len, off + sizeof(h)) != CML_OK) break;
+    if (pread_all(z->fd, buf + name_len, (size_t)size, data_off) != CML_OK) break;
+    if (cml_crc32(buf + name_len, (size_t)size) != get32(h + 14)) break;
+    cml_zip_entry e = {.name = (char *)malloc((size_t)name_len + 1),
+                       .offset = off,
+                       .size = size,
+                       .crc = get32(h + 14),
+                       .dos_time = get16(h + 10),
+                       .dos_date = get16(h + 12)};
+    if (!e.name) {
+      st = CML_ERR_OOM;
+      break;
+    }
+    memcpy(e.name, buf, name_len);
+    e.name[name_len] = '\0';
+    st = entry_push(z, &e);
+    if (st != CML_OK) {
+      free(e.name);
+      break;
+    }
+    off = data_off + size;
+  }
+  free(buf);
+  if (st != CML_OK) return st;
+  z->data_end = off;
+  return names_rebuild(z);
+}
+
+static int is_dir_name(const char *name) {
+  size_t n = strlen(name);
+  return n > 0 && name[n - 1] == '/';
+}
+
+static size_t central_size(const cml_zip_entry *e) {
+  return 46 + strlen(e->name) + ((e->offset >= 0xffffffffu) ? 12 : 0);
+}
+
+cml_status cml_zip_central_dir(const cml_zip_entry *entries, size_t len, uint64_t cd_off, uint8_t **out,
+                               size_t *out_len) {
+  size_t cd_size = 0;
+  for (size_t i = 0; i < len; i++) cd_size += central_size(&entries[i]);
+  int zip64 = (len >= 0xffff || cd_off >= 0xffffffffu || cd_size >= 0xffffffffu);
+  size_t total = cd_size + (zip64 ? 56 + 20 : 0) + 22;
+  uint8_t *buf = (uint8_t *)malloc(total);
+  if (!buf) return CML_ERR_OOM;
+
+  uint8_t *p = buf;
+  for (size_t i = 0; i < len; i++) {
+    const cml_zip_entry *e = &entries[i];
+    size_t name_len = strlen(e->name);
+    int wide = (e->offset >= 0xffffffffu);
+    int dir = is_dir_name(e->name);
+    put32(p, SIG_CENTRAL);
+    put16(p + 4, (3 << 8) | 45);  // made by: unix, spec 4.5
+    put16(p + 6, wide ? 45 : 20);
+    put16(p + 8, 0x0800);  // UTF-8 names
+    put16(p + 10, 0);      // stored
+    put16(p + 12, e->dos_time);
+    put16(p + 14, e->dos_date);
+    put32(p + 16, e->crc);
+    put32(p + 20, (uint32_t)e->size);
+    put32(p + 24, (uint32_t)e->size);
+    put16(p + 28, (uint16_t)name_len);
+    put16(p + 30, wide ? 12 : 0);
+    put16(p + 32, 0);
+    put16(p + 34, 0);
+    put16(p + 36, 0);
+    put32(p + 38, dir ? ((040755u << 16) | 0x10) : (0100644u << 16));
+    put32(p + 42, wide ? 0xffffffffu : (uint32_t)e->offset);
+    memcpy(p + 46, e->name, name_len);
+    p += 46 + name_len;
+    if (wide) {
+      put16(p, 0x0001);
+      put16(p + 2, 8);
+      put64(p + 4, e->offset);
+      p += 12;
+    }
+  }
+  if (zip64) {
+    uint64_t rec_off = cd_off + cd_size;
+    put32(p, SIG_EOCD64);
+    put64(p + 4, 44);
+    put16(p + 12, (3 << 8) | 45);
+    put16(p + 14, 45);
+    put32(p + 16, 0);
+    put32(p + 20, 0);
+    put64(p + 24, len);
+    put64(p + 32, len);
+    put64(p + 40, cd_size);
+    put64(p + 48, cd_off);
+    p += 56;
+    put32(p, SIG_EOCD64_LOC);
+    put32(p + 4, 0);
+    put64(p + 8, rec_off);
+    put32(p + 16, 1);
+    p += 20;
+  }
+  put32(p, SIG_EOCD);
+  put16(p + 4, 0);
+  put16(p + 6, 0);
+  put16(p + 8, zip64 ? 0xffff : (uint16_t)len);
+  put16(p + 10, zip64 ? 0xffff : (uint16_t)len);
+  put32(p + 12, zip64 ? 0xffffffffu : (uint32_t)cd_size);
+  put32(p + 16, zip64 ? 0xffffffffu : (uint32_t)cd_off);
+  put16(p + 20, 0);
+
+  *out = buf;
+  *out_len = total;
+  return CML_OK;
+}
+
+cml_status cml_zipw_commit(cml_zipw *z) {
+  if (!z || z->fd < 0 || z->read_only) return CML_ERR_INVALID;
+  uint64_t cd_off = z->data_end;
+  uint8_t *buf = NULL;
+  size_t total = 0;
+  cml_status st = cml_zip_central_dir(z->entries, z->len, cd_off, &buf, &total);
+  if (st != CML_OK) return st;
+  st = pwrite_all(z->fd, buf, total, cd_off);
+  free(buf);
+  if (st != CML_OK) return st;
+  if (ftruncate(z->fd, (off_t)(cd_off + total)) != 0) return CML_ERR_IO;
+  if (fsync(z->fd) != 0) return CML_ERR_IO;
+  z->committed = z->len;
+  z->committed_end = z->data_end;
+  return CML_OK;
+}
+
+cml_status cml_zipw_open(const char *path, cml_zipw *z) {
+  if (!path || !z) return CML_ERR_INVALID;
+  memset(z, 0, sizeof(*z));
+  z->fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (z->fd < 0) return CML_ERR_IO;
+  struct stat sb;
+  if (fstat(z->fd, &sb) != 0) {
+    cml_zipw_close(z);
+    return CML_ERR_IO;
+  }
+  uint64_t size = (uint64_t)sb.st_size;
+  cml_status st = CML_OK;
+  if (size > 0) {
+    st = load_eocd(z, size);
+    if (st == CML_ERR_ZIP) {
+      entries_truncate(z, 0);
+      st = recover_local(z, size);
+      // Recovery only succeeds if the file really starts with our entries.
+      if (st == CML_OK && z->len == 0) st = CML_ERR_ZIP;
+      if (st == CML_OK) st = cml_zipw_commit(z);
+    }
+  }
+  if (st != CML_OK) {
+    cml_zipw_close(z);
+    return st;
+  }
+  z->committed = z->len;
+  z->committed_end = z->data_end;
+  return CML_OK;
+}
+
+cml_status cml_zipw_open_read(const char *path, cml_zipw *z) {
+  if (!path || !z) return CML_ERR_INVALID;
+  memset(z, 0, sizeof(*z));
+  z->read_only = true;
+  z->fd = open(path, O_RDONLY);
+  if (z->fd < 0) return CML_ERR_IO;
+  struct stat sb;
+  cml_status st = fstat(z->fd, &sb) == 0 ? load_eocd(z, (uint64_t)sb.st_size) : CML_ERR_IO;
+  if (st != CML_OK) {
+    cml_zipw_close(z);
+    return st;
+  }
+  z->committed = z->len;
+  z->committed_end = z->data_end;
+  return CML_OK;
+}
+
+int cml_zipw_has(const cml_zipw *z, const char *name) { return z ? cml_strset_has(&z->names, name) : 0; }
+
+cml_status cml_zipw_add(cml_zipw *z, const char *name, const uint8_t *data, size_t len) {
+  if (!z || z->fd < 0 || z->read_only || !name || (!data && len)) return CML_ERR_INVALID;
+  size_t name_len = strlen(name);
+  if (name_len == 0 || name_len > 0xffff || (uint64_t)len >= 0xffffffffu) return CML_ERR_INVALID;
+
+  cml_zip_entry e = {.name = strdup(name), .offset = z->data_end, .size = len, .crc = len ? cml_crc32(data, len) : 0};
+  if (!e.name) return CML_ERR_OOM;
+  cml_zip_dos_now(&e.dos_time, &e.dos_date);
+
+  uint8_t *hdr = (uint8_t *)malloc(30 + name_len);
+  if (!hdr) {
+    free(e.name);
+    return CML_ERR_OOM;
+  }
+  cml_zip_local_header(hdr, &e);
+  cml_status st = pwrite_all(z->fd, hdr, 30 + name_len, z->data_end);
+  free(hdr);
+  if (st == CML_OK && len) st = pwrite_all(z->fd, data, len, z->data_end + 30 + name_len);
+  if (st == CML_OK) st = entry_push(z, &e);
+  if (st != CML_OK) {
+    free(e.name);
+    return st;
+  }
+  if (cml_strset_add(&z->names, name) != 0) {
+    // The entry goes with its name, so the directory never lists what the set does not know.
+    entries_truncate(z, z->len - 1);
+    return CML_ERR_OOM;
+  }
+  z->data_end += 30 + name_len + len;
+  return CML_OK;
+}
+
+cml_status cml_zipw_rollback(cml_zipw *z) {
+  if (!z || z->fd < 0) return CML_ERR_INVALID;
+  if (z->read_only) return CML_OK;
+  if (z->len == z->committed && z->data_end == z->committed_end) return CML_OK;
+  entries_truncate(z, z->committed);
+  z->data_end = z->committed_end;
+  cml_status st = names_rebuild(z);
+  if (st != CML_OK) return st;
+  return cml_zipw_commit(z);
+}
+
+void cml_zipw_close(cml_zipw *z) {
+  if (!z) return;
+  if (z->fd >= 0) {
+    (void)cml_zipw_rollback(z);
+    close(z->fd);
+  }
+  entries_truncate(z, 0);
+  free(z->entries);
+  cml_strset_free(&z->names);
+  memset(z, 0, sizeof(*z));
+  z->fd = -1;
+}